@@ -0,0 +1,825 @@
+/**
+* Redox benchmark
+* ---------------
+* One harness for the throughput and latency of Redox in the scenarios of
+* the speed test examples, and a few more. Every scenario runs for a fixed
+* time after a warmup, and reports operations per second, latency
+* percentiles from a Histogram, and the operator new calls and CPU time
+* per operation of the whole process. The report can be written as JSON,
+* to compare versions of Redox on the same machine.
+*
+* Run with --help for the options.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "redox.hpp"
+#include "redox/utils/histogram.hpp"
+
+#ifndef REDOX_VERSION
+#define REDOX_VERSION "unknown"
+#endif
+
+using namespace std;
+using namespace redox;
+
+// Every operator new of the process is counted, including the ones inside
+// Redox, but not the mallocs of hiredis
+static atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  void *p = malloc((size == 0) ? 1 : size);
+  if (p == nullptr)
+    throw bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+static uint64_t now_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpu_s() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+struct Options {
+  string host = "localhost";
+  int port = 6379;
+  vector<string> scenarios;
+  int connections = 1;
+  int threads = 1;
+  vector<size_t> payloads = {16};
+  double duration = 5;
+  double warmup = 1;
+  int window = 128;
+  int pipeline = 100;
+  int batch = 100;
+  int subscribers = 8;
+  size_t large = 1 << 20;
+  double rate = 1000;
+  string mode = "block";
+  int reply_threads = 0;
+  string spawn;
+  string json;
+};
+
+/**
+* Shared state of a running scenario. Operations and latencies, in
+* nanoseconds, only count while measuring, which starts after the warmup.
+*/
+struct Run {
+
+  Run(const Options &opt, size_t payload) : opt(opt), payload(payload) {}
+
+  void done(uint64_t latency_ns, uint64_t count = 1) {
+    if (!measuring.load(memory_order_relaxed))
+      return;
+    ops.fetch_add(count, memory_order_relaxed);
+    latency.record(latency_ns);
+  }
+
+  void count(uint64_t count) {
+    if (measuring.load(memory_order_relaxed))
+      ops.fetch_add(count, memory_order_relaxed);
+  }
+
+  void failed() {
+    if (measuring.load(memory_order_relaxed))
+      errors.fetch_add(1, memory_order_relaxed);
+  }
+
+  /**
+  * Waits out the warmup and the measured time, then tells the workers to
+  * stop. Each scenario calls this once, while its workers are running.
+  */
+  void measure() {
+    this_thread::sleep_for(chrono::duration<double>(opt.warmup));
+    uint64_t t0 = now_ns();
+    double cpu0 = cpu_s();
+    uint64_t allocs0 = allocations.load();
+    measuring = true;
+
+    this_thread::sleep_for(chrono::duration<double>(opt.duration));
+    measuring = false;
+    seconds = (now_ns() - t0) / 1e9;
+    cpu_seconds = cpu_s() - cpu0;
+    allocs = allocations.load() - allocs0;
+    stop = true;
+  }
+
+  const Options &opt;
+  size_t payload;
+
+  atomic<bool> stop = {false};
+  atomic<bool> measuring = {false};
+  atomic<uint64_t> ops = {0};
+  atomic<uint64_t> errors = {0};
+  Histogram latency;
+
+  double seconds = 0;
+  double cpu_seconds = 0;
+  uint64_t allocs = 0;
+};
+
+struct Result {
+  string scenario;
+  size_t payload;
+  uint64_t ops;
+  uint64_t errors;
+  double seconds;
+  double cpu_seconds;
+  uint64_t allocs;
+  HistogramSnapshot latency;
+};
+
+/**
+* Bounds the commands a thread has in flight.
+*/
+class Window {
+
+public:
+  explicit Window(int size) : size_(size) {}
+
+  void acquire() {
+    unique_lock<mutex> ul(guard_);
+    waiter_.wait(ul, [this] { return in_flight_ < size_; });
+    in_flight_++;
+  }
+
+  void release() {
+    lock_guard<mutex> lg(guard_);
+    in_flight_--;
+    waiter_.notify_one();
+  }
+
+  void drain() {
+    unique_lock<mutex> ul(guard_);
+    waiter_.wait(ul, [this] { return in_flight_ == 0; });
+  }
+
+private:
+  int size_;
+  int in_flight_ = 0;
+  mutex guard_;
+  condition_variable waiter_;
+};
+
+// Connected clients of a scenario, threads share them round robin
+struct Clients {
+
+  Clients(const Options &opt, int count) {
+    if (opt.reply_threads > 0)
+      pool.reset(new WorkerPool(opt.reply_threads));
+    for (int i = 0; i < count; i++) {
+      Redox *rdx = new Redox(cerr, log::Error);
+      rdxs.emplace_back(rdx);
+      setMode(*rdx, opt.mode);
+      if (pool)
+        rdx->replyExecutor(pool->executor());
+      if (!rdx->connect(opt.host, opt.port))
+        throw runtime_error("Could not connect to " + opt.host + ":" + to_string(opt.port));
+    }
+  }
+
+  ~Clients() { disconnect(); }
+
+  // Once disconnected, no more callbacks run, so their state can go
+  void disconnect() {
+    for (auto &rdx : rdxs)
+      rdx->disconnect();
+  }
+
+  Redox &operator[](int thread) { return *rdxs[thread % rdxs.size()]; }
+
+  template <class Client> static void setMode(Client &client, const string &mode) {
+    if (mode == "nowait")
+      client.noWait(true);
+    else if (mode.compare(0, 5, "spin=") == 0)
+      client.adaptiveSpin(stoi(mode.substr(5)));
+    else if (mode != "block")
+      throw runtime_error("Unknown mode " + mode);
+  }
+
+  unique_ptr<WorkerPool> pool;
+  vector<unique_ptr<Redox>> rdxs;
+};
+
+static string key(int thread) { return "redox_bench:" + to_string(thread); }
+
+static void joinAll(vector<thread> &workers) {
+  for (thread &t : workers)
+    t.join();
+}
+
+// ------------------------------------------------
+// Scenarios
+// ------------------------------------------------
+
+// SET with commandSync, one round trip at a time per thread
+static void benchSync(Run &run) {
+  Clients clients(run.opt, run.opt.connections);
+  vector<thread> workers;
+  for (int t = 0; t < run.opt.threads; t++) {
+    workers.emplace_back([&run, &clients, t] {
+      Redox &rdx = clients[t];
+      string k = key(t);
+      string value(run.payload, 'x');
+      while (!run.stop) {
+        uint64_t t0 = now_ns();
+        Command<string> &c = rdx.commandSync<string>(borrow({"SET", k, value}));
+        if (c.ok())
+          run.done(now_ns() - t0);
+        else
+          run.failed();
+        c.free();
+      }
+    });
+  }
+  run.measure();
+  joinAll(workers);
+}
+
+// SET with callbacks, up to --window commands in flight per thread
+static void benchAsync(Run &run) {
+  Clients clients(run.opt, run.opt.connections);
+  vector<thread> workers;
+  for (int t = 0; t < run.opt.threads; t++) {
+    workers.emplace_back([&run, &clients, t] {
+      Redox &rdx = clients[t];
+      string k = key(t);
+      string value(run.payload, 'x');
+      Window window(run.opt.window);
+      while (!run.stop) {
+        window.acquire();
+        uint64_t t0 = now_ns();
+        rdx.command<string>(borrow({"SET", k, value}), [&run, &window, t0](Command<string> &c) {
+          if (c.ok())
+            run.done(now_ns() - t0);
+          else
+            run.failed();
+          window.release();
+        });
+      }
+      window.drain();
+    });
+  }
+  run.measure();
+  joinAll(workers);
+}
+
+// Bursts of --pipeline GETs, each waited for as a whole. The latency of a
+// command is from the start of its burst.
+static void benchPipelined(Run &run) {
+  Clients clients(run.opt, run.opt.connections);
+  vector<thread> workers;
+  for (int t = 0; t < run.opt.threads; t++) {
+    workers.emplace_back([&run, &clients, t] {
+      Redox &rdx = clients[t];
+      string k = key(t);
+      rdx.set(k, string(run.payload, 'x'));
+      Window window(run.opt.pipeline);
+      while (!run.stop) {
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < run.opt.pipeline; i++) {
+          window.acquire();
+          rdx.command<string>(borrow({"GET", k}), [&run, &window, t0](Command<string> &c) {
+            if (c.ok())
+              run.done(now_ns() - t0);
+            else
+              run.failed();
+            window.release();
+          });
+        }
+        window.drain();
+      }
+    });
+  }
+  run.measure();
+  joinAll(workers);
+}
+
+// Batches of --batch SETs run synchronously. The latency is per batch, and
+// every command in it counts as an operation.
+static void benchBatch(Run &run) {
+  Clients clients(run.opt, run.opt.connections);
+  vector<thread> workers;
+  for (int t = 0; t < run.opt.threads; t++) {
+    workers.emplace_back([&run, &clients, t] {
+      Redox &rdx = clients[t];
+      string k = key(t);
+      string value(run.payload, 'x');
+      while (!run.stop) {
+        uint64_t t0 = now_ns();
+        Batch<string> &batch = rdx.batch<string>();
+        for (int i = 0; i < run.opt.batch; i++)
+          batch.add(borrow({"SET", k, value}));
+        if (batch.runSync())
+          run.done(now_ns() - t0, batch.size());
+        else
+          run.failed();
+        batch.free();
+      }
+    });
+  }
+  run.measure();
+  joinAll(workers);
+}
+
+// LPUSH through a BulkLoader per thread, like lpush_benchmark_bulk. Only
+// throughput is measured. An LTRIM now and then keeps the lists short.
+static void benchLpush(Run &run) {
+  Clients clients(run.opt, run.opt.connections);
+  vector<thread> workers;
+  for (int t = 0; t < run.opt.threads; t++) {
+    workers.emplace_back([&run, &clients, t] {
+      Redox &rdx = clients[t];
+      string k = key(t) + ":list";
+      string value(run.payload, 'x');
+      BulkLoader loader(rdx);
+      uint64_t counted = 0;
+      for (uint64_t i = 1; !run.stop; i++) {
+        loader.add({"LPUSH", k, value});
+        if (i % 10000 == 0) {
+          loader.add({"LTRIM", k, "0", "0"});
+          uint64_t replies = loader.replies();
+          run.count(replies - counted);
+          counted = replies;
+        }
+      }
+      loader.finish();
+      if (loader.errors() > 0)
+        run.failed();
+    });
+  }
+  run.measure();
+  joinAll(workers);
+}
+
+// Messages published with up to --window in flight per thread, received
+// by every subscriber. The latency is from publishing to receiving, and
+// every delivery counts as an operation.
+static void benchPubSub(Run &run, int num_subscribers) {
+  string channel = "redox_bench:channel";
+  size_t size = max(run.payload, sizeof(uint64_t));
+
+  vector<unique_ptr<Subscriber>> subs;
+  mutex guard;
+  condition_variable waiter;
+  int subscribed = 0;
+  for (int s = 0; s < num_subscribers; s++) {
+    Subscriber *sub = new Subscriber(cerr, log::Error);
+    subs.emplace_back(sub);
+    Clients::setMode(*sub, run.opt.mode);
+    if (!sub->connect(run.opt.host, run.opt.port))
+      throw runtime_error("Could not connect to " + run.opt.host + ":" + to_string(run.opt.port));
+    sub->subscribe(channel,
+                   [&run](const Slice &, const Slice &msg) {
+                     uint64_t sent;
+                     memcpy(&sent, msg.data(), sizeof(sent));
+                     run.done(now_ns() - sent);
+                   },
+                   [&](const string &) {
+                     lock_guard<mutex> lg(guard);
+                     subscribed++;
+                     waiter.notify_all();
+                   });
+  }
+  {
+    unique_lock<mutex> ul(guard);
+    waiter.wait(ul, [&] { return subscribed == num_subscribers; });
+  }
+
+  Clients clients(run.opt, run.opt.connections);
+  vector<thread> workers;
+  for (int t = 0; t < run.opt.threads; t++) {
+    workers.emplace_back([&run, &clients, &channel, size, t] {
+      Redox &rdx = clients[t];
+      string msg(size, 'x');
+      Window window(run.opt.window);
+      while (!run.stop) {
+        window.acquire();
+        uint64_t sent = now_ns();
+        memcpy(&msg[0], &sent, sizeof(sent));
+        rdx.command<int>({"PUBLISH", channel, msg}, [&run, &window](Command<int> &c) {
+          if (!c.ok())
+            run.failed();
+          window.release();
+        });
+      }
+      window.drain();
+    });
+  }
+  run.measure();
+  joinAll(workers);
+  clients.disconnect();
+  for (auto &sub : subs)
+    sub->disconnect();
+}
+
+static void benchPubSub(Run &run) { benchPubSub(run, 1); }
+
+static void benchFanout(Run &run) { benchPubSub(run, run.opt.subscribers); }
+
+// SET and GET of values of --large bytes, one round trip at a time per thread
+static void benchLarge(Run &run) {
+  Clients clients(run.opt, run.opt.connections);
+  vector<thread> workers;
+  for (int t = 0; t < run.opt.threads; t++) {
+    workers.emplace_back([&run, &clients, t] {
+      Redox &rdx = clients[t];
+      string k = key(t);
+      string value(run.payload, 'x');
+      for (bool set = true; !run.stop; set = !set) {
+        uint64_t t0 = now_ns();
+        Command<string> &c = set ? rdx.commandSync<string>(borrow({"SET", k, value}))
+                                 : rdx.commandSync<string>(borrow({"GET", k}));
+        if (c.ok())
+          run.done(now_ns() - t0);
+        else
+          run.failed();
+        c.free();
+      }
+    });
+  }
+  run.measure();
+  joinAll(workers);
+}
+
+// A looping GET per thread at --rate Hz, like jitter_test. The latency is
+// how far the time between two replies is off the period.
+static void benchJitter(Run &run) {
+  Clients clients(run.opt, run.opt.connections);
+  uint64_t period_ns = (uint64_t)(1e9 / run.opt.rate);
+  vector<uint64_t> last(run.opt.threads, 0);
+  vector<Command<string> *> loops;
+  for (int t = 0; t < run.opt.threads; t++) {
+    Redox &rdx = clients[t];
+    rdx.set(key(t), string(run.payload, 'x'));
+    uint64_t *prev = &last[t];
+    loops.push_back(&rdx.commandLoop<string>({"GET", key(t)},
+                                             [&run, prev, period_ns](Command<string> &c) {
+                                               uint64_t now = now_ns();
+                                               if (!c.ok())
+                                                 run.failed();
+                                               else if (*prev != 0)
+                                                 run.done((now > *prev + period_ns)
+                                                              ? now - *prev - period_ns
+                                                              : *prev + period_ns - now);
+                                               *prev = now;
+                                             },
+                                             1 / run.opt.rate));
+  }
+  run.measure();
+  for (Command<string> *loop : loops)
+    loop->free();
+  clients.disconnect();
+}
+
+struct Scenario {
+  const char *name;
+  void (*body)(Run &);
+  bool payload;
+  const char *description;
+};
+
+static const Scenario SCENARIOS[] = {
+    {"sync", benchSync, true, "SET with commandSync, one at a time per thread"},
+    {"async", benchAsync, true, "SET with callbacks, --window in flight per thread"},
+    {"pipelined", benchPipelined, true, "bursts of --pipeline GETs"},
+    {"batch", benchBatch, true, "Batches of --batch SETs"},
+    {"lpush", benchLpush, true, "LPUSH through a BulkLoader, throughput only"},
+    {"pubsub", benchPubSub, true, "PUBLISH to one subscriber"},
+    {"fanout", benchFanout, true, "PUBLISH to --subscribers subscribers"},
+    {"large", benchLarge, false, "SET and GET of --large byte values"},
+    {"jitter", benchJitter, true, "looping GET at --rate Hz, deviation from the period"},
+};
+
+// ------------------------------------------------
+// Setup and reporting
+// ------------------------------------------------
+
+static bool canConnect(const string &host, int port) {
+  struct addrinfo hints = {}, *res = nullptr;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &res) != 0)
+    return false;
+  bool ok = false;
+  for (struct addrinfo *ai = res; ai != nullptr && !ok; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    ok = (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0);
+    close(fd);
+  }
+  freeaddrinfo(res);
+  return ok;
+}
+
+// Starts a redis-server without persistence on the port, and waits until
+// it accepts connections
+static pid_t spawnServer(const Options &opt) {
+  if (canConnect(opt.host, opt.port))
+    throw runtime_error("Port " + to_string(opt.port) + " is already in use");
+
+  string port = to_string(opt.port);
+  pid_t pid = fork();
+  if (pid < 0)
+    throw runtime_error("Could not fork: " + string(strerror(errno)));
+  if (pid == 0) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    execlp(opt.spawn.c_str(), opt.spawn.c_str(), "--port", port.c_str(), "--save", "",
+           "--appendonly", "no", (char *)nullptr);
+    _exit(127);
+  }
+
+  for (int i = 0; i < 100; i++) {
+    if (canConnect(opt.host, opt.port))
+      return pid;
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid)
+      throw runtime_error("Could not start " + opt.spawn);
+    this_thread::sleep_for(chrono::milliseconds(50));
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  throw runtime_error("Timed out waiting for " + opt.spawn);
+}
+
+static void deleteKeys(const Options &opt) {
+  Redox rdx(cerr, log::Error);
+  if (!rdx.connect(opt.host, opt.port))
+    return;
+  for (int t = 0; t < opt.threads; t++) {
+    rdx.del(key(t));
+    rdx.del(key(t) + ":list");
+  }
+  rdx.disconnect();
+}
+
+static void printResult(ostream &out, const Result &r) {
+  const HistogramSnapshot &l = r.latency;
+  double ops = (r.ops == 0) ? 1 : r.ops;
+  out << setiosflags(ios::fixed) << setprecision(1) << left << setw(10) << r.scenario << right
+      << setw(9) << r.payload << " B " << setw(12) << r.ops / r.seconds << " ops/s";
+  if (l.count > 0)
+    out << " | p50 " << setw(8) << l.percentile(0.5) / 1e3 << " us | p99 " << setw(8)
+        << l.percentile(0.99) / 1e3 << " us | p99.9 " << setw(8) << l.percentile(0.999) / 1e3
+        << " us | max " << setw(8) << l.max / 1e3 << " us";
+  out << setprecision(2) << " | " << r.allocs / ops << " allocs/op | "
+      << r.cpu_seconds * 1e6 / ops << " us cpu/op";
+  if (r.errors > 0)
+    out << " | " << r.errors << " errors";
+  out << endl;
+}
+
+static string quote(const string &s) {
+  string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out + "\"";
+}
+
+static void writeJson(ostream &out, const Options &opt, const vector<Result> &results) {
+  char timestamp[32];
+  time_t now = time(nullptr);
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+  out << setiosflags(ios::fixed) << setprecision(3);
+  out << "{\n";
+  out << "  \"redox_version\": " << quote(REDOX_VERSION) << ",\n";
+  out << "  \"timestamp\": " << quote(timestamp) << ",\n";
+  out << "  \"compiler\": " << quote(__VERSION__) << ",\n";
+#ifdef REDOX_STATS
+  out << "  \"stats\": true,\n";
+#else
+  out << "  \"stats\": false,\n";
+#endif
+  out << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n";
+  out << "  \"config\": {\"host\": " << quote(opt.host) << ", \"port\": " << opt.port
+      << ", \"spawned_server\": " << (opt.spawn.empty() ? "false" : "true")
+      << ", \"connections\": " << opt.connections << ", \"threads\": " << opt.threads
+      << ", \"duration_s\": " << opt.duration << ", \"warmup_s\": " << opt.warmup
+      << ", \"window\": " << opt.window << ", \"pipeline\": " << opt.pipeline
+      << ", \"batch\": " << opt.batch << ", \"subscribers\": " << opt.subscribers
+      << ", \"large\": " << opt.large << ", \"rate\": " << opt.rate
+      << ", \"mode\": " << quote(opt.mode) << ", \"reply_threads\": " << opt.reply_threads
+      << "},\n";
+  out << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    const HistogramSnapshot &l = r.latency;
+    double ops = (r.ops == 0) ? 1 : r.ops;
+    out << (i == 0 ? "\n" : ",\n");
+    out << "    {\"scenario\": " << quote(r.scenario) << ", \"payload_bytes\": " << r.payload
+        << ", \"ops\": " << r.ops << ", \"errors\": " << r.errors << ", \"seconds\": " << r.seconds
+        << ", \"ops_per_sec\": " << r.ops / r.seconds << ",\n     \"latency_us\": ";
+    if (l.count == 0) {
+      out << "null";
+    } else {
+      out << "{\"samples\": " << l.count << ", \"mean\": " << l.mean() / 1e3;
+      const double fractions[] = {0.5, 0.75, 0.9, 0.99, 0.999, 0.9999};
+      const char *names[] = {"p50", "p75", "p90", "p99", "p99.9", "p99.99"};
+      for (int p = 0; p < 6; p++)
+        out << ", " << quote(names[p]) << ": " << l.percentile(fractions[p]) / 1e3;
+      out << ", \"max\": " << l.max / 1e3 << "}";
+    }
+    out << ",\n     \"allocs_per_op\": " << r.allocs / ops
+        << ", \"cpu_us_per_op\": " << r.cpu_seconds * 1e6 / ops << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+static vector<string> split(const string &s) {
+  vector<string> parts;
+  stringstream ss(s);
+  string part;
+  while (getline(ss, part, ','))
+    if (!part.empty())
+      parts.push_back(part);
+  return parts;
+}
+
+static void usage(ostream &out, const char *name) {
+  Options d;
+  out << "Usage: " << name << " [options]\n\n"
+      << "  --host <host>          Redis host (" << d.host << ")\n"
+      << "  --port <port>          Redis port (" << d.port << ")\n"
+      << "  --spawn <path>         Start this redis-server on the port for the run\n"
+      << "  --scenarios <a,b,...>  Scenarios to run (all)\n"
+      << "  --connections <n>      Clients shared by the threads (" << d.connections << ")\n"
+      << "  --threads <n>          Threads issuing commands (" << d.threads << ")\n"
+      << "  --payload <n,...>      Value sizes in bytes, run in turn (16)\n"
+      << "  --duration <s>         Measured time per scenario (" << d.duration << ")\n"
+      << "  --warmup <s>           Unmeasured time before it (" << d.warmup << ")\n"
+      << "  --window <n>           Commands in flight per thread (" << d.window << ")\n"
+      << "  --pipeline <n>         Commands per burst (" << d.pipeline << ")\n"
+      << "  --batch <n>            Commands per Batch (" << d.batch << ")\n"
+      << "  --subscribers <n>      Subscribers for fanout (" << d.subscribers << ")\n"
+      << "  --large <n>            Value size for large (" << d.large << ")\n"
+      << "  --rate <hz>            Loop rate for jitter (" << d.rate << ")\n"
+      << "  --mode <mode>          Event loop mode: block, nowait or spin=<us> (" << d.mode
+      << ")\n"
+      << "  --reply-threads <n>    Handle replies on a WorkerPool of n threads (off)\n"
+      << "  --json <file>          Write a JSON report, - for stdout\n\n"
+      << "Scenarios:\n";
+  for (const Scenario &s : SCENARIOS)
+    out << "  " << left << setw(11) << s.name << s.description << "\n";
+}
+
+static Options parseOptions(int argc, char *argv[]) {
+  Options opt;
+  for (int i = 1; i < argc; i++) {
+    string name = argv[i];
+    if (name == "--help" || name == "-h") {
+      usage(cout, argv[0]);
+      exit(0);
+    }
+    if (i + 1 >= argc)
+      throw runtime_error("Missing value for " + name);
+    string value = argv[++i];
+
+    if (name == "--host")
+      opt.host = value;
+    else if (name == "--port")
+      opt.port = stoi(value);
+    else if (name == "--spawn")
+      opt.spawn = value;
+    else if (name == "--scenarios")
+      opt.scenarios = split(value);
+    else if (name == "--connections")
+      opt.connections = max(1, stoi(value));
+    else if (name == "--threads")
+      opt.threads = max(1, stoi(value));
+    else if (name == "--payload") {
+      opt.payloads.clear();
+      for (const string &size : split(value))
+        opt.payloads.push_back(stoul(size));
+    } else if (name == "--duration")
+      opt.duration = stod(value);
+    else if (name == "--warmup")
+      opt.warmup = stod(value);
+    else if (name == "--window")
+      opt.window = max(1, stoi(value));
+    else if (name == "--pipeline")
+      opt.pipeline = max(1, stoi(value));
+    else if (name == "--batch")
+      opt.batch = max(1, stoi(value));
+    else if (name == "--subscribers")
+      opt.subscribers = max(1, stoi(value));
+    else if (name == "--large")
+      opt.large = stoul(value);
+    else if (name == "--rate")
+      opt.rate = stod(value);
+    else if (name == "--mode")
+      opt.mode = value;
+    else if (name == "--reply-threads")
+      opt.reply_threads = stoi(value);
+    else if (name == "--json")
+      opt.json = value;
+    else
+      throw runtime_error("Unknown option " + name);
+  }
+
+  for (const string &name : opt.scenarios) {
+    bool known = false;
+    for (const Scenario &s : SCENARIOS)
+      known = known || (name == s.name);
+    if (!known)
+      throw runtime_error("Unknown scenario " + name);
+  }
+  if (opt.payloads.empty())
+    throw runtime_error("No payload sizes");
+  return opt;
+}
+
+int main(int argc, char *argv[]) {
+
+  pid_t server = 0;
+  try {
+    Options opt = parseOptions(argc, argv);
+    if (!opt.spawn.empty())
+      server = spawnServer(opt);
+
+    // The table goes to stderr when the JSON report takes stdout
+    ostream &table = (opt.json == "-") ? cerr : cout;
+    vector<Result> results;
+
+    for (const Scenario &s : SCENARIOS) {
+      if (!opt.scenarios.empty() &&
+          find(opt.scenarios.begin(), opt.scenarios.end(), s.name) == opt.scenarios.end())
+        continue;
+
+      // Scenarios with a size of their own run once
+      vector<size_t> payloads = s.payload ? opt.payloads : vector<size_t>{opt.large};
+      for (size_t payload : payloads) {
+        Run run(opt, payload);
+        s.body(run);
+        Result r = {s.name, payload, run.ops, run.errors, run.seconds,
+                    run.cpu_seconds, run.allocs, run.latency.snapshot()};
+        printResult(table, r);
+        results.push_back(r);
+      }
+    }
+    deleteKeys(opt);
+
+    if (opt.json == "-") {
+      writeJson(cout, opt, results);
+    } else if (!opt.json.empty()) {
+      ofstream file(opt.json);
+      writeJson(file, opt, results);
+      if (!file)
+        throw runtime_error("Could not write " + opt.json);
+    }
+  } catch (const exception &e) {
+    cerr << e.what() << endl;
+    if (server > 0) {
+      kill(server, SIGTERM);
+      waitpid(server, nullptr, 0);
+    }
+    return 1;
+  }
+
+  if (server > 0) {
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+  }
+  return 0;
+}
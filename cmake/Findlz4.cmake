@@ -0,0 +1,31 @@
+# Try to find lz4
+# Once done, this will define
+#
+# LZ4_FOUND        - system has lz4
+# LZ4_INCLUDE_DIRS - lz4 include directories
+# LZ4_LIBRARIES    - libraries need to use lz4
+
+if(LZ4_INCLUDE_DIRS AND LZ4_LIBRARIES)
+  set(LZ4_FIND_QUIETLY TRUE)
+else()
+  find_path(
+    LZ4_INCLUDE_DIR
+    NAMES lz4.h
+    HINTS ${LZ4_ROOT_DIR}
+    PATH_SUFFIXES include)
+
+  find_library(
+    LZ4_LIBRARY
+    NAMES lz4
+    HINTS ${LZ4_ROOT_DIR}
+    PATH_SUFFIXES ${CMAKE_INSTALL_LIBDIR})
+
+  set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+  set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+
+  include (FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(
+    lz4 DEFAULT_MSG LZ4_LIBRARY LZ4_INCLUDE_DIR)
+
+  mark_as_advanced(LZ4_LIBRARY LZ4_INCLUDE_DIR)
+endif()
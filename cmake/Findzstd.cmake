@@ -0,0 +1,31 @@
+# Try to find zstd
+# Once done, this will define
+#
+# ZSTD_FOUND        - system has zstd
+# ZSTD_INCLUDE_DIRS - zstd include directories
+# ZSTD_LIBRARIES    - libraries need to use zstd
+
+if(ZSTD_INCLUDE_DIRS AND ZSTD_LIBRARIES)
+  set(ZSTD_FIND_QUIETLY TRUE)
+else()
+  find_path(
+    ZSTD_INCLUDE_DIR
+    NAMES zstd.h
+    HINTS ${ZSTD_ROOT_DIR}
+    PATH_SUFFIXES include)
+
+  find_library(
+    ZSTD_LIBRARY
+    NAMES zstd
+    HINTS ${ZSTD_ROOT_DIR}
+    PATH_SUFFIXES ${CMAKE_INSTALL_LIBDIR})
+
+  set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+  set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+
+  include (FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(
+    zstd DEFAULT_MSG ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+  mark_as_advanced(ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+endif()
@@ -30,7 +30,8 @@ int main(int argc, char* argv[]) {
 
   rdx.del(binary_key);
 
-  auto& c = rdx.commandSync<string>({"SET", binary_key, binary_data});
+  // Borrow the arguments, so the 10 kB value is not copied into the command
+  auto& c = rdx.commandSync<string>(redox::borrow({"SET", binary_key, binary_data}));
   if(c.ok()) cout << "Reply: " << c.reply() << endl;
   else cerr << "Failed to set key! Status: " << c.status() << endl;
   c.free();
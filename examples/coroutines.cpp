@@ -0,0 +1,92 @@
+/**
+* Redox test
+* ----------
+* Keep many logical requests in flight with C++20 coroutines. Each
+* coroutine runs a sequence of INCR commands with co_await, and is resumed
+* on the event thread as each reply comes in, with no thread blocked per
+* request. Build with a C++20 compiler.
+*/
+
+#include <iostream>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include "redox.hpp"
+
+using namespace std;
+using redox::Redox;
+
+#ifdef REDOX_HAS_COROUTINES
+
+double time_s() {
+  unsigned long ms = chrono::system_clock::now().time_since_epoch() / chrono::microseconds(1);
+  return (double)ms / 1e6;
+}
+
+// The smallest coroutine type: starts right away and cleans up after itself
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    suspend_never initial_suspend() { return {}; }
+    suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+  };
+};
+
+atomic_int running(0);
+atomic_long replies(0);
+mutex done_lock;
+condition_variable done_waiter;
+
+Detached incrementMany(Redox& rdx, int n) {
+  // The arguments are borrowed, so nothing is copied per command
+  const redox::BorrowedArgs cmd = redox::borrow({"INCR", "coroutines:count"});
+  for(int i = 0; i < n; i++) {
+    auto c = co_await rdx.commandAsync<int>(cmd);
+    if(!c->ok()) cerr << "Bad reply: " << c->status() << endl;
+    replies++;
+  }
+  if(--running == 0) {
+    lock_guard<mutex> lg(done_lock);
+    done_waiter.notify_one();
+  }
+}
+
+int main(int argc, char* argv[]) {
+
+  int coroutines = (argc > 1) ? stoi(argv[1]) : 1000;
+  int per_coroutine = 100;
+
+  Redox rdx;
+  if(!rdx.connect("localhost", 6379)) return 1;
+  rdx.del("coroutines:count");
+
+  cout << "Running " << coroutines << " coroutines of " << per_coroutine
+       << " INCR commands each..." << endl;
+
+  double t0 = time_s();
+  running = coroutines;
+  for(int i = 0; i < coroutines; i++) incrementMany(rdx, per_coroutine);
+
+  {
+    unique_lock<mutex> ul(done_lock);
+    done_waiter.wait(ul, [] { return running == 0; });
+  }
+  double t_elapsed = time_s() - t0;
+
+  cout << "Got " << replies << " replies in " << t_elapsed << "s, that's "
+       << replies / t_elapsed << " commands/s. Final value: " << rdx.get("coroutines:count") << endl;
+
+  rdx.disconnect();
+  return 0;
+}
+
+#else
+
+int main() {
+  cerr << "Coroutines need a C++20 compiler." << endl;
+  return 1;
+}
+
+#endif
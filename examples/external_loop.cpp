@@ -0,0 +1,81 @@
+/**
+* Redox test
+* ----------
+* Run many connections on a single libev loop owned by the program, with
+* no event thread per connection. Each connection keeps a number of INCR
+* commands in flight, sending the next from the reply callback, which goes
+* straight to the server since it runs on the loop thread.
+*/
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "redox.hpp"
+
+using namespace std;
+using redox::Redox;
+using redox::Command;
+
+double time_s() {
+  unsigned long ms = chrono::system_clock::now().time_since_epoch() / chrono::microseconds(1);
+  return (double)ms / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+
+  int connections = (argc > 1) ? stoi(argv[1]) : 8;
+  int parallel = 100; // Commands in flight per connection
+  double t = 5; // s
+
+  struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+
+  vector<unique_ptr<Redox>> clients;
+  vector<int> in_flight(connections, 0);
+  for(int i = 0; i < connections; i++) {
+    clients.emplace_back(new Redox());
+    clients[i]->attachEventLoop(loop);
+    if(!clients[i]->connect("localhost", 6379, [](int state) {
+      if(state == Redox::CONNECT_ERROR) cerr << "Could not connect to Redis." << endl;
+    })) return 1;
+  }
+
+  cout << "Sending INCR over " << connections << " connections on one thread for "
+       << t << "s..." << endl;
+
+  double t0 = time_s();
+  long count = 0;
+
+  // Everything below runs on this thread, inside ev_run
+  function<void(int)> send = [&](int i) {
+    in_flight[i]++;
+    clients[i]->command<int>({"INCR", "external_loop:count"}, [&, i](Command<int>& c) {
+      in_flight[i]--;
+      if(!c.ok()) {
+        cerr << "Bad reply: " << c.status() << endl;
+      }
+      count++;
+      if(time_s() - t0 < t) {
+        send(i);
+      } else if(in_flight[i] == 0) {
+        clients[i]->disconnect();
+      }
+    });
+  };
+
+  // Blocking calls would deadlock here, so even the reset is async
+  clients[0]->command({"DEL", "external_loop:count"});
+  for(int i = 0; i < connections; i++) {
+    for(int j = 0; j < parallel; j++) send(i);
+  }
+
+  // Returns once every client has disconnected and stopped its watchers
+  ev_run(loop, 0);
+
+  double t_elapsed = time_s() - t0;
+  cout << "Sent " << count << " commands in " << t_elapsed << "s, "
+       << "that's " << count / t_elapsed << " commands/s." << endl;
+
+  clients.clear();
+  ev_loop_destroy(loop);
+  return 0;
+}
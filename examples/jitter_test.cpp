@@ -2,9 +2,11 @@
 * Test for analyzing the jitter of commands.
 */
 
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <string.h>
+#include <vector>
 #include "redox.hpp"
 
 using namespace std;
@@ -34,31 +36,60 @@ void print_time(double t, double dt_callback, double dt_msg, double age_of_data)
       << " | age of data: " << age_of_data * 1000 << endl;
 }
 
+/**
+* Prints the median and 99th percentile of the latencies, in milliseconds.
+*/
+void print_percentiles(const string& name, vector<double>& latencies) {
+  if(latencies.empty()) return;
+  sort(latencies.begin(), latencies.end());
+  double p50 = latencies[latencies.size() / 2];
+  double p99 = latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)];
+  cout << std::setiosflags(std::ios::fixed) << std::setprecision(3)
+      << name << " p50: " << p50 * 1000 << " ms | p99: " << p99 * 1000 << " ms"
+      << " | samples: " << latencies.size() << endl;
+}
+
 int main(int argc, char* argv[]) {
 
   string usage_string = "Usage: " + string(argv[0])
-      + " --(set-async|get-async|set-sync|get-sync|get-pubsub|set-pubsub) [freq]";
+      + " --(set-async|get-async|set-sync|get-sync|get-pubsub|set-pubsub) [freq]"
+      + " [block|nowait|spin=<us>] [count]";
 
-  if(argc != 3) {
+  if(argc < 3 || argc > 5) {
     cerr << usage_string<< endl;
     return 1;
   }
 
-  bool nowait = true;
+  // Event loop mode, to compare the latency of blocking, no-wait and
+  // adaptive spinning
+  string mode = (argc > 3) ? argv[3] : "nowait";
   std::string host = "localhost";
   int port = 6379;
 
   Redox rdx;
-  if(nowait) rdx.noWait(true);
-
   Subscriber rdx_sub;
-  if(nowait) rdx_sub.noWait(true);
+
+  if(mode == "nowait") {
+    rdx.noWait(true);
+    rdx_sub.noWait(true);
+  } else if(mode.compare(0, 5, "spin=") == 0) {
+    int spin_us = stoi(mode.substr(5));
+    rdx.adaptiveSpin(spin_us);
+    rdx_sub.adaptiveSpin(spin_us);
+  } else if(mode != "block") {
+    cerr << usage_string << endl;
+    return 1;
+  }
 
   double freq = stod(argv[2]); // Hz
   double dt = 1 / freq; // s
-  int iter = 1000000;
+  int iter = (argc > 4) ? stoi(argv[4]) : 1000000;
   atomic_int count(0);
 
+  // Time from sending a command to handling its reply, or from publishing
+  // a message to receiving it
+  vector<double> latencies;
+
   double t0 = time_s();
   double t = t0;
   double t_new = t;
@@ -71,12 +102,14 @@ int main(int argc, char* argv[]) {
     if(!rdx.connect(host, port)) return 1;
 
     while(count < iter) {
+      double t_sent = time_s();
       rdx.command<string>({"GET", "jitter_test:time"},
-          [&](Command<string>& c) {
+          [&, t_sent](Command<string>& c) {
             if (!c.ok()) {
               cerr << "Bad reply: " << c.status() << endl;
             } else {
               t_new = time_s();
+              latencies.push_back(t_new - t_sent);
               t_this_reply = stod(c.reply());
               print_time(
                   t_new - t0,
@@ -126,10 +159,13 @@ int main(int argc, char* argv[]) {
     if(!rdx.connect(host, port)) return 1;
 
     while (count < iter) {
-      rdx.command<string>({"SET", "jitter_test:time", to_string(time_s())},
-          [&](Command<string>& c) {
+      double t_sent = time_s();
+      rdx.command<string>({"SET", "jitter_test:time", to_string(t_sent)},
+          [&, t_sent](Command<string>& c) {
             if (!c.ok()) {
               cerr << "Error setting value: " << c.status() << endl;
+            } else {
+              latencies.push_back(time_s() - t_sent);
             }
             count++;
             if (count == iter) rdx.stop();
@@ -143,11 +179,13 @@ int main(int argc, char* argv[]) {
     if(!rdx.connect(host, port)) return 1;
 
     while(count < iter) {
+      double t_sent = time_s();
       Command<string>& c = rdx.commandSync<string>({"GET", "jitter_test:time"});
       if(!c.ok()) {
         cerr << "Error setting value: " << c.status() << endl;
       } else {
         t_new = time_s();
+        latencies.push_back(t_new - t_sent);
         t_this_reply = stod(c.reply());
         print_time(
             t_new - t0,
@@ -169,9 +207,12 @@ int main(int argc, char* argv[]) {
     if(!rdx.connect(host, port)) return 1;
 
     while(count < iter){
-      Command<string>& c = rdx.commandSync<string>({"SET", "jitter_test:time", to_string(time_s())});
+      double t_sent = time_s();
+      Command<string>& c = rdx.commandSync<string>({"SET", "jitter_test:time", to_string(t_sent)});
       if(!c.ok()) {
         cerr << "Error setting value: " << c.status() << endl;
+      } else {
+        latencies.push_back(time_s() - t_sent);
       }
       count++;
       if(count == iter) rdx.stop();
@@ -187,6 +228,7 @@ int main(int argc, char* argv[]) {
 
       t_new = time_s();
       t_this_reply = stod(msg);
+      latencies.push_back(t_new - t_this_reply);
       print_time(
           t_new - t0,
           t_new - t,
@@ -197,7 +239,7 @@ int main(int argc, char* argv[]) {
       t_last_reply = t_this_reply;
 
       count++;
-      if (count == iter) rdx.stop();
+      if (count == iter) rdx_sub.stop();
     };
 
     rdx_sub.subscribe("jitter_test:time", got_message);
@@ -229,5 +271,19 @@ int main(int argc, char* argv[]) {
   rdx.wait();
   rdx_sub.wait();
 
+  cout << "Event loop mode: " << mode << endl;
+  print_percentiles("Latency", latencies);
+
+  // The client's own histograms split the latency into the time a command
+  // waited for the event thread and the round trip to the server
+  redox::Stats stats = rdx.stats();
+  if(stats.enabled && stats.total.round_trip.count > 0) {
+    cout << std::setprecision(3)
+        << "Queue wait p50: " << stats.total.queue_wait.percentile(0.5) / 1e6
+        << " ms | p99: " << stats.total.queue_wait.percentile(0.99) / 1e6 << " ms" << endl
+        << "Round trip p50: " << stats.total.round_trip.percentile(0.5) / 1e6
+        << " ms | p99: " << stats.total.round_trip.percentile(0.99) / 1e6 << " ms" << endl;
+  }
+
   return 0;
 };
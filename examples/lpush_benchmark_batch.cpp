@@ -0,0 +1,71 @@
+/**
+* Same workload as lpush_benchmark, but sending the commands in batches
+* so each group is queued, registered and replied to as a single object.
+*/
+
+#include <iostream>
+#include "redox.hpp"
+
+using namespace std;
+using redox::Redox;
+using redox::Batch;
+
+double time_s() {
+  unsigned long ms = chrono::system_clock::now().time_since_epoch() / chrono::microseconds(1);
+  return (double)ms / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+
+  int len = (argc > 1) ? stoi(argv[1]) : 1000000;
+  int batch_size = (argc > 2) ? stoi(argv[2]) : 1000;
+
+  redox::Redox rdx;
+
+  if(!rdx.connect()) return 1;
+
+  rdx.del("test");
+
+  double t0 = time_s();
+  double t1 = t0;
+
+  int num_batches = (len + batch_size - 1) / batch_size;
+  atomic_int count = {0};
+
+  // The arguments are the same for every command, so borrow them
+  string cmd_name = "lpush", key = "test", value = "1";
+
+  for(int b = 0; b < num_batches; b++) {
+    Batch<int>& batch = rdx.batch<int>();
+    for(int i = b * batch_size; i < min(len, (b + 1) * batch_size); i++)
+      batch.add(redox::borrow({cmd_name, key, value}));
+
+    batch.run([&t0, &t1, &count, num_batches, &rdx](Batch<int>& c) {
+
+      if(!c.ok()) {
+        cerr << "Batch failed: " << c.lastError() << endl;
+      }
+
+      count += 1;
+
+      if(count == num_batches) {
+        cout << c.cmd(c.size() - 1) << ": " << c.reply(c.size() - 1) << endl;
+
+        double t2 = time_s();
+        cout << "Time to queue async batches: " << t1 - t0 << "s" << endl;
+        cout << "Time to receive all: " << t2 - t1 << "s" <<  endl;
+        cout << "Total time: " << t2 - t0 << "s" <<  endl;
+
+        rdx.stop();
+      }
+    });
+  }
+  t1 = time_s();
+
+  rdx.wait();
+
+  double t_total = time_s() - t0;
+  cout << "Result: " << (double)len / t_total << " commands/s in batches of "
+       << batch_size << endl;
+  return 0;
+};
@@ -0,0 +1,51 @@
+/**
+* Same workload as lpush_benchmark, but sent with a BulkLoader, which
+* encodes the commands straight into large chunks and only counts the
+* replies.
+*/
+
+#include <iostream>
+#include "redox.hpp"
+
+using namespace std;
+using redox::Redox;
+using redox::BulkLoader;
+
+double time_s() {
+  unsigned long ms = chrono::system_clock::now().time_since_epoch() / chrono::microseconds(1);
+  return (double)ms / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+
+  int len = (argc > 1) ? stoi(argv[1]) : 1000000;
+  size_t chunk_bytes = (argc > 2) ? stoul(argv[2]) : (1 << 20);
+
+  redox::Redox rdx;
+
+  if(!rdx.connect()) return 1;
+
+  rdx.del("test");
+
+  double t0 = time_s();
+
+  BulkLoader loader(rdx, chunk_bytes);
+  for(int i = 0; i < len; i++)
+    loader.add({"lpush", "test", "1"});
+  double t1 = time_s();
+
+  if(!loader.finish()) {
+    cerr << loader.errors() << " commands failed, first error: " << loader.lastError() << endl;
+  }
+  double t2 = time_s();
+
+  cout << "Replies received: " << loader.replies() << endl;
+  cout << "Time to encode and send: " << t1 - t0 << "s" << endl;
+  cout << "Time to receive all: " << t2 - t1 << "s" <<  endl;
+  cout << "Total time: " << t2 - t0 << "s" <<  endl;
+  cout << "Result: " << (double)len / (t2 - t0) << " commands/s in chunks of "
+       << chunk_bytes << " bytes" << endl;
+
+  rdx.disconnect();
+  return 0;
+};
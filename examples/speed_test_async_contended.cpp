@@ -0,0 +1,76 @@
+/**
+* Redox test
+* ----------
+* Increment a key on Redis from many producer threads sharing a single
+* client, to measure contention on the command submission path.
+*/
+
+#include <iostream>
+#include <vector>
+#include "redox.hpp"
+
+using namespace std;
+using redox::Redox;
+using redox::Command;
+
+double time_s() {
+  unsigned long ms = chrono::system_clock::now().time_since_epoch() / chrono::microseconds(1);
+  return (double)ms / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+
+  int num_threads = (argc > 1) ? stoi(argv[1]) : 16;
+  int per_thread = (argc > 2) ? stoi(argv[2]) : 100000;
+
+  Redox rdx;
+  rdx.noWait(true);
+
+  if(!rdx.connect("localhost", 6379)) return 1;
+
+  if(rdx.set("contended:count", "0")) {
+    cout << "Reset the counter to zero." << endl;
+  } else {
+    cerr << "Failed to reset counter." << endl;
+    return 1;
+  }
+
+  long total = (long)num_threads * per_thread;
+  cout << "Sending " << total << " \"INCR contended:count\" commands from "
+       << num_threads << " threads..." << endl;
+
+  atomic_long count(0);
+  auto got_reply = [&count](Command<int>& c) {
+    if (!c.ok()) {
+      cerr << "Bad reply: " << c.status() << endl;
+    }
+    count++;
+  };
+
+  double t0 = time_s();
+
+  vector<thread> producers;
+  for(int i = 0; i < num_threads; i++) {
+    producers.emplace_back([&rdx, &got_reply, per_thread] {
+      for(int j = 0; j < per_thread; j++)
+        rdx.command<int>({"INCR", "contended:count"}, got_reply);
+    });
+  }
+
+  for(auto& t : producers) t.join();
+  double t_queued = time_s();
+
+  while(count < total) this_thread::sleep_for(chrono::microseconds(100));
+  double t_elapsed = time_s() - t0;
+
+  long final_count = stol(rdx.get("contended:count"));
+
+  cout << "Time to queue async commands: " << t_queued - t0 << "s" << endl;
+  cout << "Sent " << count << " commands in " << t_elapsed << "s, "
+       << "that's " << (double)count / t_elapsed << " commands/s." << endl;
+
+  cout << "Final value of counter: " << final_count << endl;
+
+  rdx.disconnect();
+  return 0;
+}
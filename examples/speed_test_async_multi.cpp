@@ -1,7 +1,9 @@
 /**
 * Redox test
 * ----------
-* Increment a key on Redis using an asynchronous command on a timer.
+* Increment a key on Redis using many asynchronous commands on a timer,
+* spread over a pool of connections. Pass the number of connections as
+* the first argument to measure how throughput scales with it.
 */
 
 #include <iostream>
@@ -10,6 +12,7 @@
 
 using namespace std;
 using redox::Redox;
+using redox::RedoxPool;
 using redox::Command;
 
 double time_s() {
@@ -19,7 +22,9 @@ double time_s() {
 
 int main(int argc, char* argv[]) {
 
-  Redox rdx = {cout, redox::log::Debug};
+  int connections = (argc > 1) ? stoi(argv[1]) : 1;
+
+  RedoxPool rdx(connections, RedoxPool::ROUND_ROBIN, cout, redox::log::Debug);
   rdx.noWait(true);
 
   if(!rdx.connect("localhost", 6379)) return 1;
@@ -37,8 +42,8 @@ int main(int argc, char* argv[]) {
   double t = 5; // s
   int parallel = 100;
 
-  cout << "Sending \"" << rdx.vecToStr(cmd_vec) << "\" asynchronously every "
-       << dt << "s for " << t << "s..." << endl;
+  cout << "Sending \"" << Redox::vecToStr(cmd_vec) << "\" asynchronously every "
+       << dt << "s for " << t << "s over " << connections << " connections..." << endl;
 
   double t0 = time_s();
   atomic_int count(0);
@@ -11,8 +11,53 @@ double time_s() {
   return (double)ms / 1e6;
 }
 
+// Time until every one of num_channels subscriptions is confirmed, with a
+// single bulk subscribe or with one subscribe per channel, and the time to
+// disconnect afterwards
+bool time_subscribe(int num_channels, bool bulk) {
+
+  Subscriber sub;
+  if(!sub.connect()) return false;
+
+  vector<string> channels;
+  for(int i = 0; i < num_channels; i++)
+    channels.push_back("speedtest:channel:" + to_string(i));
+
+  mutex lock;
+  condition_variable cv;
+  int confirmed = 0;
+  auto got_message = [](const redox::Slice& topic, const redox::Slice& msg) {};
+  auto subscribed = [&](const string& topic) {
+    lock_guard<mutex> lg(lock);
+    if(++confirmed == num_channels) cv.notify_one();
+  };
+
+  double t0 = time_s();
+  if(bulk) {
+    sub.subscribe(channels, got_message, subscribed);
+  } else {
+    for(const string& channel : channels)
+      sub.subscribe(channel, got_message, subscribed);
+  }
+  {
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [&] { return confirmed == num_channels; });
+  }
+  double t1 = time_s();
+  sub.disconnect();
+  double t2 = time_s();
+
+  cout << "Subscribed to " << num_channels << " channels " << (bulk ? "in bulk" : "one by one")
+       << " in " << (t1 - t0) * 1e3 << "ms, disconnected in " << (t2 - t1) * 1e3 << "ms" << endl;
+  return true;
+}
+
 int main(int argc, char *argv[]) {
 
+  int num_channels = (argc > 1) ? stoi(argv[1]) : 10000;
+  if(!time_subscribe(num_channels, true)) return 1;
+  if(!time_subscribe(num_channels, false)) return 1;
+
   Redox rdx_pub;
   rdx_pub.noWait(true);
 
@@ -1,7 +1,10 @@
 /**
 * Redox test
 * ----------
-* Increment a key on Redis using synchronous commands in a loop.
+* Increment a key on Redis using synchronous commands in a loop, and
+* report the distribution of the round trip time of each call. Pass
+* "block" as the first argument to let the event thread sleep between
+* replies instead of running in no-wait mode.
 */
 
 #include <iostream>
@@ -17,8 +20,10 @@ double time_s() {
 
 int main(int argc, char* argv[]) {
 
+  bool nowait = !(argc > 1 && string(argv[1]) == "block");
+
   Redox rdx;
-  rdx.noWait(true);
+  rdx.noWait(nowait);
 
   if(!rdx.connect("localhost", 6379)) return 1;
 
@@ -37,8 +42,15 @@ int main(int argc, char* argv[]) {
   double t_end = t0 + t;
   int count = 0;
 
+  // Time of each call from the caller's side, including the handoff to
+  // the event thread and the wakeup afterwards
+  Histogram call_time;
+
   while(time_s() < t_end) {
+    auto t_call = chrono::steady_clock::now();
     Command<int>& c = rdx.commandSync<int>({"INCR", "simple_loop:count"});
+    call_time.record(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - t_call).count());
     if(!c.ok()) cerr << "Bad reply, code: " << c.status() << endl;
     c.free();
     count++;
@@ -54,6 +66,22 @@ int main(int argc, char* argv[]) {
 
   cout << "Final value of counter: " << final_count << endl;
 
+  // The part of the call time not spent on the network is the overhead
+  // of the client itself
+  HistogramSnapshot calls = call_time.snapshot();
+  cout << "Call time (us): mean " << calls.mean() / 1e3
+       << ", p50 " << calls.percentile(0.5) / 1e3
+       << ", p99 " << calls.percentile(0.99) / 1e3 << endl;
+
+  Stats stats = rdx.stats();
+  if(stats.enabled) {
+    const HistogramSnapshot &rtt = stats.commands["INCR"].round_trip;
+    cout << "Server round trip (us): mean " << rtt.mean() / 1e3
+         << ", p50 " << rtt.percentile(0.5) / 1e3
+         << ", p99 " << rtt.percentile(0.99) / 1e3 << endl;
+    cout << "Client overhead per call (us): " << (calls.mean() - rtt.mean()) / 1e3 << endl;
+  }
+
   rdx.disconnect();
   return 0;
 }
@@ -22,4 +22,13 @@
 
 #include "redox/client.hpp"
 #include "redox/command.hpp"
+#include "redox/commands.hpp"
+#include "redox/batch.hpp"
+#include "redox/future.hpp"
 #include "redox/subscriber.hpp"
+#include "redox/sharded_subscriber.hpp"
+#include "redox/pool.hpp"
+#include "redox/cluster.hpp"
+#include "redox/replicas.hpp"
+#include "redox/scan.hpp"
+#include "redox/bulk.hpp"
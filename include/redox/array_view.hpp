@@ -0,0 +1,124 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+
+#include <hiredis/hiredis.h>
+
+#include "slice.hpp"
+
+namespace redox {
+
+/**
+* A read-only view over the elements of an array reply, which references
+* the redisReply tree instead of copying every element into a string. The
+* elements are Slices, and nested arrays are viewed with array(). Like a
+* Slice, the view is only valid as long as the Command it came from holds
+* on to its reply: inside the callback, or until free() for synchronous
+* commands.
+*/
+class ArrayView {
+
+public:
+  class iterator {
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef Slice value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const Slice *pointer;
+    typedef Slice reference;
+
+    iterator() : elem_(nullptr) {}
+    explicit iterator(redisReply **elem) : elem_(elem) {}
+
+    Slice operator*() const { return ArrayView::toSlice(*elem_); }
+    Slice operator[](std::ptrdiff_t n) const { return ArrayView::toSlice(elem_[n]); }
+
+    iterator &operator++() {
+      ++elem_;
+      return *this;
+    }
+    iterator operator++(int) { return iterator(elem_++); }
+    iterator &operator--() {
+      --elem_;
+      return *this;
+    }
+    iterator operator--(int) { return iterator(elem_--); }
+    iterator &operator+=(std::ptrdiff_t n) {
+      elem_ += n;
+      return *this;
+    }
+    iterator &operator-=(std::ptrdiff_t n) {
+      elem_ -= n;
+      return *this;
+    }
+    iterator operator+(std::ptrdiff_t n) const { return iterator(elem_ + n); }
+    iterator operator-(std::ptrdiff_t n) const { return iterator(elem_ - n); }
+    std::ptrdiff_t operator-(const iterator &other) const { return elem_ - other.elem_; }
+
+    bool operator==(const iterator &other) const { return elem_ == other.elem_; }
+    bool operator!=(const iterator &other) const { return elem_ != other.elem_; }
+    bool operator<(const iterator &other) const { return elem_ < other.elem_; }
+
+  private:
+    redisReply **elem_;
+  };
+
+  ArrayView() : reply_(nullptr) {}
+  explicit ArrayView(redisReply *reply) : reply_(reply) {}
+
+  size_t size() const { return (reply_ == nullptr) ? 0 : reply_->elements; }
+  bool empty() const { return size() == 0; }
+
+  iterator begin() const { return iterator((reply_ == nullptr) ? nullptr : reply_->element); }
+  iterator end() const { return begin() + size(); }
+
+  /**
+  * Returns the index-th element as a Slice. Integer and nil elements
+  * have no string and give an empty Slice.
+  */
+  Slice operator[](size_t index) const { return toSlice(reply_->element[index]); }
+
+  /**
+  * Returns a view over the index-th element if it is itself an array,
+  * or an empty view otherwise.
+  */
+  ArrayView array(size_t index) const {
+    redisReply *elem = reply_->element[index];
+    return ArrayView((elem->type == REDIS_REPLY_ARRAY) ? elem : nullptr);
+  }
+
+  /**
+  * The hiredis reply being viewed, for low-level access.
+  */
+  redisReply *reply() const { return reply_; }
+
+private:
+  static Slice toSlice(const redisReply *elem) {
+    return (elem->str == nullptr) ? Slice() : Slice(elem->str, static_cast<size_t>(elem->len));
+  }
+
+  redisReply *reply_;
+};
+
+} // End namespace redox
@@ -0,0 +1,259 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+
+#include "command.hpp"
+
+namespace redox {
+
+/**
+* A Batch is a group of commands with the same reply type that are sent
+* to the server together. The whole group is queued as one object, taken
+* off the submission queue and registered in one pass of the event loop,
+* and pipelined to the server back to back. The replies are collected in
+* order and reported to a single callback once the last one arrives.
+*
+* Create a Batch with Redox::batch<ReplyT>(), add() commands to it, then
+* either run() it with a callback, after which its memory is freed
+* automatically, or runSync() it and call .free() when done. A Batch can
+* only be run once.
+*
+* ok(), status() and lastError() refer to the whole batch. It is ok if
+* every reply is, and otherwise has the status and error of the first
+* command that failed. Each command's own status is in statuses().
+*/
+template <class ReplyT> class Batch : public Command<ReplyT> {
+
+public:
+  typedef std::function<void(Batch<ReplyT> &)> Callback;
+
+  /**
+  * Adds a command to the batch, taking ownership of its arguments.
+  */
+  Batch &add(std::vector<std::string> cmd) {
+    for (std::string &arg : cmd) {
+      owned_args_.push_back(std::move(arg));
+      this->argv_.push_back(owned_args_.back().data());
+      this->argvlen_.push_back(owned_args_.back().size());
+    }
+    this->arg_offsets_.push_back(this->argv_.size());
+    return *this;
+  }
+
+  /**
+  * Adds a command whose arguments are borrowed from the caller, and
+  * must stay valid until the batch completes.
+  */
+  Batch &add(const BorrowedArgs &cmd) {
+    for (const Slice &arg : cmd.args()) {
+      this->argv_.push_back(arg.data());
+      this->argvlen_.push_back(arg.size());
+    }
+    this->arg_offsets_.push_back(this->argv_.size());
+    return *this;
+  }
+
+  /**
+  * Stores the replies into an array provided by the caller instead of
+  * replies(). The array must hold at least size() elements and stay
+  * valid until the batch completes.
+  */
+  Batch &into(ReplyT *replies) {
+    out_ = replies;
+    return *this;
+  }
+
+  /**
+  * Number of commands in the batch.
+  */
+  size_t size() const { return this->numCommands(); }
+
+  /**
+  * Sends all commands to the server, and invokes the callback once with
+  * every reply received or failed. The Batch is freed when it returns.
+  */
+  void run(const Callback &callback = nullptr) {
+    batch_callback_ = callback;
+    this->free_memory_ = true;
+    start();
+  }
+
+  /**
+  * Sends all commands to the server and blocks until every reply is
+  * received or failed. Returns ok(). The user is responsible for
+  * calling .free() afterwards.
+  */
+  bool runSync() {
+    this->free_memory_ = false;
+    start();
+    this->wait();
+    return this->ok();
+  }
+
+  /**
+  * Reply values in the order the commands were added, unless into() was
+  * used. Only valid once the batch completes.
+  */
+  const std::vector<ReplyT> &replies() const { return replies_; }
+
+  /**
+  * Reply value of the index-th command, wherever it is stored.
+  */
+  const ReplyT &reply(size_t index) const { return out_[index]; }
+
+  /**
+  * Reply status of each command, in the order they were added.
+  */
+  const std::vector<int> &statuses() const { return statuses_; }
+
+private:
+  Batch(Redox *rdx, long id, log::Logger &logger)
+      : Command<ReplyT>(rdx, id, nullptr, 0, 0, false, logger) {
+    this->arg_offsets_.assign(1, 0);
+  }
+
+  void reset(long id) {
+    Command<ReplyT>::reset(id, nullptr, 0, 0, false);
+    this->argv_.clear();
+    this->argvlen_.clear();
+    this->arg_offsets_.assign(1, 0);
+    owned_args_.clear();
+    replies_.clear();
+    statuses_.clear();
+    out_ = nullptr;
+    received_ = 0;
+    batch_callback_ = nullptr;
+    batch_status_ = CommandBase::OK_REPLY;
+    batch_error_.clear();
+  }
+
+  // Size the reply storage and hand the batch to the event loop
+  void start() {
+    if (out_ == nullptr) {
+      replies_.resize(size());
+      out_ = replies_.data();
+    }
+    statuses_.assign(size(), CommandBase::NO_REPLY);
+
+    if (size() == 0) {
+      finish();
+      return;
+    }
+    this->enqueue();
+  }
+
+  void processReply(redisReply *r) override {
+
+    this->reply_val_ = ReplyT();
+    this->readReply(r);
+
+    size_t index = received_++;
+    out_[index] = std::move(this->reply_val_);
+    statuses_[index] = this->reply_status_;
+    if ((this->reply_status_ != CommandBase::OK_REPLY) && (batch_status_ == CommandBase::OK_REPLY)) {
+      batch_status_ = this->reply_status_;
+      batch_error_ = this->last_error_;
+    }
+
+    // Keep the reply object around until the batch is freed if the reply
+    // value references it
+    if (this->reply_obj_ != nullptr) {
+      if (ReplyReferencesObject<ReplyT>::value)
+        reply_objs_.push_back(this->reply_obj_);
+      else
+        freeReplyObject(this->reply_obj_);
+      this->reply_obj_ = nullptr;
+    }
+
+    this->pending_--;
+    if (this->pending_ == 0)
+      finish();
+  }
+
+  void sendFailed(size_t index) override {
+
+    for (size_t i = index; i < size(); i++)
+      statuses_[i] = CommandBase::SEND_ERROR;
+
+    if (batch_status_ == CommandBase::OK_REPLY) {
+      batch_status_ = CommandBase::SEND_ERROR;
+      batch_error_ = "Could not send to server.";
+    }
+
+    if (this->pending_ == 0)
+      finish();
+  }
+
+  // Report the outcome of the whole batch
+  void finish() {
+    this->reply_status_ = batch_status_;
+    this->last_error_ = batch_error_;
+    invoke();
+    this->notifyWaiter();
+    if (this->free_memory_)
+      this->free();
+  }
+
+  void invoke() override {
+    if (batch_callback_)
+      batch_callback_(*this);
+  }
+
+  size_t replyIndex() const override { return received_; }
+
+  // The replies are collected one by one, and owned by the batch
+  bool coalescable() const override { return false; }
+
+  void freeReply() override {
+    for (redisReply *r : reply_objs_)
+      freeReplyObject(r);
+    reply_objs_.clear();
+    CommandBase::freeReply();
+  }
+
+  // Owned arguments of all commands. A deque never moves its elements,
+  // so argv_ can point into it while commands are added.
+  std::deque<std::string> owned_args_;
+
+  // Reply values and statuses, in order
+  std::vector<ReplyT> replies_;
+  std::vector<int> statuses_;
+  ReplyT *out_ = nullptr;
+  size_t received_ = 0;
+
+  // Reply objects referenced by the reply values
+  std::vector<redisReply *> reply_objs_;
+
+  Callback batch_callback_;
+
+  // Status and error of the first failed command
+  int batch_status_ = CommandBase::OK_REPLY;
+  std::string batch_error_;
+
+  friend class Redox;
+};
+
+} // End namespace redox
@@ -0,0 +1,217 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+
+#include "client.hpp"
+#include "utils/resp.hpp"
+
+namespace redox {
+
+class BulkLoader;
+
+/**
+* A chunk of the commands of a BulkLoader, encoded in the Redis protocol
+* into one buffer and handed to the event loop as a single command. It
+* takes one slot in the command table however many commands it holds, and
+* its replies are only counted and freed.
+*/
+class BulkChunk : public CommandBase {
+
+public:
+  /**
+  * Creates an empty chunk. Throws if Redox is not connected.
+  */
+  static BulkChunk *create(BulkLoader *loader, Redox *rdx);
+
+  /**
+  * Appends a command, encoding its arguments into the buffer.
+  */
+  void add(const Slice *args, size_t argc);
+  void add(const std::vector<std::string> &args);
+
+  template <class Spec, class... Args> void add(const Args &... args) {
+    size_t start = buffer_.size();
+    resp::appendCommand<Spec>(buffer_, args...);
+    argvlen_.push_back(buffer_.size() - start);
+  }
+
+  /**
+  * Size of the encoded commands in bytes, and their number.
+  */
+  size_t bytes() const { return buffer_.size(); }
+  size_t size() const { return argvlen_.size(); }
+
+  /**
+  * Points the argument vectors at the encoded commands, and queues the
+  * chunk. No commands can be added after this.
+  */
+  void send();
+
+private:
+  BulkChunk(BulkLoader *loader, Redox *rdx);
+
+  // Count a reply, and report to the loader after the last one
+  void processReply(redisReply *r) override;
+
+  void parseReplyObject() override {}
+  void invoke() override {}
+  void sendFailed(size_t index) override;
+
+  // The replies queue up behind each other, so their round trips would
+  // only skew the latencies
+  bool timed() const override { return false; }
+
+  // Counting a reply is cheaper than handing it over
+  bool offloadable() const override { return false; }
+
+  // The BulkLoader bounds the bytes in flight itself
+  bool limited() const override { return false; }
+
+  // Replies are counted and freed as they come in
+  bool coalescable() const override { return false; }
+
+  // Report the counts to the loader, then free the chunk
+  void finish();
+
+  BulkLoader *const loader_;
+
+  // The encoded commands, back to back. Until the chunk is sent, argvlen_
+  // holds the length of each one, and argv_ is empty.
+  std::string buffer_;
+
+  uint64_t replies_ = 0;
+  uint64_t errors_ = 0;
+  std::string first_error_;
+};
+
+/**
+* A BulkLoader sends a stream of commands for mass ingestion, like
+* redis-cli --pipe. Commands are encoded in the Redis protocol straight
+* into large chunks, without a Command object or any formatting by
+* hiredis, and each chunk is pipelined to the server as a whole. Replies
+* are counted instead of being handed out, and the first error is kept.
+*
+* Chunks are sent once they reach chunk_bytes. To keep the output buffer
+* and the server from being flooded, flush() blocks while the chunks sent
+* but not fully answered add up to more than max_in_flight bytes.
+*
+*   redox::BulkLoader loader(rdx);
+*   for (const Record &r : records)
+*     loader.add({"HSET", r.key, "name", r.name});
+*   if (!loader.finish()) std::cerr << loader.lastError() << std::endl;
+*
+* A BulkLoader is used from one thread, and encodes on that thread. To
+* encode on several threads, give each its own BulkLoader on the same
+* Redox. Their chunks are interleaved, but the commands of each loader
+* are sent in order. A loader must not be used from the event thread, and
+* must be destroyed before the Redox client disconnects.
+*/
+class BulkLoader {
+
+public:
+  BulkLoader(Redox &rdx, size_t chunk_bytes = 1 << 20, size_t max_in_flight = 64 << 20);
+
+  /**
+  * Sends any remaining commands and waits for all replies.
+  */
+  ~BulkLoader();
+
+  /**
+  * Encodes a command into the current chunk, and sends the chunk once it
+  * is full. The arguments are copied into the chunk, so they do not need
+  * to outlive the call.
+  */
+  void add(std::initializer_list<Slice> cmd);
+  void add(const std::vector<std::string> &cmd);
+
+  /**
+  * Encodes a command given by a spec from redox::cmd, like cmd::HSet,
+  * with its arguments, see Redox::run().
+  */
+  template <class Spec, class... Args> void add(const Args &... args) {
+    chunk().add<Spec>(args...);
+    commands_++;
+    flushIfFull();
+  }
+
+  /**
+  * Sends the current chunk, waiting for replies first if too many bytes
+  * are in flight.
+  */
+  void flush();
+
+  /**
+  * Sends the current chunk and blocks until every command added so far
+  * got its reply or failed. Returns true if none failed.
+  */
+  bool finish();
+
+  /**
+  * Number of commands added, replies received, and commands that got an
+  * error reply or could not be sent, so far.
+  */
+  uint64_t commands() const { return commands_; }
+  uint64_t replies();
+  uint64_t errors();
+
+  /**
+  * The first error, or an empty string.
+  */
+  std::string lastError();
+
+private:
+  // The chunk being filled, created on first use
+  BulkChunk &chunk();
+
+  // Send the current chunk if it is full
+  void flushIfFull();
+
+  // Called on the event thread by a chunk once it is done
+  void chunkDone(size_t bytes, uint64_t replies, uint64_t errors, const std::string &error);
+
+  Redox &rdx_;
+  const size_t chunk_bytes_;
+  const size_t max_in_flight_;
+
+  // Only used by the thread adding commands
+  BulkChunk *current_ = nullptr;
+  uint64_t commands_ = 0;
+
+  // Chunks and bytes sent and not yet fully answered, and the counts of
+  // the chunks done, shared with the event thread
+  size_t in_flight_chunks_ = 0;
+  size_t in_flight_bytes_ = 0;
+  uint64_t replies_ = 0;
+  uint64_t errors_ = 0;
+  std::string last_error_;
+  std::mutex guard_;
+  std::condition_variable waiter_;
+
+  BulkLoader(const BulkLoader &) = delete;
+  BulkLoader &operator=(const BulkLoader &) = delete;
+
+  friend class BulkChunk;
+};
+
+} // End namespace redox
@@ -0,0 +1,157 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "slice.hpp"
+
+namespace redox {
+
+/**
+* Counters of a ClientCache, returned by Redox::cacheStats().
+*/
+struct CacheStats {
+
+  // Lookups answered from the cache, and sent on to the server
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+  // Keys dropped because the server or a local write invalidated them,
+  // and entries dropped to stay within the memory limit
+  uint64_t invalidations = 0;
+  uint64_t evictions = 0;
+
+  // Current number of entries, and their estimated memory use in bytes
+  size_t entries = 0;
+  size_t bytes = 0;
+};
+
+/**
+* A bounded, sharded LRU cache of string values by key, used by Redox for
+* client-side caching. Each shard has its own lock and an equal part of
+* the memory limit, and evicts its least recently used entries when full.
+*
+* A value read from the server is only stored if its key was not
+* invalidated while the read was in flight. Call reserve() before sending
+* the read, and fill() with the token it returns once the reply is in. An
+* invalidation in between drops the reservation, so the fill is ignored.
+*/
+class ClientCache {
+
+public:
+  // Estimated memory used by an entry besides its key and value
+  static const size_t ENTRY_OVERHEAD = 96;
+
+  ClientCache(size_t max_bytes, size_t num_shards);
+
+  /**
+  * Copies the value of a key into [value] and returns true if it is
+  * cached, otherwise returns false.
+  */
+  bool lookup(const Slice &key, std::string &value);
+
+  /**
+  * Reserves a key before reading it from the server. Returns a token for
+  * fill(), or 0 if the cache is disabled.
+  */
+  uint64_t reserve(const Slice &key);
+
+  /**
+  * Stores the value read for a key, unless it was invalidated since
+  * reserve() returned the token.
+  */
+  void fill(const Slice &key, uint64_t token, const std::string &value);
+
+  /**
+  * Drops a reservation without storing anything, after a failed read.
+  */
+  void release(const Slice &key, uint64_t token);
+
+  /**
+  * Drops a key and any reservation of it.
+  */
+  void invalidate(const Slice &key);
+
+  /**
+  * Drops everything.
+  */
+  void clear();
+
+  /**
+  * Drops everything and stops caching, for when invalidations can no
+  * longer be relied on. Lookups miss from then on.
+  */
+  void disable();
+
+  bool enabled() const { return enabled_; }
+
+  CacheStats stats();
+
+private:
+  struct Entry {
+    std::string key;
+    std::string value;
+  };
+
+  struct Shard {
+    std::mutex lock;
+
+    // Most recently used first
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+    // Token of the read in flight for a key
+    std::unordered_map<std::string, uint64_t> pending;
+
+    size_t bytes = 0;
+
+    // Reused to look up keys without allocating
+    std::string lookup_key;
+  };
+
+  Shard &shardFor(const Slice &key);
+
+  // Remove an entry, with the shard locked
+  static void erase(Shard &shard, std::list<Entry>::iterator it);
+
+  std::vector<Shard> shards_;
+  const size_t shard_max_bytes_;
+
+  std::atomic_bool enabled_ = {true};
+  std::atomic<uint64_t> next_token_ = {1};
+
+  std::atomic<uint64_t> hits_ = {0};
+  std::atomic<uint64_t> misses_ = {0};
+  std::atomic<uint64_t> invalidations_ = {0};
+  std::atomic<uint64_t> evictions_ = {0};
+
+  ClientCache(const ClientCache &) = delete;
+  ClientCache &operator=(const ClientCache &) = delete;
+};
+
+} // End namespace redox
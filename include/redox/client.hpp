@@ -30,16 +30,27 @@
 
 #include <string>
 #include <queue>
+#include <deque>
 #include <set>
 #include <unordered_map>
 #include <unordered_set>
+#include <memory>
 
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include <hiredis/adapters/libev.h>
 
 #include "utils/logger.hpp"
+#include "utils/slot_table.hpp"
 #include "command.hpp"
+#include "batch.hpp"
+#include "future.hpp"
+#include "stats.hpp"
+#include "cache.hpp"
+#include "commands.hpp"
+#include "utils/resp.hpp"
+#include "utils/compression.hpp"
+#include "utils/worker_pool.hpp"
 
 namespace redox {
 
@@ -47,6 +58,8 @@ static const std::string REDIS_DEFAULT_HOST = "localhost";
 static const int REDIS_DEFAULT_PORT = 6379;
 static const std::string REDIS_DEFAULT_PATH = "/var/run/redis/redis.sock";
 
+class Subscriber;
+
 /**
 * Redox is a Redis client for C++. It provides a synchronous and asynchronous
 * API for using Redis in high-performance situations.
@@ -62,6 +75,11 @@ public:
   static const int DISCONNECT_ERROR = 4;  // Disconnected on error
   static const int INIT_ERROR = 5;        // Failed to init data structures
 
+  // What to do with a command past the limits of limitCommands()
+  static const int BLOCK = 0;       // Block the thread issuing it until there is room
+  static const int FAIL = 1;        // Complete it right away with OVERLOADED
+  static const int DROP_OLDEST = 2; // Queue it, and fail the oldest queued one instead
+
   // ------------------------------------------------
   // Core public API
   // ------------------------------------------------
@@ -89,6 +107,169 @@ public:
   */
   void noWait(bool state);
 
+  /**
+  * Pins the event thread to the given CPU core once it starts, which keeps
+  * its caches warm when several clients run side by side. Call before
+  * connecting. A negative value, the default, leaves scheduling to the OS.
+  * Only supported on Linux, ignored with a warning elsewhere.
+  */
+  void cpuAffinity(int cpu) { cpu_affinity_ = cpu; }
+
+  /**
+  * Enables adaptive spinning, a middle ground between the default blocking
+  * mode and no-wait mode. The event thread busy-polls for the given number
+  * of microseconds after the last command or reply, so commands sent during
+  * a burst skip the wakeup latency, and then blocks until the next event so
+  * it uses no CPU when idle. Zero, the default, disables it. No-wait mode
+  * takes precedence if both are enabled.
+  */
+  void adaptiveSpin(int microseconds);
+
+  /**
+  * Runs the event thread with the real-time SCHED_FIFO policy at the given
+  * priority (1 to 99) once it starts, so it is not preempted by ordinary
+  * threads. This usually needs CAP_SYS_NICE, and on failure a warning is
+  * logged and the thread keeps running normally. Zero, the default, leaves
+  * scheduling to the OS. Call before connecting. Only supported on Linux.
+  */
+  void threadPriority(int priority) { thread_priority_ = priority; }
+
+  /**
+  * Enables coalescing of identical reads. A read-only command like GET or
+  * HGETALL that matches, argument for argument, one already sent and still
+  * waiting for its reply is not sent again, but completes with that reply.
+  * This turns a stampede of the same read into a single round trip.
+  *
+  * A read only joins one sent since the last other command on the
+  * connection, so it never misses a write issued before it. Looping,
+  * delayed and batched commands are not coalesced. Default is off.
+  */
+  void coalesceReads(bool state) { coalesce_reads_ = state; }
+
+  /**
+  * Compresses large values with the given codec, LZ4 or ZSTD from
+  * redox::compression. Arguments of at least threshold bytes after the
+  * first key of a command, like the value of a SET or HSET, are sent
+  * compressed, with a small header. String replies that carry the header
+  * are decompressed straight into the reply of a Command<std::string>.
+  * Other reply types, like Slice, are left as they come, and can be
+  * decompressed on any thread with compression::decompress().
+  *
+  * Values are compressed on the thread that creates the command, not on
+  * the event thread. Commands of batches and bulk loads are not. The
+  * server only sees the compressed bytes, so commands that work on the
+  * contents of strings, like APPEND or GETRANGE, do not mix with it. The
+  * codec has to be compiled in, or this throws. Call before connecting.
+  */
+  void compressValues(size_t threshold = 1024, int codec = compression::LZ4);
+
+  /**
+  * Hands replies to an executor, which parses them, runs the callbacks
+  * and frees the reply objects, so that the event thread only reads the
+  * socket. The executor is called on the event thread with a task, and
+  * has to run it soon on another thread, like WorkerPool::executor().
+  *
+  * If ordered, the replies of this client are handled one at a time in
+  * the order they came in, with a single task for all that are waiting.
+  * Otherwise every reply is a task of its own, and only commands with a
+  * single reply are handed over, while batches and looping commands are
+  * handled on the event thread, as are subscriptions, bulk loads,
+  * timeouts, lost connections and replies from the client-side cache.
+  * scan() needs ordered replies, and throws otherwise.
+  *
+  * Callbacks can then block without stalling other replies, and commands
+  * issued from them are queued like from any other thread. Disconnecting
+  * waits for the replies handed over, so their callbacks must not wait
+  * for other commands then. Call before connecting.
+  */
+  void replyExecutor(const std::function<void(std::function<void()>)> &executor,
+                     bool ordered = true);
+
+  /**
+  * Bounds the memory and latency of this client when Redis falls behind.
+  * At most max_in_flight commands are sent and awaiting their replies,
+  * and the ones after them wait in line on the event thread. A Batch
+  * counts all of its commands, and is sent as soon as it fits under the
+  * limit, or once nothing else is in flight if it is larger. At most max_queued commands are issued and not yet sent, and
+  * past that, the policy decides: BLOCK the issuing thread until there is
+  * room, FAIL the new command, or DROP_OLDEST to fail the command that
+  * waited longest. Failed commands complete with OVERLOADED. On the event
+  * thread, where blocking would never end, BLOCK fails too. Without a
+  * limit in flight, DROP_OLDEST fails the oldest commands as the event
+  * thread takes them off the submission queue, while more than max_queued
+  * are on it.
+  *
+  * With autoReconnect(), commands wait in line while reconnecting rather
+  * than in the offline buffer, and those sent again once reconnected get
+  * in line ahead of them.
+  *
+  * Zero means no limit. Looping and delayed commands, subscriptions, bulk
+  * loads and cache hits are not limited. Call before connecting.
+  */
+  void limitCommands(size_t max_in_flight, size_t max_queued = 0, int policy = BLOCK);
+
+  /**
+  * Sets the default time limit in seconds for the reply to a command, for
+  * commands that are not given one. A command whose reply does not come
+  * in time completes with the TIMEOUT status, and a late reply is
+  * dropped. Looping and delayed commands, batches and subscriptions have
+  * no time limit. Zero, the default, means no limit.
+  *
+  * Deadlines are kept in a timer wheel with a resolution of a millisecond,
+  * driven by a single event loop timer that only runs while commands with
+  * a deadline are in flight.
+  */
+  void commandTimeout(double seconds) { default_timeout_ = seconds; }
+
+  /**
+  * Enables automatic reconnection. When the connection is lost on an
+  * error, the event thread and all commands are kept, and a new
+  * connection is attempted after min_delay seconds, doubling the delay
+  * after every failed attempt up to max_delay. The connection callback
+  * gets DISCONNECT_ERROR when it drops and CONNECTED once it is back.
+  *
+  * Commands issued meanwhile wait in a buffer of up to max_buffered
+  * commands, and are sent in order once reconnected. Past that, they fail
+  * right away with SEND_ERROR. Looping commands skip their runs while
+  * disconnected. Commands that were sent but not answered fail with
+  * ERROR_REPLY, unless replayIdempotent() is on. Subscriptions are not
+  * restored. Call before connecting.
+  */
+  void autoReconnect(double min_delay = 0.1, double max_delay = 10.0,
+                     size_t max_buffered = 10000) {
+    reconnect_min_delay_ = min_delay;
+    reconnect_max_delay_ = max_delay;
+    offline_capacity_ = max_buffered;
+  }
+
+  /**
+  * With automatic reconnection, sends idempotent commands that were in
+  * flight when the connection dropped again once it is back, instead of
+  * failing them. These are reads like GET and HGETALL, and writes that
+  * have the same effect when repeated, like SET, DEL, HSET, SADD and
+  * EXPIRE. A replayed command may see the effect of its first run, which
+  * the server may or may not have applied. Default is off.
+  */
+  void replayIdempotent(bool state) { replay_idempotent_ = state; }
+
+  /**
+  * Runs this client on a libev loop owned by the caller instead of starting
+  * its own event thread, so many connections can share a few threads. Call
+  * before connecting. The loop is left running and is not destroyed.
+  *
+  * In this mode, connect() must be called from the thread that runs the
+  * loop, and returns as soon as the connection is started. Its callback
+  * reports when it is established. Commands issued from the loop thread are
+  * sent to the server right away, without going through the submission
+  * queue. Commands from other threads are queued and the loop is signaled
+  * as usual. commandSync() and wait() cannot be used from the loop thread,
+  * since the loop could not run while they block, and they throw if tried.
+  * disconnect() from the loop thread only starts the shutdown, which runs
+  * on the next loop iteration. No-wait mode, adaptive spin, CPU affinity
+  * and thread priority do not apply.
+  */
+  void attachEventLoop(struct ev_loop *loop);
+
   /**
   * Connects to Redis over TCP and starts an event loop in a separate thread. Returns
   * true once everything is ready, or false on failure.
@@ -120,45 +301,108 @@ public:
   */
   void wait();
 
+  /**
+  * Returns true if called from the thread running this client's event loop.
+  */
+  bool onLoopThread() const { return std::this_thread::get_id() == loop_thread_; }
+
   /**
   * Asynchronously runs a command and invokes the callback when a reply is
   * received or there is an error. The callback is guaranteed to be invoked
   * exactly once. The Command object is provided to the callback, and the
   * memory for it is automatically freed when the callback returns.
+  *
+  * The command vector is moved into the Command object. To send arguments
+  * without copying them at all, pass redox::borrow({...}) instead, and keep
+  * the referenced memory alive until the callback returns.
+  *
+  * A positive timeout in seconds overrides the one set with
+  * commandTimeout() for this command.
   */
 
   template <class ReplyT>
-  void command(const std::vector<std::string> &cmd,
-               const std::function<void(Command<ReplyT> &)> &callback = nullptr);
+  void command(std::vector<std::string> cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr,
+               double timeout = 0);
+
+  template <class ReplyT>
+  void command(const BorrowedArgs &cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr,
+               double timeout = 0);
 
   /**
   * Asynchronously runs a command and ignores any errors or replies.
   */
-  void command(const std::vector<std::string> &cmd);
+  void command(std::vector<std::string> cmd);
 
   /**
   * Synchronously runs a command, returning the Command object only once
   * a reply is received or there is an error. The user is responsible for
-  * calling .free() on the returned Command object.
+  * calling .free() on the returned Command object. Borrowed arguments must
+  * stay alive until then. The timeout is the same as for command().
   */
 
-  template <class ReplyT> Command<ReplyT> &commandSync(const std::vector<std::string> &cmd);
+  template <class ReplyT>
+  Command<ReplyT> &commandSync(std::vector<std::string> cmd, double timeout = 0);
+
+  template <class ReplyT> Command<ReplyT> &commandSync(const BorrowedArgs &cmd, double timeout = 0);
 
   /**
   * Synchronously runs a command, returning only once a reply is received
   * or there's an error. Returns true on successful reply, false on error.
   */
-  bool commandSync(const std::vector<std::string> &cmd);
+  bool commandSync(std::vector<std::string> cmd);
+
+  bool commandSync(const BorrowedArgs &cmd);
+
+  /**
+  * Asynchronously runs a command and returns a CommandFuture that owns it.
+  * Block on the reply with .get(), or co_await the future in a C++20
+  * coroutine, which is resumed on the event thread without any blocking.
+  * The Command is freed with the future. Borrowed arguments must stay
+  * alive until the reply is in. The timeout is the same as for command().
+  */
+
+  template <class ReplyT>
+  CommandFuture<ReplyT> commandAsync(std::vector<std::string> cmd, double timeout = 0);
+
+  template <class ReplyT>
+  CommandFuture<ReplyT> commandAsync(const BorrowedArgs &cmd, double timeout = 0);
+
+  /**
+  * Asynchronously runs a command given by a spec from redox::cmd, like
+  * run<cmd::HIncrBy>(callback, "h", "f", 5). The reply type comes from the
+  * spec, as does the number of arguments, which is checked when compiled.
+  * Arguments are strings or integers, and the command is encoded straight
+  * into the Redis protocol without building a vector of arguments.
+  */
+
+  template <class Spec, class... Args>
+  void run(const std::function<void(Command<typename Spec::Reply> &)> &callback,
+           const Args &... args);
+
+  /**
+  * Synchronously runs a command given by a spec, like runSync<cmd::Get>("k").
+  * The user is responsible for calling .free() on the returned Command.
+  */
+
+  template <class Spec, class... Args> Command<typename Spec::Reply> &runSync(const Args &... args);
 
   /**
   * Creates an asynchronous command that is run every [repeat] seconds,
   * with the first one run in [after] seconds. If [repeat] is 0, the
   * command is run only once. The user is responsible for calling .free()
-  * on the returned Command object.
+  * on the returned Command object. Borrowed arguments must stay alive
+  * until then.
   */
 
   template <class ReplyT>
-  Command<ReplyT> &commandLoop(const std::vector<std::string> &cmd,
+  Command<ReplyT> &commandLoop(std::vector<std::string> cmd,
+                               const std::function<void(Command<ReplyT> &)> &callback,
+                               double repeat, double after = 0.0);
+
+  template <class ReplyT>
+  Command<ReplyT> &commandLoop(const BorrowedArgs &cmd,
                                const std::function<void(Command<ReplyT> &)> &callback,
                                double repeat, double after = 0.0);
 
@@ -170,9 +414,40 @@ public:
   */
 
   template <class ReplyT>
-  void commandDelayed(const std::vector<std::string> &cmd,
+  void commandDelayed(std::vector<std::string> cmd,
                       const std::function<void(Command<ReplyT> &)> &callback, double after);
 
+  template <class ReplyT>
+  void commandDelayed(const BorrowedArgs &cmd,
+                      const std::function<void(Command<ReplyT> &)> &callback, double after);
+
+  /**
+  * Returns an empty Batch of commands with replies of the given type. Add
+  * commands to it, then run() it to send them all to the server in one
+  * pass of the event loop and get every reply in a single callback. A
+  * Batch that is never run must be freed with .free().
+  */
+
+  template <class ReplyT> Batch<ReplyT> &batch();
+
+  /**
+  * Walks a keyspace or collection with SCAN, HSCAN, SSCAN or ZSCAN. The
+  * command gives the cursor "0" and any options, like {"SCAN", "0",
+  * "MATCH", "user:*", "COUNT", "1000"}, and the cursor is filled in for
+  * each following page. The page callback gets the elements of every
+  * non-empty page as an ArrayView over the reply, and returns false to
+  * stop the scan early.
+  *
+  * The callback runs where replies are handled, after the request for the
+  * next page was sent, so handling a page overlaps with fetching it.
+  * The done callback then gets OK_REPLY, or the status of the command
+  * that failed. To consume the pages from another thread with a bound on
+  * the pages fetched ahead, use a ScanStream.
+  */
+  void scan(std::vector<std::string> cmd,
+            const std::function<bool(const ArrayView &)> &page_callback,
+            const std::function<void(int)> &done_callback = nullptr);
+
   // ------------------------------------------------
   // Utility methods
   // ------------------------------------------------
@@ -217,6 +492,100 @@ public:
   */
   void publish(const std::string &topic, const std::string &msg);
 
+  // ------------------------------------------------
+  // Command accounting
+  // ------------------------------------------------
+
+  /**
+  * Number of commands created and deleted since construction. Their
+  * difference is the number of commands currently in use.
+  */
+  long commandsCreated() const { return commands_created_; }
+  long commandsDeleted() const { return commands_deleted_; }
+
+  /**
+  * Number of commands currently in use, a measure of outstanding work.
+  */
+  long commandsInUse() const { return commands_created_ - commands_deleted_; }
+
+  /**
+  * The highest number of commands that were in use at the same time.
+  */
+  long commandsHighWater() const { return commands_high_water_; }
+
+  /**
+  * Number of commands sent and awaiting their replies, and the highest
+  * it reached. A Batch counts all of its commands.
+  */
+  long commandsInFlight() const { return in_flight_; }
+  long commandsInFlightHighWater() const { return in_flight_high_water_; }
+
+  /**
+  * Number of commands issued and not yet sent, and the highest it
+  * reached. Commands freed while waiting in line count until their turn.
+  * Only counted while limitCommands() sets a limit.
+  */
+  long commandsQueued() const { return queued_; }
+  long commandsQueuedHighWater() const { return queued_high_water_; }
+
+  /**
+  * Number of commands failed with OVERLOADED, see limitCommands().
+  */
+  long commandsRejected() const { return commands_rejected_; }
+
+  /**
+  * Number of Command objects currently allocated, either in use or
+  * waiting in the pools to be recycled.
+  */
+  long commandsAllocated() const { return commands_allocated_; }
+
+  /**
+  * Number of Command objects waiting in the pools to be recycled.
+  */
+  long commandsPooled() const;
+
+  /**
+  * Number of commands completed with the reply of an identical read
+  * instead of being sent, see coalesceReads().
+  */
+  long commandsCoalesced() const { return commands_coalesced_; }
+
+  /**
+  * Returns a snapshot of the latency histograms and throughput counters of
+  * this client. Recording them costs a few atomic increments per command
+  * on the event thread, and can be compiled out with the CMake option
+  * 'stats', in which case the snapshot only holds the command counts.
+  */
+  Stats stats();
+
+  // ------------------------------------------------
+  // Client-side caching
+  // ------------------------------------------------
+
+  /**
+  * Turns on a local cache of GET replies, kept coherent with server-side
+  * key tracking (CLIENT TRACKING, Redis 6 and up). A second connection is
+  * subscribed to the invalidation messages, and the server is told to
+  * redirect them there. Once enabled, get() and GET commands with a
+  * std::string reply are answered from the cache when their key is in it,
+  * without a round trip to the server.
+  *
+  * The cache is an LRU of at most max_bytes, split into num_shards parts
+  * with their own lock. If either connection is lost, invalidations could
+  * be missed, so the cache is emptied and bypassed from then on.
+  *
+  * Call once, after connecting. Returns true if the server accepted
+  * tracking, and false if the invalidation connection drops or is not
+  * subscribed within 5 seconds, or the default command timeout if longer.
+  */
+  bool enableCache(size_t max_bytes = 64 << 20, size_t num_shards = 16);
+
+  /**
+  * Hit, miss and invalidation counters and the size of the cache. All
+  * zero if it is not enabled.
+  */
+  CacheStats cacheStats();
+
   // ------------------------------------------------
   // Public members
   // ------------------------------------------------
@@ -241,14 +610,126 @@ private:
   // ------------------------------------------------
 
   // One stop shop for creating commands. The base of all public
-  // methods that run commands.
-
-  // One stop shop for creating commands. The base of all public
-  // methods that run commands.
-  template <class ReplyT>
-  Command<ReplyT> &createCommand(const std::vector<std::string> &cmd,
+  // methods that run commands. ArgsT is an owned command vector, which
+  // is moved into the Command when passed as an rvalue, or BorrowedArgs.
+  template <class ReplyT, class ArgsT>
+  Command<ReplyT> &createCommand(ArgsT &&cmd,
                                  const std::function<void(Command<ReplyT> &)> &callback = nullptr,
-                                 double repeat = 0.0, double after = 0.0, bool free_memory = true);
+                                 double repeat = 0.0, double after = 0.0, bool free_memory = true,
+                                 double timeout = 0.0);
+
+  // Encode a command given by a spec into a buffer of the calling thread,
+  // which stays valid until its next call there
+  template <class Spec, class... Args> EncodedArgs encodeCommand(const Args &... args) const;
+
+  // Encode a command given by a spec, with the values after its first
+  // argument compressed
+  template <class Spec> void appendCompressed(std::string &buf) const {
+    resp::appendCommand<Spec>(buf);
+  }
+  template <class Spec, class Key, class... Values>
+  void appendCompressed(std::string &buf, const Key &key, const Values &... values) const;
+
+  void appendValues(std::string &buf) const {}
+  template <class T, class... Rest>
+  void appendValues(std::string &buf, const T &value, const Rest &... rest) const {
+    appendValue(buf, value);
+    appendValues(buf, rest...);
+  }
+
+  // Append a value, compressed if it is large enough and shrinks
+  void appendValue(std::string &buf, const Slice &value) const;
+  template <class T>
+  typename std::enable_if<std::is_integral<T>::value>::type appendValue(std::string &buf,
+                                                                        T value) const {
+    resp::appendArg(buf, value);
+  }
+
+  // Compress the large values of a new command, and have its reply
+  // decompressed
+  void compressArgs(CommandBase *c);
+
+  // A reply handed to the reply executor, with the reply of the leader
+  // for a coalesced read
+  struct ReplyTask {
+    CommandBase *c;
+    redisReply *r;
+    bool coalesced;
+    std::shared_ptr<redisReply> shared;
+  };
+
+  // Whether the reply to a command goes to the reply executor
+  bool offloadReply(CommandBase *c) const;
+
+  // Hand a reply to the reply executor, on the event thread
+  void offload(ReplyTask &&task);
+
+  // Handle a reply on the executor, then let go of the command, freeing it
+  // if that was put off meanwhile
+  void runReplyTask(ReplyTask &task);
+
+  // Handle all queued replies in order, as one task of the executor
+  void runOrderedReplies();
+
+  // Count a task of the executor as done, and wait for all of them
+  void executorTaskDone();
+  void waitForExecutorTasks();
+
+  // Return a recycled Command object from the pool of its reply type,
+  // or a new one if the pool is empty
+  template <class ReplyT, class ArgsT>
+  Command<ReplyT> *acquireCommand(ArgsT &&cmd,
+                                  const std::function<void(Command<ReplyT> &)> &callback,
+                                  double repeat, double after, bool free_memory);
+
+  // Answer a new command from the client-side cache, or reserve its key so
+  // the reply can be cached. Only GET commands with a string reply are.
+  template <class ReplyT> void cacheLookup(Command<ReplyT> *c) {}
+  void cacheLookup(Command<std::string> *c);
+
+  // Store the reply of a command that reserved its key, on the event thread
+  void cacheReply(CommandBase *c);
+
+  // Drop the cached keys a command other than a read may change, before it
+  // is sent, so that a read right after it can not be answered with the old
+  // value. Only the key arguments are looked up, never the values.
+  void invalidateWrites(CommandBase *c);
+
+  // Attach a command to an identical read in flight and return true, or
+  // register it as the read that later ones can attach to
+  bool coalesce(CommandBase *c);
+
+  // Complete the commands attached to a read once its reply is in
+  void completeCoalesced(CommandBase *c, redisReply *r);
+
+  // Unlink a coalesced command being freed before its reply. The commands
+  // attached to a freed read are sent on their own.
+  void detachCoalesced(CommandBase *c);
+
+  // Put a command with a time limit into the timer wheel
+  void addDeadline(CommandBase *c);
+
+  // Callback of the timer driving the timer wheel, which expires the
+  // commands past their deadline and stops once the wheel is empty
+  static void expireCommands(struct ev_loop *loop, ev_timer *timer, int revents);
+  void expireCommand(CommandBase *c);
+
+  // Return the unique ID for a new command, and update the high water mark
+  long nextCommandId();
+
+  // Return the command pool for the templated Command class, created on first
+  // use, or nullptr if there are more Command classes than MAX_COMMAND_POOLS
+  template <class CommandT> CommandPool *getCommandPool();
+
+  // Each Command class gets a process-wide index into command_pools_
+  static size_t nextCommandPoolIndex();
+  template <class CommandT> static size_t commandPoolIndex() {
+    static const size_t index = nextCommandPoolIndex();
+    return index;
+  }
+
+  // Return a freed Command to its pool, or delete it if the pool is full
+  void recycleCommand(CommandBase *c);
 
   // Setup code for the constructors
   // Return true on success, false on failure
@@ -259,55 +740,116 @@ private:
   static void connectedCallback(const redisAsyncContext *c, int status);
   static void disconnectedCallback(const redisAsyncContext *c, int status);
 
+  // Handle a lost connection, reported by hiredis or by a null reply.
+  // Either starts reconnecting or stops the event loop.
+  void connectionLost(int status, const char *error);
+
+  // Start the timer for the next reconnection attempt, with backoff
+  void scheduleReconnect();
+
+  // Callback of the reconnection timer, which opens a new context
+  static void reconnectCallback(struct ev_loop *loop, ev_timer *timer, int revents);
+
+  // Send the replayed and buffered commands once reconnected
+  void reconnected();
+
+  // Keep a command to send once reconnected and return true, or fail it
+  // and return false if the buffer is full
+  bool bufferOffline(CommandBase *c);
+
+  // Keep a command whose reply was lost with the connection for replay,
+  // and return true if it is idempotent and replay is on
+  bool deferReplay(CommandBase *c);
+
+  // Start the event thread, or attach to the caller's loop, once the
+  // hiredis context is set up. Returns the result of connect().
+  bool startEventLoop();
+
   // Main event loop, run in a separate thread
   void runEventLoop();
 
-  // Return the command map corresponding to the templated reply type
-  template <class ReplyT> std::unordered_map<long, Command<ReplyT> *> &getCommandMap();
+  // Start the async watchers used to signal the event loop
+  void startWatchers();
+
+  // Shut down on a loop owned by the caller: free all commands, close
+  // the connection, and stop the watchers
+  void detachEventLoop();
+
+  // Break the event loop, or detach from the caller's loop
+  static void stopEventLoop(struct ev_loop *loop, ev_async *async, int revents);
 
-  // Return the given Command from the relevant command map, or nullptr if not there
-  template <class ReplyT> Command<ReplyT> *findCommand(long id);
+  // Apply the CPU affinity and priority settings to the calling thread
+  void applyCpuAffinity();
+  void applyThreadPriority();
 
   // Send all commands in the command queue to the server
   static void processQueuedCommands(struct ev_loop *loop, ev_async *async, int revents);
 
-  // Process the command with the given ID. Return true if the command had the
-  // templated type, and false if it was not in the command map of that type.
-  template <class ReplyT> bool processQueuedCommand(long id);
+  // Push a Command onto the submission queue and wake up the event loop
+  void enqueueCommand(CommandBase *c);
+
+  // Count a limited Command as queued, applying the overload policy.
+  // Returns false if it is to be rejected.
+  bool admitCommand();
+
+  // Count a Command as queued if that stays within max_queued_
+  bool reserveQueued();
+
+  // Count Commands that left the queue, and wake up blocked producers
+  void dequeuedCommands(long count);
+
+  // Put a Command in line for the in-flight limit, dropping the oldest
+  // one if the policy says so
+  void waitInLine(CommandBase *c);
+
+  // Send the Commands waiting in line that fit under the in-flight limit
+  void submitWaiting();
+
+  // Whether all commands of a Command fit under the in-flight limit. One
+  // larger than the limit fits once nothing else is in flight.
+  bool fitsInFlight(CommandBase *c) const {
+    long n = (long)c->numCommands();
+    return (in_flight_ == 0) || (in_flight_ + n <= max_in_flight_);
+  }
+
+  // Take every Command off the submission queue and process it
+  void drainCommandQueue();
+
+  // Register a Command taken off the submission queue in the command table,
+  // then send it to the server or start its timer
+  void processQueuedCommand(CommandBase *c);
 
   // Callback given to libev for a Command's timer watcher, to be processed in
   // a deferred or looping state
-  template <class ReplyT>
   static void submitCommandCallback(struct ev_loop *loop, ev_timer *timer, int revents);
 
   // Submit an asynchronous command to the Redox server. Return
   // true if succeeded, false otherwise.
-  template <class ReplyT> static bool submitToServer(Command<ReplyT> *c);
+  static bool submitToServer(CommandBase *c);
 
   // Callback given to hiredis to invoke when a reply is received
-  template <class ReplyT>
   static void commandCallback(redisAsyncContext *ctx, void *r, void *privdata);
 
   // Free all commands in the commands_to_free_ queue
   static void freeQueuedCommands(struct ev_loop *loop, ev_async *async, int revents);
 
-  // Free the command with the given ID. Return true if the command had the templated
-  // type, and false if it was not in the command map of that type.
-  template <class ReplyT> bool freeQueuedCommand(long id);
+  // Remove the given Command from the command table and delete it
+  void freeQueuedCommand(CommandBase *c);
 
-  // Invoked by Command objects when they are completed. Removes them
-  // from the command map.
-  template <class ReplyT> void deregisterCommand(const long id) {
-    std::lock_guard<std::mutex> lg1(command_map_guard_);
-    getCommandMap<ReplyT>().erase(id);
-    commands_deleted_ += 1;
-  }
-
-  // Free all commands remaining in the command maps
+  // Free all commands remaining in the command table
   long freeAllCommands();
 
-  // Helper function for freeAllCommands to access a specific command map
-  template <class ReplyT> long freeAllCommandsOfType();
+  // Statistics recording, called from the event thread
+  struct LatencyHistograms {
+    Histogram queue_wait;
+    Histogram round_trip;
+  };
+  LatencyHistograms &latencyFor(const char *name, size_t len);
+  void recordSubmit(CommandBase *c);
+  void recordReply(CommandBase *c, redisReply *r);
+
+  // Delete all commands still waiting in the submission queue
+  long freeUnsubmittedCommands();
 
   // Helper functions to get/set variables with synchronization.
   int getConnectState();
@@ -321,6 +863,15 @@ private:
   // Private members
   // ------------------------------------------------
 
+  // Stream given to the constructor, for the invalidation connection
+  std::ostream &log_stream_;
+
+  // Client-side cache, nullptr until enabled. The connection that receives
+  // its invalidations is declared after it, so is destroyed first.
+  std::unique_ptr<ClientCache> cache_storage_;
+  std::atomic<ClientCache *> cache_ = {nullptr};
+  std::unique_ptr<Subscriber> invalidations_;
+
   // Manage connection state
   int connect_state_ = NOT_YET_CONNECTED;
   std::mutex connect_lock_;
@@ -329,12 +880,103 @@ private:
   // User connect/disconnect callbacks
   std::function<void(int)> user_connection_callback_;
 
-  // Dynamically allocated libev event loop
+  // Dynamically allocated libev event loop, or the caller's loop
   struct ev_loop *evloop_;
+  bool external_loop_ = false;
+
+  // Thread running the event loop. Commands created on it skip the
+  // submission queue.
+  std::thread::id loop_thread_;
 
   // No-wait mode for high-performance
   std::atomic_bool nowait_ = {false};
 
+  // Coalescing of identical reads, and the reads in flight that others can
+  // attach to, by name and arguments. Only accessed from the event thread.
+  std::atomic_bool coalesce_reads_ = {false};
+  std::unordered_map<std::string, CommandBase *> in_flight_reads_;
+
+  // Codec and size threshold for compressing values, off with NONE
+  int compress_codec_ = compression::NONE;
+  size_t compress_threshold_ = 0;
+
+  // Executor that replies are handed to, if any. With ordered replies,
+  // those waiting are queued for the one task that handles them in order.
+  std::function<void(std::function<void()>)> reply_executor_;
+  bool ordered_replies_ = true;
+  std::vector<ReplyTask> reply_tasks_;
+  std::vector<ReplyTask> reply_tasks_running_;
+  bool reply_tasks_scheduled_ = false;
+  std::mutex reply_tasks_guard_;
+
+  // Number of tasks given to the executor and not yet done, waited on
+  // before the commands are freed at shutdown
+  long executor_tasks_ = 0;
+  std::mutex executor_tasks_guard_;
+  std::condition_variable executor_tasks_waiter_;
+
+  // Limits of limitCommands(), 0 for none. Without either, commands are
+  // not counted as queued at all.
+  bool limits_enabled_ = false;
+  long max_in_flight_ = 0;
+  long max_queued_ = 0;
+  int overload_policy_ = BLOCK;
+
+  // Sends awaiting a reply, and limited Commands issued but not yet sent,
+  // with the highest each reached. Only the event thread changes
+  // in_flight_.
+  std::atomic_long in_flight_ = {0};
+  std::atomic_long in_flight_high_water_ = {0};
+  std::atomic_long queued_ = {0};
+  std::atomic_long queued_high_water_ = {0};
+  std::atomic_long commands_rejected_ = {0};
+
+  // Commands waiting for the in-flight limit by slot ID, like offline_,
+  // only accessed from the event thread
+  std::deque<uintptr_t> waiting_;
+
+  // Producers blocked on max_queued_, woken as the queue goes down
+  std::atomic_int blocked_producers_ = {0};
+  std::mutex queued_guard_;
+  std::condition_variable queued_waiter_;
+
+  // Automatic reconnection settings, disabled if the delay is zero
+  double reconnect_min_delay_ = 0;
+  double reconnect_max_delay_ = 0;
+  size_t offline_capacity_ = 0;
+  std::atomic_bool replay_idempotent_ = {false};
+
+  // Reconnection state, only accessed from the event thread. Commands
+  // waiting for the connection are kept by slot ID, so any that are freed
+  // or time out meanwhile are skipped.
+  bool reconnecting_ = false;
+  int reconnect_attempts_ = 0;
+  ev_timer reconnect_timer_;
+  std::vector<uintptr_t> replays_;
+  std::deque<uintptr_t> offline_;
+
+  // Default time limit of commands in seconds, and the deadlines of the
+  // commands in flight that have one, in nanoseconds of loop time. The
+  // wheel and its timer are only accessed from the event thread.
+  static const int64_t TIMEOUT_RESOLUTION_NS = 1000000;
+  static const size_t TIMEOUT_BUCKETS = 1024;
+  std::atomic<double> default_timeout_ = {0};
+  TimerWheel timeouts_ = {TIMEOUT_RESOLUTION_NS, TIMEOUT_BUCKETS};
+  ev_timer timeout_timer_;
+
+  // Spin time of adaptive mode, in nanoseconds, zero if disabled
+  std::atomic<int64_t> spin_ns_ = {0};
+
+  // Commands sent and replies received by the event loop, so adaptive
+  // mode can tell whether the last iteration did anything
+  uint64_t loop_activity_ = 0;
+
+  // CPU core to pin the event thread to, if not negative
+  int cpu_affinity_ = -1;
+
+  // Real-time priority of the event thread, if positive
+  int thread_priority_ = 0;
+
   // Asynchronous watchers
   ev_async watcher_command_; // For processing commands
   ev_async watcher_stop_;    // For breaking the loop
@@ -343,12 +985,22 @@ private:
   // Track of Command objects allocated. Also provides unique Command IDs.
   std::atomic_long commands_created_ = {0};
   std::atomic_long commands_deleted_ = {0};
+  std::atomic_long commands_high_water_ = {0};
+  std::atomic_long commands_allocated_ = {0};
+  std::atomic_long commands_coalesced_ = {0};
+
+  // Pools of freed Command objects, one per Command class, indexed by
+  // commandPoolIndex<CommandT>()
+  static const size_t MAX_COMMAND_POOLS = 32;
+  static const size_t COMMAND_POOL_CAPACITY = 4096;
+  std::atomic<CommandPool *> command_pools_[MAX_COMMAND_POOLS];
 
   // Separate thread to have a non-blocking event loop
   std::thread event_loop_thread_;
 
-  // Variable and CV to know when the event loop starts running
-  bool running_ = false;
+  // Variable and CV to know when the event loop starts running. Written
+  // under the lock, read without it.
+  std::atomic_bool running_ = {false};
   std::mutex running_lock_;
   std::condition_variable running_waiter_;
 
@@ -358,92 +1010,234 @@ private:
   std::mutex exit_lock_;
   std::condition_variable exit_waiter_;
 
-  // Maps of each Command, fetchable by the unique ID number
-  // In C++14, member variable templates will replace all of these types
-  // with a single templated declaration
-  // ---------
-  // template<class ReplyT>
-  // std::unordered_map<long, Command<ReplyT>*> commands_;
-  // ---------
-  std::unordered_map<long, Command<redisReply *> *> commands_redis_reply_;
-  std::unordered_map<long, Command<std::string> *> commands_string_;
-  std::unordered_map<long, Command<char *> *> commands_char_p_;
-  std::unordered_map<long, Command<int> *> commands_int_;
-  std::unordered_map<long, Command<long long int> *> commands_long_long_int_;
-  std::unordered_map<long, Command<std::nullptr_t> *> commands_null_;
-  std::unordered_map<long, Command<std::vector<std::string>> *> commands_vector_string_;
-  std::unordered_map<long, Command<std::set<std::string>> *> commands_set_string_;
-  std::unordered_map<long, Command<std::unordered_set<std::string>> *>
-      commands_unordered_set_string_;
-  std::mutex command_map_guard_; // Guards access to all of the above
-
-  // Command IDs pending to be sent to the server
-  std::queue<long> command_queue_;
-  std::mutex queue_guard_;
-
-  // Commands IDs pending to be freed by the event loop
-  std::queue<long> commands_to_free_;
+  // Table of all Commands that have been taken off the submission queue,
+  // indexed by the ID given to hiredis as privdata. Only accessed from
+  // the event thread.
+  SlotTable<CommandBase> commands_;
+
+  // Commands pending to be sent to the server. Any thread pushes, only
+  // the event thread pops.
+  MPSCQueue command_queue_;
+
+  // Commands pending to be freed by the event loop
+  std::queue<CommandBase *> commands_to_free_;
   std::mutex free_queue_guard_;
 
+  // Statistics. Histograms by command name are only added to by the event
+  // thread, under latency_guard_ so that stats() can read them. Past
+  // MAX_LATENCY_NAMES names, commands are counted under "OTHER".
+  static const size_t MAX_LATENCY_NAMES = 64;
+  LatencyHistograms latency_total_;
+  std::unordered_map<std::string, std::unique_ptr<LatencyHistograms>> latency_by_name_;
+  std::mutex latency_guard_;
+  std::atomic<uint64_t> commands_sent_ = {0};
+  std::atomic<uint64_t> replies_received_ = {0};
+  std::atomic<uint64_t> bytes_out_ = {0};
+  std::atomic<uint64_t> bytes_in_ = {0};
+
   // Commands use this method to deregister themselves from Redox,
   // give it access to private members
-  template <class ReplyT> friend void Command<ReplyT>::free();
+  friend void CommandBase::free();
+
+  // Access to call connectionLost and cacheReply
+  friend void CommandBase::readReply(redisReply *r);
+
+  // Access to check the running state and queue commands
+  friend void CommandBase::enqueue();
+
+  // Creates the command of a Subscriber outside of the command pools
+  friend class PubSubCommand;
 
-  // Access to call disconnectedCallback
-  template <class ReplyT> friend void Command<ReplyT>::processReply(redisReply *r);
+  // Creates page commands that it frees itself, with a callback
+  friend class ScanStream;
+
+  // Creates the commands of a BulkLoader outside of the command pools
+  friend class BulkChunk;
 };
 
 // ------------------------------------------------
 // Implementation of templated methods
 // ------------------------------------------------
 
-template <class ReplyT>
-Command<ReplyT> &Redox::createCommand(const std::vector<std::string> &cmd,
+template <class ReplyT, class ArgsT>
+Command<ReplyT> &Redox::createCommand(ArgsT &&cmd,
                                       const std::function<void(Command<ReplyT> &)> &callback,
-                                      double repeat, double after, bool free_memory) {
-  {
-    std::unique_lock<std::mutex> ul(running_lock_);
-    if (!running_) {
-      throw std::runtime_error("[ERROR] Need to connect Redox before running commands!");
+                                      double repeat, double after, bool free_memory,
+                                      double timeout) {
+  if (!running_) {
+    throw std::runtime_error("[ERROR] Need to connect Redox before running commands!");
+  }
+
+  Command<ReplyT> *c =
+      acquireCommand<ReplyT>(std::forward<ArgsT>(cmd), callback, repeat, after, free_memory);
+  if (compress_codec_ != compression::NONE)
+    compressArgs(c);
+  if ((repeat == 0) && (after == 0)) {
+    c->timeout_ = (timeout > 0) ? timeout : default_timeout_.load(std::memory_order_relaxed);
+    if (cache_.load(std::memory_order_acquire) != nullptr)
+      cacheLookup(c);
+  }
+  enqueueCommand(c);
+  return *c;
+}
+
+template <class ReplyT, class ArgsT>
+Command<ReplyT> *Redox::acquireCommand(ArgsT &&cmd,
+                                       const std::function<void(Command<ReplyT> &)> &callback,
+                                       double repeat, double after, bool free_memory) {
+
+  long id = nextCommandId();
+
+  CommandPool *pool = getCommandPool<Command<ReplyT>>();
+  if (pool != nullptr) {
+    CommandBase *recycled = pool->acquire();
+    if (recycled != nullptr) {
+      auto *c = static_cast<Command<ReplyT> *>(recycled);
+      c->reset(id, callback, repeat, after, free_memory);
+      c->setArgs(std::forward<ArgsT>(cmd));
+      return c;
     }
   }
 
-  auto *c = new Command<ReplyT>(this, commands_created_.fetch_add(1), cmd, 
-                                callback, repeat, after, free_memory, logger_);
+  auto *c = new Command<ReplyT>(this, id, callback, repeat, after, free_memory, logger_);
+  c->setArgs(std::forward<ArgsT>(cmd));
+  c->pool_ = pool;
+  commands_allocated_++;
+  return c;
+}
 
-  std::lock_guard<std::mutex> lg(queue_guard_);
-  std::lock_guard<std::mutex> lg2(command_map_guard_);
+template <class ReplyT> Batch<ReplyT> &Redox::batch() {
 
-  getCommandMap<ReplyT>()[c->id_] = c;
-  command_queue_.push(c->id_);
+  long id = nextCommandId();
 
-  // Signal the event loop to process this command
-  ev_async_send(evloop_, &watcher_command_);
+  CommandPool *pool = getCommandPool<Batch<ReplyT>>();
+  if (pool != nullptr) {
+    CommandBase *recycled = pool->acquire();
+    if (recycled != nullptr) {
+      auto *b = static_cast<Batch<ReplyT> *>(recycled);
+      b->reset(id);
+      return *b;
+    }
+  }
 
-  return *c;
+  auto *b = new Batch<ReplyT>(this, id, logger_);
+  b->pool_ = pool;
+  commands_allocated_++;
+  return *b;
+}
+
+template <class CommandT> CommandPool *Redox::getCommandPool() {
+
+  size_t index = commandPoolIndex<CommandT>();
+  if (index >= MAX_COMMAND_POOLS)
+    return nullptr;
+
+  CommandPool *pool = command_pools_[index].load();
+  if (pool != nullptr)
+    return pool;
+
+  // First command of this reply type, race to install a new pool
+  CommandPool *fresh = new CommandPool(COMMAND_POOL_CAPACITY);
+  if (command_pools_[index].compare_exchange_strong(pool, fresh))
+    return fresh;
+
+  delete fresh;
+  return pool;
+}
+
+template <class ReplyT>
+void Redox::command(std::vector<std::string> cmd,
+                    const std::function<void(Command<ReplyT> &)> &callback, double timeout) {
+  createCommand<ReplyT>(std::move(cmd), callback, 0, 0, true, timeout);
 }
 
 template <class ReplyT>
-void Redox::command(const std::vector<std::string> &cmd,
-                    const std::function<void(Command<ReplyT> &)> &callback) {
-  createCommand(cmd, callback);
+void Redox::command(const BorrowedArgs &cmd,
+                    const std::function<void(Command<ReplyT> &)> &callback, double timeout) {
+  createCommand<ReplyT>(cmd, callback, 0, 0, true, timeout);
 }
 
 template <class ReplyT>
-Command<ReplyT> &Redox::commandLoop(const std::vector<std::string> &cmd,
+Command<ReplyT> &Redox::commandLoop(std::vector<std::string> cmd,
                                     const std::function<void(Command<ReplyT> &)> &callback,
                                     double repeat, double after) {
-  return createCommand(cmd, callback, repeat, after, false);
+  return createCommand<ReplyT>(std::move(cmd), callback, repeat, after, false);
 }
 
 template <class ReplyT>
-void Redox::commandDelayed(const std::vector<std::string> &cmd,
+Command<ReplyT> &Redox::commandLoop(const BorrowedArgs &cmd,
+                                    const std::function<void(Command<ReplyT> &)> &callback,
+                                    double repeat, double after) {
+  return createCommand<ReplyT>(cmd, callback, repeat, after, false);
+}
+
+template <class ReplyT>
+void Redox::commandDelayed(std::vector<std::string> cmd,
                            const std::function<void(Command<ReplyT> &)> &callback, double after) {
-  createCommand(cmd, callback, 0, after, true);
+  createCommand<ReplyT>(std::move(cmd), callback, 0, after, true);
+}
+
+template <class ReplyT>
+void Redox::commandDelayed(const BorrowedArgs &cmd,
+                           const std::function<void(Command<ReplyT> &)> &callback, double after) {
+  createCommand<ReplyT>(cmd, callback, 0, after, true);
+}
+
+template <class ReplyT>
+Command<ReplyT> &Redox::commandSync(std::vector<std::string> cmd, double timeout) {
+  auto &c = createCommand<ReplyT>(std::move(cmd), nullptr, 0, 0, false, timeout);
+  c.wait();
+  return c;
+}
+
+template <class ReplyT>
+Command<ReplyT> &Redox::commandSync(const BorrowedArgs &cmd, double timeout) {
+  auto &c = createCommand<ReplyT>(cmd, nullptr, 0, 0, false, timeout);
+  c.wait();
+  return c;
+}
+
+template <class ReplyT>
+CommandFuture<ReplyT> Redox::commandAsync(std::vector<std::string> cmd, double timeout) {
+  return CommandFuture<ReplyT>(
+      &createCommand<ReplyT>(std::move(cmd), nullptr, 0, 0, false, timeout));
+}
+
+template <class ReplyT>
+CommandFuture<ReplyT> Redox::commandAsync(const BorrowedArgs &cmd, double timeout) {
+  return CommandFuture<ReplyT>(&createCommand<ReplyT>(cmd, nullptr, 0, 0, false, timeout));
+}
+
+template <class Spec, class... Args>
+EncodedArgs Redox::encodeCommand(const Args &... args) const {
+  static thread_local std::string buf;
+  buf.clear();
+  if (compress_codec_ == compression::NONE)
+    resp::appendCommand<Spec>(buf, args...);
+  else
+    appendCompressed<Spec>(buf, args...);
+  return EncodedArgs(Slice(buf.data(), buf.size()));
+}
+
+template <class Spec, class Key, class... Values>
+void Redox::appendCompressed(std::string &buf, const Key &key, const Values &... values) const {
+  static_assert(sizeof...(Values) + 1 == Spec::ARGS, "Wrong number of arguments for this command");
+  Slice header = Spec::header();
+  buf.append(header.data(), header.size());
+  resp::appendArg(buf, key);
+  appendValues(buf, values...);
+}
+
+template <class Spec, class... Args>
+void Redox::run(const std::function<void(Command<typename Spec::Reply> &)> &callback,
+                const Args &... args) {
+  createCommand<typename Spec::Reply>(encodeCommand<Spec>(args...), callback, 0, 0, true);
 }
 
-template <class ReplyT> Command<ReplyT> &Redox::commandSync(const std::vector<std::string> &cmd) {
-  auto &c = createCommand<ReplyT>(cmd, nullptr, 0, 0, false);
+template <class Spec, class... Args>
+Command<typename Spec::Reply> &Redox::runSync(const Args &... args) {
+  auto &c =
+      createCommand<typename Spec::Reply>(encodeCommand<Spec>(args...), nullptr, 0, 0, false);
   c.wait();
   return c;
 }
@@ -0,0 +1,292 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <memory>
+
+#include "client.hpp"
+
+namespace redox {
+
+/**
+* RedoxCluster is a client for Redis Cluster. It keeps one Redox connection
+* per master node, reads the slot map with CLUSTER SLOTS, and sends every
+* command straight to the node that serves the hash slot of its key.
+*
+* MOVED and ASK redirects are followed transparently. A MOVED reply updates
+* the slot map for that one slot, so the map converges as slots migrate
+* without refetching it on every redirect. Call refreshSlots() to reload
+* the whole map, e.g. after a failover.
+*
+* The key of a command is its second element, or the first key of EVAL and
+* EVALSHA. Commands without a key go to any node. Arguments are always
+* owned by the Command, since a redirected command is sent again.
+*/
+class RedoxCluster {
+
+public:
+  // Number of hash slots in a Redis Cluster
+  static const int NUM_SLOTS = 16384;
+
+  // Redirects followed for a single command before giving up
+  static const int MAX_REDIRECTS = 5;
+
+  /**
+  * Constructor. Same as Redox, the log stream and level are used for every
+  * node connection.
+  */
+  RedoxCluster(std::ostream &log_stream = std::cout, log::Level log_level = log::Warning);
+
+  /**
+  * Disconnects from all nodes.
+  */
+  ~RedoxCluster();
+
+  /**
+  * Same as .noWait() on every node connection, including future ones.
+  */
+  void noWait(bool state);
+
+  /**
+  * Connects to one node of the cluster and loads the slot map from it.
+  * Connections to the other masters are opened as the map is loaded.
+  * Returns true if the slot map was loaded.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Disconnects from all nodes. A combination of .stop() and .wait().
+  */
+  void disconnect();
+  void stop();
+  void wait();
+
+  /**
+  * Reloads the whole slot map with CLUSTER SLOTS. Returns true on success.
+  */
+  bool refreshSlots();
+
+  /**
+  * Returns the hash slot of a key, honoring {hash tags}.
+  */
+  static int keySlot(const Slice &key);
+
+  /**
+  * Returns the connection serving the slot of the given key.
+  */
+  Redox &nodeForKey(const Slice &key);
+
+  /**
+  * Number of node connections currently open.
+  */
+  size_t numNodes();
+
+  // ------------------------------------------------
+  // Same as the core API of Redox
+  // ------------------------------------------------
+
+  template <class ReplyT>
+  void command(std::vector<std::string> cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr) {
+    dispatch<ReplyT>(std::move(cmd), callback, 0, nullptr, false);
+  }
+
+  void command(std::vector<std::string> cmd) { command<redisReply *>(std::move(cmd), nullptr); }
+
+  template <class ReplyT> Command<ReplyT> &commandSync(std::vector<std::string> cmd);
+
+  bool commandSync(std::vector<std::string> cmd);
+
+  std::string get(const std::string &key);
+  bool set(const std::string &key, const std::string &value);
+  bool del(const std::string &key);
+  void publish(const std::string &topic, const std::string &msg);
+
+private:
+  // A MOVED or ASK error reply
+  struct Redirect {
+    int slot = -1;
+    std::string host;
+    int port = 0;
+    bool asking = false;
+  };
+
+  // Send a command to the given node, or to the node for its slot if
+  // nullptr, preceded by ASKING if asked to, and follow redirects in the
+  // reply
+  template <class ReplyT>
+  void dispatch(std::vector<std::string> cmd,
+                const std::function<void(Command<ReplyT> &)> &callback, int redirects,
+                Redox *target, bool asking);
+
+  // Connect to the node of a redirect on a thread of its own, since the
+  // reply came in on an event thread, then dispatch the command there. If
+  // it cannot connect, the command goes back to the node for its slot with
+  // no redirects left, and its callback gets the error.
+  template <class ReplyT>
+  void dispatchToNewNode(const Redirect &r, std::vector<std::string> cmd,
+                         const std::function<void(Command<ReplyT> &)> &callback, int redirects);
+
+  // Node connection for a command that is not being redirected
+  Redox &nodeForCommand(const std::vector<std::string> &cmd);
+
+  // Parse a MOVED or ASK error. Returns false for any other reply.
+  bool parseRedirect(CommandBase &c, Redirect &r);
+
+  // Update the slot map for a MOVED to the given node
+  void redirected(const Redirect &r, Redox *rdx);
+
+  // If the command got a MOVED or ASK error, update the slot map for a
+  // MOVED, and return the node to retry on, connecting if needed. Sets
+  // asking for an ASK.
+  Redox *redirectTarget(CommandBase &c, bool &asking);
+
+  // Return the connection to a node, connecting on first use. Returns
+  // nullptr if it cannot connect. Connecting blocks, so this is never
+  // called on an event thread.
+  Redox *node(const std::string &host, int port);
+
+  // Return the connection to a node if there is one, without connecting
+  Redox *knownNode(const std::string &host, int port);
+
+  // Any connected node, for commands without a key
+  Redox &anyNode();
+
+  // Snapshot of all node connections
+  std::vector<Redox *> allNodes();
+
+  // The key argument of a command, or an empty Slice
+  static Slice commandKey(const std::vector<std::string> &cmd);
+
+  // Load the slot map from a CLUSTER SLOTS reply
+  bool loadSlots(redisReply *reply);
+
+  log::Logger logger_;
+  std::ostream &log_stream_;
+  log::Level log_level_;
+  bool nowait_ = false;
+
+  // Host of the first node, for nodes that report an empty address
+  std::string seed_host_;
+
+  // Connections to nodes by "host:port". They are only closed when the
+  // cluster client disconnects, so pointers to them stay valid.
+  std::unordered_map<std::string, std::unique_ptr<Redox>> nodes_;
+  std::mutex nodes_guard_;
+
+  // Threads connecting to nodes for redirects, waited for when stopping.
+  // Once stopping, redirects to new nodes are no longer followed.
+  int connecting_ = 0;
+  bool stopping_ = false;
+  std::condition_variable connecting_waiter_;
+
+  // Node serving each hash slot, nullptr if unknown
+  std::vector<Redox *> slots_;
+  std::mutex slots_guard_;
+
+  RedoxCluster(const RedoxCluster &) = delete;
+  RedoxCluster &operator=(const RedoxCluster &) = delete;
+};
+
+// ------------------------------------------------
+// Implementation of templated methods
+// ------------------------------------------------
+
+template <class ReplyT>
+void RedoxCluster::dispatch(std::vector<std::string> cmd,
+                            const std::function<void(Command<ReplyT> &)> &callback, int redirects,
+                            Redox *target, bool asking) {
+
+  Redox &rdx = (target != nullptr) ? *target : nodeForCommand(cmd);
+
+  // ASKING and the command are queued on the same connection in order
+  if (asking)
+    rdx.command({"ASKING"});
+
+  rdx.command<ReplyT>(std::move(cmd), [this, callback, redirects](Command<ReplyT> &c) {
+    Redirect r;
+    if ((redirects < MAX_REDIRECTS) && parseRedirect(c, r)) {
+      Redox *target = knownNode(r.host, r.port);
+      if (target != nullptr) {
+        redirected(r, target);
+        dispatch<ReplyT>(c.cmd_, callback, redirects + 1, target, r.asking);
+        return;
+      }
+
+      std::unique_lock<std::mutex> ul(nodes_guard_);
+      if (!stopping_) {
+        connecting_++;
+        ul.unlock();
+        dispatchToNewNode<ReplyT>(r, c.cmd_, callback, redirects + 1);
+        return;
+      }
+    }
+    if (callback)
+      callback(c);
+  });
+}
+
+template <class ReplyT>
+void RedoxCluster::dispatchToNewNode(const Redirect &r, std::vector<std::string> cmd,
+                                     const std::function<void(Command<ReplyT> &)> &callback,
+                                     int redirects) {
+
+  // connecting_ was counted by the caller, under the node lock
+  std::thread([this, r, cmd, callback, redirects]() mutable {
+    Redox *target = node(r.host, r.port);
+    if (target != nullptr) {
+      redirected(r, target);
+      dispatch<ReplyT>(std::move(cmd), callback, redirects, target, r.asking);
+    } else {
+      dispatch<ReplyT>(std::move(cmd), callback, MAX_REDIRECTS, nullptr, false);
+    }
+
+    std::lock_guard<std::mutex> lg(nodes_guard_);
+    connecting_--;
+    connecting_waiter_.notify_all();
+  }).detach();
+}
+
+template <class ReplyT> Command<ReplyT> &RedoxCluster::commandSync(std::vector<std::string> cmd) {
+
+  Redox *rdx = &nodeForCommand(cmd);
+  bool asking = false;
+
+  for (int redirects = 0;; redirects++) {
+
+    if (asking)
+      rdx->command({"ASKING"});
+
+    Command<ReplyT> &c = rdx->commandSync<ReplyT>(cmd);
+    if (redirects == MAX_REDIRECTS)
+      return c;
+
+    asking = false;
+    Redox *target = redirectTarget(c, asking);
+    if (target == nullptr)
+      return c;
+
+    c.free();
+    rdx = target;
+  }
+}
+
+} // End namespace redox
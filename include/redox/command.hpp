@@ -20,8 +20,17 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstddef>
 #include <string>
+#include <vector>
+#include <memory>
+#include <set>
+#include <unordered_set>
 #include <functional>
+#include <type_traits>
+#include <utility>
+#include <initializer_list>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
@@ -30,19 +39,70 @@
 #include <hiredis/async.h>
 
 #include "utils/logger.hpp"
+#include "utils/mpsc_queue.hpp"
+#include "utils/timer_wheel.hpp"
+#include "slice.hpp"
+#include "array_view.hpp"
 
 namespace redox {
 
 class Redox;
+class CommandPool;
 
 /**
-* The Command class represents a single command string to be sent to
-* a Redis server, for both synchronous and asynchronous usage. It manages
-* all of the state relevant to a single command string. A Command can also
-* represent a deferred or looping command, in which case the success or
-* error callbacks are invoked more than once.
+* Command arguments that reference memory owned by the caller instead of
+* being copied into the Command. Created with redox::borrow().
+*
+* The caller guarantees that the referenced memory stays valid and
+* unchanged until the command's callback returns, or for synchronous and
+* looping commands, until the Command is freed.
+*/
+class BorrowedArgs {
+
+public:
+  const std::vector<Slice> &args() const { return args_; }
+
+private:
+  explicit BorrowedArgs(std::vector<Slice> args) : args_(std::move(args)) {}
+
+  std::vector<Slice> args_;
+
+  friend BorrowedArgs borrow(std::initializer_list<Slice> args);
+  friend BorrowedArgs borrow(std::vector<Slice> args);
+};
+
+/**
+* Wraps command arguments so that Redox sends them to the server without
+* copying them. See BorrowedArgs for the lifetime requirements.
+*/
+inline BorrowedArgs borrow(std::initializer_list<Slice> args) {
+  return BorrowedArgs(std::vector<Slice>(args));
+}
+
+inline BorrowedArgs borrow(std::vector<Slice> args) { return BorrowedArgs(std::move(args)); }
+
+/**
+* A whole command already encoded in the Redis protocol, which is copied
+* into the Command and sent as is. Created by Redox::run() and runSync().
 */
-template <class ReplyT> class Command {
+class EncodedArgs {
+
+public:
+  explicit EncodedArgs(const Slice &bytes) : bytes_(bytes) {}
+
+  const Slice &bytes() const { return bytes_; }
+
+private:
+  Slice bytes_;
+};
+
+/**
+* The non-templated base of every Command. It manages all of the state of a
+* single command string that does not depend on the reply type, which lets
+* Redox handle Commands of any reply type through a single submission queue
+* and a single command table.
+*/
+class CommandBase : public MPSCNode, public TimerNode {
 
 public:
   // Reply codes
@@ -53,6 +113,9 @@ public:
   static const int SEND_ERROR = 3;  // Could not send to server
   static const int WRONG_TYPE = 4;  // Got reply, but it was not the expected type
   static const int TIMEOUT = 5;     // No reply, timed out
+  static const int OVERLOADED = 6;  // Not sent, the client was over its limits
+
+  virtual ~CommandBase() {}
 
   /**
   * Returns the reply status of this command.
@@ -66,11 +129,6 @@ public:
   */
   bool ok() const { return reply_status_ == OK_REPLY; }
 
-  /**
-  * Returns the reply value, if the reply was successful (ok() == true).
-  */
-  ReplyT reply();
-
   /**
   * Tells the event loop to free memory for this command. The user is
   * responsible for calling this on synchronous or looping commands,
@@ -87,83 +145,398 @@ public:
   void wait();
 
   /**
-  * Returns the command string represented by this object.
+  * Returns the command string represented by this object. For a Batch,
+  * the commands are separated by semicolons.
   */
   std::string cmd() const;
 
-  // Allow public access to constructed data
+  /**
+  * Returns the command string of the index-th command of a Batch. Index 0
+  * is the only command of a plain Command.
+  */
+  std::string cmd(size_t index) const;
+
+  /**
+  * Returns the number of arguments of the index-th command, including its
+  * name, and one of them. Both work on encoded commands too.
+  */
+  size_t numArgs(size_t index) const;
+  Slice arg(size_t index, size_t i) const;
+
+  // Allow public access to constructed data. Apart from rdx_, these are
+  // only reassigned when a pooled Command object is recycled. cmd_ is
+  // empty for commands created with borrowed arguments.
   Redox *const rdx_;
-  const long id_;
-  const std::vector<std::string> cmd_;
-  const double repeat_;
-  const double after_;
-  const bool free_memory_;
+  long id_;
+  std::vector<std::string> cmd_;
+  double repeat_;
+  double after_;
+  bool free_memory_;
 
-private:
-  Command(Redox *rdx, long id, const std::vector<std::string> &cmd,
-          const std::function<void(Command<ReplyT> &)> &callback, double repeat, double after,
-          bool free_memory, log::Logger &logger);
+protected:
+  CommandBase(Redox *rdx, long id, double repeat, double after, bool free_memory,
+              log::Logger &logger);
 
-  // Handles a new reply from the server
-  void processReply(redisReply *r);
+  // Reinitialize a recycled Command object for a new command string
+  void reset(long id, double repeat, double after, bool free_memory);
 
-  // Invoke a user callback from the reply object. This method is specialized
-  // for each ReplyT of Command.
-  void parseReplyObject();
+  // Set the arguments of the command, either taking ownership of them or
+  // referencing the memory of the caller
+  void setArgs(std::vector<std::string> &&cmd);
+  void setArgs(const std::vector<std::string> &cmd);
+  void setArgs(const BorrowedArgs &args);
+  void setArgs(const EncodedArgs &args);
 
-  // Directly invoke the user callback if it exists
-  void invoke() {
-    if (callback_)
-      callback_(*this);
-  }
+  // Store a reply from the server and parse it into the reply value
+  void readReply(redisReply *r);
+
+  // Mark the command complete, and run the continuation if one is set
+  void notifyWaiter();
+
+  // Hand the command over to the event loop of Redox
+  void enqueue();
 
   bool checkErrorReply();
   bool checkNilReply();
   bool isExpectedReply(int type);
   bool isExpectedReply(int typeA, int typeB);
 
-  // If needed, free the redisReply
-  void freeReply();
-
   // The last server reply
   redisReply *reply_obj_ = nullptr;
 
-  // User callback
-  const std::function<void(Command<ReplyT> &)> callback_;
+  // Set if string replies that are compressed are decompressed
+  bool decompress_ = false;
 
-  // Place to store the reply value and status.
-  ReplyT reply_val_;
-  int reply_status_;
+  // Place to store the reply status
+  int reply_status_ = NO_REPLY;
   std::string last_error_;
 
+  // Access the reply value of a looping command only when not being
+  // changed. Other commands are complete before the user reads them.
+  std::mutex reply_guard_;
+
+  // Passed on from Redox class
+  log::Logger &logger_;
+
+private:
+  // Handles a new reply from the server
+  virtual void processReply(redisReply *r);
+
+  // Parse the reply object into the reply value. Implemented by Command<ReplyT>.
+  virtual void parseReplyObject() = 0;
+
+  // Directly invoke the user callback if it exists
+  virtual void invoke() = 0;
+
+  // Called when the index-th command could not be sent to the server
+  virtual void sendFailed(size_t index);
+
+  // Index of the command whose reply is being parsed, for log messages
+  virtual size_t replyIndex() const { return 0; }
+
+  // Called on the event thread when the command is taken off the
+  // submission queue, before it is sent
+  virtual void dequeued() {}
+
+  // Whether the latencies of the command are recorded in the statistics
+  virtual bool timed() const { return true; }
+
+  // Whether replies can be handed to the reply executor of Redox
+  virtual bool offloadable() const { return true; }
+
+  // Whether the command can share the reply of an identical read, see
+  // Redox::coalesceReads()
+  virtual bool coalescable() const { return true; }
+
+  // Whether the command counts against Redox::limitCommands(), which
+  // single sends do unless answered from the cache
+  virtual bool limited() const { return (repeat_ == 0) && (after_ == 0) && !cached_; }
+
+  // If needed, free the redisReply
+  virtual void freeReply();
+
+  // Complete a command answered from the client-side cache, on the event
+  // thread, as if its reply had come in
+  void completeCached();
+
+  // Complete a command attached to an identical read with its reply
+  void completeCoalesced(redisReply *r, const std::shared_ptr<redisReply> &shared);
+
+  // Complete a command with TIMEOUT once its deadline passes
+  void expire();
+
+  // Complete a command with OVERLOADED instead of sending it
+  void reject();
+
+  // Argument vectors handed to hiredis, pointing into cmd_ or into
+  // borrowed memory. arg_offsets_ holds the index in argv_ where each
+  // command starts, followed by argv_.size(). Only a Batch holds more
+  // than one command.
+  std::vector<const char *> argv_;
+  std::vector<size_t> argvlen_;
+  std::vector<size_t> arg_offsets_;
+
+  size_t numCommands() const { return arg_offsets_.empty() ? 0 : arg_offsets_.size() - 1; }
+
+  // Set if each entry of argv_ is a whole command already encoded in the
+  // Redis protocol, which is sent as is. That of a single command points
+  // into encoding_, which keeps its capacity when the Command is recycled.
+  bool encoded_ = false;
+  std::string encoding_;
+
+  // Compressed copies of large values, with the index in argv_ of each,
+  // which points to them
+  std::vector<std::pair<size_t, std::string>> compressed_args_;
+
+  // ID in the command table of Redox, assigned by the event thread
+  uintptr_t slot_ = 0;
+
+  // Steady clock times in nanoseconds when the command was queued and
+  // last sent, for the statistics of Redox
+  int64_t time_queued_ = 0;
+  int64_t time_sent_ = 0;
+
+  // Pool this Command object is returned to once freed, if any
+  CommandPool *pool_ = nullptr;
+
   // How many messages sent to server but not received reply
   std::atomic_int pending_ = {0};
 
   // Whether a repeating or delayed command is canceled
   std::atomic_bool canceled_ = {false};
 
+  // Whether free() was already called
+  std::atomic_bool free_requested_ = {false};
+
+  // Set if the reply was taken from the client-side cache, so the command
+  // is not sent. Otherwise, the token of the cache reservation of its key,
+  // if any, for storing the reply.
+  bool cached_ = false;
+  uint64_t cache_token_ = 0;
+
+  // Set on a read in flight that identical reads are coalesced with. The
+  // key of a coalesced read is its name and arguments, and followers_ the
+  // commands attached to it, which point back to it with leader_.
+  bool coalescing_ = false;
+  std::string coalesce_key_;
+  std::vector<CommandBase *> followers_;
+  CommandBase *leader_ = nullptr;
+
+  // Owns a reply shared by coalesced commands, freed with the last of them
+  std::shared_ptr<redisReply> shared_reply_;
+
+  // Twice the number of replies handed to the reply executor of Redox and
+  // not yet handled, plus FREE_PENDING once freeing the command is put off
+  // until they are. Only the event thread adds replies.
+  static const int FREE_PENDING = 1;
+  std::atomic_int worker_refs_ = {0};
+
+  // Seconds to wait for the reply once the event thread takes the command,
+  // or 0 for no limit, and whether it ran out. A reply that comes in after
+  // that is dropped.
+  double timeout_ = 0;
+  bool expired_ = false;
+
+  // Set if Redox turned the command away at its limits, so the event
+  // thread rejects it, and the number of its sends counted in flight
+  bool rejected_ = false;
+  int on_wire_ = 0;
+
   // libev timer watcher
   ev_timer timer_;
-  std::mutex timer_guard_;
-
-  // Access the reply value only when not being changed
-  std::mutex reply_guard_;
 
-  // For synchronous use
-  std::condition_variable waiter_;
-  std::mutex waiter_lock_;
-  std::atomic_bool waiting_done_ = {false};
-
-  // Passed on from Redox class
-  log::Logger &logger_;
+  // Function run on the event thread once the reply is in, set by
+  // wait() to wake up the blocked thread, or by an awaited
+  // CommandFuture to resume the coroutine. The state tells whether it
+  // is set and whether the reply already came, so that setting it and
+  // completing can race. Completing costs a single atomic exchange
+  // when nobody waits.
+  static const int CONTINUATION_NONE = 0;
+  static const int CONTINUATION_SET = 1;
+  static const int CONTINUATION_DONE = 2;
+  void (*continuation_)(void *) = nullptr;
+  void *continuation_arg_ = nullptr;
+  std::atomic_int continuation_state_ = {CONTINUATION_NONE};
+
+  // Replies a looping command has notified of, and the count the last
+  // wait() returned at, so that a reply in between is not missed
+  std::atomic<uint64_t> replies_notified_ = {0};
+  uint64_t replies_waited_ = 0;
+
+  // Set the continuation, returns false if the reply is already in
+  bool setContinuation(void (*fn)(void *), void *arg);
+
+  // Whether the reply is in, for CommandFuture
+  bool done() const { return continuation_state_ == CONTINUATION_DONE; }
 
   // Explicitly delete copy constructor and assignment operator,
   // Command objects should never be copied because they hold
   // state with a network resource.
-  Command(const Command &) = delete;
-  Command &operator=(const Command &) = delete;
+  CommandBase(const CommandBase &) = delete;
+  CommandBase &operator=(const CommandBase &) = delete;
+
+  friend class Redox;
+  friend class CommandPool;
+  template <class> friend class Batch;
+  template <class> friend class CommandFuture;
+  friend class PubSubCommand;
+  friend class BulkChunk;
+};
+
+/**
+* A free list of Command objects of one class, so that Redox can
+* recycle them instead of allocating a new one for every command. The
+* mutexes and condition variable of a recycled Command are reused as is.
+*/
+class CommandPool {
+
+public:
+  explicit CommandPool(size_t capacity) : capacity_(capacity) {}
+
+  // Deletes all pooled Commands
+  ~CommandPool();
+
+  /**
+  * Returns a pooled Command, or nullptr if the pool is empty.
+  */
+  CommandBase *acquire();
+
+  /**
+  * Puts back a freed Command. Returns false if the pool is already at
+  * capacity, in which case the caller should delete the Command.
+  */
+  bool release(CommandBase *c);
+
+  /**
+  * Number of Commands currently in the pool.
+  */
+  long size() const { return size_; }
+
+private:
+  const size_t capacity_;
+
+  // Singly linked through the submission queue link, which is unused
+  // while a Command sits in the pool
+  MPSCNode *head_ = nullptr;
+  std::atomic_long size_ = {0};
+  std::mutex guard_;
+
+  CommandPool(const CommandPool &) = delete;
+  CommandPool &operator=(const CommandPool &) = delete;
+};
+
+/**
+* The Command class represents a single command string to be sent to
+* a Redis server, for both synchronous and asynchronous usage. It manages
+* all of the state relevant to a single command string. A Command can also
+* represent a deferred or looping command, in which case the success or
+* error callbacks are invoked more than once.
+*
+* Supported reply types are the ones for which parseReplyObject() is
+* specialized below. Other types can be supported by providing a
+* specialization of Command<ReplyT>::parseReplyObject().
+*/
+template <class ReplyT> class Command : public CommandBase {
+
+public:
+  /**
+  * Returns a copy of the reply value, if the reply was successful
+  * (ok() == true).
+  */
+  ReplyT reply();
+
+  /**
+  * Moves the reply value out of the Command, leaving a default
+  * constructed value behind. Avoids copying large replies.
+  */
+  ReplyT takeReply();
+
+  /**
+  * Returns a reference to the reply value without copying it. Only valid
+  * from inside the callback, or after a synchronous command returns and
+  * until it is freed, since the next reply of a looping command overwrites
+  * the value.
+  */
+  const ReplyT &replyRef() const { return reply_val_; }
+
+private:
+  Command(Redox *rdx, long id, const std::function<void(Command<ReplyT> &)> &callback,
+          double repeat, double after, bool free_memory, log::Logger &logger)
+      : CommandBase(rdx, id, repeat, after, free_memory, logger), callback_(callback) {}
+
+  void reset(long id, const std::function<void(Command<ReplyT> &)> &callback, double repeat,
+             double after, bool free_memory) {
+    CommandBase::reset(id, repeat, after, free_memory);
+    callback_ = callback;
+    reply_val_ = ReplyT();
+  }
+
+  // Invoke a user callback from the reply object. This method is specialized
+  // for each ReplyT of Command.
+  void parseReplyObject() override;
+
+  void invoke() override {
+    if (callback_)
+      callback_(*this);
+  }
+
+  // User callback
+  std::function<void(Command<ReplyT> &)> callback_;
+
+  // Place to store the reply value
+  ReplyT reply_val_;
 
   friend class Redox;
+  template <class> friend class Batch;
 };
 
+/**
+* Create a copy of the reply and return it. Use a guard
+* to make sure we don't return a reply while it is being
+* modified.
+*/
+template <class ReplyT> ReplyT Command<ReplyT>::reply() {
+  std::unique_lock<std::mutex> ul(reply_guard_, std::defer_lock);
+  if (repeat_ > 0)
+    ul.lock();
+  if (!ok()) {
+    logger_.warning() << cmd() << ": Accessing reply value while status != OK.";
+  }
+  return reply_val_;
+}
+
+template <class ReplyT> ReplyT Command<ReplyT>::takeReply() {
+  std::unique_lock<std::mutex> ul(reply_guard_, std::defer_lock);
+  if (repeat_ > 0)
+    ul.lock();
+  if (!ok()) {
+    logger_.warning() << cmd() << ": Taking reply value while status != OK.";
+  }
+  ReplyT val = std::move(reply_val_);
+  reply_val_ = ReplyT();
+  return val;
+}
+
+/**
+* True for reply types that point into the redisReply instead of copying
+* out of it, so the reply object has to outlive the reply value.
+*/
+template <class ReplyT> struct ReplyReferencesObject : std::is_pointer<ReplyT> {};
+template <> struct ReplyReferencesObject<Slice> : std::true_type {};
+template <> struct ReplyReferencesObject<ArrayView> : std::true_type {};
+
+// Specializations of parseReplyObject for all supported reply types,
+// defined in command.cpp
+template <> void Command<redisReply *>::parseReplyObject();
+template <> void Command<std::string>::parseReplyObject();
+template <> void Command<char *>::parseReplyObject();
+template <> void Command<Slice>::parseReplyObject();
+template <> void Command<int>::parseReplyObject();
+template <> void Command<long long int>::parseReplyObject();
+template <> void Command<std::nullptr_t>::parseReplyObject();
+template <> void Command<std::vector<std::string>>::parseReplyObject();
+template <> void Command<std::set<std::string>>::parseReplyObject();
+template <> void Command<std::unordered_set<std::string>>::parseReplyObject();
+template <> void Command<ArrayView>::parseReplyObject();
+
 } // End namespace redis
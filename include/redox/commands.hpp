@@ -0,0 +1,66 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "slice.hpp"
+
+namespace redox {
+namespace cmd {
+
+/**
+* Specs of common commands for Redox::run(), runSync() and
+* BulkLoader::add(). Each gives the reply type, the number of arguments
+* after the name, and the start of the command in the Redis protocol, which
+* is written out here so that nothing of it is encoded at run time. Add a
+* spec for another command with REDOX_COMMAND_SPEC, where the header counts
+* the name too: *<args + 1>, then the name as a bulk string.
+*/
+
+#define REDOX_COMMAND_SPEC(Name, ReplyT, NumArgs, Header)                                          \
+  struct Name {                                                                                    \
+    typedef ReplyT Reply;                                                                          \
+    static const size_t ARGS = NumArgs;                                                            \
+    static Slice header() { return Slice(Header, sizeof(Header) - 1); }                            \
+  }
+
+REDOX_COMMAND_SPEC(Get, std::string, 1, "*2\r\n$3\r\nGET\r\n");
+REDOX_COMMAND_SPEC(Set, std::string, 2, "*3\r\n$3\r\nSET\r\n");
+REDOX_COMMAND_SPEC(SetEx, std::string, 3, "*4\r\n$5\r\nSETEX\r\n");
+REDOX_COMMAND_SPEC(Del, int, 1, "*2\r\n$3\r\nDEL\r\n");
+REDOX_COMMAND_SPEC(Exists, int, 1, "*2\r\n$6\r\nEXISTS\r\n");
+REDOX_COMMAND_SPEC(Expire, int, 2, "*3\r\n$6\r\nEXPIRE\r\n");
+REDOX_COMMAND_SPEC(PExpire, int, 2, "*3\r\n$7\r\nPEXPIRE\r\n");
+REDOX_COMMAND_SPEC(Incr, long long int, 1, "*2\r\n$4\r\nINCR\r\n");
+REDOX_COMMAND_SPEC(IncrBy, long long int, 2, "*3\r\n$6\r\nINCRBY\r\n");
+REDOX_COMMAND_SPEC(Decr, long long int, 1, "*2\r\n$4\r\nDECR\r\n");
+REDOX_COMMAND_SPEC(HGet, std::string, 2, "*3\r\n$4\r\nHGET\r\n");
+REDOX_COMMAND_SPEC(HSet, int, 3, "*4\r\n$4\r\nHSET\r\n");
+REDOX_COMMAND_SPEC(HIncrBy, long long int, 3, "*4\r\n$7\r\nHINCRBY\r\n");
+REDOX_COMMAND_SPEC(LPush, long long int, 2, "*3\r\n$5\r\nLPUSH\r\n");
+REDOX_COMMAND_SPEC(RPush, long long int, 2, "*3\r\n$5\r\nRPUSH\r\n");
+REDOX_COMMAND_SPEC(SAdd, int, 2, "*3\r\n$4\r\nSADD\r\n");
+REDOX_COMMAND_SPEC(Publish, int, 2, "*3\r\n$7\r\nPUBLISH\r\n");
+
+} // End namespace cmd
+} // End namespace redox
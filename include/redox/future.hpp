@@ -0,0 +1,151 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <stdexcept>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define REDOX_HAS_COROUTINES 1
+#endif
+#endif
+
+#include "command.hpp"
+
+namespace redox {
+
+/**
+* A CommandFuture owns a Command started with Redox::commandAsync(), and
+* gives access to it once the reply is in. It is the only handle to the
+* Command, which is freed when the future is destroyed, so it is
+* move-only.
+*
+* The reply can be waited for by blocking in get(), or, with C++20, by
+* co_await on the future. Awaiting does not allocate or block a thread:
+* the coroutine is suspended and resumed directly by the reply callback,
+* on the event thread or the reply executor, so thousands of requests can
+* be in flight from a few threads. The result of co_await is a ready
+* future, which takes over the Command from the awaited one:
+*
+*   auto c = co_await rdx.commandAsync<std::string>({"GET", "key"});
+*   if (c->ok()) std::cout << c->reply() << std::endl;
+*
+* Code after co_await runs where replies are handled, so it must not block
+* on other commands with get() or commandSync(). A coroutine still
+* waiting when Redox disconnects is never resumed.
+*/
+template <class ReplyT> class CommandFuture {
+
+public:
+  CommandFuture() : c_(nullptr) {}
+
+  CommandFuture(CommandFuture &&other) : c_(other.c_) { other.c_ = nullptr; }
+
+  CommandFuture &operator=(CommandFuture &&other) {
+    if (this != &other) {
+      reset();
+      c_ = other.c_;
+      other.c_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~CommandFuture() { reset(); }
+
+  /**
+  * True if the future owns a Command.
+  */
+  bool valid() const { return c_ != nullptr; }
+
+  /**
+  * True once the reply is in, or sending the command failed.
+  */
+  bool ready() const { return (c_ != nullptr) && c_->done(); }
+
+  /**
+  * Blocks until the reply is in, then returns the Command. It stays owned
+  * by the future. Must not be called from the event thread, nor on a
+  * future that is not valid().
+  */
+  Command<ReplyT> &get() {
+    checkValid();
+    if (!c_->done())
+      c_->wait();
+    return *c_;
+  }
+
+  /**
+  * Access to the Command once the future is ready.
+  */
+  Command<ReplyT> *operator->() { return c_; }
+  Command<ReplyT> &operator*() { return *c_; }
+
+  /**
+  * Gives up ownership of the Command, which the caller must then .free().
+  */
+  Command<ReplyT> *release() {
+    Command<ReplyT> *c = c_;
+    c_ = nullptr;
+    return c;
+  }
+
+#ifdef REDOX_HAS_COROUTINES
+  bool await_ready() const { return ready(); }
+
+  bool await_suspend(std::coroutine_handle<> handle) {
+    checkValid();
+
+    // False if the reply came in meanwhile, which resumes right away
+    return c_->setContinuation(&CommandFuture::resume, handle.address());
+  }
+
+  CommandFuture await_resume() { return std::move(*this); }
+#endif
+
+private:
+  explicit CommandFuture(Command<ReplyT> *c) : c_(c) {}
+
+  void checkValid() const {
+    if (c_ == nullptr)
+      throw std::runtime_error("[ERROR] Cannot wait on a CommandFuture without a Command!");
+  }
+
+  void reset() {
+    if (c_ != nullptr)
+      c_->free();
+    c_ = nullptr;
+  }
+
+#ifdef REDOX_HAS_COROUTINES
+  static void resume(void *address) { std::coroutine_handle<>::from_address(address).resume(); }
+#endif
+
+  Command<ReplyT> *c_;
+
+  CommandFuture(const CommandFuture &) = delete;
+  CommandFuture &operator=(const CommandFuture &) = delete;
+
+  friend class Redox;
+};
+
+} // End namespace redox
@@ -0,0 +1,192 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <memory>
+
+#include "client.hpp"
+
+namespace redox {
+
+/**
+* RedoxPool owns several Redox clients connected to the same server, each
+* with its own hiredis context and event thread, and spreads commands over
+* them. One Redox is bound by the single core that runs its event loop, so
+* a pool raises the throughput ceiling with the number of connections.
+*
+* The command API mirrors Redox. Every call is routed to one connection
+* according to the dispatch policy, and the returned Command belongs to
+* that connection. Commands sent through different connections are not
+* ordered with respect to each other, so use KEY_AFFINITY when commands
+* on the same key must run in order.
+*/
+class RedoxPool {
+
+public:
+  // Dispatch policies
+  static const int ROUND_ROBIN = 0;   // Rotate through the connections
+  static const int LEAST_PENDING = 1; // Pick the connection with the fewest commands in use
+  static const int KEY_AFFINITY = 2;  // Pick the connection by a hash of the first key
+
+  /**
+  * Constructor. Creates [size] clients, with the same log stream and level
+  * as a Redox instance.
+  */
+  RedoxPool(size_t size, int dispatch = ROUND_ROBIN, std::ostream &log_stream = std::cout,
+            log::Level log_level = log::Warning);
+
+  /**
+  * Disconnects all clients.
+  */
+  ~RedoxPool();
+
+  /**
+  * Same as .noWait() on every Redox instance.
+  */
+  void noWait(bool state);
+
+  /**
+  * Same as .adaptiveSpin() on every Redox instance.
+  */
+  void adaptiveSpin(int microseconds);
+
+  /**
+  * Same as .threadPriority() on every Redox instance.
+  */
+  void threadPriority(int priority);
+
+  /**
+  * Pins the event thread of the i-th client to cpus[i]. Entries past the
+  * number of clients are ignored, and negative entries leave a client
+  * unpinned. Call before connecting.
+  */
+  void cpuAffinity(const std::vector<int> &cpus);
+
+  /**
+  * Connects every client over TCP. Returns true if all of them connected,
+  * otherwise disconnects the ones that did and returns false.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Connects every client over a unix socket, like connect().
+  */
+  bool connectUnix(const std::string &path = REDIS_DEFAULT_PATH);
+
+  /**
+  * Same as .disconnect(), .stop() and .wait() on every Redox instance.
+  */
+  void disconnect();
+  void stop();
+  void wait();
+
+  /**
+  * Number of clients in the pool.
+  */
+  size_t size() const { return clients_.size(); }
+
+  /**
+  * Direct access to the index-th client.
+  */
+  Redox &client(size_t index) { return *clients_[index]; }
+
+  /**
+  * The client the dispatch policy picks for the given command.
+  */
+  Redox &select(const std::vector<std::string> &cmd);
+  Redox &select(const BorrowedArgs &cmd);
+
+  // ------------------------------------------------
+  // Same as the core API of Redox
+  // ------------------------------------------------
+
+  template <class ReplyT>
+  void command(std::vector<std::string> cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr) {
+    Redox &rdx = select(cmd);
+    rdx.command<ReplyT>(std::move(cmd), callback);
+  }
+
+  template <class ReplyT>
+  void command(const BorrowedArgs &cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr) {
+    select(cmd).command<ReplyT>(cmd, callback);
+  }
+
+  void command(std::vector<std::string> cmd) {
+    Redox &rdx = select(cmd);
+    rdx.command(std::move(cmd));
+  }
+
+  template <class ReplyT> Command<ReplyT> &commandSync(std::vector<std::string> cmd) {
+    Redox &rdx = select(cmd);
+    return rdx.commandSync<ReplyT>(std::move(cmd));
+  }
+
+  template <class ReplyT> Command<ReplyT> &commandSync(const BorrowedArgs &cmd) {
+    return select(cmd).commandSync<ReplyT>(cmd);
+  }
+
+  bool commandSync(std::vector<std::string> cmd) {
+    Redox &rdx = select(cmd);
+    return rdx.commandSync(std::move(cmd));
+  }
+
+  bool commandSync(const BorrowedArgs &cmd) { return select(cmd).commandSync(cmd); }
+
+  template <class ReplyT>
+  Command<ReplyT> &commandLoop(std::vector<std::string> cmd,
+                               const std::function<void(Command<ReplyT> &)> &callback,
+                               double repeat, double after = 0.0) {
+    Redox &rdx = select(cmd);
+    return rdx.commandLoop<ReplyT>(std::move(cmd), callback, repeat, after);
+  }
+
+  template <class ReplyT>
+  void commandDelayed(std::vector<std::string> cmd,
+                      const std::function<void(Command<ReplyT> &)> &callback, double after) {
+    Redox &rdx = select(cmd);
+    rdx.commandDelayed<ReplyT>(std::move(cmd), callback, after);
+  }
+
+  std::string get(const std::string &key) { return selectByKey(key).get(key); }
+  bool set(const std::string &key, const std::string &value) {
+    return selectByKey(key).set(key, value);
+  }
+  bool del(const std::string &key) { return selectByKey(key).del(key); }
+  void publish(const std::string &topic, const std::string &msg) {
+    selectByKey(topic).publish(topic, msg);
+  }
+
+private:
+  // Pick a client for a command whose first key is [key], which may be
+  // empty for commands without one
+  Redox &selectByKey(const Slice &key);
+
+  std::vector<std::unique_ptr<Redox>> clients_;
+  const int dispatch_;
+  std::atomic<size_t> next_ = {0};
+
+  RedoxPool(const RedoxPool &) = delete;
+  RedoxPool &operator=(const RedoxPool &) = delete;
+};
+
+} // End namespace redox
@@ -0,0 +1,252 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <memory>
+
+#include "client.hpp"
+
+namespace redox {
+
+/**
+* RedoxReplicaSet is a client for one primary and its read replicas. It
+* keeps one Redox connection per server, and sends read-only commands to a
+* replica and everything else to the primary. Commands are classified by
+* name from a built-in table of read-only commands, see isReadCommand().
+*
+* Replicas that are disconnected are skipped, as reported to the
+* connection callback of each Redox, and reads fall back to the primary
+* when none is left. With autoReconnect(), a replica is used again once it
+* is back. Among the connected replicas, the read policy picks one:
+*
+*   NEAREST:       The lowest round trip, as measured with PING on connect
+*                  and by every call to measureLatency()
+*   LEAST_PENDING: The fewest commands in use
+*   ROUND_ROBIN:   Rotate through them
+*
+* Replication is asynchronous, so a read from a replica may not see a
+* write just sent to the primary. readYourWrites() sends the reads of a
+* thread to the primary for a while after it writes.
+*
+* The command API mirrors Redox, and the returned Command belongs to the
+* connection it was routed to. Commands sent through different
+* connections are not ordered with respect to each other.
+*/
+class RedoxReplicaSet {
+
+public:
+  // Read policies
+  static const int NEAREST = 0;
+  static const int LEAST_PENDING = 1;
+  static const int ROUND_ROBIN = 2;
+
+  /**
+  * Constructor. Same as Redox, the log stream and level are used for every
+  * connection.
+  */
+  RedoxReplicaSet(int read_policy = NEAREST, std::ostream &log_stream = std::cout,
+                  log::Level log_level = log::Warning);
+
+  /**
+  * Disconnects from all servers.
+  */
+  ~RedoxReplicaSet();
+
+  /**
+  * Adds a replica to read from. Call before connecting.
+  */
+  void addReplica(const std::string &host, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Same as .noWait() on every connection. Call before connecting.
+  */
+  void noWait(bool state);
+
+  /**
+  * Same as .autoReconnect() on every connection. Call before connecting.
+  */
+  void autoReconnect(double min_delay = 0.1, double max_delay = 10.0,
+                     size_t max_buffered = 10000);
+
+  /**
+  * For [window] seconds after a thread sends a write, its reads go to the
+  * primary as well, so that it sees its own writes. Writes from other
+  * threads are not taken into account. Default is 0, which is off.
+  */
+  void readYourWrites(double window);
+
+  /**
+  * Connects to the primary, then to every replica, and measures their
+  * latency. Returns true if the primary connected. Replicas that cannot
+  * be reached are logged and skipped.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+
+  /**
+  * Disconnects from all servers. A combination of .stop() and .wait().
+  */
+  void disconnect();
+  void stop();
+  void wait();
+
+  /**
+  * Measures the round trip to every connected replica with a PING, for
+  * the NEAREST policy. Blocks until all of them reply.
+  */
+  void measureLatency();
+
+  /**
+  * Returns true for commands that only read data, like GET, HGETALL or
+  * ZRANGE, which can be answered by a replica. Case is ignored.
+  */
+  static bool isReadCommand(const Slice &name);
+
+  /**
+  * Direct access to the primary and the index-th replica.
+  */
+  Redox &primary() { return *primary_->rdx; }
+  Redox &replica(size_t index) { return *replicas_[index]->rdx; }
+
+  /**
+  * Number of replicas added.
+  */
+  size_t numReplicas() const { return replicas_.size(); }
+
+  /**
+  * Whether the index-th replica is connected and used for reads.
+  */
+  bool replicaHealthy(size_t index) const { return replicas_[index]->healthy; }
+
+  /**
+  * The connection a command is routed to, the primary for writes and a
+  * replica for reads.
+  */
+  Redox &select(const std::vector<std::string> &cmd);
+  Redox &select(const BorrowedArgs &cmd);
+
+  // ------------------------------------------------
+  // Same as the core API of Redox
+  // ------------------------------------------------
+
+  template <class ReplyT>
+  void command(std::vector<std::string> cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr) {
+    Redox &rdx = select(cmd);
+    rdx.command<ReplyT>(std::move(cmd), callback);
+  }
+
+  template <class ReplyT>
+  void command(const BorrowedArgs &cmd,
+               const std::function<void(Command<ReplyT> &)> &callback = nullptr) {
+    select(cmd).command<ReplyT>(cmd, callback);
+  }
+
+  void command(std::vector<std::string> cmd) {
+    Redox &rdx = select(cmd);
+    rdx.command(std::move(cmd));
+  }
+
+  template <class ReplyT> Command<ReplyT> &commandSync(std::vector<std::string> cmd) {
+    Redox &rdx = select(cmd);
+    return rdx.commandSync<ReplyT>(std::move(cmd));
+  }
+
+  template <class ReplyT> Command<ReplyT> &commandSync(const BorrowedArgs &cmd) {
+    return select(cmd).commandSync<ReplyT>(cmd);
+  }
+
+  bool commandSync(std::vector<std::string> cmd) {
+    Redox &rdx = select(cmd);
+    return rdx.commandSync(std::move(cmd));
+  }
+
+  bool commandSync(const BorrowedArgs &cmd) { return select(cmd).commandSync(cmd); }
+
+  template <class ReplyT>
+  Command<ReplyT> &commandLoop(std::vector<std::string> cmd,
+                               const std::function<void(Command<ReplyT> &)> &callback,
+                               double repeat, double after = 0.0) {
+    Redox &rdx = select(cmd);
+    return rdx.commandLoop<ReplyT>(std::move(cmd), callback, repeat, after);
+  }
+
+  template <class ReplyT>
+  void commandDelayed(std::vector<std::string> cmd,
+                      const std::function<void(Command<ReplyT> &)> &callback, double after) {
+    Redox &rdx = select(cmd);
+    rdx.commandDelayed<ReplyT>(std::move(cmd), callback, after);
+  }
+
+  std::string get(const std::string &key) { return selectRead().get(key); }
+  bool set(const std::string &key, const std::string &value) {
+    return selectWrite().set(key, value);
+  }
+  bool del(const std::string &key) { return selectWrite().del(key); }
+  void publish(const std::string &topic, const std::string &msg) {
+    selectWrite().publish(topic, msg);
+  }
+
+private:
+  // A connection and what is known about its health. The client is
+  // declared last so it is destroyed first, while its connection
+  // callback can still update the rest.
+  struct Node {
+    std::string host;
+    int port;
+    bool connected = false;
+    std::atomic_bool healthy = {false};
+    std::atomic<int64_t> latency_ns = {0};
+    std::unique_ptr<Redox> rdx;
+  };
+
+  // Route a command by its name
+  Redox &selectByName(const Slice &name);
+
+  // The primary, noting the time of the write for readYourWrites()
+  Redox &selectWrite();
+
+  // A connected replica picked by the read policy, or the primary if
+  // there is none or the calling thread wrote recently
+  Redox &selectRead();
+
+  // Create a node whose health follows the state of its connection
+  std::unique_ptr<Node> makeNode(const std::string &host, int port);
+
+  // Connect a node and report whether it succeeded
+  bool connectNode(Node &node);
+
+  log::Logger logger_;
+  std::ostream &log_stream_;
+  log::Level log_level_;
+  const int read_policy_;
+
+  std::unique_ptr<Node> primary_;
+  std::vector<std::unique_ptr<Node>> replicas_;
+  std::atomic<size_t> next_ = {0};
+
+  // Reads follow writes to the primary for this long, 0 if off
+  std::atomic<int64_t> sticky_ns_ = {0};
+
+  RedoxReplicaSet(const RedoxReplicaSet &) = delete;
+  RedoxReplicaSet &operator=(const RedoxReplicaSet &) = delete;
+};
+
+} // End namespace redox
@@ -0,0 +1,122 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <deque>
+
+#include "client.hpp"
+
+namespace redox {
+
+/**
+* A ScanStream walks a keyspace or collection with SCAN, HSCAN, SSCAN or
+* ZSCAN and hands out its pages one at a time to a consumer thread. The
+* request for the next page is sent from the event thread as soon as a
+* page arrives, so up to max_pages are fetched ahead while the consumer
+* works, and no more: once that many wait to be consumed, the scan pauses
+* until next() takes one. A walk of any size keeps at most max_pages
+* replies in memory.
+*
+* The first command gives the cursor "0" and any options, like
+* {"SCAN", "0", "MATCH", "user:*", "COUNT", "1000"}. Each page is an
+* ArrayView over the reply, without copies, which is valid until the next
+* call to next(). Pages of HSCAN and ZSCAN alternate fields or members
+* with their values or scores. Empty pages are skipped.
+*
+*   redox::ScanStream scan(rdx, {"SCAN", "0", "COUNT", "1000"});
+*   while (scan.next())
+*     for (redox::Slice key : scan.page()) ...
+*   if (!scan.ok()) std::cerr << scan.lastError() << std::endl;
+*
+* The stream must be destroyed before the Redox client disconnects, and
+* must not be used from the event thread, since next() blocks.
+*/
+class ScanStream {
+
+public:
+  /**
+  * Starts the scan right away.
+  */
+  ScanStream(Redox &rdx, std::vector<std::string> cmd, size_t max_pages = 4);
+
+  /**
+  * Waits for a page still being fetched, then frees all pages.
+  */
+  ~ScanStream();
+
+  /**
+  * Frees the current page and blocks until the next one is in. Returns
+  * false once the scan is over or a command failed.
+  */
+  bool next();
+
+  /**
+  * The elements of the current page.
+  */
+  const ArrayView &page() const { return page_; }
+
+  /**
+  * NO_REPLY while scanning, OK_REPLY once every page was consumed, or the
+  * status of the command that failed, given by Command::status().
+  */
+  int status();
+
+  /**
+  * True unless a command failed.
+  */
+  bool ok();
+
+  /**
+  * The error of the command that failed, or an empty string.
+  */
+  std::string lastError();
+
+private:
+  // Send the command for the page at the given cursor
+  void request(const std::string &cursor);
+
+  // Callback of every page command, on the event thread
+  void pageReceived(Command<ArrayView> &c);
+
+  Redox &rdx_;
+  std::vector<std::string> cmd_;
+  size_t cursor_index_;
+  size_t max_pages_;
+
+  // Command holding the current page, whose reply the consumer reads
+  Command<ArrayView> *current_ = nullptr;
+  ArrayView page_;
+
+  // Pages fetched ahead, and the scan state, shared with the event thread
+  std::deque<Command<ArrayView> *> pages_;
+  bool in_flight_ = false; // A page command is waiting for its reply
+  bool finished_ = false;  // The cursor came back to zero, or a command failed
+  std::string paused_cursor_; // Cursor of the next page, while paused
+  int status_ = CommandBase::NO_REPLY;
+  std::string last_error_;
+  std::mutex guard_;
+  std::condition_variable waiter_;
+
+  ScanStream(const ScanStream &) = delete;
+  ScanStream &operator=(const ScanStream &) = delete;
+};
+
+} // End namespace redox
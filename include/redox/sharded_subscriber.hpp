@@ -0,0 +1,253 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <memory>
+
+#include "subscriber.hpp"
+
+namespace redox {
+
+/**
+* ShardedSubscriber spreads subscriptions over several Subscribers, each
+* with its own connection and event thread, by a hash of the channel or
+* pattern. A single Subscriber parses every message and runs every callback
+* on one event thread, which caps the message rate at what one core can do.
+*
+* With worker threads, callbacks run on a pool instead of the event
+* threads. Each worker has a FIFO queue, and every callback for a channel
+* goes to the same worker, picked by a hash of the channel name, so the
+* messages of a channel are delivered one at a time in the order the server
+* sent them. For a pattern that is the channel the message was published
+* to. The sub, unsub and error callbacks go to the worker of the channel or
+* pattern they are given. There is no ordering between channels, or
+* between a channel and a pattern matching it, since they can come in over
+* different connections.
+*
+* Handing a message to a worker copies the topic and payload, so the Slice
+* callbacks only avoid copies when there are no workers.
+*/
+class ShardedSubscriber {
+
+public:
+  /**
+  * Constructor. Creates [num_shards] Subscribers and starts [num_workers]
+  * threads to run callbacks on, or none to run them on the event threads.
+  * Same log stream and level as Redox.
+  */
+  ShardedSubscriber(size_t num_shards, size_t num_workers = 0,
+                    std::ostream &log_stream = std::cout, log::Level log_level = log::Warning);
+
+  /**
+  * Stops the workers, and disconnects.
+  */
+  ~ShardedSubscriber();
+
+  /**
+  * Same as .noWait(), .adaptiveSpin() and .threadPriority() on every
+  * Subscriber.
+  */
+  void noWait(bool state);
+  void adaptiveSpin(int microseconds);
+  void threadPriority(int priority);
+
+  /**
+  * Pins the event thread of the i-th shard to cpus[i], like
+  * RedoxPool::cpuAffinity(). Call before connecting.
+  */
+  void cpuAffinity(const std::vector<int> &cpus);
+
+  /**
+  * Connects every shard. Returns true if all of them connected, otherwise
+  * disconnects the ones that did and returns false.
+  */
+  bool connect(const std::string &host = REDIS_DEFAULT_HOST, const int port = REDIS_DEFAULT_PORT);
+  bool connectUnix(const std::string &path = REDIS_DEFAULT_PATH);
+
+  /**
+  * Same as .disconnect(), .stop() and .wait() on every Subscriber. Once
+  * the shards are done, wait() lets the workers run the callbacks still
+  * queued and stops them.
+  */
+  void disconnect();
+  void stop();
+  void wait();
+
+  /**
+  * Number of shards, and direct access to the index-th one.
+  */
+  size_t size() const { return shards_.size(); }
+  Subscriber &shard(size_t index) { return *shards_[index]; }
+
+  /**
+  * Index of the shard a channel or pattern is subscribed on.
+  */
+  size_t shardFor(const std::string &topic) const;
+
+  /**
+  * Same as on a Subscriber. Topics are grouped by shard, and each group is
+  * subscribed to with a single command.
+  */
+  void subscribe(const std::string topic,
+                 std::function<void(const std::string &, const std::string &)> msg_callback,
+                 std::function<void(const std::string &)> sub_callback = nullptr,
+                 std::function<void(const std::string &)> unsub_callback = nullptr,
+                 std::function<void(const std::string &, int)> err_callback = nullptr) {
+    subscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+              std::move(unsub_callback), std::move(err_callback));
+  }
+
+  void subscribe(const std::vector<std::string> &topics,
+                 std::function<void(const std::string &, const std::string &)> msg_callback,
+                 std::function<void(const std::string &)> sub_callback = nullptr,
+                 std::function<void(const std::string &)> unsub_callback = nullptr,
+                 std::function<void(const std::string &, int)> err_callback = nullptr) {
+    PubSubHandler handler;
+    handler.msg_callback = std::move(msg_callback);
+    handler.sub_callback = std::move(sub_callback);
+    handler.unsub_callback = std::move(unsub_callback);
+    handler.err_callback = std::move(err_callback);
+    subscribeBase(false, topics, std::move(handler));
+  }
+
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  subscribe(const std::string topic, Callback msg_callback,
+            std::function<void(const std::string &)> sub_callback = nullptr,
+            std::function<void(const std::string &)> unsub_callback = nullptr,
+            std::function<void(const std::string &, int)> err_callback = nullptr) {
+    subscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+              std::move(unsub_callback), std::move(err_callback));
+  }
+
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  subscribe(const std::vector<std::string> &topics, Callback msg_callback,
+            std::function<void(const std::string &)> sub_callback = nullptr,
+            std::function<void(const std::string &)> unsub_callback = nullptr,
+            std::function<void(const std::string &, int)> err_callback = nullptr) {
+    PubSubHandler handler;
+    handler.slice_callback = std::move(msg_callback);
+    handler.sub_callback = std::move(sub_callback);
+    handler.unsub_callback = std::move(unsub_callback);
+    handler.err_callback = std::move(err_callback);
+    subscribeBase(false, topics, std::move(handler));
+  }
+
+  void psubscribe(const std::string topic,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &)> unsub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr) {
+    psubscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+               std::move(unsub_callback), std::move(err_callback));
+  }
+
+  void psubscribe(const std::vector<std::string> &topics,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &)> unsub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr) {
+    PubSubHandler handler;
+    handler.msg_callback = std::move(msg_callback);
+    handler.sub_callback = std::move(sub_callback);
+    handler.unsub_callback = std::move(unsub_callback);
+    handler.err_callback = std::move(err_callback);
+    subscribeBase(true, topics, std::move(handler));
+  }
+
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  psubscribe(const std::string topic, Callback msg_callback,
+             std::function<void(const std::string &)> sub_callback = nullptr,
+             std::function<void(const std::string &)> unsub_callback = nullptr,
+             std::function<void(const std::string &, int)> err_callback = nullptr) {
+    psubscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+               std::move(unsub_callback), std::move(err_callback));
+  }
+
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  psubscribe(const std::vector<std::string> &topics, Callback msg_callback,
+             std::function<void(const std::string &)> sub_callback = nullptr,
+             std::function<void(const std::string &)> unsub_callback = nullptr,
+             std::function<void(const std::string &, int)> err_callback = nullptr) {
+    PubSubHandler handler;
+    handler.slice_callback = std::move(msg_callback);
+    handler.sub_callback = std::move(sub_callback);
+    handler.unsub_callback = std::move(unsub_callback);
+    handler.err_callback = std::move(err_callback);
+    subscribeBase(true, topics, std::move(handler));
+  }
+
+  /**
+  * Same as on a Subscriber, grouped by shard like subscribe().
+  */
+  void unsubscribe(const std::vector<std::string> &topics,
+                   std::function<void(const std::string &, int)> err_callback = nullptr);
+  void unsubscribe(const std::string topic,
+                   std::function<void(const std::string &, int)> err_callback = nullptr) {
+    unsubscribe(std::vector<std::string>{topic}, std::move(err_callback));
+  }
+  void unsubscribe();
+
+  void punsubscribe(const std::vector<std::string> &topics,
+                    std::function<void(const std::string &, int)> err_callback = nullptr);
+  void punsubscribe(const std::string topic,
+                    std::function<void(const std::string &, int)> err_callback = nullptr) {
+    punsubscribe(std::vector<std::string>{topic}, std::move(err_callback));
+  }
+  void punsubscribe();
+
+  /**
+  * Return the topics and patterns subscribed to over all shards.
+  */
+  std::set<std::string> subscribedTopics();
+  std::set<std::string> psubscribedTopics();
+
+private:
+  // A worker thread with its FIFO queue of callbacks
+  struct Worker;
+
+  // Base for subscribe and psubscribe
+  void subscribeBase(bool pattern, const std::vector<std::string> &topics,
+                     PubSubHandler &&handler);
+
+  // Wrap the callbacks of a handler so that they run on the workers
+  PubSubHandler onWorkers(PubSubHandler &&handler);
+
+  // Group topics by the shard they belong to
+  std::vector<std::vector<std::string>> byShard(const std::vector<std::string> &topics) const;
+
+  // Let the workers finish their queues and join them
+  void stopWorkers();
+
+  // Declared before the shards, so that event threads still running while
+  // the shards are destroyed find the workers in place
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  std::vector<std::unique_ptr<Subscriber>> shards_;
+
+  ShardedSubscriber(const ShardedSubscriber &) = delete;
+  ShardedSubscriber &operator=(const ShardedSubscriber &) = delete;
+};
+
+} // End namespace redox
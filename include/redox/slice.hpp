@@ -0,0 +1,79 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <ostream>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+namespace redox {
+
+/**
+* A non-owning reference to a string of bytes, which may contain binary
+* data. The referenced memory must outlive the Slice. This is a minimal
+* stand-in for std::string_view, which it converts to and from in C++17.
+*/
+class Slice {
+
+public:
+  Slice() : data_(nullptr), size_(0) {}
+  Slice(const char *data, size_t size) : data_(data), size_(size) {}
+  Slice(const char *str) : data_(str), size_(strlen(str)) {}
+  Slice(const std::string &str) : data_(str.data()), size_(str.size()) {}
+
+#if __cplusplus >= 201703L
+  Slice(std::string_view sv) : data_(sv.data()), size_(sv.size()) {}
+  operator std::string_view() const { return std::string_view(data_, size_); }
+#endif
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const char *begin() const { return data_; }
+  const char *end() const { return data_ + size_; }
+  char operator[](size_t i) const { return data_[i]; }
+
+  /**
+  * Returns a copy of the referenced bytes.
+  */
+  std::string str() const { return std::string(data_, size_); }
+
+  friend bool operator==(const Slice &a, const Slice &b) {
+    return (a.size_ == b.size_) && (a.size_ == 0 || memcmp(a.data_, b.data_, a.size_) == 0);
+  }
+  friend bool operator!=(const Slice &a, const Slice &b) { return !(a == b); }
+
+private:
+  const char *data_;
+  size_t size_;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const Slice &s) {
+  return os.write(s.data(), s.size());
+}
+
+} // End namespace redox
@@ -0,0 +1,76 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "utils/histogram.hpp"
+
+namespace redox {
+
+/**
+* Latencies of one kind of command, in nanoseconds.
+*/
+struct LatencyStats {
+
+  // From the moment a command is queued by the caller to when the event
+  // thread sends it. Not recorded for delayed and looping commands.
+  HistogramSnapshot queue_wait;
+
+  // From the moment a command is sent to when its reply is received
+  HistogramSnapshot round_trip;
+};
+
+/**
+* A snapshot of the statistics of a Redox client, returned by stats().
+*/
+struct Stats {
+
+  // False if Redox was built without statistics, in which case only the
+  // command counts are filled in
+  bool enabled = false;
+
+  // Command objects created and deleted, see Redox::commandsCreated()
+  long commands_created = 0;
+  long commands_deleted = 0;
+
+  // Commands sent to the server and replies received. A Batch counts
+  // once per command in it.
+  uint64_t commands_sent = 0;
+  uint64_t replies_received = 0;
+
+  // Commands sent that are still waiting for a reply
+  uint64_t in_flight() const {
+    return (commands_sent > replies_received) ? commands_sent - replies_received : 0;
+  }
+
+  // Size of the commands and replies in the Redis protocol
+  uint64_t bytes_out = 0;
+  uint64_t bytes_in = 0;
+
+  // Latencies of all commands, and by command name in upper case
+  LatencyStats total;
+  std::map<std::string, LatencyStats> commands;
+};
+
+} // End namespace redox
@@ -20,10 +20,114 @@
 
 #pragma once
 
+#include <deque>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+
 #include "client.hpp"
 
 namespace redox {
 
+class Subscriber;
+
+/**
+* The callbacks of one subscription. Exactly one of the message
+* callbacks is set.
+*/
+struct PubSubHandler {
+  std::function<void(const std::string &, const std::string &)> msg_callback;
+  std::function<void(const Slice &, const Slice &)> slice_callback;
+  std::function<void(const Slice &, const redisReply *)> reply_callback;
+  std::function<void(const std::string &)> sub_callback;
+  std::function<void(const std::string &)> unsub_callback;
+  std::function<void(const std::string &, int)> err_callback;
+};
+
+/**
+* A SUBSCRIBE, PSUBSCRIBE, UNSUBSCRIBE or PUNSUBSCRIBE of one or more
+* topics, sent as a single command.
+*/
+struct PubSubRequest {
+  enum Kind { SUBSCRIBE = 0, PSUBSCRIBE = 1, UNSUBSCRIBE = 2, PUNSUBSCRIBE = 3 };
+
+  Kind kind;
+  std::vector<std::string> topics;
+  PubSubHandler handler;
+
+  // Topics confirmed so far. The server confirms them one by one, in order.
+  size_t confirmed = 0;
+
+  static const char *name(Kind kind);
+};
+
+/**
+* The single Command through which a Subscriber talks to the server. It is
+* registered with Redox once and stays registered until the Subscriber
+* stops, and every request is sent through it, so hiredis hands every
+* confirmation and message to it. Requests made while it waits on the
+* submission queue of Redox are sent together.
+*/
+class PubSubCommand : public CommandBase {
+
+public:
+  /**
+  * Creates the command of a Subscriber. Throws if Redox is not connected.
+  */
+  static PubSubCommand *create(Subscriber *sub, Redox *rdx);
+
+  /**
+  * Queues a request, and hands the command to the event loop unless it
+  * is already waiting there.
+  */
+  void request(PubSubRequest &&req);
+
+private:
+  PubSubCommand(Subscriber *sub, Redox *rdx);
+
+  // Move the queued requests into the argument vectors
+  void dequeued() override;
+
+  // Route a confirmation or message to the Subscriber, then free it
+  void processReply(redisReply *r) override;
+
+  void parseReplyObject() override;
+  void invoke() override {}
+  void sendFailed(size_t index) override;
+
+  // Messages are dispatched by the Subscriber, on the event thread
+  bool offloadable() const override { return false; }
+
+  // Sent once, and answered with every message that follows
+  bool limited() const override { return false; }
+
+  Subscriber *const sub_;
+
+  // Requests not yet taken by the event thread, and whether the command
+  // is on the submission queue
+  std::vector<PubSubRequest> queued_;
+  bool in_queue_ = false;
+  std::mutex queued_guard_;
+
+  // Requests last sent, which argv_ points into
+  std::vector<PubSubRequest> sent_;
+};
+
+/**
+* True if F can be called with a topic and a payload as Slices, which
+* includes callbacks taking std::string_view in C++17.
+*/
+template <class F> class IsSliceCallback {
+  template <class G>
+  static auto test(int) -> decltype(std::declval<G &>()(std::declval<const Slice &>(),
+                                                         std::declval<const Slice &>()),
+                                    std::true_type());
+  template <class> static std::false_type test(...);
+
+public:
+  static const bool value = decltype(test<F>(0))::value;
+};
+
 class Subscriber {
 
 public:
@@ -42,6 +146,14 @@ public:
   */
   void noWait(bool state) { rdx_.noWait(state); }
 
+  /**
+  * Same as .adaptiveSpin(), .cpuAffinity() and .threadPriority() on a Redox
+  * instance.
+  */
+  void adaptiveSpin(int microseconds) { rdx_.adaptiveSpin(microseconds); }
+  void cpuAffinity(int cpu) { rdx_.cpuAffinity(cpu); }
+  void threadPriority(int priority) { rdx_.threadPriority(priority); }
+
   /**
   * Same as .connect() on a Redox instance.
   */
@@ -59,7 +171,9 @@ public:
   }
 
   /**
-  * Same as .stop() on a Redox instance.
+  * Same as .stop() on a Redox instance. The connection is closed without
+  * unsubscribing first, which drops all subscriptions on the server, so
+  * unsub_callbacks are not invoked.
   */
   void stop();
 
@@ -81,11 +195,74 @@ public:
   * err_callback: invoked on some error state
   */
   void subscribe(const std::string topic,
+                 std::function<void(const std::string &, const std::string &)> msg_callback,
+                 std::function<void(const std::string &)> sub_callback = nullptr,
+                 std::function<void(const std::string &)> unsub_callback = nullptr,
+                 std::function<void(const std::string &, int)> err_callback = nullptr) {
+    subscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+              std::move(unsub_callback), std::move(err_callback));
+  }
+
+  /**
+  * Subscribe to many topics with a single SUBSCRIBE, with the same
+  * callbacks for each of them. The sub_callback is invoked once per topic.
+  */
+  void subscribe(const std::vector<std::string> &topics,
                  std::function<void(const std::string &, const std::string &)> msg_callback,
                  std::function<void(const std::string &)> sub_callback = nullptr,
                  std::function<void(const std::string &)> unsub_callback = nullptr,
                  std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  /**
+  * Subscribe to a topic, or to many, with a message callback that takes the
+  * topic and payload as Slices, or as std::string_view in C++17. They point
+  * into the reply from the server, so nothing is copied, and are only
+  * valid until the callback returns.
+  */
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  subscribe(const std::string topic, Callback msg_callback,
+            std::function<void(const std::string &)> sub_callback = nullptr,
+            std::function<void(const std::string &)> unsub_callback = nullptr,
+            std::function<void(const std::string &, int)> err_callback = nullptr) {
+    subscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+              std::move(unsub_callback), std::move(err_callback));
+  }
+
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  subscribe(const std::vector<std::string> &topics, Callback msg_callback,
+            std::function<void(const std::string &)> sub_callback = nullptr,
+            std::function<void(const std::string &)> unsub_callback = nullptr,
+            std::function<void(const std::string &, int)> err_callback = nullptr) {
+    PubSubHandler handler;
+    handler.slice_callback = std::move(msg_callback);
+    handler.sub_callback = std::move(sub_callback);
+    handler.unsub_callback = std::move(unsub_callback);
+    handler.err_callback = std::move(err_callback);
+    subscribeBase(PubSubRequest::SUBSCRIBE, topics, std::move(handler));
+  }
+
+  /**
+  * Subscribe to a topic with a message callback that gets the payload as
+  * the reply object from the server, for messages that are not a single
+  * string. The invalidation messages of client tracking, for example, are
+  * an array of keys, or nil to invalidate everything. The reply is only
+  * valid until the callback returns.
+  */
+  void subscribeRaw(const std::string topic,
+                    std::function<void(const Slice &, const redisReply *)> msg_callback,
+                    std::function<void(const std::string &)> sub_callback = nullptr,
+                    std::function<void(const std::string &)> unsub_callback = nullptr,
+                    std::function<void(const std::string &, int)> err_callback = nullptr) {
+    PubSubHandler handler;
+    handler.reply_callback = std::move(msg_callback);
+    handler.sub_callback = std::move(sub_callback);
+    handler.unsub_callback = std::move(unsub_callback);
+    handler.err_callback = std::move(err_callback);
+    subscribeBase(PubSubRequest::SUBSCRIBE, {topic}, std::move(handler));
+  }
+
   /**
   * Subscribe to a topic with a pattern.
   *
@@ -94,27 +271,101 @@ public:
   * err_callback: invoked on some error state
   */
   void psubscribe(const std::string topic,
+                  std::function<void(const std::string &, const std::string &)> msg_callback,
+                  std::function<void(const std::string &)> sub_callback = nullptr,
+                  std::function<void(const std::string &)> unsub_callback = nullptr,
+                  std::function<void(const std::string &, int)> err_callback = nullptr) {
+    psubscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+               std::move(unsub_callback), std::move(err_callback));
+  }
+
+  /**
+  * Subscribe to many patterns with a single PSUBSCRIBE.
+  */
+  void psubscribe(const std::vector<std::string> &topics,
                   std::function<void(const std::string &, const std::string &)> msg_callback,
                   std::function<void(const std::string &)> sub_callback = nullptr,
                   std::function<void(const std::string &)> unsub_callback = nullptr,
                   std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  /**
+  * Subscribe to patterns with a zero-copy message callback like the one of
+  * subscribe(). The topic passed to it is the channel the message was
+  * published to.
+  */
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  psubscribe(const std::string topic, Callback msg_callback,
+             std::function<void(const std::string &)> sub_callback = nullptr,
+             std::function<void(const std::string &)> unsub_callback = nullptr,
+             std::function<void(const std::string &, int)> err_callback = nullptr) {
+    psubscribe(std::vector<std::string>{topic}, std::move(msg_callback), std::move(sub_callback),
+               std::move(unsub_callback), std::move(err_callback));
+  }
+
+  template <class Callback>
+  typename std::enable_if<IsSliceCallback<Callback>::value>::type
+  psubscribe(const std::vector<std::string> &topics, Callback msg_callback,
+             std::function<void(const std::string &)> sub_callback = nullptr,
+             std::function<void(const std::string &)> unsub_callback = nullptr,
+             std::function<void(const std::string &, int)> err_callback = nullptr) {
+    PubSubHandler handler;
+    handler.slice_callback = std::move(msg_callback);
+    handler.sub_callback = std::move(sub_callback);
+    handler.unsub_callback = std::move(unsub_callback);
+    handler.err_callback = std::move(err_callback);
+    subscribeBase(PubSubRequest::PSUBSCRIBE, topics, std::move(handler));
+  }
+
   /**
   * Unsubscribe from a topic.
   *
   * err_callback: invoked on some error state
   */
   void unsubscribe(const std::string topic,
+                   std::function<void(const std::string &, int)> err_callback = nullptr) {
+    unsubscribe(std::vector<std::string>{topic}, std::move(err_callback));
+  }
+
+  /**
+  * Unsubscribe from many topics with a single UNSUBSCRIBE.
+  */
+  void unsubscribe(const std::vector<std::string> &topics,
                    std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  /**
+  * Unsubscribe from all subscribed topics with a single UNSUBSCRIBE.
+  */
+  void unsubscribe() { unsubscribe(setToVector(subscribedTopics())); }
+
   /**
   * Unsubscribe from a topic with a pattern.
   *
   * err_callback: invoked on some error state
   */
   void punsubscribe(const std::string topic,
+                    std::function<void(const std::string &, int)> err_callback = nullptr) {
+    punsubscribe(std::vector<std::string>{topic}, std::move(err_callback));
+  }
+
+  /**
+  * Unsubscribe from many patterns with a single PUNSUBSCRIBE.
+  */
+  void punsubscribe(const std::vector<std::string> &topics,
                     std::function<void(const std::string &, int)> err_callback = nullptr);
 
+  /**
+  * Unsubscribe from all psubscribed patterns with a single PUNSUBSCRIBE.
+  */
+  void punsubscribe() { punsubscribe(setToVector(psubscribedTopics())); }
+
+  /**
+  * Returns the ID of the connection on the server, from CLIENT ID, or -1
+  * on error. Call before subscribing, since the connection only takes
+  * pub/sub commands once subscribed.
+  */
+  long long clientId();
+
   /**
   * Return the topics that are subscribed() to.
   */
@@ -132,16 +383,44 @@ public:
   }
 
 private:
+  typedef std::unordered_map<std::string, std::unique_ptr<PubSubHandler>> HandlerMap;
+
   // Base for subscribe and psubscribe
-  void subscribeBase(const std::string cmd_name, const std::string topic,
-                     std::function<void(const std::string &, const std::string &)> msg_callback,
-                     std::function<void(const std::string &)> sub_callback = nullptr,
-                     std::function<void(const std::string &)> unsub_callback = nullptr,
-                     std::function<void(const std::string &, int)> err_callback = nullptr);
+  void subscribeBase(PubSubRequest::Kind kind, const std::vector<std::string> &topics,
+                     PubSubHandler &&handler);
 
   // Base for unsubscribe and punsubscribe
-  void unsubscribeBase(const std::string cmd_name, const std::string topic,
-                       std::function<void(const std::string &, int)> err_callback = nullptr);
+  void unsubscribeBase(PubSubRequest::Kind kind, const std::vector<std::string> &topics,
+                       std::function<void(const std::string &, int)> err_callback);
+
+  static std::vector<std::string> setToVector(const std::set<std::string> &topics) {
+    return std::vector<std::string>(topics.begin(), topics.end());
+  }
+
+  // Queue a request on the command of this Subscriber, creating it first
+  void request(PubSubRequest &&req);
+
+  // Called on the event thread by the command. Requests are sent in
+  // order, and each is answered by a confirmation or an error in order.
+  void requestsSent(std::vector<PubSubRequest> &requests);
+  void requestsFailed(size_t count, int status);
+  void handleReply(int status, redisReply *reply);
+
+  // Hand a message to the handler for its channel or pattern
+  void deliver(HandlerMap &handlers, const redisReply *key, const redisReply *channel,
+               const redisReply *payload);
+
+  // Handle a [p]subscribe or [p]unsubscribe confirmation
+  void confirmed(PubSubRequest::Kind kind, const redisReply *topic);
+
+  // Report a failed request to its error callback
+  void failed(PubSubRequest &req, int status);
+
+  // The handlers of a kind of request
+  HandlerMap &handlersFor(PubSubRequest::Kind kind) {
+    bool channel = (kind == PubSubRequest::SUBSCRIBE || kind == PubSubRequest::UNSUBSCRIBE);
+    return channel ? channel_handlers_ : pattern_handlers_;
+  }
 
   // Underlying Redis client
   Redox rdx_;
@@ -155,18 +434,34 @@ private:
   std::set<std::string> psubscribed_topics_;
   std::mutex psubscribed_topics_guard_;
 
-  // Set of persisting commands, so that we can cancel them
-  std::set<Command<redisReply *> *> commands_;
+  // The one persisting command, created on the first request, and freed
+  // when stopping. Guarded so that it is created only once.
+  PubSubCommand *command_ = nullptr;
+  std::mutex command_guard_;
+
+  // Handlers by channel and by pattern, only used by the event thread, so
+  // routing a message is a single lookup without locking
+  HandlerMap channel_handlers_;
+  HandlerMap pattern_handlers_;
+
+  // Handlers replaced while one of their callbacks may be running, deleted
+  // on the next reply
+  std::vector<std::unique_ptr<PubSubHandler>> retired_handlers_;
+
+  // Requests sent and not yet fully confirmed, oldest first. Only the
+  // kind, topics and error callback are kept.
+  std::deque<PubSubRequest> awaiting_;
+
+  // Reused to look up handlers without allocating
+  std::string lookup_key_;
 
   // Reference to rdx_.logger_ for convenience
   log::Logger &logger_;
 
-  // CVs to wait for unsubscriptions
-  std::condition_variable cv_unsub_;
-  std::condition_variable cv_punsub_;
-
   // Pending subscriptions
   std::atomic_int num_pending_subs_ = {0};
+
+  friend class PubSubCommand;
 };
 
 } // End namespace
@@ -0,0 +1,74 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "../slice.hpp"
+
+namespace redox {
+namespace compression {
+
+/**
+* Compression of large values, see Redox::compressValues(). A compressed
+* value starts with a header of HEADER_SIZE bytes: the magic bytes
+* "\xffRZ", the codec, and the size of the original value as 32 bits in
+* little endian. Anything else is a plain value.
+*
+* The functions are thread safe, so values can also be compressed and
+* decompressed by hand on worker threads.
+*/
+
+// Codecs
+static const int NONE = 0;
+static const int LZ4 = 1;
+static const int ZSTD = 2;
+
+static const size_t HEADER_SIZE = 8;
+
+/**
+* Whether the codec was compiled in, with the CMake options 'lz4' and
+* 'zstd'.
+*/
+bool available(int codec);
+
+/**
+* Appends the header and the compressed value to out. Returns false and
+* leaves out as it was if the codec is not available or the value would
+* not shrink.
+*/
+bool compress(int codec, const Slice &value, std::string &out);
+
+/**
+* Whether the value starts with the header of a compressed value.
+*/
+bool isCompressed(const Slice &value);
+
+/**
+* Replaces the contents of out with the decompressed value, writing it
+* straight into the buffer of out. Returns false if the value is not
+* compressed, is corrupt, or uses a codec that is not available.
+*/
+bool decompress(const Slice &value, std::string &out);
+
+} // End namespace compression
+} // End namespace redox
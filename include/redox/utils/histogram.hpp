@@ -0,0 +1,100 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+
+namespace redox {
+
+/**
+* A copy of the contents of a Histogram at one point in time.
+*/
+struct HistogramSnapshot {
+
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+
+  // Count per bucket, see Histogram for the bucket layout
+  std::vector<uint64_t> buckets;
+
+  double mean() const { return (count == 0) ? 0 : (double)sum / count; }
+
+  /**
+  * Returns an estimate of the value below which the given fraction
+  * (0 to 1) of the recorded values fall, accurate to the bucket width.
+  */
+  uint64_t percentile(double fraction) const;
+};
+
+/**
+* A lock-free histogram of unsigned values with logarithmic buckets, in the
+* style of HdrHistogram. Values below 2^SUB_BITS get exact buckets, and each
+* power of two above is split into 2^SUB_BITS linear buckets, so a value is
+* placed with a relative error of at most 1 / 2^SUB_BITS over the whole
+* 64-bit range. Recording is a few relaxed atomic increments.
+*/
+class Histogram {
+
+public:
+  static const int SUB_BITS = 3;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  static const int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  Histogram();
+
+  void record(uint64_t value) {
+    buckets_[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  HistogramSnapshot snapshot() const;
+
+  static int bucketIndex(uint64_t value) {
+    if (value < (uint64_t)SUB_BUCKETS)
+      return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    int mantissa = (int)(value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return ((exponent - SUB_BITS + 1) << SUB_BITS) + mantissa;
+  }
+
+  // Smallest and largest value that fall into a bucket
+  static uint64_t bucketLow(int index);
+  static uint64_t bucketHigh(int index);
+
+private:
+  std::atomic<uint64_t> buckets_[NUM_BUCKETS];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+};
+
+} // End namespace redox
@@ -1,81 +1,168 @@
-/*
-* Simple stream-based logger for C++11.
-*
-* Adapted from
-*   http://vilipetek.com/2014/04/17/thread-safe-simple-logger-in-c11/
-*/
-
-#pragma once
-
-#include <string>
-#include <sstream>
-#include <mutex>
-#include <memory>
-#include <fstream>
-
-namespace redox {
-namespace log {
-
-// Log message levels
-enum Level {
-  Trace, Debug, Info, Warning, Error, Fatal, Off
-};
-
-// Forward declaration
-class Logger;
-
-/**
-* A class representing one log line.
-*/
-class Logstream : public std::ostringstream {
-public:
-  Logstream(Logger &logger, Level l);
-  Logstream(const Logstream &ls);
-  ~Logstream();
-private:
-  Logger &m_logger;
-  Level m_loglevel;
-};
-
-/**
-* A simple stream-based logger.
-*/
-class Logger {
-public:
-
-  Logger(std::string filename, Level loglevel = Level::Info);
-  Logger(std::ostream &outfile, Level loglevel = Level::Info);
-
-  virtual ~Logger();
-
-  void level(Level l) { m_loglevel = l; }
-  Level level() { return m_loglevel; }
-
-  void log(Level l, std::string oMessage);
-
-  Logstream operator()(Level l = Level::Info) { return Logstream(*this, l); }
-
-  // Helpers
-  Logstream trace() { return (*this)(Level::Trace); }
-  Logstream debug() { return (*this)(Level::Debug); }
-  Logstream info() { return (*this)(Level::Info); }
-  Logstream warning() { return (*this)(Level::Warning); }
-  Logstream error() { return (*this)(Level::Error); }
-  Logstream fatal() { return (*this)(Level::Fatal); }
-
-private:
-  const tm *getLocalTime();
-
-private:
-  std::mutex m_lock;
-
-  std::ofstream m_file;
-  std::ostream &m_stream;
-
-  tm m_time;
-
-  Level m_loglevel;
-};
-
-} // End namespace
-} // End namespace
+/*
+* Simple stream-based logger for C++11.
+*
+* Adapted from
+*   http://vilipetek.com/2014/04/17/thread-safe-simple-logger-in-c11/
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <sstream>
+#include <mutex>
+#include <memory>
+#include <fstream>
+#include <thread>
+
+namespace redox {
+namespace log {
+
+// Log message levels
+enum Level {
+  Trace, Debug, Info, Warning, Error, Fatal, Off
+};
+
+// Forward declaration
+class Logger;
+
+/**
+* A class representing one log line. It only builds a string if its level
+* is enabled, so disabled levels cost no formatting or allocation.
+*/
+class Logstream {
+public:
+  Logstream(Logger &logger, Level l, bool enabled);
+  Logstream(Logstream &&ls);
+  ~Logstream();
+
+  template <class T> Logstream &operator<<(const T &value) {
+    if (m_stream)
+      *m_stream << value;
+    return *this;
+  }
+
+  // For manipulators such as std::hex
+  Logstream &operator<<(std::ostream &(*manip)(std::ostream &)) {
+    if (m_stream)
+      manip(*m_stream);
+    return *this;
+  }
+
+private:
+  Logger &m_logger;
+  Level m_loglevel;
+  std::unique_ptr<std::ostringstream> m_stream;
+
+  Logstream(const Logstream &) = delete;
+  Logstream &operator=(const Logstream &) = delete;
+};
+
+/**
+* A simple stream-based logger.
+*
+* Logging never blocks the calling thread on the output stream. Lines are
+* put into a lock-free ring buffer, and a background thread, started on
+* the first line, adds timestamps, writes them out and flushes once per
+* batch. If the ring buffer is full, lines are dropped and counted, and
+* the number dropped is reported in the log. Fatal lines are flushed
+* before log() returns.
+*/
+class Logger {
+public:
+
+  // Number of lines that can be waiting to be written
+  static const size_t QUEUE_SIZE = 4096;
+
+  Logger(std::string filename, Level loglevel = Level::Info);
+  Logger(std::ostream &outfile, Level loglevel = Level::Info);
+
+  virtual ~Logger();
+
+  void level(Level l) { m_loglevel = l; }
+  Level level() { return m_loglevel; }
+
+  // True if lines of the given level are logged
+  bool enabled(Level l) const { return m_loglevel <= l; }
+
+  void log(Level l, std::string oMessage);
+
+  /**
+  * Blocks until all lines logged so far are written and flushed.
+  */
+  void flush();
+
+  /**
+  * Number of lines dropped because the ring buffer was full.
+  */
+  uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+  Logstream operator()(Level l = Level::Info) { return Logstream(*this, l, enabled(l)); }
+
+  // Helpers
+  Logstream trace() { return (*this)(Level::Trace); }
+  Logstream debug() { return (*this)(Level::Debug); }
+  Logstream info() { return (*this)(Level::Info); }
+  Logstream warning() { return (*this)(Level::Warning); }
+  Logstream error() { return (*this)(Level::Error); }
+  Logstream fatal() { return (*this)(Level::Fatal); }
+
+private:
+  // One line in the ring buffer. The sequence number tells producers and
+  // the writer thread whose turn it is (Vyukov's bounded queue).
+  struct Entry {
+    std::atomic<size_t> seq;
+    Level level;
+    time_t time;
+    std::string message;
+  };
+
+  // Reserve an entry and publish a line to it, false if the ring is full
+  bool push(Level l, time_t time, std::string &&message);
+
+  // Start the writer thread if it is not running yet
+  void start();
+
+  // Body of the writer thread
+  void runWriter();
+
+  // Write out all published lines, returns true if anything was written
+  bool drain();
+
+  // Timestamp of a line, formatted once per second
+  const std::string &timestamp(time_t time);
+
+private:
+  std::ofstream m_file;
+  std::ostream &m_stream;
+
+  Level m_loglevel;
+
+  std::unique_ptr<Entry[]> m_entries;
+  std::atomic<size_t> m_enqueue_pos = {0};
+  size_t m_dequeue_pos = 0;
+  std::atomic<uint64_t> m_dropped = {0};
+  uint64_t m_dropped_reported = 0;
+
+  // Writer thread, and the flag it sets before sleeping so producers know
+  // to wake it up
+  std::thread m_writer;
+  std::atomic_bool m_started = {false};
+  std::atomic_bool m_stop = {false};
+  std::atomic_bool m_idle = {false};
+  std::mutex m_lock;
+  std::condition_variable m_wake;
+
+  // Lines written so far, for flush()
+  std::atomic<size_t> m_written = {0};
+  std::condition_variable m_flushed;
+
+  time_t m_last_time = 0;
+  std::string m_last_timestamp;
+};
+
+} // End namespace
+} // End namespace
@@ -0,0 +1,125 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <atomic>
+
+namespace redox {
+
+/**
+* Intrusive link for objects that can be put into an MPSCQueue. An object
+* can be in at most one queue at a time.
+*/
+struct MPSCNode {
+  std::atomic<MPSCNode *> mpsc_next_ = {nullptr};
+};
+
+/**
+* Unbounded, lock-free, multi-producer/single-consumer FIFO queue of
+* intrusive nodes (Vyukov's algorithm). Any thread may push(), but only
+* one thread at a time may pop().
+*
+* The queue also tracks whether the consumer needs to be woken up, so
+* that producers only signal it on the first push after the consumer
+* started draining, instead of on every push.
+*/
+class MPSCQueue {
+
+public:
+  MPSCQueue() : head_(&stub_), tail_(&stub_) {}
+
+  /**
+  * Appends a node to the queue. Returns true if this is the first push
+  * since the last call to rearm(), meaning the caller must wake up the
+  * consumer.
+  */
+  bool push(MPSCNode *node) {
+    link(node);
+    return !signaled_.exchange(true);
+  }
+
+  /**
+  * Removes and returns the node at the front of the queue, or nullptr if
+  * the queue is empty. Consumer only. May spuriously return nullptr while
+  * a producer is in the middle of a push, in which case that producer is
+  * guaranteed to signal the consumer again.
+  */
+  MPSCNode *pop() {
+
+    MPSCNode *tail = tail_;
+    MPSCNode *next = tail->mpsc_next_.load(std::memory_order_acquire);
+
+    if (tail == &stub_) {
+      if (next == nullptr)
+        return nullptr;
+      tail_ = next;
+      tail = next;
+      next = next->mpsc_next_.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      tail_ = next;
+      return tail;
+    }
+
+    // A producer has swapped the head but not yet linked its node
+    if (tail != head_.load(std::memory_order_acquire))
+      return nullptr;
+
+    // Tail is the last real node, put the stub behind it so it can be popped
+    link(&stub_);
+
+    next = tail->mpsc_next_.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail_ = next;
+      return tail;
+    }
+
+    return nullptr;
+  }
+
+  /**
+  * Called by the consumer when it wakes up, before draining the queue.
+  * The next push() will then report that the consumer needs a signal.
+  */
+  void rearm() { signaled_.store(false); }
+
+private:
+  void link(MPSCNode *node) {
+    node->mpsc_next_.store(nullptr, std::memory_order_relaxed);
+    MPSCNode *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->mpsc_next_.store(node, std::memory_order_release);
+  }
+
+  // Written by producers
+  std::atomic<MPSCNode *> head_;
+  std::atomic_bool signaled_ = {false};
+  char pad_[64];
+
+  // Owned by the consumer
+  MPSCNode *tail_;
+  MPSCNode stub_;
+
+  MPSCQueue(const MPSCQueue &) = delete;
+  MPSCQueue &operator=(const MPSCQueue &) = delete;
+};
+
+} // End namespace redox
@@ -0,0 +1,108 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+#include "../slice.hpp"
+
+namespace redox {
+namespace resp {
+
+/**
+* Encoding of commands in the Redis protocol: *<argc>, then $<len> and the
+* bytes of each argument, every part followed by CRLF. Arguments are
+* Slices, or anything that converts to one, and integers, which are sent
+* in decimal.
+*/
+
+// Write the decimal digits of n to the end of a buffer of at least 20
+// chars, and return where they start
+inline char *formatDecimal(char *end, unsigned long long n) {
+  do {
+    *--end = (char)('0' + n % 10);
+    n /= 10;
+  } while (n != 0);
+  return end;
+}
+
+// Append a prefix character, a decimal number and CRLF, like *3 or $5
+inline void appendHeader(std::string &buf, char prefix, size_t n) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *start = formatDecimal(end, n);
+  buf += prefix;
+  buf.append(start, end - start);
+  buf.append("\r\n", 2);
+}
+
+inline void appendArg(std::string &buf, const Slice &arg) {
+  appendHeader(buf, '$', arg.size());
+  buf.append(arg.data(), arg.size());
+  buf.append("\r\n", 2);
+}
+
+template <class T>
+inline typename std::enable_if<std::is_integral<T>::value>::type appendArg(std::string &buf,
+                                                                            T value) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  bool negative = (value < 0);
+  unsigned long long n =
+      negative ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+  char *start = formatDecimal(end, n);
+  if (negative)
+    *--start = '-';
+  appendArg(buf, Slice(start, end - start));
+}
+
+inline void appendArgs(std::string &buf) {}
+
+template <class T, class... Rest>
+inline void appendArgs(std::string &buf, const T &first, const Rest &... rest) {
+  appendArg(buf, first);
+  appendArgs(buf, rest...);
+}
+
+/**
+* Appends a command given as an array of arguments.
+*/
+template <class ArgT> void appendCommand(std::string &buf, const ArgT *args, size_t argc) {
+  appendHeader(buf, '*', argc);
+  for (size_t i = 0; i < argc; i++)
+    appendArg(buf, Slice(args[i].data(), args[i].size()));
+}
+
+/**
+* Appends a command given by a spec from redox::cmd, whose header is
+* encoded at compile time, followed by its arguments.
+*/
+template <class Spec, class... Args> void appendCommand(std::string &buf, const Args &... args) {
+  static_assert(sizeof...(Args) == Spec::ARGS, "Wrong number of arguments for this command");
+  Slice header = Spec::header();
+  buf.append(header.data(), header.size());
+  appendArgs(buf, args...);
+}
+
+} // End namespace resp
+} // End namespace redox
@@ -0,0 +1,135 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace redox {
+
+/**
+* A table of object pointers indexed by generation-tagged slot IDs. An ID
+* packs the slot index in its low half and the generation of the slot in
+* its high half, so lookups are a bounds check plus an array access, and
+* an ID whose object was removed never resolves to a newer object that
+* reuses the slot. IDs fit into a void*, and 0 is never a valid ID.
+*
+* Not thread-safe.
+*/
+template <class T> class SlotTable {
+
+public:
+  typedef uintptr_t Id;
+
+  /**
+  * Inserts an object and returns its ID.
+  */
+  Id add(T *obj) {
+
+    uintptr_t index;
+    if (free_head_ != NONE) {
+      index = free_head_;
+      free_head_ = slots_[index].next_free;
+    } else {
+      index = slots_.size();
+      slots_.push_back(Slot());
+    }
+
+    Slot &slot = slots_[index];
+    slot.obj = obj;
+    size_++;
+
+    return (slot.generation << INDEX_BITS) | index;
+  }
+
+  /**
+  * Returns the object with the given ID, or nullptr if it was removed.
+  */
+  T *get(Id id) const {
+    uintptr_t index = id & INDEX_MASK;
+    if (index >= slots_.size())
+      return nullptr;
+
+    const Slot &slot = slots_[index];
+    if (slot.obj == nullptr || slot.generation != (id >> INDEX_BITS))
+      return nullptr;
+    return slot.obj;
+  }
+
+  /**
+  * Removes the object with the given ID. Returns false if there was none.
+  */
+  bool remove(Id id) {
+    if (get(id) == nullptr)
+      return false;
+
+    uintptr_t index = id & INDEX_MASK;
+    Slot &slot = slots_[index];
+    slot.obj = nullptr;
+    slot.generation = (slot.generation + 1) & GENERATION_MASK;
+    if (slot.generation == 0)
+      slot.generation = 1;
+    slot.next_free = free_head_;
+    free_head_ = index;
+    size_--;
+
+    return true;
+  }
+
+  /**
+  * Invokes func on every object in the table.
+  */
+  template <class Func> void forEach(Func func) const {
+    for (const Slot &slot : slots_)
+      if (slot.obj != nullptr)
+        func(slot.obj);
+  }
+
+  /**
+  * Removes all objects, without invalidating outstanding IDs.
+  */
+  void clear() {
+    for (uintptr_t index = 0; index < slots_.size(); index++)
+      if (slots_[index].obj != nullptr)
+        remove((slots_[index].generation << INDEX_BITS) | index);
+  }
+
+  size_t size() const { return size_; }
+
+private:
+  static const int INDEX_BITS = sizeof(Id) * 4;
+  static const uintptr_t INDEX_MASK = (uintptr_t(1) << INDEX_BITS) - 1;
+  static const uintptr_t GENERATION_MASK = INDEX_MASK;
+  static const uintptr_t NONE = INDEX_MASK;
+
+  struct Slot {
+    T *obj = nullptr;
+    uintptr_t generation = 1;
+    uintptr_t next_free = NONE;
+  };
+
+  std::vector<Slot> slots_;
+  uintptr_t free_head_ = NONE;
+  size_t size_ = 0;
+};
+
+} // End namespace redox
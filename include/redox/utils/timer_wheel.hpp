@@ -0,0 +1,158 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace redox {
+
+/**
+* Intrusive link for objects that can be put into a TimerWheel. An object
+* can be in at most one wheel at a time.
+*/
+struct TimerNode {
+  TimerNode *timer_prev_ = nullptr;
+  TimerNode *timer_next_ = nullptr;
+  int64_t deadline_ = 0;
+};
+
+/**
+* A hashed timing wheel of intrusive nodes with deadlines. Time is split
+* into ticks of a fixed resolution, and a node goes into the bucket of the
+* tick of its deadline, modulo the number of buckets. Adding and removing
+* a node is constant time, and advancing the wheel only looks at the
+* buckets of the ticks passed since. Deadlines further out than one turn
+* of the wheel share buckets with nearer ones, and are skipped until due.
+*
+* Deadlines and times are in any unit, as long as it is the same as the
+* resolution. Not thread-safe.
+*/
+class TimerWheel {
+
+public:
+  /**
+  * The number of buckets is rounded up to a power of two.
+  */
+  TimerWheel(int64_t resolution, size_t num_buckets) : resolution_(resolution) {
+    size_t n = 1;
+    while (n < num_buckets)
+      n <<= 1;
+    buckets_.resize(n);
+    for (TimerNode &head : buckets_)
+      head.timer_prev_ = head.timer_next_ = &head;
+    mask_ = n - 1;
+  }
+
+  /**
+  * Adds a node that is not in the wheel. Deadlines already passed expire
+  * on the next call to expire().
+  */
+  void add(TimerNode *node, int64_t deadline) {
+    node->deadline_ = deadline;
+    int64_t tick = deadline / resolution_;
+    if (tick < current_)
+      tick = current_;
+    link(&buckets_[tick & mask_], node);
+    size_++;
+  }
+
+  /**
+  * Removes a node if it is in the wheel.
+  */
+  void remove(TimerNode *node) {
+    if (node->timer_prev_ == nullptr)
+      return;
+    unlink(node);
+    size_--;
+  }
+
+  /**
+  * Removes every node whose deadline is at or before now, then passes
+  * them to func one by one, which may add or remove other nodes.
+  */
+  template <class Func> void expire(int64_t now, Func func) {
+
+    TimerNode expired;
+    expired.timer_prev_ = expired.timer_next_ = &expired;
+
+    // Past one turn of the wheel, every bucket has been visited
+    int64_t tick = now / resolution_;
+    int64_t last = (tick - current_ < (int64_t)buckets_.size())
+                       ? tick
+                       : current_ + (int64_t)buckets_.size() - 1;
+
+    for (int64_t t = current_; t <= last; t++) {
+      TimerNode *head = &buckets_[t & mask_];
+      for (TimerNode *node = head->timer_next_; node != head;) {
+        TimerNode *next = node->timer_next_;
+        if (node->deadline_ <= now) {
+          unlink(node);
+          link(&expired, node);
+          size_--;
+        }
+        node = next;
+      }
+    }
+
+    // The bucket of the current tick is visited again next time, for
+    // deadlines later in the tick
+    if (tick > current_)
+      current_ = tick;
+
+    while (expired.timer_next_ != &expired) {
+      TimerNode *node = expired.timer_next_;
+      unlink(node);
+      func(node);
+    }
+  }
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+private:
+  static void link(TimerNode *head, TimerNode *node) {
+    node->timer_prev_ = head->timer_prev_;
+    node->timer_next_ = head;
+    head->timer_prev_->timer_next_ = node;
+    head->timer_prev_ = node;
+  }
+
+  static void unlink(TimerNode *node) {
+    node->timer_prev_->timer_next_ = node->timer_next_;
+    node->timer_next_->timer_prev_ = node->timer_prev_;
+    node->timer_prev_ = node->timer_next_ = nullptr;
+  }
+
+  const int64_t resolution_;
+  std::vector<TimerNode> buckets_;
+  size_t mask_ = 0;
+  size_t size_ = 0;
+
+  // Tick of the last call to expire()
+  int64_t current_ = 0;
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+};
+
+} // End namespace redox
@@ -0,0 +1,80 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace redox {
+
+/**
+* A fixed set of threads that run tasks in the order they are submitted,
+* for Redox::replyExecutor(). Tasks are taken by whichever thread is free,
+* so two of them can run at the same time.
+*/
+class WorkerPool {
+
+public:
+  /**
+  * Starts [num_threads] threads, or as many as there are cores if 0.
+  */
+  explicit WorkerPool(size_t num_threads = 0);
+
+  /**
+  * Runs the tasks still queued, then stops the threads.
+  */
+  ~WorkerPool();
+
+  /**
+  * Queues a task to run on one of the threads. Thread safe.
+  */
+  void execute(std::function<void()> task);
+
+  /**
+  * Returns an executor that queues tasks on this pool, to pass to
+  * Redox::replyExecutor(). The pool must outlive the clients using it.
+  */
+  std::function<void(std::function<void()>)> executor();
+
+  /**
+  * Number of threads.
+  */
+  size_t size() const { return threads_.size(); }
+
+private:
+  // Run tasks until stopped and none are left
+  void work();
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex guard_;
+  std::condition_variable waiter_;
+  bool stopping_ = false;
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+};
+
+} // End namespace redox
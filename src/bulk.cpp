@@ -0,0 +1,195 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "bulk.hpp"
+
+using namespace std;
+
+namespace redox {
+
+BulkChunk *BulkChunk::create(BulkLoader *loader, Redox *rdx) {
+  if (!rdx->getRunning()) {
+    throw runtime_error("[ERROR] Need to connect Redox before running commands!");
+  }
+  return new BulkChunk(loader, rdx);
+}
+
+BulkChunk::BulkChunk(BulkLoader *loader, Redox *rdx)
+    : CommandBase(rdx, rdx->nextCommandId(), 0, 0, true, rdx->logger_), loader_(loader) {
+  encoded_ = true;
+  buffer_.reserve(loader->chunk_bytes_ + (loader->chunk_bytes_ >> 3));
+  rdx->commands_allocated_++;
+}
+
+void BulkChunk::add(const Slice *args, size_t argc) {
+  size_t start = buffer_.size();
+  resp::appendCommand(buffer_, args, argc);
+  argvlen_.push_back(buffer_.size() - start);
+}
+
+void BulkChunk::add(const vector<string> &args) {
+  size_t start = buffer_.size();
+  resp::appendCommand(buffer_, args.data(), args.size());
+  argvlen_.push_back(buffer_.size() - start);
+}
+
+void BulkChunk::send() {
+
+  // The buffer does not move from here on
+  argv_.reserve(argvlen_.size());
+  arg_offsets_.reserve(argvlen_.size() + 1);
+  const char *p = buffer_.data();
+  for (size_t i = 0; i < argvlen_.size(); i++) {
+    argv_.push_back(p);
+    arg_offsets_.push_back(i);
+    p += argvlen_[i];
+  }
+  arg_offsets_.push_back(argvlen_.size());
+
+  enqueue();
+}
+
+void BulkChunk::processReply(redisReply *r) {
+
+  if (r == nullptr) {
+    errors_++;
+    if (first_error_.empty())
+      first_error_ = "Received null redisReply* from hiredis.";
+  } else {
+    replies_++;
+    if (r->type == REDIS_REPLY_ERROR) {
+      errors_++;
+      if (first_error_.empty())
+        first_error_.assign(r->str, r->len);
+    }
+    freeReplyObject(r);
+  }
+
+  pending_--;
+  if (pending_ == 0)
+    finish();
+}
+
+void BulkChunk::sendFailed(size_t index) {
+
+  errors_ += size() - index;
+  if (first_error_.empty())
+    first_error_ = "Could not send to server.";
+
+  if (pending_ == 0)
+    finish();
+}
+
+void BulkChunk::finish() {
+  loader_->chunkDone(buffer_.size(), replies_, errors_, first_error_);
+  free();
+}
+
+BulkLoader::BulkLoader(Redox &rdx, size_t chunk_bytes, size_t max_in_flight)
+    : rdx_(rdx), chunk_bytes_(chunk_bytes), max_in_flight_(max_in_flight) {}
+
+BulkLoader::~BulkLoader() { finish(); }
+
+void BulkLoader::add(initializer_list<Slice> cmd) {
+  chunk().add(cmd.begin(), cmd.size());
+  commands_++;
+  flushIfFull();
+}
+
+void BulkLoader::add(const vector<string> &cmd) {
+  chunk().add(cmd);
+  commands_++;
+  flushIfFull();
+}
+
+BulkChunk &BulkLoader::chunk() {
+  if (current_ == nullptr)
+    current_ = BulkChunk::create(this, &rdx_);
+  return *current_;
+}
+
+void BulkLoader::flushIfFull() {
+  if (current_->bytes() >= chunk_bytes_)
+    flush();
+}
+
+void BulkLoader::flush() {
+
+  if (current_ == nullptr)
+    return;
+
+  // The replies that make room could never arrive while the event thread
+  // is blocked here
+  if (rdx_.onLoopThread())
+    throw runtime_error("[ERROR] Cannot block on a bulk load from the event loop thread!");
+
+  BulkChunk *c = current_;
+  current_ = nullptr;
+  size_t bytes = c->bytes();
+
+  {
+    // A chunk larger than the limit is still sent once nothing else is
+    unique_lock<mutex> ul(guard_);
+    waiter_.wait(ul, [this, bytes] {
+      return (in_flight_chunks_ == 0) || (in_flight_bytes_ + bytes <= max_in_flight_);
+    });
+    in_flight_chunks_++;
+    in_flight_bytes_ += bytes;
+  }
+
+  c->send();
+}
+
+bool BulkLoader::finish() {
+
+  flush();
+
+  unique_lock<mutex> ul(guard_);
+  waiter_.wait(ul, [this] { return in_flight_chunks_ == 0; });
+  return errors_ == 0;
+}
+
+uint64_t BulkLoader::replies() {
+  lock_guard<mutex> lg(guard_);
+  return replies_;
+}
+
+uint64_t BulkLoader::errors() {
+  lock_guard<mutex> lg(guard_);
+  return errors_;
+}
+
+string BulkLoader::lastError() {
+  lock_guard<mutex> lg(guard_);
+  return last_error_;
+}
+
+void BulkLoader::chunkDone(size_t bytes, uint64_t replies, uint64_t errors, const string &error) {
+  lock_guard<mutex> lg(guard_);
+  in_flight_chunks_--;
+  in_flight_bytes_ -= bytes;
+  replies_ += replies;
+  errors_ += errors;
+  if (last_error_.empty())
+    last_error_ = error;
+  waiter_.notify_all();
+}
+
+} // End namespace redox
@@ -0,0 +1,176 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "cache.hpp"
+#include "utils/hash.hpp"
+
+using namespace std;
+
+namespace redox {
+
+const size_t ClientCache::ENTRY_OVERHEAD;
+
+ClientCache::ClientCache(size_t max_bytes, size_t num_shards)
+    : shards_(num_shards > 0 ? num_shards : 1), shard_max_bytes_(max_bytes / shards_.size()) {}
+
+ClientCache::Shard &ClientCache::shardFor(const Slice &key) {
+  return shards_[hashBytes(key.data(), key.size()) % shards_.size()];
+}
+
+void ClientCache::erase(Shard &shard, list<Entry>::iterator it) {
+  shard.bytes -= it->key.size() + it->value.size() + ENTRY_OVERHEAD;
+  shard.index.erase(it->key);
+  shard.lru.erase(it);
+}
+
+bool ClientCache::lookup(const Slice &key, string &value) {
+
+  if (!enabled_) {
+    misses_.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+
+  Shard &shard = shardFor(key);
+  lock_guard<mutex> lg(shard.lock);
+
+  shard.lookup_key.assign(key.data(), key.size());
+  auto it = shard.index.find(shard.lookup_key);
+  if (it == shard.index.end()) {
+    misses_.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  value = it->second->value;
+  hits_.fetch_add(1, memory_order_relaxed);
+  return true;
+}
+
+uint64_t ClientCache::reserve(const Slice &key) {
+
+  if (!enabled_)
+    return 0;
+
+  uint64_t token = next_token_.fetch_add(1, memory_order_relaxed);
+
+  Shard &shard = shardFor(key);
+  lock_guard<mutex> lg(shard.lock);
+  shard.pending[key.str()] = token;
+  return token;
+}
+
+void ClientCache::fill(const Slice &key, uint64_t token, const string &value) {
+
+  if (token == 0)
+    return;
+
+  Shard &shard = shardFor(key);
+  lock_guard<mutex> lg(shard.lock);
+
+  shard.lookup_key.assign(key.data(), key.size());
+  auto p = shard.pending.find(shard.lookup_key);
+  if ((p == shard.pending.end()) || (p->second != token))
+    return;
+  shard.pending.erase(p);
+
+  // Checked under the lock, since disable() clears the shards with it
+  if (!enabled_)
+    return;
+
+  size_t size = key.size() + value.size() + ENTRY_OVERHEAD;
+  if (size > shard_max_bytes_)
+    return;
+
+  auto it = shard.index.find(shard.lookup_key);
+  if (it != shard.index.end())
+    erase(shard, it->second);
+
+  shard.lru.push_front(Entry{shard.lookup_key, value});
+  shard.index[shard.lookup_key] = shard.lru.begin();
+  shard.bytes += size;
+
+  while (shard.bytes > shard_max_bytes_) {
+    erase(shard, std::prev(shard.lru.end()));
+    evictions_.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+void ClientCache::release(const Slice &key, uint64_t token) {
+
+  if (token == 0)
+    return;
+
+  Shard &shard = shardFor(key);
+  lock_guard<mutex> lg(shard.lock);
+
+  shard.lookup_key.assign(key.data(), key.size());
+  auto p = shard.pending.find(shard.lookup_key);
+  if ((p != shard.pending.end()) && (p->second == token))
+    shard.pending.erase(p);
+}
+
+void ClientCache::invalidate(const Slice &key) {
+
+  Shard &shard = shardFor(key);
+  lock_guard<mutex> lg(shard.lock);
+
+  shard.lookup_key.assign(key.data(), key.size());
+  shard.pending.erase(shard.lookup_key);
+
+  auto it = shard.index.find(shard.lookup_key);
+  if (it != shard.index.end()) {
+    erase(shard, it->second);
+    invalidations_.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+void ClientCache::clear() {
+  for (Shard &shard : shards_) {
+    lock_guard<mutex> lg(shard.lock);
+    invalidations_.fetch_add(shard.lru.size(), memory_order_relaxed);
+    shard.lru.clear();
+    shard.index.clear();
+    shard.pending.clear();
+    shard.bytes = 0;
+  }
+}
+
+void ClientCache::disable() {
+  enabled_ = false;
+  clear();
+}
+
+CacheStats ClientCache::stats() {
+
+  CacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.invalidations = invalidations_;
+  stats.evictions = evictions_;
+
+  for (Shard &shard : shards_) {
+    lock_guard<mutex> lg(shard.lock);
+    stats.entries += shard.lru.size();
+    stats.bytes += shard.bytes;
+  }
+  return stats;
+}
+
+} // End namespace redox
@@ -20,12 +20,29 @@
 
 #include <signal.h>
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <cctype>
+#include <chrono>
+#include <future>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "client.hpp"
+#include "subscriber.hpp"
 
 using namespace std;
 
 namespace {
 
+// Longest wait for the invalidation connection to subscribe, in seconds,
+// unless commands have a longer default timeout
+const double CACHE_SUBSCRIBE_TIMEOUT = 5;
+
 template<typename tev, typename tcb>
 void redox_ev_async_init(tev ev, tcb cb)
 {
@@ -44,12 +61,148 @@ void redox_ev_timer_init(ttimer timer, tcb cb, tafter after, trepeat repeat)
 #pragma GCC diagnostic pop
 }
 
+// Steady clock time in nanoseconds, for statistics
+int64_t nowNs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Number of decimal digits in a length or integer of the Redis protocol
+size_t numDigits(long long n) {
+  size_t digits = (n < 0) ? 2 : 1;
+  unsigned long long u = (n < 0) ? -(unsigned long long)n : (unsigned long long)n;
+  while (u >= 10) {
+    u /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+// Size of a command in the Redis protocol, as hiredis formats it
+size_t commandSize(size_t argc, const char *const *argv, const size_t *argvlen) {
+  size_t size = 1 + numDigits(argc) + 2;
+  for (size_t i = 0; i < argc; i++)
+    size += 1 + numDigits(argvlen[i]) + 2 + argvlen[i] + 2;
+  return size;
+}
+
+// Size of a reply in the Redis protocol, as the server sent it
+size_t replySize(const redisReply *r) {
+  switch (r->type) {
+  case REDIS_REPLY_STRING:
+    return 1 + numDigits(r->len) + 2 + r->len + 2;
+  case REDIS_REPLY_STATUS:
+  case REDIS_REPLY_ERROR:
+    return 1 + r->len + 2;
+  case REDIS_REPLY_INTEGER:
+    return 1 + numDigits(r->integer) + 2;
+  case REDIS_REPLY_ARRAY: {
+    size_t size = 1 + numDigits(r->elements) + 2;
+    for (size_t i = 0; i < r->elements; i++)
+      size += replySize(r->element[i]);
+    return size;
+  }
+  default:
+    return 5;
+  }
+}
+
+// Read-only commands whose replies can be shared by identical requests
+bool isCoalescableRead(const char *name, size_t len) {
+  static const char *const reads[] = {
+      "GET",    "MGET",      "STRLEN",   "GETRANGE",      "EXISTS",  "TYPE",
+      "HGET",   "HMGET",     "HGETALL",  "HKEYS",         "HVALS",   "HLEN",   "HEXISTS",
+      "LRANGE", "LLEN",      "LINDEX",   "SMEMBERS",      "SCARD",   "SISMEMBER",
+      "ZRANGE", "ZREVRANGE", "ZSCORE",   "ZRANGEBYSCORE", "ZCARD",   "ZRANK",  "ZCOUNT",
+      "PFCOUNT"};
+  for (const char *read : reads) {
+    if ((strlen(read) == len) && (strncasecmp(read, name, len) == 0))
+      return true;
+  }
+  return false;
+}
+
+// Commands that have the same effect when run twice, for replay
+bool isIdempotent(const char *name, size_t len) {
+  static const char *const writes[] = {
+      "SET",  "DEL",  "UNLINK", "HSET", "HMSET",    "HDEL",      "SADD",    "SREM",
+      "ZADD", "ZREM", "EXPIRE", "PEXPIRE", "EXPIREAT", "PEXPIREAT", "PERSIST"};
+  if (isCoalescableRead(name, len))
+    return true;
+  for (const char *write : writes) {
+    if ((strlen(write) == len) && (strncasecmp(write, name, len) == 0))
+      return true;
+  }
+  return false;
+}
+
+bool isOneOf(const redox::Slice &name, std::initializer_list<const char *> names) {
+  for (const char *n : names) {
+    if ((strlen(n) == name.size()) && (strncasecmp(n, name.data(), name.size()) == 0))
+      return true;
+  }
+  return false;
+}
+
+// The arguments of the index-th command that are keys it may change, as
+// positions [first, last) taken every step. Commands not known to take
+// several keys are taken to change the one after their name.
+struct KeyRange {
+  size_t first = 1;
+  size_t last = 1;
+  size_t step = 1;
+};
+
+KeyRange writtenKeys(const redox::CommandBase *c, size_t index) {
+
+  KeyRange keys;
+  redox::Slice name = c->arg(index, 0);
+  size_t argc = c->numArgs(index);
+
+  if (isOneOf(name, {"DEL", "UNLINK"})) {
+    keys.last = argc;
+  } else if (isOneOf(name, {"MSET", "MSETNX"})) {
+    keys.last = argc;
+    keys.step = 2;
+  } else if (isOneOf(name, {"RENAME", "RENAMENX", "COPY", "SMOVE", "LMOVE", "BLMOVE",
+                            "RPOPLPUSH", "BRPOPLPUSH"})) {
+    keys.last = min<size_t>(argc, 3);
+  } else if (isOneOf(name, {"BLPOP", "BRPOP", "BZPOPMIN", "BZPOPMAX"})) {
+    keys.last = (argc > 1) ? argc - 1 : 1;
+  } else if (isOneOf(name, {"EVAL", "EVALSHA", "FCALL"})) {
+
+    // EVAL script numkeys key...
+    if (argc > 2) {
+      size_t numkeys = strtoul(c->arg(index, 2).str().c_str(), nullptr, 10);
+      keys.first = 3;
+      keys.last = (numkeys < argc - 3) ? 3 + numkeys : argc;
+    }
+  } else {
+    keys.last = min<size_t>(argc, 2);
+  }
+  return keys;
+}
+
+// Raise a high-water mark to the given value, if it is higher
+void raiseHighWater(std::atomic_long &high_water, long value) {
+  long current = high_water;
+  while (value > current && !high_water.compare_exchange_weak(current, value)) {
+  }
+}
+
 } // anonymous
 
 namespace redox {
 
+const size_t Redox::MAX_LATENCY_NAMES;
+const int64_t Redox::TIMEOUT_RESOLUTION_NS;
+const size_t Redox::TIMEOUT_BUCKETS;
+
 Redox::Redox(ostream &log_stream, log::Level log_level)
-    : logger_(log_stream, log_level), evloop_(nullptr) {}
+    : logger_(log_stream, log_level), log_stream_(log_stream), evloop_(nullptr) {
+  for (auto &pool : command_pools_)
+    pool = nullptr;
+}
 
 bool Redox::connect(const string &host, const int port,
                     function<void(int)> connection_callback) {
@@ -67,20 +220,7 @@ bool Redox::connect(const string &host, const int port,
   if (!initHiredis())
     return false;
 
-  event_loop_thread_ = thread([this] { runEventLoop(); });
-
-  // Block until connected and running the event loop, or until
-  // a connection error happens and the event loop exits
-  {
-    unique_lock<mutex> ul(running_lock_);
-    running_waiter_.wait(ul, [this] {
-      lock_guard<mutex> lg(connect_lock_);
-      return running_ || connect_state_ == CONNECT_ERROR;
-    });
-  }
-
-  // Return if succeeded
-  return getConnectState() == CONNECTED;
+  return startEventLoop();
 }
 
 bool Redox::connectUnix(const string &path, function<void(int)> connection_callback) {
@@ -97,6 +237,19 @@ bool Redox::connectUnix(const string &path, function<void(int)> connection_callb
   if (!initHiredis())
     return false;
 
+  return startEventLoop();
+}
+
+bool Redox::startEventLoop() {
+
+  // On the caller's loop, the connection completes as the loop runs
+  if (external_loop_) {
+    loop_thread_ = this_thread::get_id();
+    startWatchers();
+    setRunning(true);
+    return true;
+  }
+
   event_loop_thread_ = thread([this] { runEventLoop(); });
 
   // Block until connected and running the event loop, or until
@@ -113,8 +266,18 @@ bool Redox::connectUnix(const string &path, function<void(int)> connection_callb
   return getConnectState() == CONNECTED;
 }
 
+void Redox::attachEventLoop(struct ev_loop *loop) {
+  evloop_ = loop;
+  external_loop_ = (loop != nullptr);
+}
+
 void Redox::disconnect() {
   stop();
+
+  // The shutdown on the caller's loop runs once this callback returns
+  if (external_loop_ && onLoopThread())
+    return;
+
   wait();
 }
 
@@ -125,37 +288,66 @@ void Redox::stop() {
 }
 
 void Redox::wait() {
+
+  if (external_loop_ && onLoopThread() && !getExited())
+    throw runtime_error("[ERROR] Cannot wait for Redox to stop from its event loop thread!");
+
   unique_lock<mutex> ul(exit_lock_);
   exit_waiter_.wait(ul, [this] { return exited_; });
 }
 
 Redox::~Redox() {
 
-  // Bring down the event loop
+  // Bring down the event loop. On the caller's loop thread, the loop is
+  // not running while we are here, so detach right away.
   if (getRunning()) {
-    stop();
+    if (external_loop_ && onLoopThread()) {
+      detachEventLoop();
+    } else {
+      stop();
+      if (external_loop_)
+        wait();
+    }
   }
 
   if (event_loop_thread_.joinable())
     event_loop_thread_.join();
 
-  if (evloop_ != nullptr)
+  if (evloop_ != nullptr && !external_loop_)
     ev_loop_destroy(evloop_);
+
+  for (auto &pool : command_pools_)
+    delete pool.load();
 }
 
 void Redox::connectedCallback(const redisAsyncContext *ctx, int status) {
   Redox *rdx = (Redox *)ctx->data;
 
   if (status != REDIS_OK) {
+
+    // hiredis frees the context, try again with a fresh one
+    if (rdx->reconnecting_) {
+      rdx->logger_.warning() << "Could not reconnect to Redis: " << ctx->errstr;
+      rdx->ctx_ = nullptr;
+      rdx->scheduleReconnect();
+      return;
+    }
+
     rdx->logger_.fatal() << "Could not connect to Redis: " << ctx->errstr;
     rdx->logger_.fatal() << "Status: " << status;
     rdx->setConnectState(CONNECT_ERROR);
 
+    // Nothing else will shut down on the caller's loop
+    if (rdx->external_loop_)
+      rdx->stop();
+
   } else {
     rdx->logger_.info() << "Connected to Redis.";
     // Disable hiredis automatically freeing reply objects
     ctx->c.reader->fn->freeObject = [](void *reply) {};
     rdx->setConnectState(CONNECTED);
+    if (rdx->reconnecting_)
+      rdx->reconnected();
   }
 
   if (rdx->user_connection_callback_) {
@@ -164,25 +356,152 @@ void Redox::connectedCallback(const redisAsyncContext *ctx, int status) {
 }
 
 void Redox::disconnectedCallback(const redisAsyncContext *ctx, int status) {
-
   Redox *rdx = (Redox *)ctx->data;
+  rdx->connectionLost(status, ctx->errstr);
+}
+
+void Redox::connectionLost(int status, const char *error) {
+
+  // The first sign of a lost connection starts reconnecting, and the
+  // null replies and callback hiredis still delivers for it are ignored
+  if (reconnecting_)
+    return;
 
   if (status != REDIS_OK) {
-    rdx->logger_.error() << "Disconnected from Redis on error: " << ctx->errstr;
-    rdx->setConnectState(DISCONNECT_ERROR);
+    logger_.error() << "Disconnected from Redis on error: " << error;
+    setConnectState(DISCONNECT_ERROR);
   } else {
-    rdx->logger_.info() << "Disconnected from Redis as planned.";
-    rdx->setConnectState(DISCONNECTED);
+    logger_.info() << "Disconnected from Redis as planned.";
+    setConnectState(DISCONNECTED);
   }
 
-  rdx->stop();
-  if (rdx->user_connection_callback_) {
-    rdx->user_connection_callback_(rdx->getConnectState());
+  // Invalidations sent while disconnected are lost
+  ClientCache *cache = cache_.load(memory_order_acquire);
+  if (cache != nullptr)
+    cache->disable();
+
+  if ((status != REDIS_OK) && (reconnect_min_delay_ > 0) && !to_exit_) {
+    // hiredis frees the context once its callbacks return
+    reconnecting_ = true;
+    reconnect_attempts_ = 0;
+    ctx_ = nullptr;
+    scheduleReconnect();
+  } else {
+    stop();
+  }
+
+  if (user_connection_callback_) {
+    user_connection_callback_(getConnectState());
   }
 }
 
+void Redox::scheduleReconnect() {
+
+  if (to_exit_)
+    return;
+
+  double delay = reconnect_min_delay_;
+  for (int i = 0; (i < reconnect_attempts_) && (delay < reconnect_max_delay_); i++)
+    delay *= 2;
+  delay = std::min(delay, reconnect_max_delay_);
+
+  redox_ev_timer_init(&reconnect_timer_, reconnectCallback, delay, 0.0);
+  reconnect_timer_.data = (void *)this;
+  ev_timer_start(evloop_, &reconnect_timer_);
+}
+
+void Redox::reconnectCallback(struct ev_loop *loop, ev_timer *timer, int revents) {
+
+  Redox *rdx = (Redox *)timer->data;
+  rdx->reconnect_attempts_++;
+  rdx->logger_.info() << "Reconnecting to Redis, attempt " << rdx->reconnect_attempts_ << ".";
+
+  if (rdx->path_.empty())
+    rdx->ctx_ = redisAsyncConnect(rdx->host_.c_str(), rdx->port_);
+  else
+    rdx->ctx_ = redisAsyncConnectUnix(rdx->path_.c_str());
+
+  // The connection completes in connectedCallback
+  if (!rdx->ctx_->err && rdx->initHiredis())
+    return;
+
+  rdx->logger_.warning() << "Could not reconnect to Redis: " << rdx->ctx_->errstr;
+  redisAsyncFree(rdx->ctx_);
+  rdx->ctx_ = nullptr;
+  rdx->scheduleReconnect();
+}
+
+void Redox::reconnected() {
+
+  logger_.info() << "Reconnected to Redis after " << reconnect_attempts_ << " attempts.";
+  reconnecting_ = false;
+
+  // Commands sent before the connection dropped go first
+  vector<uintptr_t> replays;
+  replays.swap(replays_);
+  deque<uintptr_t> offline;
+  offline.swap(offline_);
+
+  // Under an in-flight limit, they get in line ahead of the ones that
+  // waited meanwhile, instead of all going out at once
+  deque<uintptr_t> lined;
+  auto resubmit = [this, &lined](uintptr_t slot) {
+    CommandBase *c = commands_.get(slot);
+    if ((c == nullptr) || (c->reply_status_ != CommandBase::NO_REPLY))
+      return;
+    if ((max_in_flight_ > 0) && c->limited())
+      lined.push_back(slot);
+    else
+      submitToServer(c);
+  };
+  for (uintptr_t slot : replays)
+    resubmit(slot);
+  for (uintptr_t slot : offline)
+    resubmit(slot);
+
+  if (!lined.empty()) {
+    waiting_.insert(waiting_.begin(), lined.begin(), lined.end());
+    raiseHighWater(queued_high_water_, queued_ += (long)lined.size());
+  }
+  submitWaiting();
+}
+
+bool Redox::bufferOffline(CommandBase *c) {
+
+  if (c->repeat_ > 0)
+    return false;
+
+  if (offline_.size() >= offline_capacity_) {
+    logger_.error() << "Could not send \"" << c->cmd() << "\": Offline buffer is full.";
+    c->sendFailed(0);
+    return false;
+  }
+
+  offline_.push_back(c->slot_);
+  return true;
+}
+
+bool Redox::deferReplay(CommandBase *c) {
+
+  if (!reconnecting_ || !replay_idempotent_ || (c->repeat_ > 0) || (c->numCommands() != 1))
+    return false;
+  Slice name = c->arg(0, 0);
+  if (!isIdempotent(name.data(), name.size()))
+    return false;
+
+  c->pending_--;
+  replays_.push_back(c->slot_);
+  return true;
+}
+
 bool Redox::initEv() {
   signal(SIGPIPE, SIG_IGN);
+
+  // The caller's loop is used as is. Its userdata is not ours to set,
+  // so the watchers carry the back-reference instead.
+  if (external_loop_)
+    return true;
+
   evloop_ = ev_loop_new(EVFLAG_AUTO);
   if (evloop_ == nullptr) {
     logger_.fatal() << "Could not create a libev event loop.";
@@ -234,8 +553,21 @@ void Redox::noWait(bool state) {
   nowait_ = state;
 }
 
-void breakEventLoop(struct ev_loop *loop, ev_async *async, int revents) {
-  ev_break(loop, EVBREAK_ALL);
+void Redox::adaptiveSpin(int microseconds) {
+  if (microseconds > 0)
+    logger_.info() << "Adaptive spin enabled for " << microseconds << " us.";
+  else
+    logger_.info() << "Adaptive spin disabled.";
+  spin_ns_ = (microseconds > 0) ? (int64_t)microseconds * 1000 : 0;
+}
+
+void Redox::stopEventLoop(struct ev_loop *loop, ev_async *async, int revents) {
+
+  Redox *rdx = (Redox *)async->data;
+  if (rdx->external_loop_)
+    rdx->detachEventLoop();
+  else
+    ev_break(loop, EVBREAK_ALL);
 }
 
 int Redox::getConnectState() {
@@ -251,10 +583,7 @@ void Redox::setConnectState(int connect_state) {
   connect_waiter_.notify_all();
 }
 
-int Redox::getRunning() {
-  lock_guard<mutex> lg(running_lock_);
-  return running_;
-}
+int Redox::getRunning() { return running_; }
 void Redox::setRunning(bool running) {
   {
     lock_guard<mutex> lg(running_lock_);
@@ -275,8 +604,49 @@ void Redox::setExited(bool exited) {
   exit_waiter_.notify_one();
 }
 
+void Redox::applyCpuAffinity() {
+
+  if (cpu_affinity_ < 0)
+    return;
+
+#ifdef __linux__
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu_affinity_, &cpus);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (err != 0) {
+    logger_.warning() << "Could not pin event thread to CPU " << cpu_affinity_ << ": "
+                      << strerror(err);
+  }
+#else
+  logger_.warning() << "CPU affinity is not supported on this platform.";
+#endif
+}
+
+void Redox::applyThreadPriority() {
+
+  if (thread_priority_ <= 0)
+    return;
+
+#ifdef __linux__
+  sched_param param;
+  param.sched_priority = thread_priority_;
+  int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (err != 0) {
+    logger_.warning() << "Could not set event thread priority to " << thread_priority_ << ": "
+                      << strerror(err);
+  }
+#else
+  logger_.warning() << "Thread priority is not supported on this platform.";
+#endif
+}
+
 void Redox::runEventLoop() {
 
+  loop_thread_ = this_thread::get_id();
+  applyCpuAffinity();
+  applyThreadPriority();
+
   // Events to connect to Redox
   ev_run(evloop_, EVRUN_ONCE);
   ev_run(evloop_, EVRUN_NOWAIT);
@@ -295,27 +665,30 @@ void Redox::runEventLoop() {
     }
   }
 
-  // Set up asynchronous watcher which we signal every
-  // time we add a command
-  redox_ev_async_init(&watcher_command_, processQueuedCommands);
-  ev_async_start(evloop_, &watcher_command_);
-
-  // Set up an async watcher to break the loop
-  redox_ev_async_init(&watcher_stop_, breakEventLoop);
-  ev_async_start(evloop_, &watcher_stop_);
-
-  // Set up an async watcher which we signal every time
-  // we want a command freed
-  redox_ev_async_init(&watcher_free_, freeQueuedCommands);
-  ev_async_start(evloop_, &watcher_free_);
-
+  startWatchers();
   setRunning(true);
 
   // Run the event loop, using NOWAIT if enabled for maximum
-  // throughput by avoiding any sleeping
+  // throughput by avoiding any sleeping. In adaptive mode, poll with
+  // NOWAIT while there was activity within the spin time, then block
+  // for one event at a time.
+  uint64_t last_activity = loop_activity_;
+  int64_t last_active_ns = nowNs();
   while (!to_exit_) {
+    int64_t spin_ns = spin_ns_;
     if (nowait_) {
       ev_run(evloop_, EVRUN_NOWAIT);
+    } else if (spin_ns > 0) {
+      ev_run(evloop_, EVRUN_NOWAIT);
+      int64_t now = nowNs();
+      if (loop_activity_ != last_activity) {
+        last_activity = loop_activity_;
+        last_active_ns = now;
+      } else if (now - last_active_ns > spin_ns) {
+        ev_run(evloop_, EVRUN_ONCE);
+        last_activity = loop_activity_;
+        last_active_ns = nowNs();
+      }
     } else {
       ev_run(evloop_);
     }
@@ -323,7 +696,9 @@ void Redox::runEventLoop() {
 
   logger_.info() << "Stop signal detected. Closing down event loop.";
 
-  // Signal event loop to free all commands
+  // Signal event loop to free all commands, once replies handed to the
+  // executor are handled
+  waitForExecutorTasks();
   freeAllCommands();
 
   // Wait to receive server replies for clean hiredis disconnect
@@ -332,6 +707,10 @@ void Redox::runEventLoop() {
 
   if (getConnectState() == CONNECTED) {
     redisAsyncDisconnect(ctx_);
+  } else if (reconnecting_) {
+    ev_timer_stop(evloop_, &reconnect_timer_);
+    if (ctx_ != nullptr)
+      redisAsyncFree(ctx_);
   }
 
   // Run once more to disconnect
@@ -351,242 +730,979 @@ void Redox::runEventLoop() {
   logger_.info() << "Event thread exited.";
 }
 
-template <class ReplyT> Command<ReplyT> *Redox::findCommand(long id) {
+void Redox::startWatchers() {
+
+  // Set up asynchronous watcher which we signal every
+  // time we add a command
+  redox_ev_async_init(&watcher_command_, processQueuedCommands);
+  watcher_command_.data = (void *)this;
+  ev_async_start(evloop_, &watcher_command_);
+
+  // Set up an async watcher to break the loop
+  redox_ev_async_init(&watcher_stop_, stopEventLoop);
+  watcher_stop_.data = (void *)this;
+  ev_async_start(evloop_, &watcher_stop_);
 
-  lock_guard<mutex> lg(command_map_guard_);
+  // Set up an async watcher which we signal every time
+  // we want a command freed
+  redox_ev_async_init(&watcher_free_, freeQueuedCommands);
+  watcher_free_.data = (void *)this;
+  ev_async_start(evloop_, &watcher_free_);
 
-  auto &command_map = getCommandMap<ReplyT>();
-  auto it = command_map.find(id);
-  if (it == command_map.end())
-    return nullptr;
-  return it->second;
+  // Set up the timer of the timer wheel, started once a command has a
+  // deadline
+  redox_ev_timer_init(&timeout_timer_, expireCommands, 0.0, TIMEOUT_RESOLUTION_NS / 1e9);
+  timeout_timer_.data = (void *)this;
+}
+
+void Redox::detachEventLoop() {
+
+  if (getExited())
+    return;
+
+  logger_.info() << "Stop signal detected. Detaching from event loop.";
+
+  ev_async_stop(evloop_, &watcher_command_);
+  ev_async_stop(evloop_, &watcher_stop_);
+  ev_async_stop(evloop_, &watcher_free_);
+  ev_timer_stop(evloop_, &timeout_timer_);
+
+  waitForExecutorTasks();
+  freeAllCommands();
+
+  // Unlike the event thread, we cannot wait around for a clean disconnect
+  // on the caller's loop, so free the context, which closes the socket and
+  // calls the disconnect callback. After a connection error or a
+  // disconnection hiredis has already freed it.
+  int state = getConnectState();
+  if (state == NOT_YET_CONNECTED || state == CONNECTED) {
+    redisAsyncFree(ctx_);
+  } else if (reconnecting_) {
+    ev_timer_stop(evloop_, &reconnect_timer_);
+    if (ctx_ != nullptr)
+      redisAsyncFree(ctx_);
+  }
+
+  long created = commands_created_;
+  long deleted = commands_deleted_;
+  if (created != deleted) {
+    logger_.error() << "All commands were not freed! " << deleted << "/"
+                    << created;
+  }
+
+  setExited(true);
+  setRunning(false);
+
+  logger_.info() << "Detached from event loop.";
 }
 
-template <class ReplyT>
 void Redox::commandCallback(redisAsyncContext *ctx, void *r, void *privdata) {
 
   Redox *rdx = (Redox *)ctx->data;
-  long id = (long)privdata;
   redisReply *reply_obj = (redisReply *)r;
 
-  Command<ReplyT> *c = rdx->findCommand<ReplyT>(id);
+  CommandBase *c = rdx->commands_.get((uintptr_t)privdata);
+  rdx->loop_activity_++;
+
+#ifdef REDOX_STATS
+  rdx->recordReply(c, reply_obj);
+#endif
+
+  // Replies can still come in for a freed command, such as the null
+  // replies hiredis hands to every subscribed channel as it disconnects
   if (c == nullptr) {
-    freeReplyObject(reply_obj);
+    if (reply_obj != nullptr)
+      freeReplyObject(reply_obj);
+    return;
+  }
+
+  // The reply makes room for the commands waiting in line, unless the
+  // connection is gone
+  if (c->on_wire_ > 0) {
+    c->on_wire_--;
+    rdx->in_flight_--;
+    if ((reply_obj != nullptr) && !rdx->waiting_.empty())
+      rdx->submitWaiting();
+  }
+
+  // Too late, the command already completed with TIMEOUT
+  if (c->expired_) {
+    if (reply_obj != nullptr)
+      freeReplyObject(reply_obj);
     return;
   }
 
+  // The connection is gone. Start reconnecting before the command is
+  // failed, unless it can be sent again.
+  if ((reply_obj == nullptr) && (rdx->reconnect_min_delay_ > 0)) {
+    rdx->connectionLost(REDIS_ERR, ctx->errstr);
+    if (rdx->deferReplay(c))
+      return;
+  }
+
+  rdx->timeouts_.remove(c);
+  if (c->coalescing_)
+    rdx->completeCoalesced(c, reply_obj);
+
+  // Null replies stay on the event thread, they come with the lost connection
+  if ((reply_obj != nullptr) && rdx->offloadReply(c)) {
+    rdx->offload(ReplyTask{c, reply_obj, false, nullptr});
+    return;
+  }
   c->processReply(reply_obj);
 }
 
-template <class ReplyT> bool Redox::submitToServer(Command<ReplyT> *c) {
+bool Redox::submitToServer(CommandBase *c) {
 
   Redox *rdx = c->rdx_;
-  c->pending_++;
-
-  // Construct a char** from the vector
-  vector<const char *> argv;
-  transform(c->cmd_.begin(), c->cmd_.end(), back_inserter(argv),
-            [](const string &s) { return s.c_str(); });
-
-  // Construct a size_t* of string lengths from the vector
-  vector<size_t> argvlen;
-  transform(c->cmd_.begin(), c->cmd_.end(), back_inserter(argvlen),
-            [](const string &s) { return s.size(); });
-
-  if (redisAsyncCommandArgv(rdx->ctx_, commandCallback<ReplyT>, (void *)c->id_, argv.size(),
-                            &argv[0], &argvlen[0]) != REDIS_OK) {
-    rdx->logger_.error() << "Could not send \"" << c->cmd() << "\": " << rdx->ctx_->errstr;
-    c->reply_status_ = Command<ReplyT>::SEND_ERROR;
-    c->invoke();
-    return false;
+
+  // Wait for the connection to come back
+  if (rdx->reconnecting_)
+    return rdx->bufferOffline(c);
+
+#ifdef REDOX_STATS
+  rdx->recordSubmit(c);
+#endif
+
+  // Reads sent from now on could see what this command writes, so they
+  // must not join the reads already in flight
+  if (!c->coalescing_ && !rdx->in_flight_reads_.empty())
+    rdx->in_flight_reads_.clear();
+
+  // The argument vectors point into the Command's own strings or into
+  // borrowed memory, so hiredis formats the command straight from them.
+  // The commands of a Batch are written back to back, all tagged with
+  // the same slot. Those of a BulkChunk are already formatted.
+  for (size_t i = 0; i < c->numCommands(); i++) {
+    size_t first = c->arg_offsets_[i];
+    size_t argc = c->arg_offsets_[i + 1] - first;
+
+    c->pending_++;
+    int sent = c->encoded_
+                   ? redisAsyncFormattedCommand(rdx->ctx_, commandCallback, (void *)c->slot_,
+                                                c->argv_[first], c->argvlen_[first])
+                   : redisAsyncCommandArgv(rdx->ctx_, commandCallback, (void *)c->slot_, argc,
+                                           c->argv_.data() + first, c->argvlen_.data() + first);
+    if (sent != REDIS_OK) {
+      c->pending_--;
+      rdx->logger_.error() << "Could not send \"" << c->cmd(i) << "\": " << rdx->ctx_->errstr;
+      c->sendFailed(i);
+      return false;
+    }
+    if (c->limited()) {
+      c->on_wire_++;
+      raiseHighWater(rdx->in_flight_high_water_, ++rdx->in_flight_);
+    }
   }
 
   return true;
 }
 
-template <class ReplyT>
 void Redox::submitCommandCallback(struct ev_loop *loop, ev_timer *timer, int revents) {
 
-  Redox *rdx = (Redox *)ev_userdata(loop);
-  long id = (long)timer->data;
+  // The timer is stopped before its Command is deleted
+  submitToServer((CommandBase *)timer->data);
+}
 
-  Command<ReplyT> *c = rdx->findCommand<ReplyT>(id);
-  if (c == nullptr) {
-    rdx->logger_.error() << "Couldn't find Command " << id
-                         << " in command_map (submitCommandCallback).";
+void Redox::enqueueCommand(CommandBase *c) {
+
+#ifdef REDOX_STATS
+  c->time_queued_ = nowNs();
+#endif
+
+  // Without limits, producers never touch the shared queue depth
+  if (limits_enabled_ && c->limited() && !admitCommand())
+    c->rejected_ = true;
+
+  if (!c->cached_ && (cache_.load(memory_order_acquire) != nullptr))
+    invalidateWrites(c);
+
+  // On the event thread itself, there is nobody to hand off to
+  if (onLoopThread()) {
+    loop_activity_++;
+    processQueuedCommand(c);
     return;
   }
 
-  submitToServer<ReplyT>(c);
+  // Hand the command to the event loop, and signal it only if it is not
+  // already due to drain the queue
+  if (command_queue_.push(c))
+    ev_async_send(evloop_, &watcher_command_);
 }
 
-template <class ReplyT> bool Redox::processQueuedCommand(long id) {
+void Redox::processQueuedCommand(CommandBase *c) {
 
-  Command<ReplyT> *c = findCommand<ReplyT>(id);
-  if (c == nullptr)
-    return false;
+  // A persistent command queued again, like the one of a Subscriber,
+  // keeps the slot it was registered with
+  if (c->slot_ == 0)
+    c->slot_ = commands_.add(c);
+  c->dequeued();
+
+  if (c->rejected_) {
+    commands_rejected_++;
+    c->reject();
+    return;
+  }
+
+  if (c->cached_) {
+    c->completeCached();
+    return;
+  }
 
   if ((c->repeat_ == 0) && (c->after_ == 0)) {
-    submitToServer<ReplyT>(c);
+    if (c->timeout_ > 0)
+      addDeadline(c);
+
+    // Before coalescing, so that a read in line never joins one sent
+    // ahead of the writes in line before it
+    if (limits_enabled_ && c->limited()) {
+      // While reconnecting too, rather than piling up in the offline
+      // buffer, to be sent all at once
+      if ((max_in_flight_ > 0) && (reconnecting_ || !waiting_.empty() || !fitsInFlight(c))) {
+        waitInLine(c);
+        return;
+      }
+
+      // Without a limit in flight, the submission queue is the only line,
+      // so its oldest are dropped as they come off it until it is back
+      // within bounds
+      bool dropped = (overload_policy_ == DROP_OLDEST) && (max_queued_ > 0) &&
+                     (queued_ > max_queued_);
+      dequeuedCommands(1);
+      if (dropped) {
+        commands_rejected_++;
+        c->reject();
+        return;
+      }
+    }
+
+    if (coalesce_reads_ && coalesce(c))
+      return;
+    submitToServer(c);
 
   } else {
 
-    c->timer_.data = (void *)c->id_;
-    redox_ev_timer_init(&c->timer_, submitCommandCallback<ReplyT>, c->after_, c->repeat_);
+    c->timer_.data = (void *)c;
+    redox_ev_timer_init(&c->timer_, submitCommandCallback, c->after_, c->repeat_);
     ev_timer_start(evloop_, &c->timer_);
-
-    c->timer_guard_.unlock();
   }
-
-  return true;
 }
 
-void Redox::processQueuedCommands(struct ev_loop *loop, ev_async *async, int revents) {
-
-  Redox *rdx = (Redox *)ev_userdata(loop);
+void Redox::drainCommandQueue() {
 
-  lock_guard<mutex> lg(rdx->queue_guard_);
+  // Re-arm first, so that a producer pushing after this point signals again
+  command_queue_.rearm();
 
-  while (!rdx->command_queue_.empty()) {
+  while (MPSCNode *node = command_queue_.pop())
+    processQueuedCommand(static_cast<CommandBase *>(node));
+}
 
-    long id = rdx->command_queue_.front();
-    rdx->command_queue_.pop();
+void Redox::processQueuedCommands(struct ev_loop *loop, ev_async *async, int revents) {
 
-    if (rdx->processQueuedCommand<redisReply *>(id)) {
-    } else if (rdx->processQueuedCommand<string>(id)) {
-    } else if (rdx->processQueuedCommand<char *>(id)) {
-    } else if (rdx->processQueuedCommand<int>(id)) {
-    } else if (rdx->processQueuedCommand<long long int>(id)) {
-    } else if (rdx->processQueuedCommand<nullptr_t>(id)) {
-    } else if (rdx->processQueuedCommand<vector<string>>(id)) {
-    } else if (rdx->processQueuedCommand<std::set<string>>(id)) {
-    } else if (rdx->processQueuedCommand<unordered_set<string>>(id)) {
-    } else
-      throw runtime_error("Command pointer not found in any queue!");
-  }
+  Redox *rdx = (Redox *)async->data;
+  rdx->loop_activity_++;
+  rdx->drainCommandQueue();
 }
 
 void Redox::freeQueuedCommands(struct ev_loop *loop, ev_async *async, int revents) {
 
-  Redox *rdx = (Redox *)ev_userdata(loop);
+  Redox *rdx = (Redox *)async->data;
+
+  // A command can be freed before the event loop has taken it off the
+  // submission queue, so make sure everything queued is registered first
+  rdx->drainCommandQueue();
 
   lock_guard<mutex> lg(rdx->free_queue_guard_);
 
   while (!rdx->commands_to_free_.empty()) {
-    long id = rdx->commands_to_free_.front();
+    CommandBase *c = rdx->commands_to_free_.front();
     rdx->commands_to_free_.pop();
+    rdx->freeQueuedCommand(c);
+  }
+
+  if (!rdx->waiting_.empty())
+    rdx->submitWaiting();
+}
+
+void Redox::freeQueuedCommand(CommandBase *c) {
+
+  // While the executor still handles replies to the command, the last of
+  // them queues it again
+  if ((c->worker_refs_.fetch_or(CommandBase::FREE_PENDING) & ~CommandBase::FREE_PENDING) != 0)
+    return;
+
+  // Replies still to come for it no longer count
+  in_flight_ -= c->on_wire_;
+  c->on_wire_ = 0;
+
+  if (c->coalescing_ || (c->leader_ != nullptr))
+    detachCoalesced(c);
+
+  commands_.remove(c->slot_);
+  commands_deleted_ += 1;
+
+  recycleCommand(c);
+}
+
+void Redox::recycleCommand(CommandBase *c) {
+
+  c->freeReply();
+  timeouts_.remove(c);
+
+  // Stop the libev timer if this is a repeating command
+  if ((c->repeat_ != 0) || (c->after_ != 0))
+    ev_timer_stop(evloop_, &c->timer_);
+
+  if ((c->pool_ != nullptr) && c->pool_->release(c))
+    return;
+
+  delete c;
+  commands_allocated_--;
+}
+
+long Redox::freeAllCommands() {
+
+  lock_guard<mutex> lg(free_queue_guard_);
+
+  // Everything is deleted below, so forget about pending frees
+  queue<CommandBase *>().swap(commands_to_free_);
+
+  long unsubmitted = freeUnsubmittedCommands();
+  long len = commands_.size();
+
+  in_flight_reads_.clear();
+  replays_.clear();
+  offline_.clear();
+  waiting_.clear();
+  in_flight_ = 0;
+  dequeuedCommands(queued_);
+  commands_.forEach([this](CommandBase *c) { recycleCommand(c); });
+
+  commands_.clear();
+  commands_deleted_ += len;
+
+  return unsubmitted + len;
+}
+
+long Redox::freeUnsubmittedCommands() {
+
+  long len = 0;
+  while (MPSCNode *node = command_queue_.pop()) {
+    CommandBase *c = static_cast<CommandBase *>(node);
+    delete c;
+    commands_allocated_--;
+    len++;
+  }
+
+  commands_deleted_ += len;
+  return len;
+}
+
+long Redox::nextCommandId() {
+
+  long id = commands_created_.fetch_add(1);
+
+  raiseHighWater(commands_high_water_, id + 1 - commands_deleted_);
+  return id;
+}
+
+Redox::LatencyHistograms &Redox::latencyFor(const char *name, size_t len) {
+
+  // Names are short, so this usually builds a string without allocating
+  string key(name, min(len, (size_t)32));
+  for (char &ch : key)
+    ch = (char)toupper((unsigned char)ch);
+
+  // Only the event thread inserts, so it can look up without the lock
+  auto it = latency_by_name_.find(key);
+  if (it != latency_by_name_.end())
+    return *it->second;
+
+  lock_guard<mutex> lg(latency_guard_);
+  if (latency_by_name_.size() >= MAX_LATENCY_NAMES) {
+    key = "OTHER";
+    it = latency_by_name_.find(key);
+    if (it != latency_by_name_.end())
+      return *it->second;
+  }
+
+  unique_ptr<LatencyHistograms> &latency = latency_by_name_[key];
+  latency.reset(new LatencyHistograms());
+  return *latency;
+}
+
+void Redox::recordSubmit(CommandBase *c) {
+
+  int64_t now = nowNs();
+  c->time_sent_ = now;
 
-    if (rdx->freeQueuedCommand<redisReply *>(id)) {
-    } else if (rdx->freeQueuedCommand<string>(id)) {
-    } else if (rdx->freeQueuedCommand<char *>(id)) {
-    } else if (rdx->freeQueuedCommand<int>(id)) {
-    } else if (rdx->freeQueuedCommand<long long int>(id)) {
-    } else if (rdx->freeQueuedCommand<nullptr_t>(id)) {
-    } else if (rdx->freeQueuedCommand<vector<string>>(id)) {
-    } else if (rdx->freeQueuedCommand<std::set<string>>(id)) {
-    } else if (rdx->freeQueuedCommand<unordered_set<string>>(id)) {
+  size_t num_commands = c->numCommands();
+  if (num_commands == 0)
+    return;
+
+  // Time spent queued is only meaningful when the command was due at once
+  if ((c->repeat_ == 0) && (c->after_ == 0) && c->timed()) {
+    uint64_t wait = (uint64_t)max<int64_t>(0, now - c->time_queued_);
+    latency_total_.queue_wait.record(wait);
+    Slice name = c->arg(0, 0);
+    latencyFor(name.data(), name.size()).queue_wait.record(wait);
+  }
+
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < num_commands; i++) {
+    size_t first = c->arg_offsets_[i];
+    bytes += c->encoded_ ? c->argvlen_[first]
+                         : commandSize(c->arg_offsets_[i + 1] - first, c->argv_.data() + first,
+                                       c->argvlen_.data() + first);
+  }
+  commands_sent_.fetch_add(num_commands, memory_order_relaxed);
+  bytes_out_.fetch_add(bytes, memory_order_relaxed);
+}
+
+void Redox::recordReply(CommandBase *c, redisReply *r) {
+
+  replies_received_.fetch_add(1, memory_order_relaxed);
+  if (r != nullptr)
+    bytes_in_.fetch_add(replySize(r), memory_order_relaxed);
+
+  if ((c == nullptr) || !c->timed())
+    return;
+
+  uint64_t round_trip = (uint64_t)max<int64_t>(0, nowNs() - c->time_sent_);
+  latency_total_.round_trip.record(round_trip);
+
+  size_t index = c->replyIndex();
+  if (index < c->numCommands()) {
+    Slice name = c->arg(index, 0);
+    latencyFor(name.data(), name.size()).round_trip.record(round_trip);
+  }
+}
+
+Stats Redox::stats() {
+
+  Stats stats;
+  stats.commands_created = commands_created_;
+  stats.commands_deleted = commands_deleted_;
+
+#ifdef REDOX_STATS
+  stats.enabled = true;
+  stats.commands_sent = commands_sent_;
+  stats.replies_received = replies_received_;
+  stats.bytes_out = bytes_out_;
+  stats.bytes_in = bytes_in_;
+
+  stats.total.queue_wait = latency_total_.queue_wait.snapshot();
+  stats.total.round_trip = latency_total_.round_trip.snapshot();
+
+  lock_guard<mutex> lg(latency_guard_);
+  for (auto &entry : latency_by_name_) {
+    LatencyStats &latency = stats.commands[entry.first];
+    latency.queue_wait = entry.second->queue_wait.snapshot();
+    latency.round_trip = entry.second->round_trip.snapshot();
+  }
+#endif
+
+  return stats;
+}
+
+bool Redox::coalesce(CommandBase *c) {
+
+  if ((c->numCommands() != 1) || !c->coalescable())
+    return false;
+  Slice name = c->arg(0, 0);
+  if (!isCoalescableRead(name.data(), name.size()))
+    return false;
+
+  // Lengths are included so that different splits of the same bytes into
+  // arguments do not collide. An encoded command is its own key, which
+  // starts with '*' and so differs from any other.
+  string &key = c->coalesce_key_;
+  key.clear();
+  if (c->encoded_)
+    key.assign(c->argv_[0], c->argvlen_[0]);
+  for (size_t i = 0; !c->encoded_ && (i < c->argv_.size()); i++) {
+    key += to_string(c->argvlen_[i]);
+    key += ':';
+    if (i == 0) {
+      for (size_t j = 0; j < c->argvlen_[0]; j++)
+        key += (char)toupper((unsigned char)c->argv_[0][j]);
     } else {
+      key.append(c->argv_[i], c->argvlen_[i]);
     }
   }
+
+  auto it = in_flight_reads_.find(key);
+  if (it != in_flight_reads_.end()) {
+    c->leader_ = it->second;
+    it->second->followers_.push_back(c);
+    commands_coalesced_++;
+    return true;
+  }
+
+  in_flight_reads_.emplace(key, c);
+  c->coalescing_ = true;
+  return false;
 }
 
-template <class ReplyT> bool Redox::freeQueuedCommand(long id) {
-  Command<ReplyT> *c = findCommand<ReplyT>(id);
-  if (c == nullptr)
-    return false;
+void Redox::completeCoalesced(CommandBase *c, redisReply *r) {
 
-  c->freeReply();
+  c->coalescing_ = false;
+  auto it = in_flight_reads_.find(c->coalesce_key_);
+  if ((it != in_flight_reads_.end()) && (it->second == c))
+    in_flight_reads_.erase(it);
 
-  // Stop the libev timer if this is a repeating command
-  if ((c->repeat_ != 0) || (c->after_ != 0)) {
-    lock_guard<mutex> lg(c->timer_guard_);
-    ev_timer_stop(c->rdx_->evloop_, &c->timer_);
+  if (c->followers_.empty())
+    return;
+
+  // Every command parses the same reply, which is freed with the last one
+  shared_ptr<redisReply> shared;
+  if (r != nullptr)
+    shared.reset(r, freeReplyObject);
+  c->shared_reply_ = shared;
+
+  for (CommandBase *follower : c->followers_) {
+    follower->leader_ = nullptr;
+    timeouts_.remove(follower);
+    if ((r != nullptr) && offloadReply(follower))
+      offload(ReplyTask{follower, r, true, shared});
+    else
+      follower->completeCoalesced(r, shared);
   }
+  c->followers_.clear();
+}
 
-  deregisterCommand<ReplyT>(c->id_);
+void Redox::detachCoalesced(CommandBase *c) {
 
-  delete c;
+  if (c->leader_ != nullptr) {
+    vector<CommandBase *> &followers = c->leader_->followers_;
+    followers.erase(std::remove(followers.begin(), followers.end(), c), followers.end());
+    c->leader_ = nullptr;
+  }
+
+  if (c->coalescing_) {
+    c->coalescing_ = false;
+    auto it = in_flight_reads_.find(c->coalesce_key_);
+    if ((it != in_flight_reads_.end()) && (it->second == c))
+      in_flight_reads_.erase(it);
 
+    for (CommandBase *follower : c->followers_) {
+      follower->leader_ = nullptr;
+      submitToServer(follower);
+    }
+    c->followers_.clear();
+  }
+}
+
+void Redox::limitCommands(size_t max_in_flight, size_t max_queued, int policy) {
+  if ((policy != BLOCK) && (policy != FAIL) && (policy != DROP_OLDEST))
+    throw runtime_error("[ERROR] Unknown overload policy " + to_string(policy) + "!");
+  max_in_flight_ = (long)max_in_flight;
+  max_queued_ = (long)max_queued;
+  overload_policy_ = policy;
+  limits_enabled_ = (max_in_flight > 0) || (max_queued > 0);
+}
+
+bool Redox::reserveQueued() {
+  long queued = queued_;
+  do {
+    if ((max_queued_ > 0) && (queued >= max_queued_))
+      return false;
+  } while (!queued_.compare_exchange_weak(queued, queued + 1));
+
+  raiseHighWater(queued_high_water_, queued + 1);
   return true;
 }
 
-long Redox::freeAllCommands() {
-  return freeAllCommandsOfType<redisReply *>() + freeAllCommandsOfType<string>() +
-         freeAllCommandsOfType<char *>() + freeAllCommandsOfType<int>() +
-         freeAllCommandsOfType<long long int>() + freeAllCommandsOfType<nullptr_t>() +
-         freeAllCommandsOfType<vector<string>>() + freeAllCommandsOfType<std::set<string>>() +
-         freeAllCommandsOfType<unordered_set<string>>();
+bool Redox::admitCommand() {
+
+  if (reserveQueued())
+    return true;
+
+  // Room is made on the event thread, when the oldest is taken off
+  if (overload_policy_ == DROP_OLDEST) {
+    raiseHighWater(queued_high_water_, ++queued_);
+    return true;
+  }
+
+  // Blocking the event thread would keep the queue from going down
+  if ((overload_policy_ == FAIL) || onLoopThread())
+    return false;
+
+  unique_lock<mutex> ul(queued_guard_);
+  blocked_producers_++;
+  bool admitted = true;
+  while (!reserveQueued()) {
+    if (!running_) {
+      admitted = false;
+      break;
+    }
+    queued_waiter_.wait(ul);
+  }
+  blocked_producers_--;
+  return admitted;
 }
 
-template <class ReplyT> long Redox::freeAllCommandsOfType() {
+void Redox::dequeuedCommands(long count) {
 
-  lock_guard<mutex> lg(free_queue_guard_);
-  lock_guard<mutex> lg2(queue_guard_);
-  lock_guard<mutex> lg3(command_map_guard_);
+  queued_ -= count;
+  if (blocked_producers_ > 0) {
+    lock_guard<mutex> lg(queued_guard_);
+    queued_waiter_.notify_all();
+  }
+}
+
+void Redox::waitInLine(CommandBase *c) {
+
+  waiting_.push_back(c->slot_);
+  if ((overload_policy_ != DROP_OLDEST) || (max_queued_ == 0))
+    return;
+
+  while ((queued_ > max_queued_) && !waiting_.empty()) {
+    CommandBase *oldest = commands_.get(waiting_.front());
+    waiting_.pop_front();
+    dequeuedCommands(1);
+    if ((oldest != nullptr) && (oldest->reply_status_ == CommandBase::NO_REPLY)) {
+      commands_rejected_++;
+      oldest->reject();
+    }
+  }
+}
+
+void Redox::submitWaiting() {
+
+  // Commands sent while reconnecting would only move to the offline buffer
+  while (!waiting_.empty() && !reconnecting_) {
+    CommandBase *c = commands_.get(waiting_.front());
+
+    // Skip those freed, timed out or dropped meanwhile, and keep the
+    // order for the others
+    bool skip = (c == nullptr) || (c->reply_status_ != CommandBase::NO_REPLY);
+    if (!skip && !fitsInFlight(c))
+      break;
+    waiting_.pop_front();
+    dequeuedCommands(1);
+    if (skip)
+      continue;
+    if (coalesce_reads_ && coalesce(c))
+      continue;
+    submitToServer(c);
+  }
+}
+
+void Redox::replyExecutor(const function<void(function<void()>)> &executor, bool ordered) {
+  reply_executor_ = executor;
+  ordered_replies_ = ordered;
+}
 
-  auto &command_map = getCommandMap<ReplyT>();
-  long len = command_map.size();
+bool Redox::offloadReply(CommandBase *c) const {
+  return reply_executor_ && c->offloadable() &&
+         (ordered_replies_ || ((c->repeat_ == 0) && (c->numCommands() == 1)));
+}
 
-  for (auto &pair : command_map) {
-    Command<ReplyT> *c = pair.second;
+void Redox::offload(ReplyTask &&task) {
 
-    c->freeReply();
+  task.c->worker_refs_ += 2;
 
-    // Stop the libev timer if this is a repeating command
-    if ((c->repeat_ != 0) || (c->after_ != 0)) {
-      lock_guard<mutex> lg3(c->timer_guard_);
-      ev_timer_stop(c->rdx_->evloop_, &c->timer_);
+  if (!ordered_replies_) {
+    {
+      lock_guard<mutex> lg(executor_tasks_guard_);
+      executor_tasks_++;
     }
+    ReplyTask t = std::move(task);
+    reply_executor_([this, t]() mutable {
+      runReplyTask(t);
+      executorTaskDone();
+    });
+    return;
+  }
 
-    delete c;
+  bool schedule = false;
+  {
+    lock_guard<mutex> lg(reply_tasks_guard_);
+    reply_tasks_.push_back(std::move(task));
+    schedule = !reply_tasks_scheduled_;
+    reply_tasks_scheduled_ = true;
   }
+  if (schedule) {
+    {
+      lock_guard<mutex> lg(executor_tasks_guard_);
+      executor_tasks_++;
+    }
+    reply_executor_([this] { runOrderedReplies(); });
+  }
+}
 
-  command_map.clear();
-  commands_deleted_ += len;
+void Redox::runOrderedReplies() {
 
-  return len;
+  while (true) {
+    {
+      lock_guard<mutex> lg(reply_tasks_guard_);
+      if (reply_tasks_.empty()) {
+        reply_tasks_scheduled_ = false;
+        break;
+      }
+      reply_tasks_running_.swap(reply_tasks_);
+    }
+    for (ReplyTask &task : reply_tasks_running_)
+      runReplyTask(task);
+    reply_tasks_running_.clear();
+  }
+  executorTaskDone();
 }
 
-// ---------------------------------
-// get_command_map specializations
-// ---------------------------------
+void Redox::runReplyTask(ReplyTask &task) {
 
-template <> unordered_map<long, Command<redisReply *> *> &Redox::getCommandMap<redisReply *>() {
-  return commands_redis_reply_;
+  CommandBase *c = task.c;
+  if (task.coalesced)
+    c->completeCoalesced(task.r, task.shared);
+  else
+    c->processReply(task.r);
+  task.shared.reset();
+
+  if (c->worker_refs_.fetch_sub(2) == 2 + CommandBase::FREE_PENDING) {
+    lock_guard<mutex> lg(free_queue_guard_);
+    commands_to_free_.push(c);
+    ev_async_send(evloop_, &watcher_free_);
+  }
 }
 
-template <> unordered_map<long, Command<string> *> &Redox::getCommandMap<string>() {
-  return commands_string_;
+void Redox::executorTaskDone() {
+  lock_guard<mutex> lg(executor_tasks_guard_);
+  if (--executor_tasks_ == 0)
+    executor_tasks_waiter_.notify_all();
 }
 
-template <> unordered_map<long, Command<char *> *> &Redox::getCommandMap<char *>() {
-  return commands_char_p_;
+void Redox::waitForExecutorTasks() {
+  unique_lock<mutex> ul(executor_tasks_guard_);
+  executor_tasks_waiter_.wait(ul, [this] { return executor_tasks_ == 0; });
 }
 
-template <> unordered_map<long, Command<int> *> &Redox::getCommandMap<int>() {
-  return commands_int_;
+void Redox::compressValues(size_t threshold, int codec) {
+  if ((codec != compression::NONE) && !compression::available(codec))
+    throw runtime_error("[ERROR] Compression codec " + to_string(codec) + " is not compiled in!");
+  compress_codec_ = codec;
+  compress_threshold_ = threshold;
 }
 
-template <> unordered_map<long, Command<long long int> *> &Redox::getCommandMap<long long int>() {
-  return commands_long_long_int_;
+void Redox::appendValue(string &buf, const Slice &value) const {
+
+  if (value.size() >= compress_threshold_) {
+    static thread_local string compressed;
+    compressed.clear();
+    if (compression::compress(compress_codec_, value, compressed)) {
+      resp::appendArg(buf, compressed);
+      return;
+    }
+  }
+  resp::appendArg(buf, value);
 }
 
-template <> unordered_map<long, Command<nullptr_t> *> &Redox::getCommandMap<nullptr_t>() {
-  return commands_null_;
+void Redox::compressArgs(CommandBase *c) {
+
+  c->decompress_ = true;
+
+  // Values of encoded commands were compressed as they were encoded
+  if (c->encoded_)
+    return;
+
+  auto &compressed = c->compressed_args_;
+  for (size_t i = 0; i < c->numCommands(); i++) {
+    for (size_t j = c->arg_offsets_[i] + 2; j < c->arg_offsets_[i + 1]; j++) {
+      if (c->argvlen_[j] < compress_threshold_)
+        continue;
+      string value;
+      if (compression::compress(compress_codec_, Slice(c->argv_[j], c->argvlen_[j]), value))
+        compressed.emplace_back(j, std::move(value));
+    }
+  }
+
+  // Only once all are in place, since the vector may move them
+  for (auto &arg : compressed) {
+    c->argv_[arg.first] = arg.second.data();
+    c->argvlen_[arg.first] = arg.second.size();
+  }
 }
 
-template <> unordered_map<long, Command<vector<string>> *> &Redox::getCommandMap<vector<string>>() {
-  return commands_vector_string_;
+void Redox::addDeadline(CommandBase *c) {
+  int64_t now = (int64_t)(ev_now(evloop_) * 1e9);
+  timeouts_.add(c, now + (int64_t)(c->timeout_ * 1e9));
+  if (!ev_is_active(&timeout_timer_))
+    ev_timer_again(evloop_, &timeout_timer_);
 }
 
-template <> unordered_map<long, Command<set<string>> *> &Redox::getCommandMap<set<string>>() {
-  return commands_set_string_;
+void Redox::expireCommands(struct ev_loop *loop, ev_timer *timer, int revents) {
+
+  Redox *rdx = (Redox *)timer->data;
+  int64_t now = (int64_t)(ev_now(loop) * 1e9);
+  rdx->timeouts_.expire(now, [rdx](TimerNode *node) {
+    rdx->expireCommand(static_cast<CommandBase *>(node));
+  });
+
+  if (rdx->timeouts_.empty())
+    ev_timer_stop(loop, timer);
 }
 
-template <>
-unordered_map<long, Command<unordered_set<string>> *> &
-Redox::getCommandMap<unordered_set<string>>() {
-  return commands_unordered_set_string_;
+void Redox::expireCommand(CommandBase *c) {
+
+  // Completed without a reply, when it could not be sent
+  if (c->reply_status_ != CommandBase::NO_REPLY)
+    return;
+
+  if (logger_.enabled(log::Warning))
+    logger_.warning() << "Timed out waiting for a reply to \"" << c->cmd() << "\"";
+
+  if (c->coalescing_ || (c->leader_ != nullptr))
+    detachCoalesced(c);
+  c->expire();
+}
+
+bool Redox::enableCache(size_t max_bytes, size_t num_shards) {
+
+  if (!running_) {
+    throw runtime_error("[ERROR] Need to connect Redox before enabling the cache!");
+  }
+
+  if (invalidations_) {
+    logger_.error() << "The client-side cache is already enabled.";
+    return false;
+  }
+
+  unique_ptr<ClientCache> cache(new ClientCache(max_bytes, num_shards));
+  ClientCache *cache_ptr = cache.get();
+
+  // Resolved once, by the subscription, its error, or the connection
+  // dropping before either
+  auto subscribed = make_shared<promise<bool>>();
+  auto resolved = make_shared<atomic_bool>(false);
+  auto resolve = [subscribed, resolved](bool ok) {
+    if (!resolved->exchange(true))
+      subscribed->set_value(ok);
+  };
+
+  // Without this connection, writes by other clients go unnoticed
+  unique_ptr<Subscriber> sub(new Subscriber(log_stream_, logger_.level()));
+  auto connection_callback = [cache_ptr, resolve](int state) {
+    if (state != CONNECTED) {
+      cache_ptr->disable();
+      resolve(false);
+    }
+  };
+  bool connected = path_.empty() ? sub->connect(host_, port_, connection_callback)
+                                 : sub->connectUnix(path_, connection_callback);
+  if (!connected) {
+    logger_.error() << "Could not open the connection for cache invalidations.";
+    return false;
+  }
+
+  long long id = sub->clientId();
+  if (id < 0) {
+    logger_.error() << "Could not get the client ID of the invalidation connection.";
+    return false;
+  }
+
+  // Invalidations are an array of keys, or nil when the server flushes
+  // everything or runs out of memory for tracking
+  sub->subscribeRaw(
+      "__redis__:invalidate",
+      [cache_ptr](const Slice &, const redisReply *keys) {
+        if (keys->type == REDIS_REPLY_ARRAY) {
+          for (size_t i = 0; i < keys->elements; i++)
+            cache_ptr->invalidate(Slice(keys->element[i]->str, keys->element[i]->len));
+        } else {
+          cache_ptr->clear();
+        }
+      },
+      [resolve](const string &) { resolve(true); }, nullptr,
+      [resolve](const string &, int) { resolve(false); });
+
+  double timeout = max(CACHE_SUBSCRIBE_TIMEOUT, default_timeout_.load(memory_order_relaxed));
+  future<bool> result = subscribed->get_future();
+  if ((result.wait_for(chrono::duration<double>(timeout)) != future_status::ready) ||
+      !result.get()) {
+    logger_.error() << "Could not subscribe to cache invalidations.";
+    return false;
+  }
+
+  Command<redisReply *> &c =
+      commandSync<redisReply *>({"CLIENT", "TRACKING", "ON", "REDIRECT", to_string(id)});
+  bool tracking = c.ok();
+  if (!tracking)
+    logger_.error() << "Could not turn on key tracking: " << c.lastError();
+  c.free();
+  if (!tracking)
+    return false;
+
+  cache_storage_ = std::move(cache);
+  invalidations_ = std::move(sub);
+  cache_.store(cache_ptr, memory_order_release);
+  return true;
+}
+
+CacheStats Redox::cacheStats() {
+  ClientCache *cache = cache_.load(memory_order_acquire);
+  return (cache != nullptr) ? cache->stats() : CacheStats();
+}
+
+void Redox::cacheLookup(Command<string> *c) {
+
+  // GET key, in any case
+  if ((c->numArgs(0) != 2) || (c->arg(0, 0).size() != 3) ||
+      (strncasecmp(c->arg(0, 0).data(), "GET", 3) != 0))
+    return;
+
+  ClientCache *cache = cache_.load(memory_order_acquire);
+  Slice key = c->arg(0, 1);
+  if (cache->lookup(key, c->reply_val_)) {
+    c->reply_status_ = CommandBase::OK_REPLY;
+    c->cached_ = true;
+  } else {
+    c->cache_token_ = cache->reserve(key);
+  }
+}
+
+void Redox::cacheReply(CommandBase *c) {
+
+  // Only GET commands with a string reply reserve their key
+  auto *get = static_cast<Command<string> *>(c);
+  ClientCache *cache = cache_.load(memory_order_acquire);
+  Slice key = c->arg(0, 1);
+
+  if (c->reply_status_ == CommandBase::OK_REPLY)
+    cache->fill(key, c->cache_token_, get->reply_val_);
+  else
+    cache->release(key, c->cache_token_);
+  c->cache_token_ = 0;
+}
+
+void Redox::invalidateWrites(CommandBase *c) {
+  ClientCache *cache = cache_.load(memory_order_acquire);
+  for (size_t i = 0; i < c->numCommands(); i++) {
+    Slice name = c->arg(i, 0);
+    if (isCoalescableRead(name.data(), name.size()))
+      continue;
+    if (isOneOf(name, {"FLUSHDB", "FLUSHALL", "SWAPDB"})) {
+      cache->clear();
+      continue;
+    }
+    KeyRange keys = writtenKeys(c, i);
+    for (size_t j = keys.first; j < keys.last; j += keys.step)
+      cache->invalidate(c->arg(i, j));
+  }
+}
+
+size_t Redox::nextCommandPoolIndex() {
+  static atomic<size_t> next_index = {0};
+  return next_index++;
+}
+
+long Redox::commandsPooled() const {
+  long pooled = 0;
+  for (auto &pool : command_pools_) {
+    CommandPool *p = pool.load();
+    if (p != nullptr)
+      pooled += p->size();
+  }
+  return pooled;
 }
 
 // ----------------------------
@@ -613,9 +1729,16 @@ vector<string> Redox::strToVec(const string &s, const char delimiter) {
   return vec;
 }
 
-void Redox::command(const vector<string> &cmd) { command<redisReply *>(cmd, nullptr); }
+void Redox::command(vector<string> cmd) { command<redisReply *>(std::move(cmd), nullptr); }
 
-bool Redox::commandSync(const vector<string> &cmd) {
+bool Redox::commandSync(vector<string> cmd) {
+  auto &c = commandSync<redisReply *>(std::move(cmd));
+  bool succeeded = c.ok();
+  c.free();
+  return succeeded;
+}
+
+bool Redox::commandSync(const BorrowedArgs &cmd) {
   auto &c = commandSync<redisReply *>(cmd);
   bool succeeded = c.ok();
   c.free();
@@ -624,19 +1747,49 @@ bool Redox::commandSync(const vector<string> &cmd) {
 
 string Redox::get(const string &key) {
 
-  Command<char *> &c = commandSync<char *>({"GET", key});
-  if (!c.ok()) {
+  // A cached key is answered right here, without involving the event loop
+  string reply;
+  ClientCache *cache = cache_.load(memory_order_acquire);
+  if ((cache != nullptr) && cache->lookup(key, reply))
+    return reply;
+
+  if (!running_) {
+    throw runtime_error("[ERROR] Need to connect Redox before running commands!");
+  }
+
+  // Same as commandSync(), but a miss was already counted, so reserve the
+  // key for the reply without looking it up again
+  Command<string> *c = acquireCommand<string>(encodeCommand<cmd::Get>(key), nullptr, 0, 0, false);
+  if (compress_codec_ != compression::NONE)
+    compressArgs(c);
+  c->timeout_ = default_timeout_.load(memory_order_relaxed);
+  if (cache != nullptr)
+    c->cache_token_ = cache->reserve(key);
+  enqueueCommand(c);
+  c->wait();
+
+  if (!c->ok()) {
     throw runtime_error("[FATAL] Error getting key " + key + ": Status code " +
-                        to_string(c.status()));
+                        to_string(c->status()));
   }
-  string reply = c.reply();
-  c.free();
+  reply = c->takeReply();
+  c->free();
   return reply;
 }
 
-bool Redox::set(const string &key, const string &value) { return commandSync({"SET", key, value}); }
+bool Redox::set(const string &key, const string &value) {
+  auto &c = runSync<cmd::Set>(key, value);
+  bool succeeded = c.ok();
+  c.free();
+  return succeeded;
+}
 
-bool Redox::del(const string &key) { return commandSync({"DEL", key}); }
+bool Redox::del(const string &key) {
+  auto &c = runSync<cmd::Del>(key);
+  bool succeeded = c.ok();
+  c.free();
+  return succeeded;
+}
 
 void Redox::publish(const string &topic, const string &msg) {
   command<redisReply *>({"PUBLISH", topic, msg});
@@ -0,0 +1,370 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include "cluster.hpp"
+
+using namespace std;
+
+namespace redox {
+
+namespace {
+
+// CRC16-CCITT (XMODEM), as specified for Redis Cluster key hashing
+uint16_t crc16(const char *buf, size_t len) {
+
+  static const struct Table {
+    uint16_t t[256];
+    Table() {
+      for (int i = 0; i < 256; i++) {
+        uint16_t crc = (uint16_t)(i << 8);
+        for (int j = 0; j < 8; j++)
+          crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        t[i] = crc;
+      }
+    }
+  } table;
+
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; i++)
+    crc = (uint16_t)((crc << 8) ^ table.t[((crc >> 8) ^ (unsigned char)buf[i]) & 0xff]);
+  return crc;
+}
+
+string nodeName(const string &host, int port) { return host + ":" + to_string(port); }
+
+// Parse the decimal number that spans exactly [start, end), as it comes
+// from the server
+bool parseNumber(const char *start, const char *end, long &value) {
+  if (start == end)
+    return false;
+  char *parsed = nullptr;
+  errno = 0;
+  value = strtol(start, &parsed, 10);
+  return (errno == 0) && (parsed == end);
+}
+
+} // anonymous
+
+const int RedoxCluster::NUM_SLOTS;
+const int RedoxCluster::MAX_REDIRECTS;
+
+RedoxCluster::RedoxCluster(ostream &log_stream, log::Level log_level)
+    : logger_(log_stream, log_level), log_stream_(log_stream), log_level_(log_level),
+      slots_(NUM_SLOTS, nullptr) {}
+
+RedoxCluster::~RedoxCluster() { disconnect(); }
+
+void RedoxCluster::noWait(bool state) {
+  lock_guard<mutex> lg(nodes_guard_);
+  nowait_ = state;
+  for (auto &n : nodes_)
+    n.second->noWait(state);
+}
+
+bool RedoxCluster::connect(const string &host, const int port) {
+
+  seed_host_ = host;
+  if (node(host, port) == nullptr)
+    return false;
+
+  return refreshSlots();
+}
+
+void RedoxCluster::disconnect() {
+  stop();
+  wait();
+}
+
+// Callbacks on the event threads may start connecting to nodes, so the
+// node lock is not held while waiting for them
+
+void RedoxCluster::stop() {
+  {
+    unique_lock<mutex> ul(nodes_guard_);
+    stopping_ = true;
+    connecting_waiter_.wait(ul, [this] { return connecting_ == 0; });
+  }
+  for (Redox *rdx : allNodes())
+    rdx->stop();
+}
+
+void RedoxCluster::wait() {
+  for (Redox *rdx : allNodes())
+    rdx->wait();
+}
+
+vector<Redox *> RedoxCluster::allNodes() {
+  lock_guard<mutex> lg(nodes_guard_);
+  vector<Redox *> nodes;
+  for (auto &n : nodes_)
+    nodes.push_back(n.second.get());
+  return nodes;
+}
+
+size_t RedoxCluster::numNodes() {
+  lock_guard<mutex> lg(nodes_guard_);
+  return nodes_.size();
+}
+
+bool RedoxCluster::refreshSlots() {
+
+  Command<redisReply *> &c = anyNode().commandSync<redisReply *>({"CLUSTER", "SLOTS"});
+  bool loaded = c.ok() && loadSlots(c.reply());
+  if (!loaded)
+    logger_.error() << "Could not load the cluster slot map: " << c.lastError();
+  c.free();
+  return loaded;
+}
+
+bool RedoxCluster::loadSlots(redisReply *reply) {
+
+  if (reply->type != REDIS_REPLY_ARRAY)
+    return false;
+
+  vector<Redox *> slots(NUM_SLOTS, nullptr);
+
+  // Each entry is [first slot, last slot, [master host, port, ...], replicas...]
+  for (size_t i = 0; i < reply->elements; i++) {
+    redisReply *range = reply->element[i];
+    if (range->type != REDIS_REPLY_ARRAY || range->elements < 3)
+      continue;
+
+    redisReply *master = range->element[2];
+    if (master->type != REDIS_REPLY_ARRAY || master->elements < 2)
+      continue;
+
+    string host(master->element[0]->str, master->element[0]->len);
+    if (host.empty() || host == "?")
+      host = seed_host_;
+
+    Redox *rdx = node(host, (int)master->element[1]->integer);
+    if (rdx == nullptr)
+      return false;
+
+    long long first = range->element[0]->integer;
+    long long last = range->element[1]->integer;
+    for (long long slot = first; slot <= last && slot < NUM_SLOTS; slot++)
+      slots[slot] = rdx;
+  }
+
+  lock_guard<mutex> lg(slots_guard_);
+  slots_.swap(slots);
+  return true;
+}
+
+int RedoxCluster::keySlot(const Slice &key) {
+
+  // Only the part between the first { and the next } is hashed, if it
+  // is not empty, so related keys can be put into the same slot
+  const char *data = key.data();
+  size_t len = key.size();
+  const char *open = (len > 0) ? (const char *)memchr(data, '{', len) : nullptr;
+  if (open != nullptr) {
+    const char *start = open + 1;
+    const char *close = (const char *)memchr(start, '}', len - (start - data));
+    if (close != nullptr && close > start) {
+      data = start;
+      len = close - start;
+    }
+  }
+
+  return crc16(data, len) & (NUM_SLOTS - 1);
+}
+
+Redox &RedoxCluster::nodeForKey(const Slice &key) {
+
+  if (key.empty())
+    return anyNode();
+
+  Redox *rdx;
+  {
+    lock_guard<mutex> lg(slots_guard_);
+    rdx = slots_[keySlot(key)];
+  }
+  return (rdx != nullptr) ? *rdx : anyNode();
+}
+
+Redox &RedoxCluster::nodeForCommand(const vector<string> &cmd) {
+  return nodeForKey(commandKey(cmd));
+}
+
+Slice RedoxCluster::commandKey(const vector<string> &cmd) {
+
+  if (cmd.size() < 2)
+    return Slice();
+
+  // EVAL script numkeys key...
+  if (strcasecmp(cmd[0].c_str(), "EVAL") == 0 || strcasecmp(cmd[0].c_str(), "EVALSHA") == 0) {
+    if (cmd.size() < 4 || cmd[2] == "0")
+      return Slice();
+    return Slice(cmd[3]);
+  }
+
+  return Slice(cmd[1]);
+}
+
+bool RedoxCluster::parseRedirect(CommandBase &c, Redirect &r) {
+
+  if (c.status() != CommandBase::ERROR_REPLY)
+    return false;
+
+  // MOVED <slot> <host>:<port> or ASK <slot> <host>:<port>
+  string error = c.lastError();
+  if (error.compare(0, 6, "MOVED ") == 0) {
+    r.asking = false;
+  } else if (error.compare(0, 4, "ASK ") == 0) {
+    r.asking = true;
+  } else {
+    return false;
+  }
+
+  size_t slot_start = error.find(' ') + 1;
+  size_t addr_start = error.find(' ', slot_start);
+  size_t port_start = error.rfind(':');
+  long slot = 0;
+  long port = 0;
+  if (addr_start == string::npos || port_start == string::npos || port_start < addr_start ||
+      !parseNumber(error.c_str() + slot_start, error.c_str() + addr_start, slot) ||
+      !parseNumber(error.c_str() + port_start + 1, error.c_str() + error.size(), port) ||
+      (port <= 0) || (port > 65535)) {
+    logger_.error() << "Malformed cluster redirect: " << error;
+    return false;
+  }
+
+  r.slot = (int)slot;
+  r.host = error.substr(addr_start + 1, port_start - addr_start - 1);
+  r.port = (int)port;
+  if (r.host.empty())
+    r.host = seed_host_;
+  return true;
+}
+
+void RedoxCluster::redirected(const Redirect &r, Redox *rdx) {
+
+  // The slot has moved for good, so update just that entry
+  if (!r.asking && r.slot >= 0 && r.slot < NUM_SLOTS) {
+    lock_guard<mutex> lg(slots_guard_);
+    slots_[r.slot] = rdx;
+  }
+
+  if (logger_.enabled(log::Debug))
+    logger_.debug() << "Redirected slot " << r.slot << " to " << nodeName(r.host, r.port);
+}
+
+Redox *RedoxCluster::redirectTarget(CommandBase &c, bool &asking) {
+
+  Redirect r;
+  if (!parseRedirect(c, r))
+    return nullptr;
+
+  Redox *rdx = node(r.host, r.port);
+  if (rdx == nullptr)
+    return nullptr;
+
+  redirected(r, rdx);
+  asking = r.asking;
+  return rdx;
+}
+
+Redox *RedoxCluster::knownNode(const string &host, int port) {
+
+  lock_guard<mutex> lg(nodes_guard_);
+  auto it = nodes_.find(nodeName(host, port));
+  return (it != nodes_.end()) ? it->second.get() : nullptr;
+}
+
+Redox *RedoxCluster::node(const string &host, int port) {
+
+  Redox *known = knownNode(host, port);
+  if (known != nullptr)
+    return known;
+
+  // Connect without the node lock, so that routing on the event threads
+  // of the other nodes goes on meanwhile
+  bool nowait;
+  {
+    lock_guard<mutex> lg(nodes_guard_);
+    nowait = nowait_;
+  }
+  string name = nodeName(host, port);
+  unique_ptr<Redox> rdx(new Redox(log_stream_, log_level_));
+  rdx->noWait(nowait);
+  if (!rdx->connect(host, port)) {
+    logger_.error() << "Could not connect to cluster node " << name;
+    return nullptr;
+  }
+
+  // Another thread may have connected to it meanwhile, then ours is
+  // closed on return, after the lock is released
+  Redox *ptr;
+  {
+    lock_guard<mutex> lg(nodes_guard_);
+    unique_ptr<Redox> &slot = nodes_[name];
+    if (!slot)
+      slot = std::move(rdx);
+    ptr = slot.get();
+  }
+  return ptr;
+}
+
+Redox &RedoxCluster::anyNode() {
+
+  lock_guard<mutex> lg(nodes_guard_);
+  if (nodes_.empty())
+    throw runtime_error("[ERROR] Need to connect RedoxCluster before running commands!");
+  return *nodes_.begin()->second;
+}
+
+bool RedoxCluster::commandSync(vector<string> cmd) {
+  auto &c = commandSync<redisReply *>(std::move(cmd));
+  bool succeeded = c.ok();
+  c.free();
+  return succeeded;
+}
+
+string RedoxCluster::get(const string &key) {
+
+  Command<string> &c = commandSync<string>({"GET", key});
+  if (!c.ok()) {
+    throw runtime_error("[FATAL] Error getting key " + key + ": Status code " +
+                        to_string(c.status()));
+  }
+  string reply = c.takeReply();
+  c.free();
+  return reply;
+}
+
+bool RedoxCluster::set(const string &key, const string &value) {
+  return commandSync({"SET", key, value});
+}
+
+bool RedoxCluster::del(const string &key) { return commandSync({"DEL", key}); }
+
+void RedoxCluster::publish(const string &topic, const string &msg) {
+  command({"PUBLISH", topic, msg});
+}
+
+} // End namespace redox
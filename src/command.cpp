@@ -18,10 +18,20 @@
 * limitations under the License.
 */
 
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <set>
 #include <unordered_set>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#endif
+
 #include "command.hpp"
 #include "client.hpp"
 
@@ -29,22 +39,178 @@ using namespace std;
 
 namespace redox {
 
-template <class ReplyT>
-Command<ReplyT>::Command(Redox *rdx, long id, const vector<string> &cmd,
-                         const function<void(Command<ReplyT> &)> &callback, double repeat,
-                         double after, bool free_memory, log::Logger &logger)
-    : rdx_(rdx), id_(id), cmd_(cmd), repeat_(repeat), after_(after), free_memory_(free_memory),
-      callback_(callback), last_error_(), logger_(logger) {
-  timer_guard_.lock();
+namespace {
+
+/**
+* Blocks a thread until a command completes. There is one per thread,
+* reused for every blocking wait on it, so commands themselves carry no
+* mutex or condition variable. On Linux it waits on a futex.
+*/
+struct ThreadWaiter {
+
+  atomic_int signaled = {0};
+
+#ifndef __linux__
+  mutex lock;
+  condition_variable cv;
+#endif
+
+  void wait() {
+#ifdef __linux__
+    while (signaled.load(memory_order_acquire) == 0)
+      syscall(SYS_futex, &signaled, FUTEX_WAIT_PRIVATE, 0, nullptr, nullptr, 0);
+#else
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [this] { return signaled.load(memory_order_acquire) != 0; });
+#endif
+    signaled.store(0, memory_order_relaxed);
+  }
+
+  // Continuation of the awaited command, run on the event thread
+  static void wake(void *arg) {
+    ThreadWaiter *w = (ThreadWaiter *)arg;
+#ifdef __linux__
+    w->signaled.store(1, memory_order_release);
+    syscall(SYS_futex, &w->signaled, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    {
+      lock_guard<mutex> lg(w->lock);
+      w->signaled.store(1, memory_order_release);
+    }
+    w->cv.notify_one();
+#endif
+  }
+};
+
+} // anonymous
+
+// Definitions of the reply codes, for when they are bound to references
+const int CommandBase::NO_REPLY;
+const int CommandBase::OK_REPLY;
+const int CommandBase::NIL_REPLY;
+const int CommandBase::ERROR_REPLY;
+const int CommandBase::SEND_ERROR;
+const int CommandBase::WRONG_TYPE;
+const int CommandBase::TIMEOUT;
+const int CommandBase::OVERLOADED;
+const int CommandBase::CONTINUATION_NONE;
+const int CommandBase::CONTINUATION_SET;
+const int CommandBase::CONTINUATION_DONE;
+const int CommandBase::FREE_PENDING;
+
+CommandBase::CommandBase(Redox *rdx, long id, double repeat, double after, bool free_memory,
+                         log::Logger &logger)
+    : rdx_(rdx), id_(id), repeat_(repeat), after_(after), free_memory_(free_memory),
+      last_error_(), logger_(logger) {}
+
+void CommandBase::reset(long id, double repeat, double after, bool free_memory) {
+  id_ = id;
+  repeat_ = repeat;
+  after_ = after;
+  free_memory_ = free_memory;
+
+  reply_obj_ = nullptr;
+  reply_status_ = NO_REPLY;
+  last_error_.clear();
+  slot_ = 0;
+  pending_ = 0;
+  canceled_ = false;
+  free_requested_ = false;
+  cached_ = false;
+  cache_token_ = 0;
+  coalescing_ = false;
+  followers_.clear();
+  leader_ = nullptr;
+  timeout_ = 0;
+  expired_ = false;
+  rejected_ = false;
+  on_wire_ = 0;
+  encoded_ = false;
+  compressed_args_.clear();
+  decompress_ = false;
+  worker_refs_ = 0;
+  continuation_ = nullptr;
+  continuation_arg_ = nullptr;
+  continuation_state_ = CONTINUATION_NONE;
+  replies_notified_ = 0;
+  replies_waited_ = 0;
+}
+
+void CommandBase::setArgs(vector<string> &&cmd) {
+  cmd_ = std::move(cmd);
+  setArgs(static_cast<const vector<string> &>(cmd_));
+}
+
+void CommandBase::setArgs(const vector<string> &cmd) {
+
+  // Copy unless we are pointing argv_ at our own cmd_
+  if (&cmd != &cmd_)
+    cmd_ = cmd;
+
+  argv_.clear();
+  argvlen_.clear();
+  for (const string &arg : cmd_) {
+    argv_.push_back(arg.data());
+    argvlen_.push_back(arg.size());
+  }
+  arg_offsets_.assign({0, argv_.size()});
+  encoded_ = false;
+}
+
+void CommandBase::setArgs(const BorrowedArgs &args) {
+
+  cmd_.clear();
+
+  argv_.clear();
+  argvlen_.clear();
+  for (const Slice &arg : args.args()) {
+    argv_.push_back(arg.data());
+    argvlen_.push_back(arg.size());
+  }
+  arg_offsets_.assign({0, argv_.size()});
+  encoded_ = false;
 }
 
-template <class ReplyT> void Command<ReplyT>::wait() {
-  unique_lock<mutex> lk(waiter_lock_);
-  waiter_.wait(lk, [this]() { return waiting_done_.load(); });
-  waiting_done_ = {false};
+void CommandBase::setArgs(const EncodedArgs &args) {
+
+  cmd_.clear();
+  encoding_.assign(args.bytes().data(), args.bytes().size());
+
+  argv_.assign(1, encoding_.data());
+  argvlen_.assign(1, encoding_.size());
+  arg_offsets_.assign({0, 1});
+  encoded_ = true;
 }
 
-template <class ReplyT> void Command<ReplyT>::processReply(redisReply *r) {
+void CommandBase::wait() {
+
+  // The reply could never arrive while the event thread is blocked here
+  if (rdx_->onLoopThread())
+    throw runtime_error("[ERROR] Cannot block on a command from the event loop thread!");
+
+  // Register this thread's waiter as the continuation, unless the reply
+  // is already in
+  static thread_local ThreadWaiter waiter;
+  if (repeat_ == 0) {
+    if (setContinuation(&ThreadWaiter::wake, &waiter))
+      waiter.wait();
+    return;
+  }
+
+  // A looping command can be waited on again for its next reply. The
+  // state is still DONE from the last one, and a reply that came in since
+  // then is told apart from it by the count.
+  uint64_t next = replies_waited_ + 1;
+  if (replies_notified_ < next) {
+    int done = CONTINUATION_DONE;
+    continuation_state_.compare_exchange_strong(done, CONTINUATION_NONE);
+    if ((replies_notified_ < next) && setContinuation(&ThreadWaiter::wake, &waiter))
+      waiter.wait();
+  }
+  replies_waited_ = replies_notified_;
+}
+
+void CommandBase::readReply(redisReply *r) {
 
   last_error_.clear();
   reply_obj_ = r;
@@ -53,22 +219,103 @@ template <class ReplyT> void Command<ReplyT>::processReply(redisReply *r) {
     reply_status_ = ERROR_REPLY;
     last_error_ = "Received null redisReply* from hiredis.";
     logger_.error() << last_error_;
-    Redox::disconnectedCallback(rdx_->ctx_, REDIS_ERR);
+    rdx_->connectionLost(REDIS_ERR, (rdx_->ctx_ != nullptr) ? rdx_->ctx_->errstr : "");
 
-  } else {
+  } else if (repeat_ > 0) {
+    // Only a looping command can be read by the user while a reply
+    // comes in, others are not touched once they complete
     lock_guard<mutex> lg(reply_guard_);
     parseReplyObject();
+  } else {
+    parseReplyObject();
   }
 
+  if (cache_token_ != 0)
+    rdx_->cacheReply(this);
+}
+
+void CommandBase::notifyWaiter() {
+
+  // Last, since the continuation may free this command
+  replies_notified_++;
+  if (continuation_state_.exchange(CONTINUATION_DONE) == CONTINUATION_SET)
+    continuation_(continuation_arg_);
+}
+
+bool CommandBase::setContinuation(void (*fn)(void *), void *arg) {
+  continuation_ = fn;
+  continuation_arg_ = arg;
+  int expected = CONTINUATION_NONE;
+  return continuation_state_.compare_exchange_strong(expected, CONTINUATION_SET);
+}
+
+void CommandBase::enqueue() {
+  if (!rdx_->getRunning()) {
+    throw runtime_error("[ERROR] Need to connect Redox before running commands!");
+  }
+  rdx_->enqueueCommand(this);
+}
+
+void CommandBase::sendFailed(size_t index) {
+  reply_status_ = SEND_ERROR;
   invoke();
+  notifyWaiter();
+  if (free_memory_ && repeat_ == 0)
+    free();
+}
 
-  pending_--;
+void CommandBase::completeCached() {
+  invoke();
+  notifyWaiter();
+  if (free_memory_)
+    free();
+}
+
+void CommandBase::completeCoalesced(redisReply *r, const shared_ptr<redisReply> &shared) {
 
-  {
-    unique_lock<mutex> lk(waiter_lock_);
-    waiting_done_ = true;
+  // The command that was sent handles a lost connection
+  if (r == nullptr) {
+    reply_status_ = ERROR_REPLY;
+    last_error_ = "Received null redisReply* from hiredis.";
+  } else {
+    shared_reply_ = shared;
+    readReply(r);
   }
-  waiter_.notify_all();
+
+  invoke();
+  notifyWaiter();
+  if (free_memory_)
+    free();
+}
+
+void CommandBase::expire() {
+  expired_ = true;
+  reply_status_ = TIMEOUT;
+  last_error_ = "Timed out waiting for a reply.";
+  invoke();
+  notifyWaiter();
+  if (free_memory_)
+    free();
+}
+
+void CommandBase::reject() {
+  reply_status_ = OVERLOADED;
+  last_error_ = "Not sent, the client is over its command limits.";
+  invoke();
+  notifyWaiter();
+  if (free_memory_)
+    free();
+}
+
+void CommandBase::processReply(redisReply *r) {
+
+  readReply(r);
+
+  invoke();
+
+  pending_--;
+
+  notifyWaiter();
 
   // Always free the reply object for repeating commands
   if (repeat_ > 0) {
@@ -80,23 +327,35 @@ template <class ReplyT> void Command<ReplyT>::processReply(redisReply *r) {
     if (!free_memory_)
       return;
 
-    // Free non-repeating commands automatically
-    // once we receive expected replies
-    if (pending_ == 0)
+    // Free non-repeating commands automatically once we receive
+    // expected replies. The reply goes right away, on whichever thread
+    // handles it, instead of on the event thread.
+    if (pending_ == 0) {
+      freeReply();
       free();
+    }
   }
 }
 
 // This is the only method in Command that has
 // access to private members of Redox
-template <class ReplyT> void Command<ReplyT>::free() {
+void CommandBase::free() {
+
+  if (free_requested_.exchange(true))
+    return;
 
   lock_guard<mutex> lg(rdx_->free_queue_guard_);
-  rdx_->commands_to_free_.push(id_);
+  rdx_->commands_to_free_.push(this);
   ev_async_send(rdx_->evloop_, &rdx_->watcher_free_);
 }
 
-template <class ReplyT> void Command<ReplyT>::freeReply() {
+void CommandBase::freeReply() {
+
+  if (shared_reply_) {
+    shared_reply_.reset();
+    reply_obj_ = nullptr;
+    return;
+  }
 
   if (reply_obj_ == nullptr)
     return;
@@ -105,22 +364,88 @@ template <class ReplyT> void Command<ReplyT>::freeReply() {
   reply_obj_ = nullptr;
 }
 
-/**
-* Create a copy of the reply and return it. Use a guard
-* to make sure we don't return a reply while it is being
-* modified.
-*/
-template <class ReplyT> ReplyT Command<ReplyT>::reply() {
-  lock_guard<mutex> lg(reply_guard_);
-  if (!ok()) {
-    logger_.warning() << cmd() << ": Accessing reply value while status != OK.";
+CommandPool::~CommandPool() {
+  while (CommandBase *c = acquire())
+    delete c;
+}
+
+CommandBase *CommandPool::acquire() {
+  lock_guard<mutex> lg(guard_);
+  if (head_ == nullptr)
+    return nullptr;
+
+  MPSCNode *node = head_;
+  head_ = node->mpsc_next_.load(memory_order_relaxed);
+  size_--;
+  return static_cast<CommandBase *>(node);
+}
+
+bool CommandPool::release(CommandBase *c) {
+  lock_guard<mutex> lg(guard_);
+  if ((size_t)size_ >= capacity_)
+    return false;
+
+  c->mpsc_next_.store(head_, memory_order_relaxed);
+  head_ = c;
+  size_++;
+  return true;
+}
+
+string CommandBase::cmd() const {
+  string str;
+  for (size_t i = 0; i < numCommands(); i++) {
+    if (i > 0)
+      str += "; ";
+    str += cmd(i);
+  }
+  return str;
+}
+
+string CommandBase::cmd(size_t index) const {
+
+  if (index >= numCommands())
+    return "";
+
+  string str;
+  for (size_t i = 0; i < numArgs(index); i++) {
+    if (i > 0)
+      str += ' ';
+    Slice a = arg(index, i);
+    str.append(a.data(), a.size());
   }
-  return reply_val_;
+  return str;
 }
 
-template <class ReplyT> string Command<ReplyT>::cmd() const { return rdx_->vecToStr(cmd_); }
+size_t CommandBase::numArgs(size_t index) const {
+  if (encoded_)
+    return strtoul(argv_[index] + 1, nullptr, 10);
+  return arg_offsets_[index + 1] - arg_offsets_[index];
+}
 
-template <class ReplyT> bool Command<ReplyT>::isExpectedReply(int type) {
+Slice CommandBase::arg(size_t index, size_t i) const {
+
+  if (!encoded_) {
+    size_t a = arg_offsets_[index] + i;
+    return Slice(argv_[a], argvlen_[a]);
+  }
+
+  // Skip *<argc>, then $<len> and the bytes of each argument before it
+  const char *p = argv_[index];
+  const char *end = p + argvlen_[index];
+  p = (const char *)memchr(p, '\n', end - p);
+  for (size_t n = 0; (p != nullptr) && (++p < end) && (*p == '$'); n++) {
+    size_t len = strtoul(p + 1, nullptr, 10);
+    p = (const char *)memchr(p, '\n', end - p);
+    if ((p == nullptr) || (len > (size_t)(end - p - 1)))
+      break;
+    if (n == i)
+      return Slice(p + 1, len);
+    p += len + 2;
+  }
+  return Slice();
+}
+
+bool CommandBase::isExpectedReply(int type) {
 
   if (reply_obj_->type == type) {
     reply_status_ = OK_REPLY;
@@ -130,16 +455,14 @@ template <class ReplyT> bool Command<ReplyT>::isExpectedReply(int type) {
   if (checkErrorReply() || checkNilReply())
     return false;
 
-  stringstream errorMessage;
-  errorMessage << "Received reply of type " << reply_obj_->type << ", expected type " << type
-               << ".";
-  last_error_ = errorMessage.str();
-  logger_.error() << cmd() << ": " << last_error_;
+  last_error_ = "Received reply of type " + to_string(reply_obj_->type) + ", expected type " +
+                to_string(type) + ".";
+  logger_.error() << cmd(replyIndex()) << ": " << last_error_;
   reply_status_ = WRONG_TYPE;
   return false;
 }
 
-template <class ReplyT> bool Command<ReplyT>::isExpectedReply(int typeA, int typeB) {
+bool CommandBase::isExpectedReply(int typeA, int typeB) {
 
   if ((reply_obj_->type == typeA) || (reply_obj_->type == typeB)) {
     reply_status_ = OK_REPLY;
@@ -149,33 +472,34 @@ template <class ReplyT> bool Command<ReplyT>::isExpectedReply(int typeA, int typ
   if (checkErrorReply() || checkNilReply())
     return false;
 
-  stringstream errorMessage;
-  errorMessage << "Received reply of type " << reply_obj_->type << ", expected type " << typeA
-               << " or " << typeB << ".";
-  last_error_ = errorMessage.str();
-  logger_.error() << cmd() << ": " << last_error_;
+  last_error_ = "Received reply of type " + to_string(reply_obj_->type) + ", expected type " +
+                to_string(typeA) + " or " + to_string(typeB) + ".";
+  logger_.error() << cmd(replyIndex()) << ": " << last_error_;
   reply_status_ = WRONG_TYPE;
   return false;
 }
 
-template <class ReplyT> bool Command<ReplyT>::checkErrorReply() {
+bool CommandBase::checkErrorReply() {
 
   if (reply_obj_->type == REDIS_REPLY_ERROR) {
     if (reply_obj_->str != 0) {
       last_error_ = reply_obj_->str;
     }
 
-    logger_.error() << cmd() << ": " << last_error_;
+    logger_.error() << cmd(replyIndex()) << ": " << last_error_;
     reply_status_ = ERROR_REPLY;
     return true;
   }
   return false;
 }
 
-template <class ReplyT> bool Command<ReplyT>::checkNilReply() {
+bool CommandBase::checkNilReply() {
 
   if (reply_obj_->type == REDIS_REPLY_NIL) {
-    logger_.warning() << cmd() << ": Nil reply.";
+    // Nil replies are common, so skip building the command string if the
+    // warning is not logged
+    if (logger_.enabled(log::Warning))
+      logger_.warning() << cmd(replyIndex()) << ": Nil reply.";
     reply_status_ = NIL_REPLY;
     return true;
   }
@@ -195,6 +519,12 @@ template <> void Command<redisReply *>::parseReplyObject() {
 template <> void Command<string>::parseReplyObject() {
   if (!isExpectedReply(REDIS_REPLY_STRING, REDIS_REPLY_STATUS))
     return;
+
+  // A compressed value is decoded straight into the reply. One that does
+  // not decode is kept as it is.
+  Slice value(reply_obj_->str, static_cast<size_t>(reply_obj_->len));
+  if (decompress_ && compression::decompress(value, reply_val_))
+    return;
   reply_val_ = {reply_obj_->str, static_cast<size_t>(reply_obj_->len)};
 }
 
@@ -204,6 +534,12 @@ template <> void Command<char *>::parseReplyObject() {
   reply_val_ = reply_obj_->str;
 }
 
+template <> void Command<Slice>::parseReplyObject() {
+  if (!isExpectedReply(REDIS_REPLY_STRING, REDIS_REPLY_STATUS))
+    return;
+  reply_val_ = Slice(reply_obj_->str, static_cast<size_t>(reply_obj_->len));
+}
+
 template <> void Command<int>::parseReplyObject() {
 
   if (!isExpectedReply(REDIS_REPLY_INTEGER))
@@ -225,11 +561,16 @@ template <> void Command<nullptr_t>::parseReplyObject() {
   reply_val_ = nullptr;
 }
 
+// The container types are cleared first, as a looping command parses
+// every reply into the same value
+
 template <> void Command<vector<string>>::parseReplyObject() {
 
+  reply_val_.clear();
   if (!isExpectedReply(REDIS_REPLY_ARRAY))
     return;
 
+  reply_val_.reserve(reply_obj_->elements);
   for (size_t i = 0; i < reply_obj_->elements; i++) {
     redisReply *r = *(reply_obj_->element + i);
     reply_val_.emplace_back(r->str, r->len);
@@ -238,9 +579,11 @@ template <> void Command<vector<string>>::parseReplyObject() {
 
 template <> void Command<unordered_set<string>>::parseReplyObject() {
 
+  reply_val_.clear();
   if (!isExpectedReply(REDIS_REPLY_ARRAY))
     return;
 
+  reply_val_.reserve(reply_obj_->elements);
   for (size_t i = 0; i < reply_obj_->elements; i++) {
     redisReply *r = *(reply_obj_->element + i);
     reply_val_.emplace(r->str, r->len);
@@ -249,6 +592,7 @@ template <> void Command<unordered_set<string>>::parseReplyObject() {
 
 template <> void Command<set<string>>::parseReplyObject() {
 
+  reply_val_.clear();
   if (!isExpectedReply(REDIS_REPLY_ARRAY))
     return;
 
@@ -258,17 +602,13 @@ template <> void Command<set<string>>::parseReplyObject() {
   }
 }
 
-// Explicit template instantiation for available types, so that the generated
-// library contains them and we can keep the method definitions out of the
-// header file.
-template class Command<redisReply *>;
-template class Command<string>;
-template class Command<char *>;
-template class Command<int>;
-template class Command<long long int>;
-template class Command<nullptr_t>;
-template class Command<vector<string>>;
-template class Command<set<string>>;
-template class Command<unordered_set<string>>;
+template <> void Command<ArrayView>::parseReplyObject() {
+
+  if (!isExpectedReply(REDIS_REPLY_ARRAY)) {
+    reply_val_ = ArrayView();
+    return;
+  }
+  reply_val_ = ArrayView(reply_obj_);
+}
 
 } // End namespace redox
@@ -0,0 +1,141 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <cstdint>
+
+#include "pool.hpp"
+#include "utils/hash.hpp"
+
+using namespace std;
+
+namespace redox {
+
+const int RedoxPool::ROUND_ROBIN;
+const int RedoxPool::LEAST_PENDING;
+const int RedoxPool::KEY_AFFINITY;
+
+RedoxPool::RedoxPool(size_t size, int dispatch, ostream &log_stream, log::Level log_level)
+    : dispatch_(dispatch) {
+
+  if (size == 0)
+    size = 1;
+
+  for (size_t i = 0; i < size; i++)
+    clients_.emplace_back(new Redox(log_stream, log_level));
+}
+
+RedoxPool::~RedoxPool() {}
+
+void RedoxPool::noWait(bool state) {
+  for (auto &rdx : clients_)
+    rdx->noWait(state);
+}
+
+void RedoxPool::adaptiveSpin(int microseconds) {
+  for (auto &rdx : clients_)
+    rdx->adaptiveSpin(microseconds);
+}
+
+void RedoxPool::threadPriority(int priority) {
+  for (auto &rdx : clients_)
+    rdx->threadPriority(priority);
+}
+
+void RedoxPool::cpuAffinity(const vector<int> &cpus) {
+  for (size_t i = 0; i < cpus.size() && i < clients_.size(); i++)
+    clients_[i]->cpuAffinity(cpus[i]);
+}
+
+bool RedoxPool::connect(const string &host, const int port) {
+
+  for (size_t i = 0; i < clients_.size(); i++) {
+    if (!clients_[i]->connect(host, port)) {
+      for (size_t j = 0; j < i; j++)
+        clients_[j]->disconnect();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RedoxPool::connectUnix(const string &path) {
+
+  for (size_t i = 0; i < clients_.size(); i++) {
+    if (!clients_[i]->connectUnix(path)) {
+      for (size_t j = 0; j < i; j++)
+        clients_[j]->disconnect();
+      return false;
+    }
+  }
+  return true;
+}
+
+void RedoxPool::disconnect() {
+  stop();
+  wait();
+}
+
+void RedoxPool::stop() {
+  for (auto &rdx : clients_)
+    rdx->stop();
+}
+
+void RedoxPool::wait() {
+  for (auto &rdx : clients_)
+    rdx->wait();
+}
+
+Redox &RedoxPool::select(const vector<string> &cmd) {
+  return selectByKey((cmd.size() > 1) ? Slice(cmd[1]) : Slice());
+}
+
+Redox &RedoxPool::select(const BorrowedArgs &cmd) {
+  return selectByKey((cmd.args().size() > 1) ? cmd.args()[1] : Slice());
+}
+
+Redox &RedoxPool::selectByKey(const Slice &key) {
+
+  if (clients_.size() == 1)
+    return *clients_[0];
+
+  if ((dispatch_ == KEY_AFFINITY) && !key.empty())
+    return *clients_[hashBytes(key.data(), key.size()) % clients_.size()];
+
+  if (dispatch_ == LEAST_PENDING) {
+
+    // Start the scan at a rotating offset, so ties are spread evenly
+    size_t start = next_++;
+    size_t best = start % clients_.size();
+    long best_load = clients_[best]->commandsInUse();
+    for (size_t i = 1; i < clients_.size() && best_load > 0; i++) {
+      size_t index = (start + i) % clients_.size();
+      long load = clients_[index]->commandsInUse();
+      if (load < best_load) {
+        best = index;
+        best_load = load;
+      }
+    }
+    return *clients_[best];
+  }
+
+  return *clients_[next_++ % clients_.size()];
+}
+
+} // End namespace redox
@@ -0,0 +1,245 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
+#include "replicas.hpp"
+
+using namespace std;
+
+namespace redox {
+
+namespace {
+
+// Commands that only read data, sorted for binary search
+const char *const READ_COMMANDS[] = {
+    "BITCOUNT", "BITFIELD_RO", "BITPOS", "DBSIZE", "DUMP", "EVALSHA_RO", "EVAL_RO", "EXISTS",
+    "FCALL_RO", "GEODIST", "GEOHASH", "GEOPOS", "GEORADIUSBYMEMBER_RO", "GEORADIUS_RO",
+    "GEOSEARCH", "GET", "GETBIT", "GETRANGE", "HEXISTS", "HGET", "HGETALL", "HKEYS", "HLEN",
+    "HMGET", "HRANDFIELD", "HSCAN", "HSTRLEN", "HVALS", "KEYS", "LINDEX", "LLEN", "LPOS", "LRANGE",
+    "MGET", "PFCOUNT", "PTTL", "RANDOMKEY", "SCAN", "SCARD", "SDIFF", "SINTER", "SISMEMBER",
+    "SMEMBERS", "SMISMEMBER", "SRANDMEMBER", "SSCAN", "STRLEN", "SUNION", "TTL", "TYPE", "XLEN",
+    "XRANGE", "XREVRANGE", "ZCARD", "ZCOUNT", "ZLEXCOUNT", "ZMSCORE", "ZRANDMEMBER", "ZRANGE",
+    "ZRANGEBYLEX", "ZRANGEBYSCORE", "ZRANK", "ZREVRANGE", "ZREVRANGEBYLEX", "ZREVRANGEBYSCORE",
+    "ZREVRANK", "ZSCAN", "ZSCORE"};
+
+// Longer than any name in the table
+const size_t MAX_READ_NAME = 32;
+
+// PINGs per replica when measuring latency, of which the fastest counts
+const int LATENCY_SAMPLES = 3;
+
+int64_t nowNs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time of the last write of this thread through each replica set
+thread_local unordered_map<const RedoxReplicaSet *, int64_t> last_writes;
+
+} // anonymous
+
+const int RedoxReplicaSet::NEAREST;
+const int RedoxReplicaSet::LEAST_PENDING;
+const int RedoxReplicaSet::ROUND_ROBIN;
+
+RedoxReplicaSet::RedoxReplicaSet(int read_policy, ostream &log_stream, log::Level log_level)
+    : logger_(log_stream, log_level), log_stream_(log_stream), log_level_(log_level),
+      read_policy_(read_policy), primary_(makeNode(REDIS_DEFAULT_HOST, REDIS_DEFAULT_PORT)) {}
+
+RedoxReplicaSet::~RedoxReplicaSet() { disconnect(); }
+
+unique_ptr<RedoxReplicaSet::Node> RedoxReplicaSet::makeNode(const string &host, int port) {
+  unique_ptr<Node> node(new Node());
+  node->host = host;
+  node->port = port;
+  node->rdx.reset(new Redox(log_stream_, log_level_));
+  return node;
+}
+
+void RedoxReplicaSet::addReplica(const string &host, const int port) {
+  replicas_.push_back(makeNode(host, port));
+}
+
+void RedoxReplicaSet::noWait(bool state) {
+  primary_->rdx->noWait(state);
+  for (auto &node : replicas_)
+    node->rdx->noWait(state);
+}
+
+void RedoxReplicaSet::autoReconnect(double min_delay, double max_delay, size_t max_buffered) {
+  primary_->rdx->autoReconnect(min_delay, max_delay, max_buffered);
+  for (auto &node : replicas_)
+    node->rdx->autoReconnect(min_delay, max_delay, max_buffered);
+}
+
+void RedoxReplicaSet::readYourWrites(double window) { sticky_ns_ = (int64_t)(window * 1e9); }
+
+bool RedoxReplicaSet::connectNode(Node &node) {
+  Node *n = &node;
+  node.connected = node.rdx->connect(node.host, node.port, [n](int state) {
+    n->healthy = (state == Redox::CONNECTED);
+  });
+  return node.connected;
+}
+
+bool RedoxReplicaSet::connect(const string &host, const int port) {
+
+  primary_->host = host;
+  primary_->port = port;
+  if (!connectNode(*primary_)) {
+    logger_.error() << "Could not connect to the primary at " << host << ":" << port;
+    return false;
+  }
+
+  for (auto &node : replicas_) {
+    if (!connectNode(*node))
+      logger_.warning() << "Could not connect to the replica at " << node->host << ":"
+                        << node->port << ", reading from the others";
+  }
+
+  measureLatency();
+  return true;
+}
+
+void RedoxReplicaSet::disconnect() {
+  stop();
+  wait();
+}
+
+void RedoxReplicaSet::stop() {
+  if (primary_->connected)
+    primary_->rdx->stop();
+  for (auto &node : replicas_) {
+    if (node->connected)
+      node->rdx->stop();
+  }
+}
+
+void RedoxReplicaSet::wait() {
+  if (primary_->connected)
+    primary_->rdx->wait();
+  for (auto &node : replicas_) {
+    if (node->connected)
+      node->rdx->wait();
+  }
+}
+
+void RedoxReplicaSet::measureLatency() {
+
+  for (auto &node : replicas_) {
+    if (!node->healthy)
+      continue;
+
+    int64_t best = -1;
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+      int64_t start = nowNs();
+      Command<string> &c = node->rdx->commandSync<string>({"PING"});
+      int64_t round_trip = nowNs() - start;
+      bool ok = c.ok();
+      c.free();
+      if (ok && ((best < 0) || (round_trip < best)))
+        best = round_trip;
+    }
+    if (best >= 0)
+      node->latency_ns = best;
+  }
+}
+
+bool RedoxReplicaSet::isReadCommand(const Slice &name) {
+
+  if (name.empty() || (name.size() >= MAX_READ_NAME))
+    return false;
+
+  char upper[MAX_READ_NAME];
+  for (size_t i = 0; i < name.size(); i++)
+    upper[i] = (char)toupper((unsigned char)name.data()[i]);
+  upper[name.size()] = '\0';
+
+  return binary_search(begin(READ_COMMANDS), end(READ_COMMANDS), (const char *)upper,
+                       [](const char *a, const char *b) { return strcmp(a, b) < 0; });
+}
+
+Redox &RedoxReplicaSet::select(const vector<string> &cmd) {
+  return selectByName(cmd.empty() ? Slice() : Slice(cmd[0]));
+}
+
+Redox &RedoxReplicaSet::select(const BorrowedArgs &cmd) {
+  return selectByName(cmd.args().empty() ? Slice() : cmd.args()[0]);
+}
+
+Redox &RedoxReplicaSet::selectByName(const Slice &name) {
+  return isReadCommand(name) ? selectRead() : selectWrite();
+}
+
+Redox &RedoxReplicaSet::selectWrite() {
+  if (sticky_ns_.load(memory_order_relaxed) > 0)
+    last_writes[this] = nowNs();
+  return *primary_->rdx;
+}
+
+Redox &RedoxReplicaSet::selectRead() {
+
+  int64_t sticky_ns = sticky_ns_.load(memory_order_relaxed);
+  if (sticky_ns > 0) {
+    auto it = last_writes.find(this);
+    if ((it != last_writes.end()) && (nowNs() - it->second < sticky_ns))
+      return *primary_->rdx;
+  }
+
+  size_t num_healthy = 0;
+  for (auto &node : replicas_)
+    num_healthy += node->healthy ? 1 : 0;
+  if (num_healthy == 0)
+    return *primary_->rdx;
+
+  // Ties go to the next replica in a rotation over the connected ones, so
+  // they are spread evenly. With ROUND_ROBIN, everything is a tie.
+  size_t start = next_++ % num_healthy;
+  Node *best = nullptr;
+  int64_t best_cost = 0;
+  size_t best_order = 0;
+  size_t rank = 0;
+
+  for (auto &node : replicas_) {
+    if (!node->healthy)
+      continue;
+    size_t order = (rank++ + num_healthy - start) % num_healthy;
+    int64_t cost = 0;
+    if (read_policy_ == LEAST_PENDING)
+      cost = node->rdx->commandsInUse();
+    else if (read_policy_ == NEAREST)
+      cost = node->latency_ns;
+    if ((best == nullptr) || (cost < best_cost) || ((cost == best_cost) && (order < best_order))) {
+      best = node.get();
+      best_cost = cost;
+      best_order = order;
+    }
+  }
+
+  // The connected replicas may all have dropped since they were counted
+  return (best != nullptr) ? *best->rdx : *primary_->rdx;
+}
+
+} // End namespace redox
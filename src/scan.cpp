@@ -0,0 +1,270 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <algorithm>
+#include <strings.h>
+
+#include "scan.hpp"
+
+using namespace std;
+
+namespace redox {
+
+namespace {
+
+// Position of the cursor in a SCAN, HSCAN, SSCAN or ZSCAN command
+size_t cursorIndex(const vector<string> &cmd) {
+
+  size_t index = 0;
+  if (!cmd.empty()) {
+    if (strcasecmp(cmd[0].c_str(), "SCAN") == 0) {
+      index = 1;
+    } else if ((strcasecmp(cmd[0].c_str(), "HSCAN") == 0) ||
+               (strcasecmp(cmd[0].c_str(), "SSCAN") == 0) ||
+               (strcasecmp(cmd[0].c_str(), "ZSCAN") == 0)) {
+      index = 2;
+    }
+  }
+
+  if ((index == 0) || (cmd.size() <= index))
+    throw runtime_error("[ERROR] Not a SCAN, HSCAN, SSCAN or ZSCAN command: " +
+                        Redox::vecToStr(cmd));
+  return index;
+}
+
+// Split a page reply [cursor, [elements...]] into its parts. Returns the
+// status of the command, or WRONG_TYPE if it is not shaped like a page.
+int readPage(Command<ArrayView> &c, string &cursor, ArrayView &elements) {
+
+  if (!c.ok())
+    return c.status();
+
+  const ArrayView &reply = c.replyRef();
+  if ((reply.size() != 2) || (reply.reply()->element[1]->type != REDIS_REPLY_ARRAY) ||
+      reply[0].empty())
+    return CommandBase::WRONG_TYPE;
+
+  cursor = reply[0].str();
+  elements = reply.array(1);
+  return CommandBase::OK_REPLY;
+}
+
+// State of a scan run by Redox::scan(), only accessed where replies are
+// handled, one at a time
+struct ScanState {
+  vector<string> cmd;
+  size_t cursor_index;
+  function<bool(const ArrayView &)> page_callback;
+  function<void(int)> done_callback;
+  bool stopped = false;
+};
+
+void finishScan(ScanState &state, int status) {
+  state.stopped = true;
+  if (state.done_callback)
+    state.done_callback(status);
+}
+
+void scanPage(Redox &rdx, const shared_ptr<ScanState> &state) {
+
+  rdx.command<ArrayView>(state->cmd, [&rdx, state](Command<ArrayView> &c) {
+
+    // A page fetched ahead of the callback stopping the scan
+    if (state->stopped)
+      return;
+
+    string cursor;
+    ArrayView elements;
+    int status = readPage(c, cursor, elements);
+    if (status != CommandBase::OK_REPLY) {
+      finishScan(*state, status);
+      return;
+    }
+
+    // Ask for the next page before handing out this one
+    bool more = (cursor != "0");
+    if (more) {
+      state->cmd[state->cursor_index] = cursor;
+      scanPage(rdx, state);
+    }
+
+    // Sending the next page may have failed right away
+    if (state->stopped)
+      return;
+
+    if (!elements.empty() && !state->page_callback(elements))
+      more = false;
+
+    if (!more)
+      finishScan(*state, CommandBase::OK_REPLY);
+  });
+}
+
+} // anonymous
+
+void Redox::scan(vector<string> cmd, const function<bool(const ArrayView &)> &page_callback,
+                 const function<void(int)> &done_callback) {
+
+  // The next page is requested before a page is handed out, so without
+  // ordered replies, the callbacks could overlap
+  if (reply_executor_ && !ordered_replies_)
+    throw runtime_error("[ERROR] scan() needs ordered replies, see replyExecutor()!");
+
+  auto state = make_shared<ScanState>();
+  state->cursor_index = cursorIndex(cmd);
+  state->cmd = std::move(cmd);
+  state->page_callback = page_callback;
+  state->done_callback = done_callback;
+  scanPage(*this, state);
+}
+
+ScanStream::ScanStream(Redox &rdx, vector<string> cmd, size_t max_pages)
+    : rdx_(rdx), cmd_(std::move(cmd)), cursor_index_(cursorIndex(cmd_)),
+      max_pages_(std::max(max_pages, (size_t)1)) {
+
+  in_flight_ = true;
+  request(cmd_[cursor_index_]);
+}
+
+ScanStream::~ScanStream() {
+
+  // The callback of a page in flight refers to this stream
+  unique_lock<mutex> ul(guard_);
+  waiter_.wait(ul, [this] { return !in_flight_; });
+
+  if (current_ != nullptr)
+    current_->free();
+  for (Command<ArrayView> *c : pages_)
+    c->free();
+}
+
+bool ScanStream::next() {
+
+  if (current_ != nullptr) {
+    current_->free();
+    current_ = nullptr;
+    page_ = ArrayView();
+  }
+
+  string cursor;
+  {
+    unique_lock<mutex> ul(guard_);
+    waiter_.wait(ul, [this] { return !pages_.empty() || finished_; });
+
+    if (pages_.empty()) {
+      if (status_ == CommandBase::NO_REPLY)
+        status_ = CommandBase::OK_REPLY;
+      return false;
+    }
+
+    current_ = pages_.front();
+    pages_.pop_front();
+
+    // Taking a page makes room for the next one, if the scan was paused
+    if (!paused_cursor_.empty()) {
+      cursor.swap(paused_cursor_);
+      in_flight_ = true;
+    }
+  }
+
+  page_ = current_->replyRef().array(1);
+  if (!cursor.empty())
+    request(cursor);
+  return true;
+}
+
+int ScanStream::status() {
+  lock_guard<mutex> lg(guard_);
+  return status_;
+}
+
+bool ScanStream::ok() {
+  lock_guard<mutex> lg(guard_);
+  return (status_ == CommandBase::NO_REPLY) || (status_ == CommandBase::OK_REPLY);
+}
+
+string ScanStream::lastError() {
+  lock_guard<mutex> lg(guard_);
+  return last_error_;
+}
+
+void ScanStream::request(const string &cursor) {
+
+  vector<string> cmd = cmd_;
+  cmd[cursor_index_] = cursor;
+
+  try {
+    rdx_.createCommand<ArrayView>(std::move(cmd),
+                                  [this](Command<ArrayView> &c) { pageReceived(c); }, 0, 0,
+                                  false);
+  } catch (const runtime_error &e) {
+    lock_guard<mutex> lg(guard_);
+    in_flight_ = false;
+    finished_ = true;
+    status_ = CommandBase::SEND_ERROR;
+    last_error_ = e.what();
+    waiter_.notify_all();
+  }
+}
+
+void ScanStream::pageReceived(Command<ArrayView> &c) {
+
+  string cursor;
+  ArrayView elements;
+  int status = readPage(c, cursor, elements);
+  bool keep = (status == CommandBase::OK_REPLY) && !elements.empty();
+  bool fetch = false;
+
+  {
+    lock_guard<mutex> lg(guard_);
+
+    if (status != CommandBase::OK_REPLY) {
+      finished_ = true;
+      status_ = status;
+      last_error_ = c.lastError();
+      if (last_error_.empty())
+        last_error_ = ((status == CommandBase::SEND_ERROR) ? "Could not send " : "Unexpected reply to ") + c.cmd();
+    } else if (cursor == "0") {
+      finished_ = true;
+    }
+
+    if (keep)
+      pages_.push_back(&c);
+
+    // Fetch the next page if there is room for it, or pause until the
+    // consumer takes one. While fetching, the stream stays in flight, so
+    // it is not destroyed before request() returns.
+    if (!finished_) {
+      if (pages_.size() < max_pages_)
+        fetch = true;
+      else
+        paused_cursor_ = cursor;
+    }
+    in_flight_ = fetch;
+    waiter_.notify_all();
+  }
+
+  if (!keep)
+    c.free();
+  if (fetch)
+    request(cursor);
+}
+
+} // End namespace redox
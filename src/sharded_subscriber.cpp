@@ -0,0 +1,319 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <deque>
+#include <thread>
+
+#include "sharded_subscriber.hpp"
+#include "utils/hash.hpp"
+
+using namespace std;
+
+namespace redox {
+
+struct ShardedSubscriber::Worker {
+
+  // A callback to run, with copies of its arguments
+  struct Task {
+    enum Kind { MESSAGE, SUBSCRIBED, UNSUBSCRIBED, FAILED };
+
+    Kind kind;
+    shared_ptr<const PubSubHandler> handler;
+    string topic;
+    string payload;
+    int status;
+
+    void run() const {
+      switch (kind) {
+      case MESSAGE:
+        if (handler->slice_callback)
+          handler->slice_callback(Slice(topic), Slice(payload));
+        else if (handler->msg_callback)
+          handler->msg_callback(topic, payload);
+        break;
+      case SUBSCRIBED:
+        handler->sub_callback(topic);
+        break;
+      case UNSUBSCRIBED:
+        handler->unsub_callback(topic);
+        break;
+      case FAILED:
+        handler->err_callback(topic, status);
+        break;
+      }
+    }
+  };
+
+  Worker() : thread_(&Worker::run, this) {}
+
+  void push(Task &&task) {
+    bool idle;
+    {
+      lock_guard<mutex> lg(lock_);
+      idle = tasks_.empty();
+      tasks_.push_back(std::move(task));
+    }
+
+    // Only an empty queue can have the worker waiting on it
+    if (idle)
+      cv_.notify_one();
+  }
+
+  // Run what is queued, then exit
+  void stop() {
+    {
+      lock_guard<mutex> lg(lock_);
+      stopping_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+private:
+  void run() {
+    deque<Task> batch;
+    while (true) {
+      {
+        unique_lock<mutex> ul(lock_);
+        cv_.wait(ul, [this] { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty())
+          return;
+        batch.swap(tasks_);
+      }
+
+      // Take the whole queue at once, so producers only contend for the
+      // lock once per batch
+      for (const Task &task : batch)
+        task.run();
+      batch.clear();
+    }
+  }
+
+  mutex lock_;
+  condition_variable cv_;
+  deque<Task> tasks_;
+  bool stopping_ = false;
+  thread thread_;
+};
+
+ShardedSubscriber::ShardedSubscriber(size_t num_shards, size_t num_workers, ostream &log_stream,
+                                     log::Level log_level) {
+
+  if (num_shards == 0)
+    num_shards = 1;
+
+  for (size_t i = 0; i < num_workers; i++)
+    workers_.emplace_back(new Worker());
+
+  for (size_t i = 0; i < num_shards; i++)
+    shards_.emplace_back(new Subscriber(log_stream, log_level));
+}
+
+// The shards are destroyed after the workers are stopped, and any message
+// they still hand over is dropped
+ShardedSubscriber::~ShardedSubscriber() { stopWorkers(); }
+
+void ShardedSubscriber::noWait(bool state) {
+  for (auto &sub : shards_)
+    sub->noWait(state);
+}
+
+void ShardedSubscriber::adaptiveSpin(int microseconds) {
+  for (auto &sub : shards_)
+    sub->adaptiveSpin(microseconds);
+}
+
+void ShardedSubscriber::threadPriority(int priority) {
+  for (auto &sub : shards_)
+    sub->threadPriority(priority);
+}
+
+void ShardedSubscriber::cpuAffinity(const vector<int> &cpus) {
+  for (size_t i = 0; i < cpus.size() && i < shards_.size(); i++)
+    shards_[i]->cpuAffinity(cpus[i]);
+}
+
+bool ShardedSubscriber::connect(const string &host, const int port) {
+
+  for (size_t i = 0; i < shards_.size(); i++) {
+    if (!shards_[i]->connect(host, port)) {
+      for (size_t j = 0; j < i; j++)
+        shards_[j]->disconnect();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ShardedSubscriber::connectUnix(const string &path) {
+
+  for (size_t i = 0; i < shards_.size(); i++) {
+    if (!shards_[i]->connectUnix(path)) {
+      for (size_t j = 0; j < i; j++)
+        shards_[j]->disconnect();
+      return false;
+    }
+  }
+  return true;
+}
+
+void ShardedSubscriber::disconnect() {
+  stop();
+  wait();
+}
+
+void ShardedSubscriber::stop() {
+  for (auto &sub : shards_)
+    sub->stop();
+}
+
+void ShardedSubscriber::wait() {
+  for (auto &sub : shards_)
+    sub->wait();
+  stopWorkers();
+}
+
+void ShardedSubscriber::stopWorkers() {
+  for (auto &worker : workers_)
+    worker->stop();
+}
+
+size_t ShardedSubscriber::shardFor(const string &topic) const {
+  if (shards_.size() == 1)
+    return 0;
+  return hashBytes(topic.data(), topic.size()) % shards_.size();
+}
+
+vector<vector<string>> ShardedSubscriber::byShard(const vector<string> &topics) const {
+  vector<vector<string>> groups(shards_.size());
+  for (const string &topic : topics)
+    groups[shardFor(topic)].push_back(topic);
+  return groups;
+}
+
+PubSubHandler ShardedSubscriber::onWorkers(PubSubHandler &&handler) {
+
+  typedef Worker::Task Task;
+  shared_ptr<const PubSubHandler> shared = make_shared<PubSubHandler>(std::move(handler));
+
+  // Every callback for a topic goes to the same worker
+  auto post = [this](const Slice &topic, Task &&task) {
+    workers_[hashBytes(topic.data(), topic.size()) % workers_.size()]->push(std::move(task));
+  };
+
+  PubSubHandler wrapped;
+  wrapped.slice_callback = [post, shared](const Slice &topic, const Slice &payload) {
+    post(topic, Task{Task::MESSAGE, shared, topic.str(), payload.str(), 0});
+  };
+  if (shared->sub_callback) {
+    wrapped.sub_callback = [post, shared](const string &topic) {
+      post(topic, Task{Task::SUBSCRIBED, shared, topic, string(), 0});
+    };
+  }
+  if (shared->unsub_callback) {
+    wrapped.unsub_callback = [post, shared](const string &topic) {
+      post(topic, Task{Task::UNSUBSCRIBED, shared, topic, string(), 0});
+    };
+  }
+  if (shared->err_callback) {
+    wrapped.err_callback = [post, shared](const string &topic, int status) {
+      post(topic, Task{Task::FAILED, shared, topic, string(), status});
+    };
+  }
+  return wrapped;
+}
+
+void ShardedSubscriber::subscribeBase(bool pattern, const vector<string> &topics,
+                                      PubSubHandler &&handler) {
+
+  PubSubHandler h = workers_.empty() ? std::move(handler) : onWorkers(std::move(handler));
+
+  vector<vector<string>> groups = byShard(topics);
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (groups[i].empty())
+      continue;
+
+    Subscriber &sub = *shards_[i];
+    if (h.slice_callback) {
+      if (pattern)
+        sub.psubscribe(groups[i], h.slice_callback, h.sub_callback, h.unsub_callback,
+                       h.err_callback);
+      else
+        sub.subscribe(groups[i], h.slice_callback, h.sub_callback, h.unsub_callback,
+                      h.err_callback);
+    } else {
+      if (pattern)
+        sub.psubscribe(groups[i], h.msg_callback, h.sub_callback, h.unsub_callback,
+                       h.err_callback);
+      else
+        sub.subscribe(groups[i], h.msg_callback, h.sub_callback, h.unsub_callback,
+                      h.err_callback);
+    }
+  }
+}
+
+void ShardedSubscriber::unsubscribe(const vector<string> &topics,
+                                    function<void(const string &, int)> err_callback) {
+  vector<vector<string>> groups = byShard(topics);
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (!groups[i].empty())
+      shards_[i]->unsubscribe(groups[i], err_callback);
+  }
+}
+
+void ShardedSubscriber::unsubscribe() {
+  for (auto &sub : shards_)
+    sub->unsubscribe();
+}
+
+void ShardedSubscriber::punsubscribe(const vector<string> &topics,
+                                     function<void(const string &, int)> err_callback) {
+  vector<vector<string>> groups = byShard(topics);
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (!groups[i].empty())
+      shards_[i]->punsubscribe(groups[i], err_callback);
+  }
+}
+
+void ShardedSubscriber::punsubscribe() {
+  for (auto &sub : shards_)
+    sub->punsubscribe();
+}
+
+set<string> ShardedSubscriber::subscribedTopics() {
+  set<string> topics;
+  for (auto &sub : shards_) {
+    set<string> shard_topics = sub->subscribedTopics();
+    topics.insert(shard_topics.begin(), shard_topics.end());
+  }
+  return topics;
+}
+
+set<string> ShardedSubscriber::psubscribedTopics() {
+  set<string> topics;
+  for (auto &sub : shards_) {
+    set<string> shard_topics = sub->psubscribedTopics();
+    topics.insert(shard_topics.begin(), shard_topics.end());
+  }
+  return topics;
+}
+
+} // End namespace redox
@@ -25,6 +25,110 @@ using namespace std;
 
 namespace redox {
 
+namespace {
+
+// Whether a reply is the given string, like the kind of a pub/sub reply
+template <size_t N> bool replyEquals(const redisReply *r, const char (&str)[N]) {
+  return (r->str != nullptr) && ((size_t)r->len == N - 1) && !memcmp(r->str, str, N - 1);
+}
+
+string replyString(const redisReply *r) {
+  return (r->str != nullptr) ? string(r->str, r->len) : string();
+}
+
+} // anonymous
+
+const char *PubSubRequest::name(Kind kind) {
+  static const char *names[] = {"SUBSCRIBE", "PSUBSCRIBE", "UNSUBSCRIBE", "PUNSUBSCRIBE"};
+  return names[kind];
+}
+
+// ------------------------------------------------
+// PubSubCommand
+// ------------------------------------------------
+
+PubSubCommand *PubSubCommand::create(Subscriber *sub, Redox *rdx) {
+  if (!rdx->getRunning()) {
+    throw runtime_error("[ERROR] Need to connect Redox before running commands!");
+  }
+  return new PubSubCommand(sub, rdx);
+}
+
+PubSubCommand::PubSubCommand(Subscriber *sub, Redox *rdx)
+    : CommandBase(rdx, rdx->nextCommandId(), 0, 0, false, rdx->logger_), sub_(sub) {
+  rdx->commands_allocated_++;
+}
+
+void PubSubCommand::request(PubSubRequest &&req) {
+
+  bool first;
+  {
+    lock_guard<mutex> lg(queued_guard_);
+    queued_.push_back(std::move(req));
+    first = !in_queue_;
+    in_queue_ = true;
+  }
+
+  // A node can only be on the submission queue once, later requests are
+  // picked up along with the first
+  if (first)
+    enqueue();
+}
+
+void PubSubCommand::dequeued() {
+
+  {
+    lock_guard<mutex> lg(queued_guard_);
+    sent_.clear();
+    sent_.swap(queued_);
+    in_queue_ = false;
+  }
+
+  argv_.clear();
+  argvlen_.clear();
+  arg_offsets_.clear();
+  for (const PubSubRequest &req : sent_) {
+    const char *name = PubSubRequest::name(req.kind);
+    arg_offsets_.push_back(argv_.size());
+    argv_.push_back(name);
+    argvlen_.push_back(strlen(name));
+    for (const string &topic : req.topics) {
+      argv_.push_back(topic.data());
+      argvlen_.push_back(topic.size());
+    }
+  }
+  arg_offsets_.push_back(argv_.size());
+
+  sub_->requestsSent(sent_);
+}
+
+void PubSubCommand::processReply(redisReply *r) {
+
+  readReply(r);
+  if (reply_obj_ != nullptr)
+    sub_->handleReply(reply_status_, reply_obj_);
+
+  freeReply();
+}
+
+void PubSubCommand::parseReplyObject() {
+  if (reply_obj_->type == REDIS_REPLY_ERROR) {
+    reply_status_ = ERROR_REPLY;
+    last_error_ = replyString(reply_obj_);
+  } else {
+    reply_status_ = OK_REPLY;
+  }
+}
+
+void PubSubCommand::sendFailed(size_t index) {
+  reply_status_ = SEND_ERROR;
+  sub_->requestsFailed(numCommands() - index, SEND_ERROR);
+}
+
+// ------------------------------------------------
+// Subscriber
+// ------------------------------------------------
+
 Subscriber::Subscriber(ostream &log_stream, log::Level log_level)
     : rdx_(log_stream, log_level), logger_(rdx_.logger_) {}
 
@@ -37,199 +141,317 @@ void Subscriber::disconnect() {
 
 void Subscriber::wait() { rdx_.wait(); }
 
-// This is a fairly awkward way of shutting down, where
-// we pause to wait for subscriptions to happen, and then
-// unsubscribe from everything and wait for that to finish.
-// The reason is because hiredis goes into
-// a segfault in freeReplyObject() under redisAsyncDisconnect()
-// if we don't do this first.
-// TODO(hayk): look at hiredis, ask them what causes the error
+// Closing the connection ends all subscriptions on the server, so there
+// is no need to unsubscribe first and wait for the confirmations. hiredis
+// runs the callback of every subscribed channel with a null reply as it
+// disconnects, which Redox ignores once the command is freed.
 void Subscriber::stop() {
 
-  this_thread::sleep_for(chrono::milliseconds(1000));
+  {
+    lock_guard<mutex> lg(command_guard_);
+    if (command_ != nullptr)
+      command_->free();
+    command_ = nullptr;
+  }
 
-  for (const string &topic : subscribedTopics())
-    unsubscribe(topic);
+  {
+    lock_guard<mutex> lg(subscribed_topics_guard_);
+    subscribed_topics_.clear();
+  }
+  {
+    lock_guard<mutex> lg(psubscribed_topics_guard_);
+    psubscribed_topics_.clear();
+  }
+  num_pending_subs_ = 0;
 
-  for (const string &topic : psubscribedTopics())
-    punsubscribe(topic);
+  rdx_.stop();
+}
 
+long long Subscriber::clientId() {
+  Command<long long int> &c = rdx_.commandSync<long long int>({"CLIENT", "ID"});
+  long long id = c.ok() ? c.reply() : -1;
+  c.free();
+  return id;
+}
+
+void Subscriber::request(PubSubRequest &&req) {
+
+  PubSubCommand *c;
   {
-    unique_lock<mutex> ul(subscribed_topics_guard_);
-    cv_unsub_.wait(ul, [this] {
-      return (subscribed_topics_.size() == 0);
-    });
+    lock_guard<mutex> lg(command_guard_);
+    if (command_ == nullptr)
+      command_ = PubSubCommand::create(this, &rdx_);
+    c = command_;
   }
 
-  {
-    unique_lock<mutex> ul(psubscribed_topics_guard_);
-    cv_punsub_.wait(ul, [this] {
-      return (psubscribed_topics_.size() == 0);
-    });
+  c->request(std::move(req));
+}
+
+void Subscriber::subscribeBase(PubSubRequest::Kind kind, const vector<string> &topics,
+                               PubSubHandler &&handler) {
+
+  bool pattern = (kind == PubSubRequest::PSUBSCRIBE);
+  lock_guard<mutex> lg(pattern ? psubscribed_topics_guard_ : subscribed_topics_guard_);
+  const set<string> &subscribed = pattern ? psubscribed_topics_ : subscribed_topics_;
+
+  PubSubRequest req;
+  req.kind = kind;
+  req.handler = std::move(handler);
+  for (const string &topic : topics) {
+    if (subscribed.find(topic) != subscribed.end()) {
+      logger_.warning() << "Already " << (pattern ? "psubscribed" : "subscribed") << " to "
+                        << topic << "!";
+      continue;
+    }
+    req.topics.push_back(topic);
   }
 
-  for (Command<redisReply *> *c : commands_)
-    c->free();
+  if (req.topics.empty())
+    return;
 
-  rdx_.stop();
+  size_t num_topics = req.topics.size();
+  request(std::move(req));
+  num_pending_subs_ += (int)num_topics;
 }
 
-// For debugging only
-void debugReply(Command<redisReply *> c) {
-
-  redisReply *reply = c.reply();
-
-  cout << "------" << endl;
-  cout << c.cmd() << " " << (reply->type == REDIS_REPLY_ARRAY) << " " << (reply->elements) << endl;
-  for (size_t i = 0; i < reply->elements; i++) {
-    redisReply *r = reply->element[i];
-    cout << "element " << i << ", reply type = " << r->type << " ";
-    if (r->type == REDIS_REPLY_STRING)
-      cout << r->str << endl;
-    else if (r->type == REDIS_REPLY_INTEGER)
-      cout << r->integer << endl;
-    else
-      cout << "some other type" << endl;
-  }
-  cout << "------" << endl;
-}
-
-void Subscriber::subscribeBase(const string cmd_name, const string topic,
-                               function<void(const string &, const string &)> msg_callback,
-                               function<void(const string &)> sub_callback,
-                               function<void(const string &)> unsub_callback,
-                               function<void(const string &, int)> err_callback) {
-
-  Command<redisReply *> &sub_cmd = rdx_.commandLoop<redisReply *>(
-      {cmd_name, topic},
-      [this, topic, msg_callback, err_callback, sub_callback, unsub_callback](
-          Command<redisReply *> &c) {
-
-        if (!c.ok()) {
-          num_pending_subs_--;
-          if (err_callback)
-            err_callback(topic, c.status());
-          return;
-        }
-
-        redisReply *reply = c.reply();
-
-        // If the last entry is an integer, then it is a [p]sub/[p]unsub command
-        if ((reply->type == REDIS_REPLY_ARRAY) &&
-            (reply->element[reply->elements - 1]->type == REDIS_REPLY_INTEGER)) {
-
-
-          if (!strncmp(reply->element[0]->str, "sub", 3)) {
-            lock_guard<mutex> lg(subscribed_topics_guard_);
-            subscribed_topics_.insert(topic);
-            num_pending_subs_--;
-            if (sub_callback)
-              sub_callback(topic);
-          } else if (!strncmp(reply->element[0]->str, "psub", 4)) {
-            lock_guard<mutex> lg(psubscribed_topics_guard_);
-            psubscribed_topics_.insert(topic);
-            num_pending_subs_--;
-            if (sub_callback)
-              sub_callback(topic);
-          } else if (!strncmp(reply->element[0]->str, "uns", 3)) {
-            lock_guard<mutex> lg(subscribed_topics_guard_);
-            subscribed_topics_.erase(topic);
-            if (unsub_callback)
-              unsub_callback(topic);
-            cv_unsub_.notify_all();
-          } else if (!strncmp(reply->element[0]->str, "puns", 4)) {
-            lock_guard<mutex> lg(psubscribed_topics_guard_);
-            psubscribed_topics_.erase(topic);
-            if (unsub_callback)
-              unsub_callback(topic);
-            cv_punsub_.notify_all();
-          }
-
-          else
-            logger_.error() << "Unknown pubsub message: " << reply->element[0]->str;
-        }
-
-        // Message for subscribe
-        else if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 3)) {
-          char *msg = reply->element[2]->str;
-          int len = reply->element[2]->len;
-          if (msg && msg_callback)
-            msg_callback(topic, string(msg, len));
-        }
-
-        // Message for psubscribe
-        else if ((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 4)) {
-          char *msg = reply->element[3]->str;
-          int len = reply->element[3]->len;
-          if (msg && msg_callback)
-            msg_callback(reply->element[2]->str, string(msg, len));
-        }
-
-        else
-          logger_.error() << "Unknown pubsub message of type " << reply->type;
-      },
-      1e10 // To keep the command around for a few hundred years
-      );
-
-  // Add it to the command list
-  commands_.insert(&sub_cmd);
-  num_pending_subs_++;
-}
-
-void Subscriber::subscribe(const string topic,
+void Subscriber::subscribe(const vector<string> &topics,
                            function<void(const string &, const string &)> msg_callback,
                            function<void(const string &)> sub_callback,
                            function<void(const string &)> unsub_callback,
                            function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(subscribed_topics_guard_);
-  if (subscribed_topics_.find(topic) != subscribed_topics_.end()) {
-    logger_.warning() << "Already subscribed to " << topic << "!";
-    return;
-  }
-  subscribeBase("SUBSCRIBE", topic, msg_callback, sub_callback, unsub_callback, err_callback);
+  PubSubHandler handler;
+  handler.msg_callback = std::move(msg_callback);
+  handler.sub_callback = std::move(sub_callback);
+  handler.unsub_callback = std::move(unsub_callback);
+  handler.err_callback = std::move(err_callback);
+  subscribeBase(PubSubRequest::SUBSCRIBE, topics, std::move(handler));
 }
 
-void Subscriber::psubscribe(const string topic,
+void Subscriber::psubscribe(const vector<string> &topics,
                             function<void(const string &, const string &)> msg_callback,
                             function<void(const string &)> sub_callback,
                             function<void(const string &)> unsub_callback,
                             function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(psubscribed_topics_guard_);
-  if (psubscribed_topics_.find(topic) != psubscribed_topics_.end()) {
-    logger_.warning() << "Already psubscribed to " << topic << "!";
-    return;
-  }
-  subscribeBase("PSUBSCRIBE", topic, msg_callback, sub_callback, unsub_callback, err_callback);
+  PubSubHandler handler;
+  handler.msg_callback = std::move(msg_callback);
+  handler.sub_callback = std::move(sub_callback);
+  handler.unsub_callback = std::move(unsub_callback);
+  handler.err_callback = std::move(err_callback);
+  subscribeBase(PubSubRequest::PSUBSCRIBE, topics, std::move(handler));
 }
 
-void Subscriber::unsubscribeBase(const string cmd_name, const string topic,
+void Subscriber::unsubscribeBase(PubSubRequest::Kind kind, const vector<string> &topics,
                                  function<void(const string &, int)> err_callback) {
-  rdx_.command<redisReply *>({cmd_name, topic}, [topic, err_callback](Command<redisReply *> &c) {
-    if (!c.ok()) {
-      if (err_callback)
-        err_callback(topic, c.status());
+
+  bool pattern = (kind == PubSubRequest::PUNSUBSCRIBE);
+  lock_guard<mutex> lg(pattern ? psubscribed_topics_guard_ : subscribed_topics_guard_);
+  const set<string> &subscribed = pattern ? psubscribed_topics_ : subscribed_topics_;
+
+  PubSubRequest req;
+  req.kind = kind;
+  req.handler.err_callback = std::move(err_callback);
+  for (const string &topic : topics) {
+    if (subscribed.find(topic) == subscribed.end()) {
+      logger_.warning() << "Cannot " << (pattern ? "punsubscribe" : "unsubscribe") << " from "
+                        << topic << ", not " << (pattern ? "psubscribed" : "subscribed") << "!";
+      continue;
+    }
+    req.topics.push_back(topic);
+  }
+
+  if (!req.topics.empty())
+    request(std::move(req));
+}
+
+void Subscriber::unsubscribe(const vector<string> &topics,
+                             function<void(const string &, int)> err_callback) {
+  unsubscribeBase(PubSubRequest::UNSUBSCRIBE, topics, std::move(err_callback));
+}
+
+void Subscriber::punsubscribe(const vector<string> &topics,
+                              function<void(const string &, int)> err_callback) {
+  unsubscribeBase(PubSubRequest::PUNSUBSCRIBE, topics, std::move(err_callback));
+}
+
+// ------------------------------------------------
+// Event thread side
+// ------------------------------------------------
+
+void Subscriber::requestsSent(vector<PubSubRequest> &requests) {
+
+  for (PubSubRequest &req : requests) {
+
+    PubSubRequest waiting;
+    waiting.kind = req.kind;
+    waiting.topics = req.topics;
+    waiting.handler.err_callback = req.handler.err_callback;
+    awaiting_.push_back(std::move(waiting));
+
+    // Handlers are in place before any message can arrive. A replaced
+    // handler may be running right now if this is called from inside
+    // one of its callbacks, so it is kept alive until the next reply.
+    if (req.kind == PubSubRequest::SUBSCRIBE || req.kind == PubSubRequest::PSUBSCRIBE) {
+      HandlerMap &handlers = handlersFor(req.kind);
+      for (const string &topic : req.topics) {
+        unique_ptr<PubSubHandler> &handler = handlers[topic];
+        if (handler)
+          retired_handlers_.push_back(std::move(handler));
+        handler.reset(new PubSubHandler(req.handler));
+      }
+    }
+  }
+}
+
+void Subscriber::requestsFailed(size_t count, int status) {
+
+  // The requests that were not sent are the last ones waiting
+  count = min(count, awaiting_.size());
+  deque<PubSubRequest> failed_reqs(awaiting_.end() - count, awaiting_.end());
+  awaiting_.erase(awaiting_.end() - count, awaiting_.end());
+
+  for (PubSubRequest &req : failed_reqs)
+    failed(req, status);
+}
+
+void Subscriber::failed(PubSubRequest &req, int status) {
+
+  // Topics already confirmed are not affected
+  for (size_t i = req.confirmed; i < req.topics.size(); i++) {
+    const string &topic = req.topics[i];
+
+    if (req.kind == PubSubRequest::SUBSCRIBE || req.kind == PubSubRequest::PSUBSCRIBE) {
+      num_pending_subs_--;
+      HandlerMap &handlers = handlersFor(req.kind);
+      auto it = handlers.find(topic);
+      if (it != handlers.end()) {
+        retired_handlers_.push_back(std::move(it->second));
+        handlers.erase(it);
+      }
+    }
+
+    if (req.handler.err_callback)
+      req.handler.err_callback(topic, status);
+  }
+}
+
+void Subscriber::handleReply(int status, redisReply *reply) {
+
+  retired_handlers_.clear();
+
+  // Replies to requests come in order, so an error belongs to the oldest
+  // request that is still waiting
+  if (status != CommandBase::OK_REPLY) {
+    if (awaiting_.empty()) {
+      logger_.error() << "Pub/sub error: " << replyString(reply);
       return;
     }
-  });
+    PubSubRequest req = std::move(awaiting_.front());
+    awaiting_.pop_front();
+    logger_.error() << PubSubRequest::name(req.kind) << ": " << replyString(reply);
+    failed(req, status);
+    return;
+  }
+
+  if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements < 3)) {
+    logger_.error() << "Unknown pubsub message of type " << reply->type;
+    return;
+  }
+
+  const redisReply *kind = reply->element[0];
+
+  // Messages first, since they are by far the most common
+  if (replyEquals(kind, "message"))
+    deliver(channel_handlers_, reply->element[1], reply->element[1], reply->element[2]);
+  else if (replyEquals(kind, "pmessage") && (reply->elements == 4))
+    deliver(pattern_handlers_, reply->element[1], reply->element[2], reply->element[3]);
+  else if (replyEquals(kind, "subscribe"))
+    confirmed(PubSubRequest::SUBSCRIBE, reply->element[1]);
+  else if (replyEquals(kind, "psubscribe"))
+    confirmed(PubSubRequest::PSUBSCRIBE, reply->element[1]);
+  else if (replyEquals(kind, "unsubscribe"))
+    confirmed(PubSubRequest::UNSUBSCRIBE, reply->element[1]);
+  else if (replyEquals(kind, "punsubscribe"))
+    confirmed(PubSubRequest::PUNSUBSCRIBE, reply->element[1]);
+  else
+    logger_.error() << "Unknown pubsub message: " << replyString(kind);
 }
 
-void Subscriber::unsubscribe(const string topic, function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(subscribed_topics_guard_);
-  if (subscribed_topics_.find(topic) == subscribed_topics_.end()) {
-    logger_.warning() << "Cannot unsubscribe from " << topic << ", not subscribed!";
+void Subscriber::deliver(HandlerMap &handlers, const redisReply *key, const redisReply *channel,
+                         const redisReply *payload) {
+
+  lookup_key_.assign(key->str, key->len);
+  auto it = handlers.find(lookup_key_);
+
+  // Messages can still arrive for a topic being unsubscribed from
+  if (it == handlers.end())
+    return;
+
+  const PubSubHandler &handler = *it->second;
+  if (handler.reply_callback) {
+    handler.reply_callback(Slice(channel->str, channel->len), payload);
     return;
   }
-  unsubscribeBase("UNSUBSCRIBE", topic, err_callback);
+
+  // Only raw callbacks take payloads that are not a string
+  if (payload->str == nullptr)
+    return;
+
+  if (handler.slice_callback)
+    handler.slice_callback(Slice(channel->str, channel->len), Slice(payload->str, payload->len));
+  else if (handler.msg_callback)
+    handler.msg_callback(string(channel->str, channel->len), string(payload->str, payload->len));
 }
 
-void Subscriber::punsubscribe(const string topic,
-                              function<void(const string &, int)> err_callback) {
-  lock_guard<mutex> lg(psubscribed_topics_guard_);
-  if (psubscribed_topics_.find(topic) == psubscribed_topics_.end()) {
-    logger_.warning() << "Cannot punsubscribe from " << topic << ", not psubscribed!";
+void Subscriber::confirmed(PubSubRequest::Kind kind, const redisReply *topic_reply) {
+
+  string topic = replyString(topic_reply);
+
+  // Usually the next topic of the oldest request
+  for (auto it = awaiting_.begin(); it != awaiting_.end(); ++it) {
+    if ((it->kind == kind) && (it->topics[it->confirmed] == topic)) {
+      if (++it->confirmed == it->topics.size())
+        awaiting_.erase(it);
+      break;
+    }
+  }
+
+  auto &handlers = handlersFor(kind);
+  auto it = handlers.find(topic);
+  PubSubHandler *handler = (it != handlers.end()) ? it->second.get() : nullptr;
+
+  if (kind == PubSubRequest::SUBSCRIBE || kind == PubSubRequest::PSUBSCRIBE) {
+
+    if (kind == PubSubRequest::SUBSCRIBE) {
+      lock_guard<mutex> lg(subscribed_topics_guard_);
+      subscribed_topics_.insert(topic);
+    } else {
+      lock_guard<mutex> lg(psubscribed_topics_guard_);
+      psubscribed_topics_.insert(topic);
+    }
+    num_pending_subs_--;
+
+    if (handler != nullptr && handler->sub_callback)
+      handler->sub_callback(topic);
     return;
   }
-  unsubscribeBase("PUNSUBSCRIBE", topic, err_callback);
+
+  // Keep the handler until its unsubscribe callback returns
+  unique_ptr<PubSubHandler> removed;
+  if (it != handlers.end()) {
+    removed = std::move(it->second);
+    handlers.erase(it);
+  }
+
+  if (kind == PubSubRequest::UNSUBSCRIBE) {
+    lock_guard<mutex> lg(subscribed_topics_guard_);
+    subscribed_topics_.erase(topic);
+  } else {
+    lock_guard<mutex> lg(psubscribed_topics_guard_);
+    psubscribed_topics_.erase(topic);
+  }
+
+  if (removed && removed->unsub_callback)
+    removed->unsub_callback(topic);
 }
 
 } // End namespace
@@ -0,0 +1,180 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef REDOX_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef REDOX_ZSTD
+#include <zstd.h>
+#endif
+
+#include "utils/compression.hpp"
+
+using namespace std;
+
+namespace redox {
+namespace compression {
+
+namespace {
+
+const char MAGIC[] = "\xffRZ";
+const size_t MAGIC_SIZE = 3;
+
+// Values are sized by 32 bits in the header
+const size_t MAX_VALUE_SIZE = 0xffffffffu;
+
+// Fastest zstd level, values are compressed on the hot path
+const int ZSTD_LEVEL = 1;
+
+// Upper bound of the compressed size of [size] bytes, 0 if unavailable
+size_t compressBound(int codec, size_t size) {
+#ifdef REDOX_LZ4
+  if ((codec == LZ4) && (size <= (size_t)LZ4_MAX_INPUT_SIZE))
+    return (size_t)LZ4_compressBound((int)size);
+#endif
+#ifdef REDOX_ZSTD
+  if (codec == ZSTD)
+    return ZSTD_compressBound(size);
+#endif
+  return 0;
+}
+
+// Compress into a buffer of compressBound() bytes, and return the
+// compressed size, 0 on failure
+size_t compressInto(int codec, const Slice &value, char *out, size_t capacity) {
+#ifdef REDOX_LZ4
+  if (codec == LZ4)
+    return (size_t)max(0, LZ4_compress_default(value.data(), out, (int)value.size(),
+                                               (int)capacity));
+#endif
+#ifdef REDOX_ZSTD
+  if (codec == ZSTD) {
+    size_t n = ZSTD_compress(out, capacity, value.data(), value.size(), ZSTD_LEVEL);
+    return ZSTD_isError(n) ? 0 : n;
+  }
+#endif
+  return 0;
+}
+
+// LZ4 can not expand a byte into more than about this many
+const size_t LZ4_MAX_RATIO = 255;
+
+// Whether [in_size] bytes can decode into [size] bytes, checked before
+// allocating for them, since the header is read from any stored value
+bool plausibleSize(int codec, const char *in, size_t in_size, size_t size) {
+#ifdef REDOX_LZ4
+  if (codec == LZ4)
+    return size <= in_size * LZ4_MAX_RATIO;
+#endif
+#ifdef REDOX_ZSTD
+  if (codec == ZSTD)
+    return ZSTD_getFrameContentSize(in, in_size) == (unsigned long long)size;
+#endif
+  return false;
+}
+
+// Decompress exactly [size] bytes, and return whether that succeeded
+bool decompressInto(int codec, const char *in, size_t in_size, char *out, size_t size) {
+#ifdef REDOX_LZ4
+  if ((codec == LZ4) && (in_size <= (size_t)LZ4_MAX_INPUT_SIZE) &&
+      (size <= (size_t)LZ4_MAX_INPUT_SIZE))
+    return LZ4_decompress_safe(in, out, (int)in_size, (int)size) == (int)size;
+#endif
+#ifdef REDOX_ZSTD
+  if (codec == ZSTD)
+    return ZSTD_decompress(out, size, in, in_size) == size;
+#endif
+  return false;
+}
+
+} // anonymous
+
+bool available(int codec) {
+#ifdef REDOX_LZ4
+  if (codec == LZ4)
+    return true;
+#endif
+#ifdef REDOX_ZSTD
+  if (codec == ZSTD)
+    return true;
+#endif
+  return false;
+}
+
+bool compress(int codec, const Slice &value, string &out) {
+
+  if (value.size() > MAX_VALUE_SIZE)
+    return false;
+  size_t bound = compressBound(codec, value.size());
+  if (bound == 0)
+    return false;
+
+  size_t start = out.size();
+  out.resize(start + HEADER_SIZE + bound);
+  char *header = &out[start];
+  memcpy(header, MAGIC, MAGIC_SIZE);
+  header[3] = (char)codec;
+  uint32_t size = (uint32_t)value.size();
+  for (int i = 0; i < 4; i++)
+    header[4 + i] = (char)((size >> (8 * i)) & 0xff);
+
+  size_t n = compressInto(codec, value, header + HEADER_SIZE, bound);
+  if ((n == 0) || (HEADER_SIZE + n >= value.size())) {
+    out.resize(start);
+    return false;
+  }
+  out.resize(start + HEADER_SIZE + n);
+  return true;
+}
+
+bool isCompressed(const Slice &value) {
+  return (value.size() >= HEADER_SIZE) && (memcmp(value.data(), MAGIC, MAGIC_SIZE) == 0);
+}
+
+bool decompress(const Slice &value, string &out) {
+
+  if (!isCompressed(value))
+    return false;
+
+  const unsigned char *header = (const unsigned char *)value.data();
+  int codec = header[3];
+  size_t size = 0;
+  for (int i = 0; i < 4; i++)
+    size |= (size_t)header[4 + i] << (8 * i);
+
+  const char *in = value.data() + HEADER_SIZE;
+  size_t in_size = value.size() - HEADER_SIZE;
+  if (!available(codec) || !plausibleSize(codec, in, in_size, size))
+    return false;
+
+  out.resize(size);
+  if (!decompressInto(codec, in, in_size, &out[0], size)) {
+    out.clear();
+    return false;
+  }
+  return true;
+}
+
+} // End namespace compression
+} // End namespace redox
@@ -0,0 +1,89 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <algorithm>
+
+#include "utils/histogram.hpp"
+
+using namespace std;
+
+namespace redox {
+
+const int Histogram::SUB_BITS;
+const int Histogram::SUB_BUCKETS;
+const int Histogram::NUM_BUCKETS;
+
+Histogram::Histogram() : count_(0), sum_(0), max_(0) {
+  for (auto &bucket : buckets_)
+    bucket.store(0, memory_order_relaxed);
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+
+  HistogramSnapshot snap;
+  snap.buckets.resize(NUM_BUCKETS);
+  for (int i = 0; i < NUM_BUCKETS; i++)
+    snap.buckets[i] = buckets_[i].load(memory_order_relaxed);
+
+  snap.count = count_.load(memory_order_relaxed);
+  snap.sum = sum_.load(memory_order_relaxed);
+  snap.max = max_.load(memory_order_relaxed);
+  return snap;
+}
+
+uint64_t Histogram::bucketLow(int index) {
+  if (index < SUB_BUCKETS)
+    return (uint64_t)index;
+  int exponent = (index >> SUB_BITS) + SUB_BITS - 1;
+  uint64_t mantissa = (uint64_t)(index & (SUB_BUCKETS - 1));
+  return (SUB_BUCKETS + mantissa) << (exponent - SUB_BITS);
+}
+
+uint64_t Histogram::bucketHigh(int index) {
+  if (index < SUB_BUCKETS)
+    return (uint64_t)index;
+  int exponent = (index >> SUB_BITS) + SUB_BITS - 1;
+  return bucketLow(index) + (uint64_t(1) << (exponent - SUB_BITS)) - 1;
+}
+
+uint64_t HistogramSnapshot::percentile(double fraction) const {
+
+  // The buckets are read one by one while recording goes on, so count
+  // them up rather than trusting count
+  uint64_t total = 0;
+  for (uint64_t n : buckets)
+    total += n;
+  if (total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(std::max(0.0, std::min(1.0, fraction)) * total);
+  if (rank == 0)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    seen += buckets[i];
+    if (seen >= rank)
+      return std::min(Histogram::bucketHigh((int)i), max);
+  }
+  return max;
+}
+
+} // End namespace redox
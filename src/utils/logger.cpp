@@ -1,89 +1,241 @@
-/*
-* Simple stream-based logger for C++11.
-*
-* Adapted from
-*   http://vilipetek.com/2014/04/17/thread-safe-simple-logger-in-c11/
-*/
-
-#include "utils/logger.hpp"
-#include <iostream>
-#include <iomanip>
-
-// needed for MSVC
-#ifdef WIN32
-#define localtime_r(_Time, _Tm) localtime_s(_Tm, _Time)
-#endif // localtime_r
-
-namespace redox {
-namespace log {
-
-// Convert date and time info from tm to a character string
-// in format "YYYY-mm-DD HH:MM:SS" and send it to a stream
-std::ostream &operator<<(std::ostream &stream, const tm *tm) {
-// I had to muck around this section since GCC 4.8.1 did not implement std::put_time
-//	return stream << std::put_time(tm, "%Y-%m-%d %H:%M:%S");
-  return stream << 1900 + tm->tm_year << '-' <<
-    std::setfill('0') << std::setw(2) << tm->tm_mon + 1 << '.'
-    << std::setfill('0') << std::setw(2) << tm->tm_mday << ' '
-    << std::setfill('0') << std::setw(2) << tm->tm_hour << ':'
-    << std::setfill('0') << std::setw(2) << tm->tm_min << ':'
-    << std::setfill('0') << std::setw(2) << tm->tm_sec;
-}
-
-// --------------------
-// Logstream
-// --------------------
-
-Logstream::Logstream(Logger &logger, Level loglevel) :
-  m_logger(logger), m_loglevel(loglevel) {
-}
-
-Logstream::Logstream(const Logstream &ls) :
-  m_logger(ls.m_logger), m_loglevel(ls.m_loglevel) {
-  // As of GCC 8.4.1 basic_stream is still lacking a copy constructor
-  // (part of C++11 specification)
-  //
-  // GCC compiler expects the copy constructor even thought because of
-  // RVO this constructor is never used
-}
-
-Logstream::~Logstream() {
-  if(m_logger.level() <= m_loglevel)
-    m_logger.log(m_loglevel, this->str());
-}
-
-// --------------------
-// Logger
-// --------------------
-
-Logger::Logger(std::string filename, Level loglevel) :
-  m_file(filename, std::fstream::out | std::fstream::app | std::fstream::ate),
-  m_stream(m_file), m_loglevel(loglevel) {}
-
-Logger::Logger(std::ostream &outfile, Level loglevel) :
-  m_stream(outfile), m_loglevel(loglevel) {}
-
-Logger::~Logger() {
-  m_stream.flush();
-}
-
-const tm *Logger::getLocalTime() {
-  auto in_time_t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-  localtime_r(&in_time_t, &m_time);
-  return &m_time;
-}
-
-void Logger::log(Level l, std::string oMessage) {
-  const static char *LevelStr[] = {
-    "[Trace]  ", "[Debug]  ", "[Info]   ", "[Warning]", "[Error]  ", "[Fatal]  "
-  };
-
-  m_lock.lock();
-  m_stream << '(' << getLocalTime() << ") "
-    << LevelStr[l] << "\t"
-    << oMessage << std::endl;
-  m_lock.unlock();
-}
-
-} // End namespace
-} // End namespace
+/*
+* Simple stream-based logger for C++11.
+*
+* Adapted from
+*   http://vilipetek.com/2014/04/17/thread-safe-simple-logger-in-c11/
+*/
+
+#include "utils/logger.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdint>
+
+// needed for MSVC
+#ifdef WIN32
+#define localtime_r(_Time, _Tm) localtime_s(_Tm, _Time)
+#endif // localtime_r
+
+namespace redox {
+namespace log {
+
+// Convert date and time info from tm to a character string
+// in format "YYYY-mm-DD HH:MM:SS" and send it to a stream
+std::ostream &operator<<(std::ostream &stream, const tm *tm) {
+// I had to muck around this section since GCC 4.8.1 did not implement std::put_time
+//	return stream << std::put_time(tm, "%Y-%m-%d %H:%M:%S");
+  return stream << 1900 + tm->tm_year << '-' <<
+    std::setfill('0') << std::setw(2) << tm->tm_mon + 1 << '.'
+    << std::setfill('0') << std::setw(2) << tm->tm_mday << ' '
+    << std::setfill('0') << std::setw(2) << tm->tm_hour << ':'
+    << std::setfill('0') << std::setw(2) << tm->tm_min << ':'
+    << std::setfill('0') << std::setw(2) << tm->tm_sec;
+}
+
+// --------------------
+// Logstream
+// --------------------
+
+Logstream::Logstream(Logger &logger, Level loglevel, bool enabled) :
+  m_logger(logger), m_loglevel(loglevel),
+  m_stream(enabled ? new std::ostringstream() : nullptr) {
+}
+
+Logstream::Logstream(Logstream &&ls) :
+  m_logger(ls.m_logger), m_loglevel(ls.m_loglevel), m_stream(std::move(ls.m_stream)) {
+}
+
+Logstream::~Logstream() {
+  if(m_stream)
+    m_logger.log(m_loglevel, m_stream->str());
+}
+
+// --------------------
+// Logger
+// --------------------
+
+const size_t Logger::QUEUE_SIZE;
+
+static_assert((Logger::QUEUE_SIZE & (Logger::QUEUE_SIZE - 1)) == 0,
+              "Logger queue size must be a power of two");
+
+Logger::Logger(std::string filename, Level loglevel) :
+  m_file(filename, std::fstream::out | std::fstream::app | std::fstream::ate),
+  m_stream(m_file), m_loglevel(loglevel), m_entries(new Entry[QUEUE_SIZE]) {
+  for(size_t i = 0; i < QUEUE_SIZE; i++)
+    m_entries[i].seq.store(i, std::memory_order_relaxed);
+}
+
+Logger::Logger(std::ostream &outfile, Level loglevel) :
+  m_stream(outfile), m_loglevel(loglevel), m_entries(new Entry[QUEUE_SIZE]) {
+  for(size_t i = 0; i < QUEUE_SIZE; i++)
+    m_entries[i].seq.store(i, std::memory_order_relaxed);
+}
+
+Logger::~Logger() {
+  if(m_started) {
+    {
+      std::lock_guard<std::mutex> lg(m_lock);
+      m_stop = true;
+      m_wake.notify_one();
+    }
+    m_writer.join();
+  }
+  m_stream.flush();
+}
+
+void Logger::log(Level l, std::string oMessage) {
+
+  if(l >= Level::Off)
+    return;
+
+  start();
+
+  auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  if(!push(l, now, std::move(oMessage))) {
+    m_dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  // Pairs with the fence in runWriter(), so either the writer sees the
+  // line or we see that it is going to sleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(m_idle.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lg(m_lock);
+    m_wake.notify_one();
+  }
+
+  if(l == Level::Fatal)
+    flush();
+}
+
+void Logger::flush() {
+
+  if(!m_started)
+    return;
+
+  size_t target = m_enqueue_pos.load(std::memory_order_acquire);
+
+  std::unique_lock<std::mutex> ul(m_lock);
+  m_wake.notify_one();
+  m_flushed.wait(ul, [this, target] {
+    return m_stop || (m_written.load(std::memory_order_acquire) >= target);
+  });
+}
+
+bool Logger::push(Level l, time_t time, std::string &&message) {
+
+  size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+  while(true) {
+    Entry &e = m_entries[pos & (QUEUE_SIZE - 1)];
+    size_t seq = e.seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if(diff == 0) {
+      if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        e.level = l;
+        e.time = time;
+        e.message = std::move(message);
+        e.seq.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if(diff < 0) {
+      // The writer has not caught up with this entry, the ring is full
+      return false;
+    } else {
+      pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void Logger::start() {
+
+  if(m_started.load(std::memory_order_acquire))
+    return;
+
+  std::lock_guard<std::mutex> lg(m_lock);
+  if(!m_started) {
+    m_writer = std::thread(&Logger::runWriter, this);
+    m_started.store(true, std::memory_order_release);
+  }
+}
+
+void Logger::runWriter() {
+
+  while(true) {
+
+    if(drain()) {
+      m_stream.flush();
+      std::lock_guard<std::mutex> lg(m_lock);
+      m_written.store(m_dequeue_pos, std::memory_order_release);
+      m_flushed.notify_all();
+      continue;
+    }
+
+    if(m_stop)
+      break;
+
+    // Sleep until a producer wakes us up. The timeout is only a safety net.
+    std::unique_lock<std::mutex> ul(m_lock);
+    m_idle.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    m_wake.wait_for(ul, std::chrono::milliseconds(100), [this] {
+      const Entry &e = m_entries[m_dequeue_pos & (QUEUE_SIZE - 1)];
+      return m_stop || (e.seq.load(std::memory_order_acquire) == m_dequeue_pos + 1);
+    });
+    m_idle.store(false, std::memory_order_relaxed);
+  }
+
+  std::lock_guard<std::mutex> lg(m_lock);
+  m_flushed.notify_all();
+}
+
+bool Logger::drain() {
+  const static char *LevelStr[] = {
+    "[Trace]  ", "[Debug]  ", "[Info]   ", "[Warning]", "[Error]  ", "[Fatal]  "
+  };
+
+  bool wrote = false;
+  while(true) {
+    Entry &e = m_entries[m_dequeue_pos & (QUEUE_SIZE - 1)];
+    if(e.seq.load(std::memory_order_acquire) != m_dequeue_pos + 1)
+      break;
+
+    m_stream << '(' << timestamp(e.time) << ") "
+      << LevelStr[e.level] << "\t"
+      << e.message << '\n';
+
+    e.message.clear();
+    e.seq.store(m_dequeue_pos + QUEUE_SIZE, std::memory_order_release);
+    m_dequeue_pos++;
+    wrote = true;
+  }
+
+  uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+  if(dropped != m_dropped_reported) {
+    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    m_stream << '(' << timestamp(now) << ") "
+      << LevelStr[Level::Warning] << "\t"
+      << "Logger dropped " << (dropped - m_dropped_reported)
+      << " lines because its queue was full" << '\n';
+    m_dropped_reported = dropped;
+    wrote = true;
+  }
+
+  return wrote;
+}
+
+const std::string &Logger::timestamp(time_t time) {
+  if(time != m_last_time || m_last_timestamp.empty()) {
+    tm local;
+    localtime_r(&time, &local);
+    std::ostringstream ss;
+    ss << &local;
+    m_last_timestamp = ss.str();
+    m_last_time = time;
+  }
+  return m_last_timestamp;
+}
+
+} // End namespace
+} // End namespace
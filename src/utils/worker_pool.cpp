@@ -0,0 +1,76 @@
+/*
+* Redox - A modern, asynchronous, and wicked fast C++11 client for Redis
+*
+*    https://github.com/hmartiro/redox
+*
+* Copyright 2015 - Hayk Martirosyan <hayk.mart at gmail dot com>
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include <algorithm>
+
+#include "utils/worker_pool.hpp"
+
+using namespace std;
+
+namespace redox {
+
+WorkerPool::WorkerPool(size_t num_threads) {
+
+  if (num_threads == 0)
+    num_threads = max(thread::hardware_concurrency(), 1u);
+
+  for (size_t i = 0; i < num_threads; i++)
+    threads_.emplace_back([this] { work(); });
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    lock_guard<mutex> lg(guard_);
+    stopping_ = true;
+  }
+  waiter_.notify_all();
+  for (thread &t : threads_)
+    t.join();
+}
+
+void WorkerPool::execute(function<void()> task) {
+  {
+    lock_guard<mutex> lg(guard_);
+    tasks_.push_back(std::move(task));
+  }
+  waiter_.notify_one();
+}
+
+function<void(function<void()>)> WorkerPool::executor() {
+  return [this](function<void()> task) { execute(std::move(task)); };
+}
+
+void WorkerPool::work() {
+
+  while (true) {
+    function<void()> task;
+    {
+      unique_lock<mutex> ul(guard_);
+      waiter_.wait(ul, [this] { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty())
+        return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+} // End namespace redox
@@ -19,6 +19,7 @@
 */
 
 #include <iostream>
+#include <future>
 
 #include <gtest/gtest.h>
 
@@ -29,6 +30,9 @@ namespace {
 using namespace std;
 using redox::Redox;
 using redox::Command;
+using redox::Stats;
+using redox::LatencyStats;
+using redox::CacheStats;
 
 // ------------------------------------------
 // The fixture for testing class Redox.
@@ -46,7 +50,7 @@ protected:
     rdx.connect("localhost", 6379);
 
     // Clear all keys used by the tests here
-    rdx.command({"DEL", "redox_test:a"});
+    rdx.command({"DEL", "redox_test:a", "redox_test:b", "redox_test:h", "redox_test:l"});
   }
 
   virtual ~RedoxTest() {}
@@ -174,6 +178,55 @@ TEST_F(RedoxTest, Incr) {
   wait_for_replies();
 }
 
+TEST_F(RedoxTest, CoalesceReads) {
+  connect();
+  rdx.coalesceReads(true);
+
+  // Issued from the event thread, the GETs are all sent before any reply
+  // can be handled, so all but the first one join it
+  int count = 100;
+  auto set_done = check<string>("OK");
+  rdx.command<string>({"SET", "redox_test:a", "apple"}, [&](Command<string> &c) {
+    for (int i = 0; i < count; i++)
+      rdx.command<string>(redox::borrow({"GET", "redox_test:a"}), check<string>("apple"));
+    set_done(c);
+  });
+
+  // Reads after a write never share a reply from before it
+  rdx.command<string>({"SET", "redox_test:a", "banana"}, check<string>("OK"));
+  rdx.command<string>({"GET", "redox_test:a"}, check<string>("banana"));
+  wait_for_replies();
+  EXPECT_GT(rdx.commandsCoalesced(), 0);
+  EXPECT_EQ(rdx.commandsCoalesced(), count - 1);
+}
+
+TEST_F(RedoxTest, CoalesceReadsBatch) {
+  connect();
+  rdx.coalesceReads(true);
+
+  // A one-command batch neither leads nor joins an identical GET
+  auto check_batch = [this](redox::Batch<string> &b) {
+    EXPECT_TRUE(b.ok());
+    EXPECT_EQ(b.statuses()[0], Command<string>::OK_REPLY);
+    EXPECT_EQ(b.replies()[0], "apple");
+    cmd_count--;
+    cmd_waiter.notify_all();
+  };
+  auto set_done = check<string>("OK");
+  rdx.command<string>({"SET", "redox_test:a", "apple"}, [&](Command<string> &c) {
+    cmd_count += 2;
+    rdx.batch<string>().add({"GET", "redox_test:a"}).run(check_batch);
+    rdx.command<string>({"GET", "redox_test:a"}, check<string>("apple"));
+    rdx.command<string>({"GET", "redox_test:a"}, check<string>("apple"));
+    rdx.batch<string>().add({"GET", "redox_test:a"}).run(check_batch);
+    set_done(c);
+  });
+  wait_for_replies();
+
+  // Only the second plain GET shares the reply of the first
+  EXPECT_EQ(rdx.commandsCoalesced(), 1);
+}
+
 TEST_F(RedoxTest, Delayed) {
   connect();
   rdx.commandDelayed<int>({"INCR", "redox_test:a"}, check(1), 0.1);
@@ -216,6 +269,85 @@ TEST_F(RedoxTest, GetSetSync) {
   rdx.disconnect();
 }
 
+TEST_F(RedoxTest, GetSetSyncBorrowed) {
+  connect();
+  string key = "redox_test:a";
+  string value("app\0le", 6);
+  print_and_check_sync<string>(rdx.commandSync<string>(redox::borrow({"SET", key, value})), "OK");
+  print_and_check_sync<string>(rdx.commandSync<string>(redox::borrow({"GET", key})), value);
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, TakeReplySync) {
+  connect();
+  print_and_check_sync<string>(rdx.commandSync<string>({"SET", "redox_test:a", "apple"}), "OK");
+
+  auto &c = rdx.commandSync<string>({"GET", "redox_test:a"});
+  ASSERT_TRUE(c.ok());
+  EXPECT_EQ(c.replyRef(), "apple");
+  EXPECT_EQ(c.takeReply(), "apple");
+  EXPECT_TRUE(c.replyRef().empty());
+  c.free();
+
+  auto &s = rdx.commandSync<redox::Slice>({"GET", "redox_test:a"});
+  ASSERT_TRUE(s.ok());
+  EXPECT_EQ(s.replyRef(), "apple");
+  EXPECT_EQ(s.reply().str(), "apple");
+  s.free();
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, ArrayViewSync) {
+  connect();
+  check_sync(rdx.commandSync<int>({"RPUSH", "redox_test:a", "apple", "banana", "cherry"}), 3);
+
+  auto &c = rdx.commandSync<redox::ArrayView>({"LRANGE", "redox_test:a", "0", "-1"});
+  ASSERT_TRUE(c.ok());
+  const redox::ArrayView &view = c.replyRef();
+  ASSERT_EQ(view.size(), 3u);
+  EXPECT_EQ(view[1], "banana");
+
+  vector<string> elements;
+  for (redox::Slice s : view)
+    elements.push_back(s.str());
+  EXPECT_EQ(elements, vector<string>({"apple", "banana", "cherry"}));
+  c.free();
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, ScanSync) {
+  connect();
+  auto &b = rdx.batch<int>();
+  for (int i = 0; i < 250; i++)
+    b.add({"SADD", "redox_test:a", to_string(i)});
+  ASSERT_TRUE(b.runSync());
+  b.free();
+
+  // Pulled from a stream that fetches at most two pages ahead
+  set<string> streamed;
+  redox::ScanStream stream(rdx, {"SSCAN", "redox_test:a", "0", "COUNT", "10"}, 2);
+  while (stream.next()) {
+    for (redox::Slice member : stream.page())
+      streamed.insert(member.str());
+  }
+  EXPECT_TRUE(stream.ok());
+  EXPECT_EQ(streamed.size(), 250u);
+
+  // Pushed to a callback on the event thread
+  set<string> pushed;
+  promise<int> done;
+  rdx.scan({"SSCAN", "redox_test:a", "0", "COUNT", "10"},
+           [&pushed](const redox::ArrayView &page) {
+             for (redox::Slice member : page)
+               pushed.insert(member.str());
+             return true;
+           },
+           [&done](int status) { done.set_value(status); });
+  EXPECT_EQ(done.get_future().get(), Command<redox::ArrayView>::OK_REPLY);
+  EXPECT_EQ(pushed, streamed);
+  rdx.disconnect();
+}
+
 TEST_F(RedoxTest, DeleteSync) {
   connect();
   print_and_check_sync<string>(rdx.commandSync<string>({"SET", "redox_test:a", "apple"}), "OK");
@@ -241,6 +373,818 @@ TEST_F(RedoxTest, GetSetSyncError) {
   rdx.disconnect();
 }
 
+TEST_F(RedoxTest, BatchSync) {
+  connect();
+  int count = 100;
+  auto &b = rdx.batch<int>();
+  for (int i = 0; i < count; i++) {
+    b.add({"INCR", "redox_test:a"});
+  }
+  EXPECT_EQ(b.size(), (size_t)count);
+  ASSERT_TRUE(b.runSync());
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(b.statuses()[i], Command<int>::OK_REPLY);
+    EXPECT_EQ(b.replies()[i], i + 1);
+  }
+  b.free();
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, BatchError) {
+  connect();
+  vector<string> replies(3);
+  auto &b = rdx.batch<string>();
+  b.add({"SET", "redox_test:a", "apple"}).add({"INCR", "redox_test:a"}).add({"GET", "redox_test:a"});
+  EXPECT_FALSE(b.into(replies.data()).runSync());
+  EXPECT_EQ(b.status(), Command<string>::ERROR_REPLY);
+  EXPECT_EQ(b.statuses()[0], Command<string>::OK_REPLY);
+  EXPECT_EQ(b.statuses()[1], Command<string>::ERROR_REPLY);
+  EXPECT_EQ(replies[2], "apple");
+  b.free();
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, BulkLoad) {
+  connect();
+  {
+    // Small chunks and a small limit, so the loader has to wait for replies
+    redox::BulkLoader loader(rdx, 4096, 16384);
+    int count = 10000;
+    for (int i = 0; i < count; i++)
+      loader.add({"RPUSH", "redox_test:a", to_string(i)});
+    EXPECT_TRUE(loader.finish());
+    EXPECT_EQ(loader.replies(), (uint64_t)count);
+    check_sync(rdx.commandSync<int>({"LLEN", "redox_test:a"}), count);
+
+    // Errors are counted, and the first one is kept
+    loader.add(vector<string>({"INCR", "redox_test:a"}));
+    loader.add({"RPUSH", "redox_test:a", "last"});
+    EXPECT_FALSE(loader.finish());
+    EXPECT_EQ(loader.errors(), 1u);
+    EXPECT_EQ(loader.lastError().compare(0, 9, "WRONGTYPE"), 0);
+    EXPECT_EQ(loader.replies(), (uint64_t)count + 2);
+  }
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, RunSync) {
+  connect();
+  check_sync(rdx.runSync<redox::cmd::Set>("redox_test:a", "apple"), string("OK"));
+  check_sync(rdx.runSync<redox::cmd::Get>("redox_test:a"), string("apple"));
+  check_sync(rdx.runSync<redox::cmd::HIncrBy>("redox_test:h", "f", 5), 5LL);
+  check_sync(rdx.runSync<redox::cmd::HIncrBy>("redox_test:h", "f", -7), -2LL);
+
+  // The replies to these come back in order, on the event thread
+  int count = 100;
+  for (int i = 0; i < count; i++)
+    rdx.run<redox::cmd::RPush>(print_and_check<long long int>(i + 1), "redox_test:l", i);
+  wait_for_replies();
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, CompressedValues) {
+  if (!redox::compression::available(redox::compression::LZ4)) {
+    EXPECT_THROW(rdx.compressValues(1024, redox::compression::LZ4), std::runtime_error);
+    return;
+  }
+  rdx.compressValues(1024, redox::compression::LZ4);
+  connect();
+
+  string value(100000, 'x');
+  EXPECT_TRUE(rdx.set("redox_test:a", value));
+  EXPECT_EQ(rdx.get("redox_test:a"), value);
+  check_sync(rdx.commandSync<int>({"HSET", "redox_test:h", "f", value}), 1);
+  check_sync(rdx.runSync<redox::cmd::HGet>("redox_test:h", "f"), value);
+
+  // The server only holds the compressed bytes, and small values as they are
+  auto &len = rdx.commandSync<int>({"STRLEN", "redox_test:a"});
+  ASSERT_TRUE(len.ok());
+  EXPECT_LT(len.reply(), 1000);
+  len.free();
+  EXPECT_TRUE(rdx.set("redox_test:b", "small"));
+  check_sync(rdx.commandSync<int>({"STRLEN", "redox_test:b"}), 5);
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, FutureSync) {
+  connect();
+  int count = 100;
+  vector<redox::CommandFuture<int>> futures;
+  for (int i = 0; i < count; i++) {
+    futures.push_back(rdx.commandAsync<int>({"INCR", "redox_test:a"}));
+  }
+  for (int i = 0; i < count; i++) {
+    Command<int> &c = futures[i].get();
+    ASSERT_TRUE(c.ok());
+    EXPECT_EQ(c.reply(), i + 1);
+    EXPECT_TRUE(futures[i].ready());
+  }
+
+  // A moved-from future has nothing to wait for
+  {
+    redox::CommandFuture<int> moved = std::move(futures[0]);
+    EXPECT_TRUE(moved.valid());
+    EXPECT_FALSE(futures[0].valid());
+    EXPECT_THROW(futures[0].get(), runtime_error);
+    EXPECT_THROW(redox::CommandFuture<int>().get(), runtime_error);
+  }
+
+  // Destroying the futures frees their commands
+  futures.clear();
+  rdx.disconnect();
+  EXPECT_EQ(rdx.commandsCreated(), rdx.commandsDeleted());
+}
+
+TEST_F(RedoxTest, CommandPoolSync) {
+  connect();
+  int count = 100;
+  for (int i = 0; i < count; i++) {
+    check_sync(rdx.commandSync<int>({"INCR", "redox_test:a"}), i + 1);
+  }
+  rdx.disconnect();
+
+  // Freed commands are recycled rather than allocated for every call
+  EXPECT_EQ(rdx.commandsCreated(), rdx.commandsDeleted());
+  EXPECT_LT(rdx.commandsAllocated(), 10);
+  EXPECT_EQ(rdx.commandsAllocated(), rdx.commandsPooled());
+  EXPECT_GE(rdx.commandsHighWater(), 1);
+}
+
+TEST_F(RedoxTest, TimeoutSync) {
+  connect();
+
+  // The server holds the reply for a second
+  auto &c = rdx.commandSync<redisReply *>({"BLPOP", "redox_test:empty", "1"}, 0.1);
+  EXPECT_EQ(c.status(), Command<redisReply *>::TIMEOUT);
+  c.free();
+
+  // Replies that come in late are dropped, and later commands still work
+  rdx.commandTimeout(5);
+  check_sync(rdx.commandSync<string>({"SET", "redox_test:a", "apple"}), string("OK"));
+  rdx.disconnect();
+}
+
+TEST_F(RedoxTest, CommandLimitsBlock) {
+  rdx.limitCommands(4, 8, Redox::BLOCK);
+  connect();
+
+  // This thread waits whenever 8 commands are queued, and none are lost
+  int count = 1000;
+  for (int i = 1; i <= count; i++)
+    rdx.command<int>({"INCR", "redox_test:a"}, check<int>(i));
+  wait_for_replies();
+
+  EXPECT_LE(rdx.commandsInFlightHighWater(), 4);
+  EXPECT_LE(rdx.commandsQueuedHighWater(), 8);
+  EXPECT_EQ(rdx.commandsInFlight(), 0);
+  EXPECT_EQ(rdx.commandsRejected(), 0);
+}
+
+TEST_F(RedoxTest, CommandLimitsBatch) {
+  rdx.limitCommands(4);
+  connect();
+
+  // Batches of three wait until all of them fit
+  auto count_batch = [this](redox::Batch<int> &b) {
+    EXPECT_TRUE(b.ok());
+    cmd_count--;
+    cmd_waiter.notify_all();
+  };
+  for (int i = 1; i <= 100; i++) {
+    rdx.command<int>({"INCR", "redox_test:a"}, check<int>(4 * i - 3));
+    cmd_count++;
+    rdx.batch<int>()
+        .add({"INCR", "redox_test:a"})
+        .add({"INCR", "redox_test:a"})
+        .add({"INCR", "redox_test:a"})
+        .run(count_batch);
+  }
+  EXPECT_LE(rdx.commandsInFlightHighWater(), 4);
+
+  // One larger than the limit goes out alone
+  cmd_count++;
+  auto &big = rdx.batch<int>();
+  for (int i = 0; i < 10; i++)
+    big.add({"INCR", "redox_test:a"});
+  big.run(count_batch);
+  rdx.command<int>({"INCR", "redox_test:a"}, check<int>(411));
+  wait_for_replies();
+
+  EXPECT_EQ(rdx.commandsInFlightHighWater(), 10);
+  EXPECT_EQ(rdx.commandsInFlight(), 0);
+}
+
+TEST_F(RedoxTest, CommandLimitsFail) {
+  rdx.limitCommands(1, 1, Redox::FAIL);
+  connect();
+
+  // Past the limits, commands fail right away instead of piling up
+  int count = 1000;
+  atomic_int ok = {0};
+  atomic_int overloaded = {0};
+  for (int i = 0; i < count; i++) {
+    rdx.command<int>({"INCR", "redox_test:a"}, [&](Command<int> &c) {
+      if (c.ok())
+        ok++;
+      else if (c.status() == Command<int>::OVERLOADED)
+        overloaded++;
+    });
+  }
+  while (ok + overloaded < count)
+    this_thread::sleep_for(chrono::milliseconds(1));
+  rdx.disconnect();
+
+  EXPECT_GT(ok.load(), 0);
+  EXPECT_EQ(rdx.commandsRejected(), overloaded.load());
+  EXPECT_LE(rdx.commandsInFlightHighWater(), 1);
+}
+
+TEST_F(RedoxTest, CommandLimitsDropOldest) {
+  rdx.limitCommands(0, 10, Redox::DROP_OLDEST);
+  connect();
+
+  // Hold up the event thread in a callback while the queue fills up
+  atomic_bool release = {false};
+  rdx.command<int>({"INCR", "redox_test:a"}, [&](Command<int> &c) {
+    while (!release)
+      this_thread::sleep_for(chrono::milliseconds(1));
+  });
+  this_thread::sleep_for(chrono::milliseconds(100));
+
+  // Once it catches up, all but the newest ten are dropped
+  int count = 100;
+  atomic_int ok = {0};
+  atomic_int overloaded = {0};
+  for (int i = 0; i < count; i++) {
+    rdx.command<int>({"INCR", "redox_test:a"}, [&](Command<int> &c) {
+      if (c.ok())
+        ok++;
+      else if (c.status() == Command<int>::OVERLOADED)
+        overloaded++;
+    });
+  }
+  release = true;
+  while (ok + overloaded < count)
+    this_thread::sleep_for(chrono::milliseconds(1));
+
+  auto &c = rdx.commandSync<string>({"GET", "redox_test:a"});
+  check_sync(c, string("11"));
+  rdx.disconnect();
+
+  EXPECT_EQ(ok.load(), 10);
+  EXPECT_EQ(overloaded.load(), count - 10);
+  EXPECT_EQ(rdx.commandsRejected(), count - 10);
+  EXPECT_EQ(rdx.commandsQueuedHighWater(), count);
+}
+
+TEST(RedoxReconnectTest, KilledConnection) {
+  Redox rdx;
+  rdx.autoReconnect(0.01, 0.1);
+  atomic_int reconnects = {0};
+  ASSERT_TRUE(rdx.connect("localhost", 6379, [&](int state) {
+    if (state == Redox::DISCONNECT_ERROR)
+      reconnects++;
+  }));
+
+  auto &id = rdx.commandSync<long long int>({"CLIENT", "ID"});
+  ASSERT_TRUE(id.ok());
+  string client_id = to_string(id.reply());
+  id.free();
+
+  Redox killer;
+  ASSERT_TRUE(killer.connect("localhost", 6379));
+  ASSERT_TRUE(killer.commandSync({"CLIENT", "KILL", "ID", client_id}));
+  killer.disconnect();
+
+  // Sent while reconnecting or after, on the same client
+  auto &c = rdx.commandSync<string>({"SET", "redox_test:a", "apple"}, 5);
+  EXPECT_TRUE(c.ok());
+  c.free();
+  rdx.disconnect();
+  EXPECT_EQ(reconnects, 1);
+}
+
+TEST(RedoxReconnectTest, CommandLimits) {
+  Redox rdx;
+  rdx.autoReconnect(0.2, 0.5);
+  rdx.limitCommands(2);
+  atomic_int reconnects = {0};
+  ASSERT_TRUE(rdx.connect("localhost", 6379, [&](int state) {
+    if (state == Redox::DISCONNECT_ERROR)
+      reconnects++;
+  }));
+  ASSERT_TRUE(rdx.commandSync({"DEL", "redox_test:a"}));
+
+  auto &id = rdx.commandSync<long long int>({"CLIENT", "ID"});
+  ASSERT_TRUE(id.ok());
+  string client_id = to_string(id.reply());
+  id.free();
+
+  Redox killer;
+  ASSERT_TRUE(killer.connect("localhost", 6379));
+  ASSERT_TRUE(killer.commandSync({"CLIENT", "KILL", "ID", client_id}));
+  killer.disconnect();
+  while (reconnects == 0)
+    this_thread::sleep_for(chrono::milliseconds(1));
+
+  // Issued while reconnecting, they wait in line instead of all going
+  // out at once when the connection is back
+  int count = 100;
+  atomic_int ok = {0};
+  for (int i = 0; i < count; i++) {
+    rdx.command<int>({"INCR", "redox_test:a"}, [&](Command<int> &c) {
+      if (c.ok())
+        ok++;
+    });
+  }
+  while (ok < count)
+    this_thread::sleep_for(chrono::milliseconds(1));
+  rdx.disconnect();
+
+  EXPECT_LE(rdx.commandsInFlightHighWater(), 2);
+}
+
+TEST_F(RedoxTest, StatsSync) {
+  connect();
+  int count = 100;
+  for (int i = 0; i < count; i++) {
+    check_sync(rdx.commandSync<int>({"incr", "redox_test:a"}), i + 1);
+  }
+  Stats stats = rdx.stats();
+  rdx.disconnect();
+
+  EXPECT_GE(stats.commands_created, count);
+  if (!stats.enabled)
+    return;
+
+  // The fixture also sent a DEL on connect
+  EXPECT_EQ(stats.commands_sent, (uint64_t)count + 1);
+  EXPECT_EQ(stats.replies_received, stats.commands_sent);
+  EXPECT_EQ(stats.in_flight(), (uint64_t)0);
+  EXPECT_GT(stats.bytes_out, stats.bytes_in);
+
+  // Names are grouped in upper case
+  ASSERT_EQ(stats.commands.count("INCR"), (size_t)1);
+  const LatencyStats &incr = stats.commands["INCR"];
+  EXPECT_EQ(incr.round_trip.count, (uint64_t)count);
+  EXPECT_EQ(incr.queue_wait.count, (uint64_t)count);
+  EXPECT_GT(incr.round_trip.percentile(0.5), (uint64_t)0);
+  EXPECT_LE(incr.round_trip.percentile(0.5), incr.round_trip.percentile(0.99));
+  EXPECT_LE(incr.round_trip.percentile(0.99), incr.round_trip.max);
+}
+
+TEST(HistogramTest, Percentiles) {
+  redox::Histogram h;
+  for (uint64_t v = 1; v <= 1000; v++)
+    h.record(v);
+
+  redox::HistogramSnapshot snap = h.snapshot();
+  EXPECT_EQ(snap.count, (uint64_t)1000);
+  EXPECT_EQ(snap.max, (uint64_t)1000);
+  EXPECT_DOUBLE_EQ(snap.mean(), 500.5);
+
+  // Buckets are accurate to 1/8 of the value
+  EXPECT_NEAR((double)snap.percentile(0.5), 500, 500 / 8.0);
+  EXPECT_NEAR((double)snap.percentile(0.99), 990, 990 / 8.0);
+  EXPECT_EQ(snap.percentile(1.0), (uint64_t)1000);
+
+  for (uint64_t v : {0ull, 7ull, 8ull, 1000ull, 1ull << 40, ~0ull}) {
+    int i = redox::Histogram::bucketIndex(v);
+    EXPECT_LE(redox::Histogram::bucketLow(i), v);
+    EXPECT_GE(redox::Histogram::bucketHigh(i), v);
+  }
+}
+
+template <class Spec> void check_spec(const vector<string> &cmd) {
+  string generic, spec;
+  redox::resp::appendCommand(generic, cmd.data(), cmd.size());
+  spec.assign(Spec::header().data(), Spec::header().size());
+  for (size_t i = 0; i < Spec::ARGS; i++)
+    redox::resp::appendArg(spec, cmd[i + 1]);
+  EXPECT_EQ(spec, generic) << cmd[0];
+  EXPECT_EQ(Spec::ARGS + 1, cmd.size()) << cmd[0];
+}
+
+TEST(RespTest, CommandSpecs) {
+  check_spec<redox::cmd::Get>({"GET", "k"});
+  check_spec<redox::cmd::Set>({"SET", "k", "v"});
+  check_spec<redox::cmd::SetEx>({"SETEX", "k", "10", "v"});
+  check_spec<redox::cmd::Del>({"DEL", "k"});
+  check_spec<redox::cmd::Exists>({"EXISTS", "k"});
+  check_spec<redox::cmd::Expire>({"EXPIRE", "k", "10"});
+  check_spec<redox::cmd::PExpire>({"PEXPIRE", "k", "10"});
+  check_spec<redox::cmd::Incr>({"INCR", "k"});
+  check_spec<redox::cmd::IncrBy>({"INCRBY", "k", "2"});
+  check_spec<redox::cmd::Decr>({"DECR", "k"});
+  check_spec<redox::cmd::HGet>({"HGET", "h", "f"});
+  check_spec<redox::cmd::HSet>({"HSET", "h", "f", "v"});
+  check_spec<redox::cmd::HIncrBy>({"HINCRBY", "h", "f", "2"});
+  check_spec<redox::cmd::LPush>({"LPUSH", "l", "v"});
+  check_spec<redox::cmd::RPush>({"RPUSH", "l", "v"});
+  check_spec<redox::cmd::SAdd>({"SADD", "s", "v"});
+  check_spec<redox::cmd::Publish>({"PUBLISH", "c", "m"});
+
+  // Integers are written in decimal, negative ones too
+  string a, b;
+  redox::resp::appendCommand<redox::cmd::IncrBy>(a, "k", -1234567890123LL);
+  redox::resp::appendCommand<redox::cmd::IncrBy>(b, "k", "-1234567890123");
+  EXPECT_EQ(a, b);
+}
+
+TEST(CompressionTest, RoundTrip) {
+  namespace compression = redox::compression;
+  string value;
+  for (int i = 0; i < 1000; i++)
+    value += "redox " + to_string(i % 10) + " ";
+
+  string out;
+  EXPECT_FALSE(compression::compress(compression::NONE, value, out));
+  EXPECT_TRUE(out.empty());
+
+  for (int codec : {compression::LZ4, compression::ZSTD}) {
+    if (!compression::available(codec))
+      continue;
+
+    string compressed = "prefix";
+    ASSERT_TRUE(compression::compress(codec, value, compressed));
+    redox::Slice encoded(compressed.data() + 6, compressed.size() - 6);
+    EXPECT_LT(encoded.size(), value.size());
+    EXPECT_TRUE(compression::isCompressed(encoded));
+    ASSERT_TRUE(compression::decompress(encoded, out));
+    EXPECT_EQ(out, value);
+
+    // Values that would not shrink are left alone
+    string small;
+    EXPECT_FALSE(compression::compress(codec, "abc", small));
+    EXPECT_TRUE(small.empty());
+
+    // Corrupt data does not decode
+    string corrupt(encoded.data(), encoded.size() / 2);
+    EXPECT_FALSE(compression::decompress(corrupt, out));
+
+    // A forged header claiming 4 GB is not allocated for
+    string forged = string("\xffRZ", 3) + (char)codec + string(4, '\xff') + "abc";
+    string forged_out;
+    EXPECT_TRUE(compression::isCompressed(forged));
+    EXPECT_FALSE(compression::decompress(forged, forged_out));
+    EXPECT_LT(forged_out.capacity(), 1024u);
+  }
+  EXPECT_FALSE(compression::isCompressed(value));
+  EXPECT_FALSE(compression::decompress(value, out));
+}
+
+TEST(ClientCacheTest, EvictionAndInvalidation) {
+
+  // One shard with room for two entries of this size
+  size_t entry = 2 + 5 + redox::ClientCache::ENTRY_OVERHEAD;
+  redox::ClientCache cache(2 * entry, 1);
+  std::string value;
+
+  for (std::string key : {"k1", "k2", "k3"})
+    cache.fill(key, cache.reserve(key), "value");
+
+  // The least recently used entry made room
+  EXPECT_FALSE(cache.lookup("k1", value));
+  EXPECT_TRUE(cache.lookup("k2", value));
+  EXPECT_EQ(value, "value");
+
+  // A read that raced an invalidation is not stored
+  uint64_t token = cache.reserve("k4");
+  cache.invalidate("k4");
+  cache.fill("k4", token, "stale");
+  EXPECT_FALSE(cache.lookup("k4", value));
+
+  cache.invalidate("k2");
+  redox::CacheStats stats = cache.stats();
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.misses, 2u);
+  EXPECT_EQ(stats.evictions, 1u);
+  EXPECT_EQ(stats.invalidations, 1u);
+  EXPECT_EQ(stats.entries, 1u);
+  EXPECT_EQ(stats.bytes, entry);
+
+  cache.disable();
+  EXPECT_EQ(cache.reserve("k5"), 0u);
+  EXPECT_FALSE(cache.lookup("k3", value));
+}
+
+TEST_F(RedoxTest, CacheSync) {
+  connect();
+  ASSERT_TRUE(rdx.enableCache());
+  ASSERT_TRUE(rdx.set("redox_test:a", "apple"));
+
+  EXPECT_EQ(rdx.get("redox_test:a"), "apple");
+  EXPECT_EQ(rdx.get("redox_test:a"), "apple");
+  check_sync(rdx.commandSync<string>({"GET", "redox_test:a"}), string("apple"));
+
+  // A write from another connection evicts the key once the invalidation
+  // comes in
+  Redox other;
+  ASSERT_TRUE(other.connect("localhost", 6379));
+  ASSERT_TRUE(other.set("redox_test:a", "banana"));
+  other.disconnect();
+
+  for (int i = 0; (i < 100) && (rdx.cacheStats().invalidations == 0); i++)
+    this_thread::sleep_for(chrono::milliseconds(10));
+  EXPECT_EQ(rdx.get("redox_test:a"), "banana");
+
+  CacheStats stats = rdx.cacheStats();
+
+  // A local write is seen by the next read, without waiting for the server
+  ASSERT_TRUE(rdx.set("redox_test:a", "cherry"));
+  EXPECT_EQ(rdx.get("redox_test:a"), "cherry");
+  ASSERT_TRUE(rdx.del("redox_test:a"));
+  EXPECT_THROW(rdx.get("redox_test:a"), runtime_error);
+  rdx.disconnect();
+
+  EXPECT_EQ(stats.hits, 2u);
+  EXPECT_EQ(stats.misses, 2u);
+  EXPECT_EQ(stats.invalidations, 1u);
+  EXPECT_EQ(stats.entries, 1u);
+}
+
+TEST(RedoxExternalLoopTest, Incr) {
+  struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+  Redox rdx;
+  rdx.attachEventLoop(loop);
+  ASSERT_TRUE(rdx.connect("localhost", 6379));
+  rdx.command({"DEL", "redox_test:a"});
+
+  // Blocking on the loop thread would deadlock
+  EXPECT_THROW(rdx.commandSync<int>({"GET", "redox_test:a"}), runtime_error);
+
+  int count = 0;
+  int target = 101;
+  auto callback = [&](Command<int> &c) {
+    EXPECT_TRUE(c.ok());
+    EXPECT_EQ(c.reply(), ++count);
+    if (count == target)
+      rdx.disconnect();
+  };
+
+  // Commands from the loop thread go out directly, others are queued
+  for (int i = 0; i < target - 1; i++)
+    rdx.command<int>({"INCR", "redox_test:a"}, callback);
+  thread other([&] { rdx.command<int>({"INCR", "redox_test:a"}, callback); });
+  other.join();
+
+  ev_run(loop, 0);
+  EXPECT_EQ(count, target);
+  EXPECT_EQ(rdx.commandsCreated(), rdx.commandsDeleted());
+  ev_loop_destroy(loop);
+}
+
+TEST(RedoxExecutorTest, Ordered) {
+  redox::WorkerPool pool(4);
+  Redox rdx;
+  rdx.replyExecutor(pool.executor());
+  ASSERT_TRUE(rdx.connect("localhost", 6379));
+  rdx.command({"DEL", "redox_test:a"});
+
+  // Callbacks run on the pool, but one at a time and in order
+  int count = 0;
+  int target = 1000;
+  atomic_int on_pool = {0};
+  thread::id caller = this_thread::get_id();
+  for (int i = 0; i < target; i++) {
+    rdx.command<int>({"INCR", "redox_test:a"}, [&](Command<int> &c) {
+      EXPECT_TRUE(c.ok());
+      EXPECT_EQ(c.reply(), ++count);
+      if (this_thread::get_id() != caller)
+        on_pool++;
+    });
+  }
+
+  auto &c = rdx.commandSync<int>({"INCR", "redox_test:a"});
+  EXPECT_EQ(c.reply(), target + 1);
+  c.free();
+  rdx.disconnect();
+
+  EXPECT_EQ(count, target);
+  EXPECT_EQ(on_pool, target);
+  EXPECT_EQ(rdx.commandsCreated(), rdx.commandsDeleted());
+}
+
+TEST(SubscriberTest, Dispatch) {
+  redox::Subscriber sub;
+  Redox rdx;
+  ASSERT_TRUE(sub.connect("localhost", 6379));
+  ASSERT_TRUE(rdx.connect("localhost", 6379));
+
+  mutex lock;
+  condition_variable cv;
+  int subscribed = 0;
+  vector<string> received;
+
+  // All topics share one command, each message goes to its own handler
+  auto on_sub = [&](const string &) {
+    lock_guard<mutex> lg(lock);
+    subscribed++;
+    cv.notify_all();
+  };
+  auto on_msg = [&](const string &topic, const string &msg) {
+    lock_guard<mutex> lg(lock);
+    received.push_back(topic + "=" + msg);
+    cv.notify_all();
+  };
+  sub.subscribe("redox_test:a", on_msg, on_sub);
+  sub.subscribe("redox_test:b", [&](const redox::Slice &topic, const redox::Slice &msg) {
+    lock_guard<mutex> lg(lock);
+    received.push_back("slice:" + topic.str() + "=" + msg.str());
+    cv.notify_all();
+  }, on_sub);
+  sub.psubscribe("redox_test:p*", on_msg, on_sub);
+
+  {
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [&] { return subscribed == 3; });
+  }
+  EXPECT_EQ(sub.subscribedTopics().size(), 2u);
+  EXPECT_EQ(sub.psubscribedTopics().size(), 1u);
+
+  rdx.publish("redox_test:a", "1");
+  rdx.publish("redox_test:b", "2");
+  rdx.publish("redox_test:pq", "3");
+
+  {
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [&] { return received.size() == 3; });
+  }
+  EXPECT_EQ(received[0], "redox_test:a=1");
+  EXPECT_EQ(received[1], "slice:redox_test:b=2");
+  EXPECT_EQ(received[2], "redox_test:pq=3");
+
+  sub.disconnect();
+  rdx.disconnect();
+  EXPECT_TRUE(sub.subscribedTopics().empty());
+}
+
+TEST(SubscriberTest, Bulk) {
+  redox::Subscriber sub;
+  ASSERT_TRUE(sub.connect("localhost", 6379));
+
+  vector<string> topics;
+  for (int i = 0; i < 100; i++)
+    topics.push_back("redox_test:bulk:" + to_string(i));
+
+  mutex lock;
+  condition_variable cv;
+  int subscribed = 0;
+  int unsubscribed = 0;
+  auto on_sub = [&](const string &) {
+    lock_guard<mutex> lg(lock);
+    subscribed++;
+    cv.notify_all();
+  };
+  auto on_unsub = [&](const string &) {
+    lock_guard<mutex> lg(lock);
+    unsubscribed++;
+    cv.notify_all();
+  };
+
+  sub.subscribe(topics, [](const string &, const string &) {}, on_sub, on_unsub);
+  {
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [&] { return subscribed == 100; });
+  }
+  EXPECT_EQ(sub.subscribedTopics().size(), 100u);
+
+  // Everything at once
+  sub.unsubscribe();
+  {
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [&] { return unsubscribed == 100; });
+  }
+  EXPECT_TRUE(sub.subscribedTopics().empty());
+
+  // Stopping does not wait for anything
+  sub.subscribe(topics, [](const string &, const string &) {}, on_sub);
+  auto t0 = chrono::steady_clock::now();
+  sub.disconnect();
+  EXPECT_LT(chrono::steady_clock::now() - t0, chrono::milliseconds(500));
+}
+
+TEST(ShardedSubscriberTest, OrderPerChannel) {
+  redox::ShardedSubscriber sub(3, 2);
+  Redox rdx;
+  ASSERT_TRUE(sub.connect("localhost", 6379));
+  ASSERT_TRUE(rdx.connect("localhost", 6379));
+
+  vector<string> topics;
+  for (int i = 0; i < 8; i++)
+    topics.push_back("redox_test:shard:" + to_string(i));
+
+  mutex lock;
+  condition_variable cv;
+  int subscribed = 0;
+  int received = 0;
+  map<string, vector<int>> messages;
+
+  sub.subscribe(topics, [&](const string &topic, const string &msg) {
+    lock_guard<mutex> lg(lock);
+    messages[topic].push_back(stoi(msg));
+    received++;
+    cv.notify_all();
+  }, [&](const string &) {
+    lock_guard<mutex> lg(lock);
+    subscribed++;
+    cv.notify_all();
+  });
+  {
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [&] { return subscribed == 8; });
+  }
+  EXPECT_EQ(sub.subscribedTopics().size(), 8u);
+
+  int count = 100;
+  for (int i = 0; i < count; i++)
+    for (const string &topic : topics)
+      rdx.publish(topic, to_string(i));
+  {
+    unique_lock<mutex> ul(lock);
+    cv.wait(ul, [&] { return received == count * 8; });
+  }
+
+  // Each channel sees its messages in the order they were published
+  for (const string &topic : topics) {
+    ASSERT_EQ(messages[topic].size(), (size_t)count);
+    for (int i = 0; i < count; i++)
+      EXPECT_EQ(messages[topic][i], i);
+  }
+
+  sub.disconnect();
+  rdx.disconnect();
+}
+
+TEST(RedoxClusterTest, KeySlot) {
+  using redox::RedoxCluster;
+  EXPECT_EQ(RedoxCluster::keySlot("123456789"), 0x31C3);
+  EXPECT_EQ(RedoxCluster::keySlot("foo"), 12182);
+  EXPECT_EQ(RedoxCluster::keySlot("{user1000}.following"),
+            RedoxCluster::keySlot("{user1000}.followers"));
+  // An empty hash tag means the whole key is hashed
+  EXPECT_NE(RedoxCluster::keySlot("foo{}{bar}"), RedoxCluster::keySlot("bar"));
+}
+
+TEST(RedoxReplicaSetTest, Routing) {
+  using redox::RedoxReplicaSet;
+  EXPECT_TRUE(RedoxReplicaSet::isReadCommand("hgetall"));
+  EXPECT_TRUE(RedoxReplicaSet::isReadCommand("ZREVRANGEBYSCORE"));
+  EXPECT_FALSE(RedoxReplicaSet::isReadCommand("SET"));
+  EXPECT_FALSE(RedoxReplicaSet::isReadCommand("UNKNOWN"));
+
+  // The local server stands in for the replicas as well
+  RedoxReplicaSet replicas(RedoxReplicaSet::ROUND_ROBIN);
+  replicas.addReplica("localhost", 6379);
+  replicas.addReplica("localhost", 6379);
+  ASSERT_TRUE(replicas.connect("localhost", 6379));
+  EXPECT_TRUE(replicas.replicaHealthy(0));
+  EXPECT_TRUE(replicas.replicaHealthy(1));
+
+  Redox &primary = replicas.primary();
+  EXPECT_EQ(&replicas.select({"INCR", "redox_test:a"}), &primary);
+  Redox &first = replicas.select({"GET", "redox_test:a"});
+  Redox &second = replicas.select({"GET", "redox_test:a"});
+  EXPECT_NE(&first, &primary);
+  EXPECT_NE(&second, &primary);
+  EXPECT_NE(&first, &second);
+
+  // Reads follow a write of the same thread to the primary
+  replicas.readYourWrites(60);
+  EXPECT_TRUE(replicas.set("redox_test:a", "apple"));
+  EXPECT_EQ(&replicas.select({"GET", "redox_test:a"}), &primary);
+  EXPECT_EQ(replicas.get("redox_test:a"), "apple");
+
+  // Once a replica is gone, reads skip it
+  replicas.replica(0).disconnect();
+  EXPECT_FALSE(replicas.replicaHealthy(0));
+  replicas.readYourWrites(0);
+  for (int i = 0; i < 10; i++)
+    EXPECT_EQ(&replicas.select({"GET", "redox_test:a"}), &replicas.replica(1));
+
+  EXPECT_TRUE(replicas.del("redox_test:a"));
+  replicas.disconnect();
+}
+
+TEST(RedoxPoolTest, KeyAffinity) {
+  redox::RedoxPool pool(4, redox::RedoxPool::KEY_AFFINITY);
+  ASSERT_TRUE(pool.connect("localhost", 6379));
+  pool.del("redox_test:a");
+
+  // Commands on the same key always go through the same connection
+  Redox &rdx = pool.select({"INCR", "redox_test:a"});
+  for (int i = 0; i < 100; i++)
+    EXPECT_EQ(&pool.select({"GET", "redox_test:a"}), &rdx);
+
+  for (int i = 0; i < 100; i++) {
+    auto &c = pool.commandSync<int>({"INCR", "redox_test:a"});
+    ASSERT_TRUE(c.ok());
+    EXPECT_EQ(c.reply(), i + 1);
+    c.free();
+  }
+  pool.disconnect();
+}
+
 TEST_F(RedoxTest, MultithreadedCRUD) {
   connect();
   int create_count(0);